@@ -0,0 +1,53 @@
+#! /usr/bin/env ruby
+# coding: utf-8
+
+#
+# Exif orientation decode benchmark
+#
+#   usage: ruby -Ilib bench/orientation.rb [WIDTH HEIGHT [COUNT [ORIENTATION]]]
+#
+# Decodes a WIDTHxHEIGHT image (default 4000x3000, 12MP) tagged with
+# ORIENTATION (default 6, portrait photo) with and without applying the
+# orientation, and reports the time spent on the rotation.
+#
+
+require 'jpeg'
+
+wd    = (ARGV[0] || 4000).to_i
+ht    = (ARGV[1] || 3000).to_i
+count = (ARGV[2] || 5).to_i
+o9n   = (ARGV[3] || 6).to_i
+
+def measure(count)
+  best = Float::INFINITY
+
+  count.times {
+    t0   = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    yield
+    best = [best, Process.clock_gettime(Process::CLOCK_MONOTONIC) - t0].min
+  }
+
+  return best * 1000.0
+end
+
+# なだらかな画像の方が実際の写真に近い復号時間になる
+raw = (0...ht).map { |y|
+  ([(y * 255) / ht, 128, 64] * wd).pack("C*")
+}.join
+
+jpg = JPEG::Encoder.new(wd, ht, :pixel_format => :RGB,
+                        :orientation => o9n, :quality => 90) << raw
+
+printf("%dx%d (%.1fMP), orientation: %d, simd: %s, best of %d\n",
+       wd, ht, wd * ht / 1e6, o9n, JPEG.simd, count)
+
+[:GRAYSCALE, :RGB, :RGBX].each { |fmt|
+  plain = JPEG::Decoder.new(:pixel_format => fmt)
+  o9n   = JPEG::Decoder.new(:pixel_format => fmt, :orientation => true)
+
+  t1 = measure(count) { plain << jpg }
+  t2 = measure(count) { o9n << jpg }
+
+  printf("  %-9s  decode %8.2f ms  with orientation %8.2f ms" \
+         "  (rotation %7.2f ms)\n", fmt, t1, t2, t2 - t1)
+}
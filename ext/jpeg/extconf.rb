@@ -16,6 +16,10 @@ OptionParser.new { |opt|
 
 have_library( "jpeg")
 have_header( "jpeglib.h")
+have_header( "pthread.h")
+
+have_func( "jpeg_skip_scanlines", "jpeglib.h")
+have_func( "jpeg_crop_scanline", "jpeglib.h")
 
 RbConfig::CONFIG.instance_eval {
   flag = false
@@ -7,15 +7,39 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <strings.h>
+#include <math.h>
 #include <setjmp.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL           /* selected at runtime by cpuid */
+#endif /* defined(__x86_64__) && defined(__GNUC__) */
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif /* defined(HAVE_PTHREAD_H) */
 
 #include <jpeglib.h>
+#include <jerror.h>
 
 #include "ruby.h"
 #include "ruby/version.h"
 #include "ruby/encoding.h"
+#include "ruby/thread.h"
 
 #define UNIT_LINES                 10
+#define STRIPE_ROWS                8      /* MCU rows per encoder stripe */
+#define DEFAULT_BAND_ROWS          16     /* rows per band of each_band */
+#define DEFAULT_THUMBNAIL_SIZE     256
+#define TRANSPOSE_TILE             64     /* pixels, multiple of 8 */
+#define ORIENT_BAND_ROWS           16     /* rows transposed at once */
 
 #ifdef DEFAULT_QUALITY
 #undef DEFAULT_QUALITY
@@ -33,6 +57,9 @@
 #define F_APPLY_ORIENTATION        0x00000008
 #define F_DITHER                   0x00000010
 #define F_CREAT                    0x00010000
+#define F_BANDED                   0x00020000
+#define F_SESSION                  0x00040000
+#define F_THUMBNAIL                0x00080000
 
 #define SET_FLAG(ptr, msk)         ((ptr)->flags |= (msk))
 #define CLR_FLAG(ptr, msk)         ((ptr)->flags &= ~(msk))
@@ -52,9 +79,26 @@
 #define FMT_BGR32                  8
 
 #define FMT_YVU                    20     /* original extend */
+#define FMT_I420                   21     /* planar formats */
+#define FMT_NV12                   22
+#define FMT_YUV422P                23
 
 #define JPEG_APP1                  0xe1   /* Exif marker */
 
+#define FIT_CONTAIN                0
+#define FIT_COVER                  1
+#define FIT_FILL                   2
+
+#define FILTER_BILINEAR            0
+#define FILTER_LANCZOS             1
+
+#define COEF_BITS                  14     /* fixed point of resample weight */
+
+#define ITEM_PENDING               0
+#define ITEM_DONE                  1
+#define ITEM_ERROR                 2
+#define ITEM_INVALID               3
+
 #define N(x)                       (sizeof(x)/sizeof(*x))
 #define SWAP(a,b,t) \
         do {t c; c = (a); (a) = (b); (b) = c;} while (0)
@@ -65,11 +109,20 @@
 #define RANGE_ERROR(msg)           rb_raise(rb_eRangeError, (msg))
 #define NOT_IMPLEMENTED_ERROR(msg) rb_raise(rb_eNotImpError, (msg))
 
-#define IS_COLORMAPPED(ci)         (((ci)->actual_number_of_colors > 0) &&\
-                                    ((ci)->colormap != NULL) && \
-                                    ((ci)->output_components == 1) && \
-                                    (((ci)->out_color_components == 1) || \
-                                     ((ci)->out_color_components == 3)))
+#define IS_CROPPED(ptr)            ((ptr)->crop.width > 0)
+#define IS_RESIZED(ptr)            ((ptr)->resize.width > 0)
+#define IS_PLANAR(ptr)             ((ptr)->format >= FMT_I420)
+#define NUM_PLANES(fmt)            (((fmt) == FMT_NV12)? 2: 3)
+#define IS_PACKED(ptr)             (((ptr)->format == FMT_YUV422) || \
+                                    ((ptr)->format == FMT_RGB565))
+#define PACK_ON_OUTPUT(ptr, o)     (IS_PACKED(ptr) && !((o) & 4))
+#define IS_COLORMAPPED(info)       (((info)->colormap.n > 0) && \
+                                    ((info)->components == 1) && \
+                                    (((info)->out_color_components == 1) || \
+                                     ((info)->out_color_components == 3)))
+
+#define NEED_CONVERSION(ptr)       (((ptr)->format == FMT_YUV422) || \
+                                    ((ptr)->format == FMT_RGB565))
 
 #define ALLOC_ARRAY() \
         ((JSAMPARRAY)malloc(sizeof(JSAMPROW) * UNIT_LINES))
@@ -85,6 +138,7 @@ static VALUE encerr_klass;
 
 static VALUE decoder_klass;
 static VALUE meta_klass;
+static VALUE probe_klass;
 static VALUE decerr_klass;
 
 static ID id_meta;
@@ -96,6 +150,36 @@ static ID id_out_cs;
 static ID id_ncompo;
 static ID id_exif_tags;
 static ID id_colormap;
+static ID id_planes;
+static ID id_threads;
+static ID id_samp;
+static ID id_prog;
+static ID id_o9n;
+
+static VALUE samp_pairs;    // [h, v]の組(h, vは1～4)を共有するための表
+
+static int default_workers;
+
+/*
+ * 画素形式の変換と転置・左右反転、リサンプラの垂直パスのカーネル
+ * （Init_jpeg()でCPUの機能を見て一度だけ選択する）
+ */
+typedef void (*row_conv_t)(uint8_t* dst, uint8_t* src, int wd);
+typedef void (*block_conv_t)(uint8_t* sp, ptrdiff_t ss,
+                             uint8_t* dp, ptrdiff_t ds);
+typedef void (*column_conv_t)(uint8_t* dst, uint8_t** rows, int32_t* w,
+                              int nrow, int32_t* acc, size_t len);
+
+static struct {
+  const char* name;
+  row_conv_t expand_yuv422;       /* YUYV -> YCbCr (encoder) */
+  row_conv_t expand_rgb565;       /* RGB565 -> RGB (encoder) */
+  row_conv_t pack_yuv422;         /* YCbCr -> YUYV (decoder) */
+  row_conv_t pack_rgb565;         /* RGBX -> RGB565 (decoder) */
+  block_conv_t transpose[4];      /* 8x8 block, indexed by bytes/pixel - 1 */
+  row_conv_t mirror[4];           /* reversed row copy, same index */
+  column_conv_t resample_col;     /* vertical pass of the resampler */
+} kernels;
 
 typedef struct {
   int tag;
@@ -264,6 +348,7 @@ static const char* encoder_opts_keys[] = {
   "dct_method",               // {str}
   "orientation",              // {integer}
   "stride",                   // {integer}
+  "threads",                  // {integer} or {bool}
 };
 
 static ID encoder_opts_ids[N(encoder_opts_keys)];
@@ -275,6 +360,21 @@ typedef struct {
   jmp_buf jmpbuf;
 } ext_error_t;
 
+typedef struct {
+  struct jpeg_destination_mgr pub;
+
+  VALUE str;
+  size_t capa;
+  size_t size;
+} str_dest_t;
+
+typedef struct {
+  size_t offset;
+  int stride;
+  int width;
+  int height;
+} plane_t;
+
 typedef struct {
   int flags;
   int width;
@@ -287,6 +387,7 @@ typedef struct {
   int components;
   int quality;
   J_DCT_METHOD dct_method;
+  int threads;
 
   struct jpeg_compress_struct cinfo;
   ext_error_t err_mgr;
@@ -295,13 +396,18 @@ typedef struct {
   JSAMPROW rows;
 
   VALUE data;
+  uint8_t* src;
 
   struct {
     unsigned char* mem;
     unsigned long size;
   } buf;
 
+  str_dest_t dest;
+
   int orientation;
+
+  plane_t planes[3];
 } jpeg_encode_t;
 
 static const char* decoder_opts_keys[] = {
@@ -320,11 +426,23 @@ static const char* decoder_opts_keys[] = {
   "scale",                    // {rational} or {float}
   "dct_method",               // {str}
   "with_exif_tags",           // {bool}
-  "orientation"               // {bool}
+  "orientation",              // {bool}
+  "threads"                   // {int} or {bool}
 };
 
 static ID decoder_opts_ids[N(decoder_opts_keys)];
 
+static const char* decode_args_keys[] = {
+  "into",                     // {str}
+  "crop",                     // [{int}X, {int}Y, {int}WIDTH, {int}HEIGHT]
+  "size",                     // [{int}WIDTH, {int}HEIGHT]
+  "fit",                      // {str}
+  "filter",                   // {str}
+  "max_scans",                // {int}
+};
+
+static ID decode_args_ids[N(decode_args_keys)];
+
 typedef struct {
   int flags;
   int format;
@@ -345,6 +463,7 @@ typedef struct {
   boolean enable_1pass_quant;
   boolean enable_external_quant;
   boolean enable_2pass_quant;
+  int threads;
 
   struct jpeg_decompress_struct cinfo;
   ext_error_t err_mgr;
@@ -352,13 +471,84 @@ typedef struct {
   JSAMPARRAY array;
 
   VALUE data;
+  VALUE into;
+
+  struct {
+    uint8_t* ptr;
+    size_t size;
+  } src;
+
+  /*
+   * 出力先。向きを適用する場合、復号した行は出力時に最終的な位置へ
+   * 書き込む(転置や左右反転を伴う場合はband行単位でまとめて処理する)。
+   */
+  struct {
+    uint8_t* ptr;
+    size_t stride;  // 向きを適用する前の1行のバイト数
+    int rows;       // each_band時に1回で読み込む行数
+    int width;      // 向きを適用する前の幅と高さ
+    int height;
+    int nc;
+    int orientation;
+    int pack;       // 書き出す際に詰めるパック形式(0の場合は詰めない)
+    size_t pstride; // パック形式に詰めた後の1行のバイト数
+    uint8_t* band;  // 帯バッファ(libjpegのイメージプールから確保)
+    int top;        // 帯バッファ先頭の行(書き出し済みの行数)
+    int fill;       // 帯バッファに溜まっている行数
+  } dst;
 
   struct {
-    int value;
-    VALUE buf;
-  } orientation;
+    int x;
+    int y;
+    int width;      // 0の場合は切り出しを行わない
+    int height;
+  } crop;
+
+  struct {
+    int width;      // 0の場合はリサイズを行わない
+    int height;
+    int fit;
+    int filter;
+
+    /*
+     * 以下はヘッダ読み込み後に確定する値(デコード時の向きでの値)。
+     * virt_*は縮尺変更後の仮想的な画像の大きさで、出力はその画像の
+     * (off_x, off_y)からout_width x out_heightを切り出したものとなる。
+     */
+    int virt_width;
+    int virt_height;
+    int off_x;
+    int off_y;
+    int out_width;
+    int out_height;
+  } resize;
+
+  int thumbnail_max;
+  int max_scans;                    // 0の場合は全てのスキャンを復号する
+
+  jvirt_barray_ptr* coef;           // read_coefficients()で読んだ係数
 } jpeg_decode_t;
 
+typedef struct {
+  int width;
+  int height;
+  int components;
+  int out_color_components;
+  J_COLOR_SPACE jpeg_color_space;
+  J_COLOR_SPACE out_color_space;
+  int orientation;
+
+  struct {
+    uint8_t* data;
+    size_t size;
+  } exif;
+
+  struct {
+    int n;
+    JSAMPLE map[4][256];
+  } colormap;
+} decode_info_t;
+
 #if 0
 static VALUE
 create_runtime_error(const char* fmt, ...)
@@ -413,6 +603,7 @@ create_range_error(const char* fmt, ...)
   return ret;
 }
 
+#if 0
 static VALUE
 create_not_implement_error(const char* fmt, ...)
 {
@@ -425,6 +616,7 @@ create_not_implement_error(const char* fmt, ...)
 
   return ret;
 }
+#endif
 
 static VALUE
 create_memory_error()
@@ -474,6 +666,229 @@ error_exit(j_common_ptr cinfo)
   longjmp(err->jmpbuf, 1);
 }
 
+typedef struct {
+  int n;
+  int next;
+  int done;
+  int failed;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t mutex;
+#endif /* defined(HAVE_PTHREAD_H) */
+} work_queue_t;
+
+static void
+work_queue_init(work_queue_t* wq, int n)
+{
+  wq->n      = n;
+  wq->next   = 0;
+  wq->done   = 0;
+  wq->failed = 0;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init(&wq->mutex, NULL);
+#endif /* defined(HAVE_PTHREAD_H) */
+}
+
+static void
+work_queue_destroy(work_queue_t* wq)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_destroy(&wq->mutex);
+#endif /* defined(HAVE_PTHREAD_H) */
+}
+
+static int
+work_queue_fetch(work_queue_t* wq)
+{
+  int ret;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&wq->mutex);
+#endif /* defined(HAVE_PTHREAD_H) */
+
+  ret = (!wq->failed && wq->next < wq->n)? wq->next++: -1;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&wq->mutex);
+#endif /* defined(HAVE_PTHREAD_H) */
+
+  return ret;
+}
+
+static void
+work_queue_done(work_queue_t* wq)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&wq->mutex);
+#endif /* defined(HAVE_PTHREAD_H) */
+
+  wq->done++;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&wq->mutex);
+#endif /* defined(HAVE_PTHREAD_H) */
+}
+
+/*
+ * 最初に失敗を報告した呼び出しに対してのみ真を返す(エラーメッセージを
+ * 書き込んで良いのはその呼び出し元だけ)。以降のfetchは-1を返す。
+ */
+static int
+work_queue_fail(work_queue_t* wq)
+{
+  int ret;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&wq->mutex);
+#endif /* defined(HAVE_PTHREAD_H) */
+
+  ret        = !wq->failed;
+  wq->failed = !0;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&wq->mutex);
+#endif /* defined(HAVE_PTHREAD_H) */
+
+  return ret;
+}
+
+/*
+ * rb_thread_call_without_gvl2()に渡すUBF。キューを失敗状態にして未着手の
+ * 項目を打ち切らせる(処理中の項目はそのまま完了させる)。
+ */
+static void
+cancel_work_queue(void* _wq)
+{
+  work_queue_fail((work_queue_t*)_wq);
+}
+
+static void
+run_workers(int nworker, void* (*func)(void*), void* arg)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_t* thr;
+  int n;
+  int i;
+
+  /*
+   * 呼び出し元のスレッドも1ワーカとして働くので、生成するスレッドは
+   * nworker - 1個となる。スレッドの生成に失敗した場合は生成できた
+   * 分だけで処理を行う。
+   */
+  thr = (nworker > 1)? malloc(sizeof(pthread_t) * (nworker - 1)): NULL;
+  n   = 0;
+
+  if (thr != NULL) {
+    for (i = 0; i < nworker - 1; i++) {
+      if (pthread_create(thr + n, NULL, func, arg) == 0) n++;
+    }
+  }
+
+  func(arg);
+
+  for (i = 0; i < n; i++) {
+    pthread_join(thr[i], NULL);
+  }
+
+  if (thr != NULL) free(thr);
+#else /* defined(HAVE_PTHREAD_H) */
+  func(arg);
+#endif /* defined(HAVE_PTHREAD_H) */
+}
+
+/*
+ * 平面形式の各プレーンの配置を求める（戻り値は全体のバイト数）
+ *
+ * Y, U, V (NV12の場合はY, UV)の順に詰めて配置する。色差のサイズは奇数幅・
+ * 奇数高さの場合切り上げとなる。色差の行のバイト数は輝度の行のバイト数
+ * (stride)から求める。
+ */
+static size_t
+get_plane_layout(int format, int width, int height, int stride,
+                 plane_t* planes)
+{
+  plane_t pl[3];
+  int cw;
+  int ch;
+  int cs;
+  int n;
+  int i;
+
+  cw = (width + 1) / 2;
+  ch = (format == FMT_YUV422P)? height: (height + 1) / 2;
+  cs = (stride + 1) / 2;
+  n  = NUM_PLANES(format);
+
+  pl[0].stride = stride;
+  pl[0].width  = width;
+  pl[0].height = height;
+
+  if (format == FMT_NV12) {
+    pl[1].stride = cs * 2;
+    pl[1].width  = cw;
+    pl[1].height = ch;
+
+  } else {
+    pl[1].stride = cs;
+    pl[1].width  = cw;
+    pl[1].height = ch;
+    pl[2]        = pl[1];
+  }
+
+  pl[0].offset = 0;
+
+  for (i = 1; i < n; i++) {
+    pl[i].offset = pl[i - 1].offset +
+                   ((size_t)pl[i - 1].stride * pl[i - 1].height);
+  }
+
+  if (planes != NULL) memcpy(planes, pl, sizeof(plane_t) * n);
+
+  return pl[n - 1].offset + ((size_t)pl[n - 1].stride * pl[n - 1].height);
+}
+
+static int
+eval_threads_opt(VALUE opt, int n)
+{
+  VALUE val;
+  int ret;
+
+  val = Qundef;
+
+  if (opt != Qnil) {
+    rb_get_kwargs(opt, &id_threads, 0, 1, &val);
+  }
+
+  // Encoder/Decoderの:threadsと同じく真偽値・nilも受け付ける
+  switch (TYPE(val)) {
+  case T_UNDEF:
+  case T_TRUE:
+    ret = default_workers;
+    break;
+
+  case T_NIL:
+  case T_FALSE:
+    ret = 1;
+    break;
+
+  case T_FIXNUM:
+    if (FIX2LONG(val) < 1) {
+      RANGE_ERROR(":threads less than 1");
+    }
+    ret = (FIX2LONG(val) > 256)? 256: FIX2INT(val);
+    break;
+
+  default:
+    TYPE_ERROR("unsupportd :threads option type");
+  }
+
+  if (ret > n) ret = n;
+  if (ret < 1) ret = 1;
+
+  return ret;
+}
+
 static VALUE
 lookup_tag_symbol(tag_entry_t* tbl, size_t n, int tag)
 {
@@ -514,6 +929,24 @@ lookup_tag_symbol(tag_entry_t* tbl, size_t n, int tag)
   return ret;
 }
 
+static void
+mark_pinned(VALUE data)
+{
+  long i;
+
+  /*
+   * GVL解放中に参照するバッファが移動されないよう、バッチ処理中の
+   * 入力(配列)は要素も含めて固定する
+   */
+  rb_gc_mark(data);
+
+  if (RB_TYPE_P(data, T_ARRAY)) {
+    for (i = 0; i < RARRAY_LEN(data); i++) {
+      rb_gc_mark(RARRAY_AREF(data, i));
+    }
+  }
+}
+
 static void
 rb_encoder_mark(void* _ptr)
 {
@@ -522,7 +955,11 @@ rb_encoder_mark(void* _ptr)
   ptr = (jpeg_encode_t*)_ptr;
 
   if (ptr->data != Qnil) {
-    rb_gc_mark(ptr->data);
+    mark_pinned(ptr->data);
+  }
+
+  if (ptr->dest.str != Qnil) {
+    rb_gc_mark(ptr->dest.str);
   }
 }
 
@@ -668,6 +1105,21 @@ eval_encoder_pixel_format_opt(jpeg_encode_t* ptr, VALUE opt)
       color_space = JCS_GRAYSCALE;
       components  = 1;
 
+    } else if (EQ_STR(opt, "I420") || EQ_STR(opt, "YUV420P")) {
+      format      = FMT_I420;
+      color_space = JCS_YCbCr;
+      components  = 3;
+
+    } else if (EQ_STR(opt, "NV12")) {
+      format      = FMT_NV12;
+      color_space = JCS_YCbCr;
+      components  = 3;
+
+    } else if (EQ_STR(opt, "YUV422P")) {
+      format      = FMT_YUV422P;
+      color_space = JCS_YCbCr;
+      components  = 3;
+
     } else {
       ret = create_argument_error("unsupportd :pixel_format option value");
     }
@@ -814,17 +1266,21 @@ eval_encoder_stride_opt(jpeg_encode_t* ptr, VALUE opt)
 {
   VALUE ret;
   int stride;
+  int min;
 
   ret = Qnil;
 
+  // 平面形式の場合は輝度の行のバイト数を表す
+  min = (IS_PLANAR(ptr))? ptr->width: ptr->width * ptr->components;
+
   switch (TYPE(opt)) {
   case T_UNDEF:
-    stride = ptr->width * ptr->components;
+    stride = min;
     break;
 
   case T_FIXNUM:
     stride = FIX2INT(opt);
-    if (stride < (ptr->width * ptr->components)) {
+    if (stride < min) {
       ret = create_range_error(":stride too little");
     }
     break;
@@ -838,6 +1294,134 @@ eval_encoder_stride_opt(jpeg_encode_t* ptr, VALUE opt)
   return ret;
 }
 
+static VALUE
+eval_encoder_threads_opt(jpeg_encode_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  int threads;
+
+  ret     = Qnil;
+  threads = 0;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+  case T_NIL:
+  case T_FALSE:
+    threads = 0;
+    break;
+
+  case T_TRUE:
+    threads = default_workers;
+    break;
+
+  case T_FIXNUM:
+    if (FIX2LONG(opt) < 1) {
+      ret = create_range_error(":threads less than 1");
+
+    } else {
+      threads = (FIX2LONG(opt) > 256)? 256: FIX2INT(opt);
+    }
+    break;
+
+  default:
+    ret = create_type_error("unsupportd :threads option type");
+    break;
+  }
+
+  if (!RTEST(ret)) ptr->threads = threads;
+
+  return ret;
+}
+
+static void
+get_mcu_geometry(struct jpeg_compress_struct* cinfo, int* mpr, int* height)
+{
+  int max_h;
+  int max_v;
+  int i;
+
+  max_h = 1;
+  max_v = 1;
+
+  for (i = 0; i < cinfo->num_components; i++) {
+    if (cinfo->comp_info[i].h_samp_factor > max_h) {
+      max_h = cinfo->comp_info[i].h_samp_factor;
+    }
+
+    if (cinfo->comp_info[i].v_samp_factor > max_v) {
+      max_v = cinfo->comp_info[i].v_samp_factor;
+    }
+  }
+
+  // 単一コンポーネントの場合はMCUは1ブロック
+  if (cinfo->num_components == 1) {
+    max_h = 1;
+    max_v = 1;
+  }
+
+  *mpr    = (cinfo->image_width + (max_h * DCTSIZE) - 1) / (max_h * DCTSIZE);
+  *height = max_v * DCTSIZE;
+}
+
+static void
+create_compress(jpeg_encode_t* ptr)
+{
+  int mpr;
+  int mcu_height;
+
+  // jpeg_std_error()はハンドラを上書きするので、その後に設定すること
+  ptr->cinfo.err                   = jpeg_std_error(&ptr->err_mgr.jerr);
+  ptr->err_mgr.jerr.output_message = output_message;
+  ptr->err_mgr.jerr.emit_message   = emit_message;
+  ptr->err_mgr.jerr.error_exit     = error_exit;
+
+  jpeg_create_compress(&ptr->cinfo);
+
+  ptr->cinfo.image_width      = ptr->width;
+  ptr->cinfo.image_height     = ptr->height;
+  ptr->cinfo.in_color_space   = ptr->color_space;
+  ptr->cinfo.input_components = ptr->components;
+
+  ptr->cinfo.arith_code       = TRUE;
+  ptr->cinfo.raw_data_in      = FALSE;
+  ptr->cinfo.dct_method       = ptr->dct_method;
+
+  jpeg_set_defaults(&ptr->cinfo);
+  jpeg_set_quality(&ptr->cinfo, ptr->quality, TRUE);
+  jpeg_suppress_tables(&ptr->cinfo, TRUE);
+
+  /*
+   * 平面形式の入力は色変換・間引きを行わずにそのまま渡すので、
+   * サンプリング比を入力に合わせる（jpeg_set_defaults()で
+   * raw_data_inはクリアされるので、その後に設定すること）
+   */
+  if (IS_PLANAR(ptr)) {
+    ptr->cinfo.raw_data_in               = TRUE;
+    ptr->cinfo.comp_info[0].h_samp_factor = 2;
+    ptr->cinfo.comp_info[0].v_samp_factor = (ptr->format == FMT_YUV422P)? 1: 2;
+    ptr->cinfo.comp_info[1].h_samp_factor = 1;
+    ptr->cinfo.comp_info[1].v_samp_factor = 1;
+    ptr->cinfo.comp_info[2].h_samp_factor = 1;
+    ptr->cinfo.comp_info[2].v_samp_factor = 1;
+  }
+
+  /*
+   * ストライプ分割を行う場合はストライプ毎にリスタートマーカーを置く。
+   * リスタート区間はスレッド数に依存しないので、スレッド数によらず
+   * 同一の出力が得られる。
+   *
+   * ストライプは先頭ストライプのハフマンテーブルを共有して連結されるので、
+   * ストライプ毎に最適化したテーブルを作らせてはならない（連結した
+   * ストリームが壊れる）。jpeg_set_defaults()の設定に頼らず明示的に
+   * 無効にしておく。
+   */
+  if (ptr->threads > 0) {
+    get_mcu_geometry(&ptr->cinfo, &mpr, &mcu_height);
+    ptr->cinfo.restart_interval = STRIPE_ROWS * mpr;
+    ptr->cinfo.optimize_coding  = FALSE;
+  }
+}
+
 static VALUE
 set_encoder_context(jpeg_encode_t* ptr, int wd, int ht, VALUE opt)
 {
@@ -894,6 +1478,9 @@ set_encoder_context(jpeg_encode_t* ptr, int wd, int ht, VALUE opt)
 
     ret = eval_encoder_stride_opt(ptr, opts[4]);
     if (RTEST(ret)) break;
+
+    ret = eval_encoder_threads_opt(ptr, opts[5]);
+    if (RTEST(ret)) break;
   } while (0);
 
   /*
@@ -917,16 +1504,19 @@ set_encoder_context(jpeg_encode_t* ptr, int wd, int ht, VALUE opt)
    * set the rest context parameter
    */
   if (!RTEST(ret)) {
-    ptr->err_mgr.jerr.output_message = output_message;
-    ptr->err_mgr.jerr.emit_message   = emit_message;
-    ptr->err_mgr.jerr.error_exit     = error_exit;
+    if (IS_PLANAR(ptr)) {
+      ptr->data_size = get_plane_layout(ptr->format, ptr->width, ptr->height,
+                                        ptr->stride, ptr->planes);
+    } else {
+      ptr->data_size = ptr->stride * ptr->height;
+    }
 
-    ptr->data_size = ptr->stride * ptr->height;
     ptr->buf.mem   = NULL;
     ptr->buf.size  = 0;
     ptr->array     = ary;
     ptr->rows      = rows;
     ptr->data      = Qnil;
+    ptr->dest.str  = Qnil;
 
     for (i = 0; i < UNIT_LINES; i++) {
       ptr->array[i] = ptr->rows + (i * ptr->width * ptr->components);
@@ -937,23 +1527,8 @@ set_encoder_context(jpeg_encode_t* ptr, int wd, int ht, VALUE opt)
    * setup libjpeg
    */
   if (!RTEST(ret)) {
-    jpeg_create_compress(&ptr->cinfo);
+    create_compress(ptr);
     SET_FLAG(ptr, F_CREAT);
-
-    ptr->cinfo.err              = jpeg_std_error(&ptr->err_mgr.jerr);
-    ptr->cinfo.image_width      = ptr->width;
-    ptr->cinfo.image_height     = ptr->height;
-    ptr->cinfo.in_color_space   = ptr->color_space;
-    ptr->cinfo.input_components = ptr->components;
-
-    ptr->cinfo.optimize_coding  = TRUE;
-    ptr->cinfo.arith_code       = TRUE;
-    ptr->cinfo.raw_data_in      = FALSE;
-    ptr->cinfo.dct_method       = ptr->dct_method;
-
-    jpeg_set_defaults(&ptr->cinfo);
-    jpeg_set_quality(&ptr->cinfo, ptr->quality, TRUE);
-    jpeg_suppress_tables(&ptr->cinfo, TRUE);
   }
 
   /*
@@ -979,7 +1554,11 @@ set_encoder_context(jpeg_encode_t* ptr, int wd, int ht, VALUE opt)
  *   @option opts [Symbol] :pixel_format
  *     specifies the format of the input image. possible values are:
  *     YUV422 YUYV RGB565 RGB RGB24 BGR BGR24 YUV444 YCbCr
- *     RGBX RGB32 BGRX BGR32 GRAYSCALE
+ *     RGBX RGB32 BGRX BGR32 GRAYSCALE I420 YUV420P NV12 YUV422P.
+ *     the planar formats (I420, NV12, YUV422P) are passed to libjpeg
+ *     without color conversion and downsampling. their planes are packed
+ *     in this order without gaps, and :stride gives the bytes per luma
+ *     row (the chroma rows use the half of it).
  *
  *   @option opts [Integer] :quality
  *     specifies the quality of the compressed image.
@@ -988,6 +1567,13 @@ set_encoder_context(jpeg_encode_t* ptr, int wd, int ht, VALUE opt)
  *   @option opts [Symbol] :dct_method
  *     specifies how encoding is handled. possible values are:
  *     FASTEST ISLOW IFAST FLOAT
+ *
+ *   @option opts [Integer, Boolean] :threads
+ *     specifies the number of native threads used to encode one image.
+ *     if true, the number of online CPUs is used. when this option is
+ *     given, the image is split into stripes separated by restart markers
+ *     and the stripes are compressed concurrently. the output does not
+ *     depend on the number of threads.
  */
 static VALUE
 rb_encoder_initialize(int argc, VALUE *argv, VALUE self)
@@ -1040,96 +1626,355 @@ rb_encoder_initialize(int argc, VALUE *argv, VALUE self)
   return Qtrue;
 }
 
+/*
+ * YUYVの1行をYCbCr(3バイト/画素)に展開する。幅が奇数の場合、最後の画素は
+ * 前半のみを使用する。
+ */
 static void
-push_rows_yuv422(JSAMPROW dst, int wd, int st, uint8_t* data, int nrow)
+expand_yuv422_scalar(uint8_t* dst, uint8_t* src, int wd)
 {
-  uint8_t* src;
-  int i;
   int j;
 
-  for (i = 0; i < nrow; i++) {
-    src = data;
-
-    for (j = 0; j < wd; j += 2) {
-      dst[0] = src[0];
-      dst[1] = src[1];
-      dst[2] = src[3];
-      dst[3] = src[2];
-      dst[4] = src[1];
-      dst[5] = src[3];
-
-      dst += 6;
-      src += 4;
-    } 
+  for (j = 0; j < wd - 1; j += 2) {
+    dst[0] = src[0];
+    dst[1] = src[1];
+    dst[2] = src[3];
+    dst[3] = src[2];
+    dst[4] = src[1];
+    dst[5] = src[3];
 
-    data += st;
+    dst += 6;
+    src += 4;
+  } 
+
+  if (j < wd) {
+    dst[0] = src[0];
+    dst[1] = src[1];
+    dst[2] = src[3];
   }
 }
 
+/*
+ * RGB565(リトルエンディアン)の1行をRGB(3バイト/画素)に展開する
+ */
 static void
-push_rows_rgb565(JSAMPROW dst, int wd, int st, uint8_t* data, int nrow)
+expand_rgb565_scalar(uint8_t* dst, uint8_t* src, int wd)
 {
-  uint8_t* src;
-  int i;
   int j;
 
-  for (i = 0; i < nrow; i++) {
-    src = data;
+  for (j = 0; j < wd; j++) {
+    dst[0] = src[1] & 0xf8;
+    dst[1] = ((src[1] << 5) & 0xe0) | ((src[0] >> 3) & 0x1c);
+    dst[2] = (src[0] << 3) & 0xf8;
 
-    for (j = 0; j < wd; j++) {
-      dst[0] = src[1] & 0xf8;
-      dst[1] = ((src[1] << 5) & 0xe0) | ((src[0] >> 3) & 0x1c);
-      dst[2] = (src[0] << 3) & 0xf8;
+    dst += 3;
+    src += 2;
+  }
+}
 
-      dst += 3;
-      src += 2;
-    }
+#if defined(__SSE2__)
+/*
+ * 4画素分の[c0 c1 c2 0]の並びを前詰めして12バイトにする
+ */
+static inline __m128i
+compact_pixel3(__m128i p)
+{
+  __m128i q;
 
-    data += st;
+  q = _mm_or_si128(
+        _mm_and_si128(p, _mm_set1_epi64x(0x0000000000ffffffLL)),
+        _mm_and_si128(_mm_srli_epi64(p, 8),
+                      _mm_set1_epi64x(0x0000ffffff000000LL)));
+
+  return _mm_or_si128(_mm_and_si128(q, _mm_set_epi64x(0, -1)),
+                      _mm_slli_si128(_mm_srli_si128(q, 8), 6));
+}
+
+/*
+ * 3チャネル分のプレーン（各16バイト）をインタリーブして48バイト書き出す
+ */
+static inline void
+store_interleave3(uint8_t* dst, __m128i c0, __m128i c1, __m128i c2)
+{
+  __m128i t0;
+  __m128i t1;
+  __m128i u0;
+  __m128i u1;
+  __m128i r0;
+  __m128i r1;
+  __m128i r2;
+  __m128i r3;
+
+  t0 = _mm_unpacklo_epi8(c0, c1);
+  t1 = _mm_unpackhi_epi8(c0, c1);
+  u0 = _mm_unpacklo_epi8(c2, _mm_setzero_si128());
+  u1 = _mm_unpackhi_epi8(c2, _mm_setzero_si128());
+
+  r0 = compact_pixel3(_mm_unpacklo_epi16(t0, u0));
+  r1 = compact_pixel3(_mm_unpackhi_epi16(t0, u0));
+  r2 = compact_pixel3(_mm_unpacklo_epi16(t1, u1));
+  r3 = compact_pixel3(_mm_unpackhi_epi16(t1, u1));
+
+  _mm_storeu_si128((__m128i*)(dst + 0),
+                   _mm_or_si128(r0, _mm_slli_si128(r1, 12)));
+  _mm_storeu_si128((__m128i*)(dst + 16),
+                   _mm_or_si128(_mm_srli_si128(r1, 4), _mm_slli_si128(r2, 8)));
+  _mm_storeu_si128((__m128i*)(dst + 32),
+                   _mm_or_si128(_mm_srli_si128(r2, 8), _mm_slli_si128(r3, 4)));
+}
+
+static void
+expand_yuv422_sse2(uint8_t* dst, uint8_t* src, int wd)
+{
+  __m128i p0;
+  __m128i p1;
+  __m128i y;
+  __m128i uv;
+  __m128i u;
+  __m128i v;
+  __m128i mask;
+  int i;
+
+  mask = _mm_set1_epi16(0x00ff);
+
+  for (i = 0; i + 16 <= wd; i += 16) {
+    p0 = _mm_loadu_si128((__m128i*)(src + 0));
+    p1 = _mm_loadu_si128((__m128i*)(src + 16));
+
+    y  = _mm_packus_epi16(_mm_and_si128(p0, mask), _mm_and_si128(p1, mask));
+    uv = _mm_packus_epi16(_mm_srli_epi16(p0, 8), _mm_srli_epi16(p1, 8));
+    u  = _mm_packus_epi16(_mm_and_si128(uv, mask), _mm_setzero_si128());
+    v  = _mm_packus_epi16(_mm_srli_epi16(uv, 8), _mm_setzero_si128());
+
+    store_interleave3(dst, y, _mm_unpacklo_epi8(u, u), _mm_unpacklo_epi8(v, v));
+
+    src += 32;
+    dst += 48;
+  }
+
+  expand_yuv422_scalar(dst, src, wd - i);
+}
+
+static void
+expand_rgb565_sse2(uint8_t* dst, uint8_t* src, int wd)
+{
+  __m128i p0;
+  __m128i p1;
+  __m128i r;
+  __m128i g;
+  __m128i b;
+  __m128i m_rb;
+  __m128i m_g;
+  int i;
+
+  m_rb = _mm_set1_epi16(0x00f8);
+  m_g  = _mm_set1_epi16(0x00fc);
+
+#define EXPAND(x, op, n, m)   _mm_and_si128(op((x), (n)), (m))
+
+  for (i = 0; i + 16 <= wd; i += 16) {
+    p0 = _mm_loadu_si128((__m128i*)(src + 0));
+    p1 = _mm_loadu_si128((__m128i*)(src + 16));
+
+    r = _mm_packus_epi16(EXPAND(p0, _mm_srli_epi16, 8, m_rb),
+                         EXPAND(p1, _mm_srli_epi16, 8, m_rb));
+    g = _mm_packus_epi16(EXPAND(p0, _mm_srli_epi16, 3, m_g),
+                         EXPAND(p1, _mm_srli_epi16, 3, m_g));
+    b = _mm_packus_epi16(EXPAND(p0, _mm_slli_epi16, 3, m_rb),
+                         EXPAND(p1, _mm_slli_epi16, 3, m_rb));
+
+    store_interleave3(dst, r, g, b);
+
+    src += 32;
+    dst += 48;
   }
+
+#undef EXPAND
+
+  expand_rgb565_scalar(dst, src, wd - i);
+}
+#endif /* defined(__SSE2__) */
+
+#ifdef HAVE_AVX2_KERNEL
+/*
+ * AVX2版はレーン毎に8画素を扱い、vpshufbで24バイトに並べ替える
+ */
+__attribute__((target("avx2")))
+static inline void
+store_lanes24(uint8_t* dst, __m256i o0, __m256i o1)
+{
+  _mm_storeu_si128((__m128i*)(dst + 0), _mm256_castsi256_si128(o0));
+  _mm_storel_epi64((__m128i*)(dst + 16), _mm256_castsi256_si128(o1));
+  _mm_storeu_si128((__m128i*)(dst + 24), _mm256_extracti128_si256(o0, 1));
+  _mm_storel_epi64((__m128i*)(dst + 40), _mm256_extracti128_si256(o1, 1));
 }
 
+__attribute__((target("avx2")))
 static void
-push_rows_comp3(JSAMPROW rows, int wd, int st, uint8_t* data, int nrow)
+expand_yuv422_avx2(uint8_t* dst, uint8_t* src, int wd)
 {
-  int size;
+  __m256i s0;
+  __m256i s1;
+  __m256i p;
   int i;
 
-  size = wd * 3;
+  s0 = _mm256_setr_epi8(
+     0,  1,  3,  2,  1,  3,  4,  5,  7,  6,  5,  7,  8,  9, 11, 10,
+     0,  1,  3,  2,  1,  3,  4,  5,  7,  6,  5,  7,  8,  9, 11, 10);
+  s1 = _mm256_setr_epi8(
+     9, 11, 12, 13, 15, 14, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1,
+     9, 11, 12, 13, 15, 14, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1);
 
-  for (i = 0; i < nrow; i++) {
-    memcpy(rows, data, size);
+  for (i = 0; i + 16 <= wd; i += 16) {
+    p = _mm256_loadu_si256((__m256i*)src);
 
-    rows += size;
-    data += st;
+    store_lanes24(dst, _mm256_shuffle_epi8(p, s0), _mm256_shuffle_epi8(p, s1));
+
+    src += 32;
+    dst += 48;
+  }
+
+  expand_yuv422_scalar(dst, src, wd - i);
+}
+
+__attribute__((target("avx2")))
+static void
+expand_rgb565_avx2(uint8_t* dst, uint8_t* src, int wd)
+{
+  __m256i s0;
+  __m256i s1;
+  __m256i s2;
+  __m256i s3;
+  __m256i m_rb;
+  __m256i m_g;
+  __m256i p;
+  __m256i rg;
+  __m256i b;
+  int i;
+
+  /* rgは[R0..R7 G0..G7]、bは[B0..B7 0..]の並び（レーン毎） */
+  s0 = _mm256_setr_epi8(
+     0,  8, -1,  1,  9, -1,  2, 10, -1,  3, 11, -1,  4, 12, -1,  5,
+     0,  8, -1,  1,  9, -1,  2, 10, -1,  3, 11, -1,  4, 12, -1,  5);
+  s1 = _mm256_setr_epi8(
+    -1, -1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1,
+    -1, -1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1);
+  s2 = _mm256_setr_epi8(
+    13, -1,  6, 14, -1,  7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    13, -1,  6, 14, -1,  7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  s3 = _mm256_setr_epi8(
+    -1,  5, -1, -1,  6, -1, -1,  7, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1,  5, -1, -1,  6, -1, -1,  7, -1, -1, -1, -1, -1, -1, -1, -1);
+
+  m_rb = _mm256_set1_epi16(0x00f8);
+  m_g  = _mm256_set1_epi16(0x00fc);
+
+  for (i = 0; i + 16 <= wd; i += 16) {
+    p  = _mm256_loadu_si256((__m256i*)src);
+    rg = _mm256_packus_epi16(
+           _mm256_and_si256(_mm256_srli_epi16(p, 8), m_rb),
+           _mm256_and_si256(_mm256_srli_epi16(p, 3), m_g));
+    b  = _mm256_packus_epi16(
+           _mm256_and_si256(_mm256_slli_epi16(p, 3), m_rb),
+           _mm256_setzero_si256());
+
+    store_lanes24(dst,
+                  _mm256_or_si256(_mm256_shuffle_epi8(rg, s0),
+                                  _mm256_shuffle_epi8(b, s1)),
+                  _mm256_or_si256(_mm256_shuffle_epi8(rg, s2),
+                                  _mm256_shuffle_epi8(b, s3)));
+
+    src += 32;
+    dst += 48;
+  }
+
+  expand_rgb565_scalar(dst, src, wd - i);
+}
+#endif /* defined(HAVE_AVX2_KERNEL) */
+
+#if defined(__ARM_NEON)
+static void
+expand_yuv422_neon(uint8_t* dst, uint8_t* src, int wd)
+{
+  uint8x16x4_t in;
+  uint8x16x2_t y;
+  uint8x16x2_t u;
+  uint8x16x2_t v;
+  uint8x16x3_t out;
+  int i;
+
+  for (i = 0; i + 32 <= wd; i += 32) {
+    in = vld4q_u8(src);
+
+    y  = vzipq_u8(in.val[0], in.val[2]);
+    u  = vzipq_u8(in.val[1], in.val[1]);
+    v  = vzipq_u8(in.val[3], in.val[3]);
+
+    out.val[0] = y.val[0];
+    out.val[1] = u.val[0];
+    out.val[2] = v.val[0];
+    vst3q_u8(dst, out);
+
+    out.val[0] = y.val[1];
+    out.val[1] = u.val[1];
+    out.val[2] = v.val[1];
+    vst3q_u8(dst + 48, out);
+
+    src += 64;
+    dst += 96;
   }
+
+  expand_yuv422_scalar(dst, src, wd - i);
 }
 
 static void
-push_rows_comp4(JSAMPROW rows, int wd, int st, uint8_t* data, int nrow)
+expand_rgb565_neon(uint8_t* dst, uint8_t* src, int wd)
 {
-  int size;
+  uint8x16x2_t in;
+  uint8x16x3_t out;
   int i;
 
-  size = wd * 4;
+  for (i = 0; i + 16 <= wd; i += 16) {
+    in = vld2q_u8(src);
+
+    out.val[0] = vandq_u8(in.val[1], vdupq_n_u8(0xf8));
+    out.val[1] = vorrq_u8(vshlq_n_u8(in.val[1], 5),
+                          vandq_u8(vshrq_n_u8(in.val[0], 3),
+                                   vdupq_n_u8(0x1c)));
+    out.val[2] = vshlq_n_u8(in.val[0], 3);
+
+    vst3q_u8(dst, out);
+
+    src += 32;
+    dst += 48;
+  }
+
+  expand_rgb565_scalar(dst, src, wd - i);
+}
+#endif /* defined(__ARM_NEON) */
+
+static void
+push_rows_yuv422(JSAMPROW dst, int wd, int st, uint8_t* data, int nrow)
+{
+  int i;
 
   for (i = 0; i < nrow; i++) {
-    memcpy(rows, data, size);
+    kernels.expand_yuv422(dst, data, wd);
 
-    rows += size;
+    dst  += wd * 3;
     data += st;
   }
 }
 
 static void
-push_rows_grayscale(JSAMPROW rows, int wd, int st, uint8_t* data, int nrow)
+push_rows_rgb565(JSAMPROW dst, int wd, int st, uint8_t* data, int nrow)
 {
   int i;
 
   for (i = 0; i < nrow; i++) {
-    memcpy(rows, data, wd);
+    kernels.expand_rgb565(dst, data, wd);
 
-    rows += wd;
+    dst  += wd * 3;
     data += st;
   }
 }
@@ -1146,21 +1991,6 @@ push_rows(jpeg_encode_t* ptr, uint8_t* data, int nrow)
     push_rows_rgb565(ptr->rows, ptr->width, ptr->stride, data, nrow);
     break;
 
-  case FMT_YUV:
-  case FMT_RGB:
-  case FMT_BGR:
-    push_rows_comp3(ptr->rows, ptr->width, ptr->stride, data, nrow);
-    break;
-
-  case FMT_RGB32:
-  case FMT_BGR32:
-    push_rows_comp4(ptr->rows, ptr->width, ptr->stride, data, nrow);
-    break;
-
-  case FMT_GRAYSCALE:
-    push_rows_grayscale(ptr->rows, ptr->width, ptr->stride, data, nrow);
-    break;
-
   default:
     RUNTIME_ERROR("Really?");
   }
@@ -1194,1840 +2024,7410 @@ put_exif_tags(jpeg_encode_t* ptr)
   jpeg_write_marker(&ptr->cinfo, JPEG_APP1, data, sizeof(data));
 }
 
+/*
+ * Rubyの文字列に直接書き出すdestination manager
+ *
+ * 出力先の文字列の容量が不足した場合はGVLを再取得して倍に拡張する。
+ * エンコードはGVLを解放したRubyスレッド上で行われることが前提なので、
+ * ワーカスレッドからは使用できない(ワーカはjpeg_mem_dest()を使う)。
+ */
+
 static VALUE
-do_encode(VALUE _ptr)
+expand_dest_string_body(VALUE _dest)
 {
-  VALUE ret;
-  jpeg_encode_t* ptr;
-  uint8_t* data;
-  int nrow;
-
-  /*
-   * initialize
-   */
-  ret  = Qnil;
-  ptr  = (jpeg_encode_t*)_ptr;
-  data = (uint8_t*)RSTRING_PTR(ptr->data);
-
-  /*
-   * do encode
-   */
-  if (setjmp(ptr->err_mgr.jmpbuf)) {
-    /*
-     * when error occurred
-     */
-    jpeg_abort_compress(&ptr->cinfo);
-    rb_raise(encerr_klass, "%s", ptr->err_mgr.msg);
-
-  } else {
-    /*
-     * normal path
-     */
-    jpeg_start_compress(&ptr->cinfo, TRUE);
+  str_dest_t* dest;
 
-    if (ptr->orientation != 0) {
-      put_exif_tags(ptr);
-    }
+  dest = (str_dest_t*)_dest;
 
-    while (ptr->cinfo.next_scanline < ptr->cinfo.image_height) {
-      nrow = ptr->cinfo.image_height - ptr->cinfo.next_scanline;
-      if (nrow > UNIT_LINES) nrow = UNIT_LINES;
+  // 書き込み済みの内容が保存されるよう、先に長さを確定させる
+  rb_str_set_len(dest->str, dest->capa);
+  rb_str_modify_expand(dest->str, dest->capa);
 
-      push_rows(ptr, data, nrow);
+  dest->capa = rb_str_capacity(dest->str);
 
-      jpeg_write_scanlines(&ptr->cinfo, ptr->array, nrow);
-      data += (ptr->stride * nrow);
-    }
+  return Qnil;
+}
 
-    jpeg_finish_compress(&ptr->cinfo);
+static void*
+expand_dest_string(void* _dest)
+{
+  int state;
 
-    /*
-     * build return data
-     */
-    ret = rb_str_buf_new(ptr->buf.size);
-    rb_str_set_len(ret, ptr->buf.size);
+  rb_protect(expand_dest_string_body, (VALUE)_dest, &state);
 
-    memcpy(RSTRING_PTR(ret), ptr->buf.mem, ptr->buf.size);
+  if (state != 0) {
+    rb_set_errinfo(Qnil);
+    return _dest;
   }
 
-  return ret;
+  return NULL;
 }
 
-/**
- * encode data
- *
- * @overload encode(raw)
- *
- *   @param raw [String]  raw image data to encode.
- *
- *   @return [String] encoded JPEG data.
- */
-static VALUE
-rb_encoder_encode(VALUE self, VALUE data)
+static void
+init_dest_string(j_compress_ptr cinfo)
 {
-  VALUE ret;
-  int state;
-  jpeg_encode_t* ptr;
+  str_dest_t* dest;
 
-  /*
-   * initialize
-   */
-  ret   = Qnil;
-  state = 0;
+  dest = (str_dest_t*)cinfo->dest;
 
-  TypedData_Get_Struct(self, jpeg_encode_t, &jpeg_encoder_data_type, ptr);
+  dest->capa                 = rb_str_capacity(dest->str);
+  dest->size                 = 0;
+  dest->pub.next_output_byte = (JOCTET*)RSTRING_PTR(dest->str);
+  dest->pub.free_in_buffer   = dest->capa;
+}
 
-  /*
-   * argument check
-   */
-  Check_Type(data, T_STRING);
+static boolean
+empty_dest_string(j_compress_ptr cinfo)
+{
+  str_dest_t* dest;
+  size_t used;
 
-  if (RSTRING_LEN(data) < ptr->data_size) {
-    ARGUMENT_ERROR("image data is too short");
-  }
+  dest = (str_dest_t*)cinfo->dest;
+  used = dest->capa;
 
-  if (RSTRING_LEN(data) > ptr->data_size) {
-    ARGUMENT_ERROR("image data is too large");
+  if (rb_thread_call_with_gvl(expand_dest_string, dest) != NULL) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
   }
 
-  /*
-   * alloc memory
-   */
-  jpeg_mem_dest(&ptr->cinfo, &ptr->buf.mem, &ptr->buf.size); 
-  if (ptr->buf.mem == NULL) {
-    RUNTIME_ERROR("jpeg_mem_dest() failed");
-  }
+  dest->pub.next_output_byte = (JOCTET*)RSTRING_PTR(dest->str) + used;
+  dest->pub.free_in_buffer   = dest->capa - used;
 
-  /*
-   * prepare
-   */
-  SET_DATA(ptr, data);
+  return TRUE;
+}
 
-  /*
-   * do encode
-   */
-  ret = rb_protect(do_encode, (VALUE)ptr, &state);
+static void
+term_dest_string(j_compress_ptr cinfo)
+{
+  str_dest_t* dest;
 
-  /*
-   * post process
-   */
-  CLR_DATA(ptr);
+  dest = (str_dest_t*)cinfo->dest;
+  dest->size = dest->capa - dest->pub.free_in_buffer;
+}
 
-  if (ptr->buf.mem != NULL) {
-    free(ptr->buf.mem);
+static void
+jpeg_str_dest(j_compress_ptr cinfo, str_dest_t* dest)
+{
+  dest->pub.init_destination    = init_dest_string;
+  dest->pub.empty_output_buffer = empty_dest_string;
+  dest->pub.term_destination    = term_dest_string;
 
-    ptr->buf.mem  = NULL;
-    ptr->buf.size = 0;
-  }
+  cinfo->dest = &dest->pub;
+}
 
-  if (state != 0) rb_jump_tag(state);
+static size_t
+estimate_output_size(jpeg_encode_t* ptr)
+{
+  size_t bits;
 
-  return ret;
+  /*
+   * 画素あたりのビット数を品質から大雑把に見積もる(q75で約3.8bpp、
+   * q100で約6bpp)。グレースケールはその半分とする。見積もりが外れた
+   * 場合も出力先の拡張で対処できるので厳密である必要はない。
+   */
+  bits = 1000 + (ptr->quality * ptr->quality * 1000 / 2000);
+  if (ptr->components == 1) bits /= 2;
+
+  return ((size_t)ptr->width * ptr->height * bits / 8000) + 1024;
 }
 
 static void
-rb_decoder_mark(void* _ptr)
+write_scanlines(jpeg_encode_t* ptr, uint8_t* data, int nrow)
 {
-  jpeg_decode_t* ptr;
+  JSAMPROW direct[UNIT_LINES];
+  int n;
+  int i;
 
-  ptr = (jpeg_decode_t*)_ptr; 
+  while (nrow > 0) {
+    n = (nrow > UNIT_LINES)? UNIT_LINES: nrow;
 
-  if (ptr->orientation.buf != Qnil) {
-    rb_gc_mark(ptr->orientation.buf);
-  }
+    if (NEED_CONVERSION(ptr)) {
+      push_rows(ptr, data, n);
+      jpeg_write_scanlines(&ptr->cinfo, ptr->array, n);
 
-  if (ptr->data != Qnil) {
-    rb_gc_mark(ptr->data);
+    } else {
+      // 変換の不要な形式は入力データの各行をそのままlibjpegに渡す
+      for (i = 0; i < n; i++) {
+        direct[i] = (JSAMPROW)(data + (i * ptr->stride));
+      }
+
+      jpeg_write_scanlines(&ptr->cinfo, direct, n);
+    }
+
+    data += (ptr->stride * n);
+    nrow -= n;
   }
 }
 
 static void
-rb_decoder_free(void* _ptr)
+write_raw_rows(jpeg_encode_t* ptr)
 {
-  jpeg_decode_t* ptr;
+  struct jpeg_compress_struct* cinfo;
+  jpeg_component_info* comp;
+  JSAMPARRAY bufs[3];
+  JSAMPROW rows[3][2 * DCTSIZE];
+  JSAMPARRAY image[3];
+  plane_t* pl;
+  uint8_t* src;
+  uint8_t* dst;
+  int width[3];
+  int step;
+  int lines;
+  int imcu;
+  int top;
+  int y;
+  int i;
+  int j;
+  int k;
 
-  ptr = (jpeg_decode_t*)_ptr;
+  cinfo = &ptr->cinfo;
+  lines = cinfo->max_v_samp_factor * DCTSIZE;
 
-  if (ptr->array != NULL) {
-    free(ptr->array);
+  /*
+   * 各コンポーネントの行はブロック境界まで埋めて渡す必要があるので、
+   * 端の画素を複製するための作業領域を用意しておく
+   */
+  for (i = 0; i < 3; i++) {
+    comp     = cinfo->comp_info + i;
+    width[i] = comp->width_in_blocks * DCTSIZE;
+    bufs[i]  = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo,
+                                           JPOOL_IMAGE,
+                                           width[i],
+                                           comp->v_samp_factor * DCTSIZE);
+    image[i] = rows[i];
   }
 
-  ptr->orientation.buf = Qnil;
-  ptr->data            = Qnil;
+  for (imcu = 0; cinfo->next_scanline < cinfo->image_height; imcu++) {
+    for (i = 0; i < 3; i++) {
+      comp = cinfo->comp_info + i;
 
-  if (TEST_FLAG(ptr, F_CREAT)) {
-    jpeg_destroy_decompress(&ptr->cinfo);
-  }
+      // NV12のU,Vは同じプレーンから1バイトずつずらして取り出す
+      if (ptr->format == FMT_NV12 && i > 0) {
+        pl   = ptr->planes + 1;
+        step = 2;
+      } else {
+        pl   = ptr->planes + i;
+        step = 1;
+      }
 
-  free(ptr);
-}
+      top = imcu * comp->v_samp_factor * DCTSIZE;
 
-static size_t
-rb_decoder_size(const void* ptr)
-{
-  size_t ret;
+      for (j = 0; j < comp->v_samp_factor * DCTSIZE; j++) {
+        y   = (top + j < pl->height)? top + j: pl->height - 1;
+        src = ptr->src + pl->offset + ((size_t)y * pl->stride);
 
-  ret  = sizeof(jpeg_decode_t);
+        if (ptr->format == FMT_NV12 && i == 2) src += 1;
 
-  return ret;
+        if (step == 1 && pl->width == width[i]) {
+          // ブロック境界に揃っている行は入力をそのまま渡す
+          rows[i][j] = (JSAMPROW)src;
+          continue;
+        }
+
+        dst = bufs[i][j];
+
+        for (k = 0; k < pl->width; k++) {
+          dst[k] = src[k * step];
+        }
+
+        for (; k < width[i]; k++) {
+          dst[k] = dst[pl->width - 1];
+        }
+
+        rows[i][j] = dst;
+      }
+    }
+
+    jpeg_write_raw_data(cinfo, image, lines);
+  }
 }
 
-#if RUBY_API_VERSION_CODE > 20600
-static const rb_data_type_t jpeg_decoder_data_type = {
-  "libjpeg-ruby decoder object",     // wrap_struct_name
-  {                                 
-    rb_decoder_mark,                 // function.dmark
-    rb_decoder_free,                 // function.dfree
-    rb_decoder_size,                 // function.dsize
-    NULL,                            // function.dcompact
-    {NULL},                          // function.reserved
-  },                                
-  NULL,                              // parent
-  NULL,                              // data
-  (VALUE)RUBY_TYPED_FREE_IMMEDIATELY // flags
-};
-#else /* RUBY_API_VERSION_CODE > 20600 */
-static const rb_data_type_t jpeg_decoder_data_type = {
-  "libjpeg-ruby decoder object",     // wrap_struct_name
-  {                                 
-    rb_decoder_mark,                 // function.dmark
-    rb_decoder_free,                 // function.dfree
-    rb_decoder_size,                 // function.dsize
-    {NULL, NULL},                    // function.reserved
-  },                                
-  NULL,                              // parent
-  NULL,                              // data
-  (VALUE)RUBY_TYPED_FREE_IMMEDIATELY // flags
-};
-#endif /* RUBY_API_VERSION_CODE > 20600 */
-
-static VALUE
-rb_decoder_alloc(VALUE self)
+static void*
+encode_without_gvl(void* _ptr)
 {
-  jpeg_decode_t* ptr;
+  jpeg_encode_t* ptr;
 
-  ptr = ALLOC(jpeg_decode_t);
-  memset(ptr, 0, sizeof(*ptr));
+  /*
+   * initialize
+   */
+  ptr  = (jpeg_encode_t*)_ptr;
 
-  ptr->flags = DEFAULT_DECODE_FLAGS;
+  /*
+   * do encode
+   */
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_compress(&ptr->cinfo);
+    return ptr;
+  }
 
-  return TypedData_Wrap_Struct(decoder_klass, &jpeg_decoder_data_type, ptr);
-}
+  if (ptr->dest.str != Qnil) {
+    jpeg_str_dest(&ptr->cinfo, &ptr->dest);
+  } else {
+    jpeg_mem_dest(&ptr->cinfo, &ptr->buf.mem, &ptr->buf.size); 
+  }
 
-static VALUE
-eval_decoder_pixel_format_opt(jpeg_decode_t* ptr, VALUE opt)
-{
-  VALUE ret;
-  int format;
-  int color_space;
-  int components;
+  jpeg_start_compress(&ptr->cinfo, TRUE);
 
-  ret = Qnil;
+  if (ptr->orientation != 0) {
+    put_exif_tags(ptr);
+  }
 
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    format      = FMT_RGB;
-    color_space = JCS_RGB;
-    components  = 3;
-    break;
+  if (IS_PLANAR(ptr)) {
+    write_raw_rows(ptr);
+  } else {
+    write_scanlines(ptr, ptr->src, ptr->cinfo.image_height);
+  }
 
-  case T_STRING:
-  case T_SYMBOL:
-    if(EQ_STR(opt, "RGB") || EQ_STR(opt, "RGB24")) {
-      format      = FMT_RGB;
-      color_space = JCS_RGB;
-      components  = 3;
+  jpeg_finish_compress(&ptr->cinfo);
 
-    } else if (EQ_STR(opt, "YUV422") || EQ_STR(opt, "YUYV")) {
-      ret = create_not_implement_error( "not implemented colorspace");
+  return NULL;
+}
 
-    } else if (EQ_STR(opt, "RGB565")) {
-      ret = create_not_implement_error( "not implemented colorspace");
+/*
+ * ストライプ分割による並列エンコード
+ *
+ * 入力をSTRIPE_ROWS MCU行毎のストライプに分割し、各ストライプを単独の
+ * JPEGとしてワーカスレッドで圧縮する。リスタート区間をストライプの
+ * 大きさに合わせてあるので、各ストライプのエントロピー符号化データを
+ * RSTマーカーで繋ぐと、全体を逐次圧縮した場合と同一のデータになる。
+ * ヘッダは先頭ストライプのものをSOFの高さを書き換えて使用する。
+ */
 
-    } else if (EQ_STR(opt, "GRAYSCALE")) {
-      format      = FMT_GRAYSCALE;
-      color_space = JCS_GRAYSCALE;
-      components  = 1;
+typedef struct {
+  unsigned char* mem;
+  unsigned long size;
+  size_t head;
+} stripe_t;
 
-    } else if (EQ_STR(opt, "YUV444") || EQ_STR(opt, "YCbCr")) {
-      format      = FMT_YUV;
-      color_space = JCS_YCbCr;
-      components  = 3;
+typedef struct {
+  jpeg_encode_t* ptr;
+  stripe_t* stripe;
+  int nstripe;
+  int height;
+  int nworker;
 
-    } else if (EQ_STR(opt, "BGR") || EQ_STR(opt, "BGR24")) {
-      format      = FMT_BGR;
-      color_space = JCS_EXT_BGR;
-      components  = 3;
+  work_queue_t queue;
+} stripe_plan_t;
 
-    } else if (EQ_STR(opt, "YVU444") || EQ_STR(opt, "YCrCb")) {
-      format      = FMT_YVU;
-      color_space = JCS_YCbCr;
-      components  = 3;
+static size_t
+find_scan_data(uint8_t* p, size_t size, size_t* sof_pos)
+{
+  size_t pos;
+  size_t len;
+  int m;
 
-    } else if (EQ_STR(opt, "RGBX") || EQ_STR(opt, "RGB32")) {
-      format      = FMT_RGB32;
-      color_space = JCS_EXT_RGBX;
-      components  = 4;
+  pos = 2;
 
-    } else if (EQ_STR(opt, "BGRX") || EQ_STR(opt, "BGR32")) {
-      format      = FMT_BGR32;
-      color_space = JCS_EXT_BGRX;
-      components  = 4;
+  while (pos + 4 <= size && p[pos] == 0xff) {
+    m   = p[pos + 1];
+    len = (p[pos + 2] << 8) | p[pos + 3];
 
-    } else {
-      ret = create_argument_error("unsupportd :pixel_format option value");
-    }
-    break;
+    if (m >= 0xc0 && m <= 0xc2 && sof_pos != NULL) *sof_pos = pos + 5;
 
-  default:
-    ret = create_type_error("unsupportd :pixel_format option type");
-    break;
-  }
+    pos += len + 2;
 
-  if (!RTEST(ret)) {
-    ptr->format               = format;
-    ptr->out_color_space      = color_space;
-    ptr->out_color_components = components;
+    if (m == 0xda) return (pos <= size)? pos: 0;
   }
 
-  return ret;
+  return 0;
 }
 
-static VALUE
-eval_decoder_output_gamma_opt(jpeg_decode_t* ptr, VALUE opt)
+static void
+get_stripe_planes(jpeg_encode_t* ctx, plane_t* planes, int top)
 {
-  VALUE ret;
-  double gamma;
-
-  ret = Qnil;
-
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    gamma = 0.0;
-    break;
+  int vs;
+  int i;
 
-  case T_FIXNUM:
-  case T_FLOAT:
-    if (isnan(NUM2DBL(opt)) || isinf(NUM2DBL(opt))) {
-      ret = create_argument_error("unsupported :output_gamma value");
-    } else {
-      gamma = NUM2DBL(opt);
-    }
-    break;
+  for (i = 0; i < NUM_PLANES(ctx->format); i++) {
+    // 色差の行はYUV422P以外は縦方向も間引かれている
+    vs = (i == 0 || ctx->format == FMT_YUV422P)? 1: 2;
 
-  default:
-    ret = create_type_error("unsupported :output_gamma type");
-    break;
+    ctx->planes[i]         = planes[i];
+    ctx->planes[i].offset += (size_t)(top / vs) * planes[i].stride;
+    ctx->planes[i].height  = (ctx->height + vs - 1) / vs;
   }
-
-  if (!RTEST(ret)) ptr->output_gamma = gamma;
-
-  return ret;
 }
 
-static VALUE
-eval_decoder_do_fancy_upsampling_opt(jpeg_decode_t* ptr, VALUE opt)
+static void*
+encode_stripe_worker(void* _plan)
 {
-  if (opt != Qundef && RTEST(opt)) {
-    ptr->do_fancy_upsampling = TRUE;
-  } else {
-    ptr->do_fancy_upsampling = FALSE;
-  }
+  stripe_plan_t* plan;
+  stripe_t* stripe;
+  jpeg_encode_t ctx;
+  int i;
 
-  return Qnil;
-}
+  plan = (stripe_plan_t*)_plan;
 
-static VALUE
-eval_decoder_do_smoothing_opt(jpeg_decode_t* ptr, VALUE opt)
-{
-  if (opt != Qundef && RTEST(opt)) {
-    ptr->do_block_smoothing = TRUE;
-  } else {
-    ptr->do_block_smoothing = FALSE;
-  }
+  memcpy(&ctx, plan->ptr, sizeof(ctx));
 
-  return Qnil;
-}
+  ctx.data     = Qnil;
+  ctx.dest.str = Qnil;
+  ctx.array    = ALLOC_ARRAY();
+  ctx.rows     = ALLOC_ROWS(ctx.width, ctx.components);
 
-static VALUE
-eval_decoder_dither_opt( jpeg_decode_t* ptr, VALUE opt)
-{
-  VALUE ret;
-  VALUE tmp;
-  int mode;
-  int quant;
-  int pass2;
-  int ncol;
+  if (ctx.array == NULL || ctx.rows == NULL) goto out;
 
-  ret = Qnil;
+  for (i = 0; i < UNIT_LINES; i++) {
+    ctx.array[i] = ctx.rows + (i * ctx.width * ctx.components);
+  }
 
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    mode  = JDITHER_NONE;
-    quant = FALSE;
-    ncol  = 0;
-    pass2 = FALSE;
-    break;
+  while ((i = work_queue_fetch(&plan->queue)) >= 0) {
+    stripe = plan->stripe + i;
 
-  case T_ARRAY:
-    if (RARRAY_LEN(opt) != 3) {
-      ret = create_argument_error(":dither invalid size");
+    /*
+     * ストライプ毎に画像の高さが異なるのでコンテキストを作り直す
+     */
+    ctx.height = plan->height;
+    if (i == plan->nstripe - 1) ctx.height = plan->ptr->height - (i * plan->height);
 
-    } else do {
+    if (setjmp(ctx.err_mgr.jmpbuf)) {
       /*
-       * dither mode
+       * when failed to create compress object
        */
-      tmp = rb_ary_entry(opt, 0);
-      if (TYPE(tmp) != T_STRING && TYPE(tmp) != T_SYMBOL) {
-        ret = create_type_error("unsupported dither mode type");
-        break;
+      if (work_queue_fail(&plan->queue)) {
+        strcpy(plan->ptr->err_mgr.msg, ctx.err_mgr.msg);
+      }
+      break;
+    }
 
-      } else if (EQ_STR(tmp, "NONE")) {
-        mode  = JDITHER_NONE;
-        quant = FALSE;
+    create_compress(&ctx);
 
-      } else if(EQ_STR(tmp, "ORDERED")) {
-        mode  = JDITHER_ORDERED;
-        quant = TRUE;
+    if (IS_PLANAR(&ctx)) {
+      // 平面形式の場合はストライプの範囲を各プレーンの配置で表す
+      ctx.src = plan->ptr->src;
+      get_stripe_planes(&ctx, plan->ptr->planes, i * plan->height);
+    } else {
+      ctx.src = plan->ptr->src + ((size_t)i * plan->height * ctx.stride);
+    }
 
-      } else if(EQ_STR(tmp, "FS")) {
-        mode  = JDITHER_FS;
-        quant = TRUE;
+    ctx.buf.mem  = NULL;
+    ctx.buf.size = 0;
 
-      } else {
-        ret = create_argument_error("dither mode is illeagal value.");
-        break;
+    if (encode_without_gvl(&ctx) != NULL) {
+      if (work_queue_fail(&plan->queue)) {
+        strcpy(plan->ptr->err_mgr.msg, ctx.err_mgr.msg);
       }
 
-      /*
-       * 2 pass flag
-       */
-      pass2 = (RTEST(rb_ary_entry(opt, 1)))? TRUE: FALSE;
-
-      /*
-       * number of color
-       */
-      tmp = rb_ary_entry(opt, 2);
-      if (TYPE(tmp) != T_FIXNUM) {
-        ret = create_type_error("unsupported number of colors type");
-        break;
-
-      } else if (FIX2LONG(tmp) < 8) {
-        ret = create_range_error("number of colors less than 0");
-        break;
+    } else {
+      stripe->head = find_scan_data(ctx.buf.mem, ctx.buf.size, NULL);
 
-      } else if (FIX2LONG(tmp) > 256) {
-        ret = create_range_error("number of colors greater than 256");
-        break;
+      if (stripe->head == 0 || ctx.buf.size < stripe->head + 2) {
+        if (work_queue_fail(&plan->queue)) {
+          strcpy(plan->ptr->err_mgr.msg, "broken stripe data");
+        }
 
       } else {
-        ncol = FIX2INT(tmp); 
+        work_queue_done(&plan->queue);
       }
-    } while (0);
-    break;
-
-  default:
-    ret = create_type_error("unsupported :dither type");
-    break;
-  }
+    }
 
-  if (!RTEST(ret)) {
-    ptr->dither_mode              = mode;
-    ptr->quantize_colors          = quant;
-    ptr->two_pass_quantize        = pass2;
-    ptr->desired_number_of_colors = ncol;
+    stripe->mem  = ctx.buf.mem;
+    stripe->size = ctx.buf.size;
 
-    if (mode != JDITHER_NONE) SET_FLAG(ptr, F_DITHER);
+    jpeg_destroy_compress(&ctx.cinfo);
   }
 
-  return ret;
+ out:
+  if (ctx.array != NULL) free(ctx.array);
+  if (ctx.rows != NULL) free(ctx.rows);
+
+  return NULL;
 }
 
-#if 0
-static void
-eval_decoder_use_1pass_quantizer_opt(jpeg_decode_t* ptr, VALUE opt)
+static int
+join_stripes(stripe_plan_t* plan)
 {
-  if (opt != Qundef && RTEST(opt)) {
-    ptr->enable_1pass_quant = TRUE;
-  } else {
-    ptr->enable_1pass_quant = FALSE;
-  }
+  jpeg_encode_t* ptr;
+  stripe_t* stripe;
+  unsigned char* dst;
+  size_t sof_pos;
+  size_t size;
+  size_t len;
+  int i;
 
-  return Qnil;
-}
+  ptr     = plan->ptr;
+  sof_pos = 0;
 
-static VALUE
-eval_decoder_use_external_colormap_opt(jpeg_decode_t* ptr, VALUE opt)
-{
-  if (opt != Qundef && RTEST(opt)) {
-      ptr->enable_external_quant = TRUE;
-    } else {
-      ptr->enable_external_quant = FALSE;
-    }
-  }
+  find_scan_data(plan->stripe[0].mem, plan->stripe[0].size, &sof_pos);
+  if (sof_pos == 0) return -1;
 
-  return Qnil;
-}
+  /*
+   * 出力サイズの算出
+   */
+  size = plan->stripe[0].head + 2;
 
-static VALUE
-eval_decoder_use_2pass_quantizer_opt(jpeg_decode_t* ptr, VALUE opt)
-{
-  if (opt != Qundef && RTEST(opt)) {
-      ptr->enable_2pass_quant = TRUE;
-    } else {
-      ptr->enable_2pass_quant = FALSE;
-    }
+  for (i = 0; i < plan->nstripe; i++) {
+    stripe = plan->stripe + i;
+    size  += (stripe->size - stripe->head - 2) + ((i > 0)? 2: 0);
   }
 
-  return Qnil;
-}
-#endif
+  ptr->buf.mem = (unsigned char*)malloc(size);
+  if (ptr->buf.mem == NULL) return -1;
 
-static VALUE
-eval_decoder_without_meta_opt(jpeg_decode_t* ptr, VALUE opt)
-{
-  if (opt != Qundef && RTEST(opt)) {
-    CLR_FLAG(ptr, F_NEED_META);
-  } else {
-    SET_FLAG(ptr, F_NEED_META);
+  ptr->buf.size = size;
+
+  /*
+   * ヘッダ + ストライプ毎のデータ(RSTで区切る) + EOI
+   */
+  dst = ptr->buf.mem;
+
+  memcpy(dst, plan->stripe[0].mem, plan->stripe[0].head);
+  dst[sof_pos + 0] = (ptr->height >> 8) & 0xff;
+  dst[sof_pos + 1] = ptr->height & 0xff;
+  dst += plan->stripe[0].head;
+
+  for (i = 0; i < plan->nstripe; i++) {
+    stripe = plan->stripe + i;
+    len    = stripe->size - stripe->head - 2;
+
+    if (i > 0) {
+      *dst++ = 0xff;
+      *dst++ = 0xd0 + ((i - 1) & 7);
+    }
+
+    memcpy(dst, stripe->mem + stripe->head, len);
+    dst += len;
   }
 
-  return Qnil;
+  *dst++ = 0xff;
+  *dst++ = 0xd9;
+
+  return 0;
 }
 
-static VALUE
-eval_decoder_expand_colormap_opt(jpeg_decode_t* ptr, VALUE opt)
+static void
+plan_stripes(jpeg_encode_t* ptr, stripe_plan_t* plan)
 {
-  if (opt != Qundef && RTEST(opt)) {
-    SET_FLAG(ptr, F_EXPAND_COLORMAP);
-  } else {
-    CLR_FLAG(ptr, F_EXPAND_COLORMAP);
-  }
+  int mpr;
+  int mcu_height;
 
-  return Qnil;
-}
+  get_mcu_geometry(&ptr->cinfo, &mpr, &mcu_height);
 
+  plan->ptr     = ptr;
+  plan->height  = STRIPE_ROWS * mcu_height;
+  plan->nstripe = (ptr->height + plan->height - 1) / plan->height;
+  plan->nworker = (ptr->threads < plan->nstripe)? ptr->threads: plan->nstripe;
+}
 
-static VALUE
-eval_decoder_scale_opt(jpeg_decode_t* ptr, VALUE opt)
+static void*
+encode_stripes_without_gvl(void* _ptr)
 {
-  VALUE ret;
-  int scale_num;
-  int scale_denom;
+  jpeg_encode_t* ptr;
+  stripe_plan_t plan;
+  void* ret;
+  int i;
 
-  ret = Qnil;
+  ptr = (jpeg_encode_t*)_ptr;
 
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    scale_num   = 1;
-    scale_denom = 1;
-    break;
+  plan_stripes(ptr, &plan);
 
-  case T_FIXNUM:
-    if (FIX2LONG(opt) <= 0) {
-      ret = create_range_error(":scale less equal 0");
+  plan.stripe = (stripe_t*)calloc(plan.nstripe, sizeof(stripe_t));
+  if (plan.stripe == NULL) {
+    strcpy(ptr->err_mgr.msg, "no memory");
+    return ptr;
+  }
 
-    } else {
-      scale_num   = FIX2INT(opt) * 1000;
-      scale_denom = 1000;
-    }
-    break;
+  work_queue_init(&plan.queue, plan.nstripe);
+  run_workers(plan.nworker, encode_stripe_worker, &plan);
 
-  case T_FLOAT:
-    if (isnan(NUM2DBL(opt)) || isinf(NUM2DBL(opt))) {
-      ret = create_argument_error("unsupportd :quality option value");
-      
-    } else if (NUM2DBL(opt) <= 0.0) {
-      ret = create_range_error(":scale less equal 0");
+  if (plan.queue.failed) {
+    ret = ptr;
 
-    } else {
-      scale_num   = (int)(NUM2DBL(opt) * 1000.0);
-      scale_denom = 1000;
-    }
-    break;
+  } else if (plan.queue.done != plan.nstripe) {
+    strcpy(ptr->err_mgr.msg, "stripe encode worker failed");
+    ret = ptr;
 
-  case T_RATIONAL:
-    scale_num   = (int)FIX2LONG(rb_rational_num(opt));
-    scale_denom = (int)FIX2LONG(rb_rational_den(opt));
-    break;
+  } else if (join_stripes(&plan)) {
+    strcpy(ptr->err_mgr.msg, "no memory");
+    ret = ptr;
 
-  default:
-    ret = create_type_error("unsupportd :scale option type");
-    break;
+  } else {
+    ret = NULL;
   }
 
-  if (!RTEST(ret)) {
-    ptr->scale_num   = scale_num;
-    ptr->scale_denom = scale_denom;
+  for (i = 0; i < plan.nstripe; i++) {
+    if (plan.stripe[i].mem != NULL) free(plan.stripe[i].mem);
   }
 
+  work_queue_destroy(&plan.queue);
+  free(plan.stripe);
+
   return ret;
 }
 
 static VALUE
-eval_decoder_dct_method_opt(jpeg_decode_t* ptr, VALUE opt)
+do_encode(VALUE _ptr)
 {
   VALUE ret;
-  int dct_method;
+  jpeg_encode_t* ptr;
+  stripe_plan_t plan;
+  void* err;
 
-  ret = Qnil;
+  /*
+   * initialize
+   */
+  ret      = Qnil;
+  ptr      = (jpeg_encode_t*)_ptr;
+  ptr->src = (uint8_t*)RSTRING_PTR(ptr->data);
 
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    dct_method = JDCT_FASTEST;
-    break;
+  plan_stripes(ptr, &plan);
 
-  case T_STRING:
-  case T_SYMBOL:
-    if (EQ_STR(opt, "FASTEST")) {
-      dct_method = JDCT_FASTEST;
+  /*
+   * do encode
+   *
+   * libjpegのエラーはlongjmpで通知されるため、GVL解放中に
+   * rb_raise()を呼ぶことはできない。GVLを再取得した後に
+   * 例外に変換する。
+   */
+  if (plan.nworker > 1) {
+    // ストライプの連結結果はmallocしたバッファで返される
+    err = rb_thread_call_without_gvl(encode_stripes_without_gvl,
+                                     ptr, NULL, NULL);
+    if (err != NULL) {
+      rb_raise(encerr_klass, "%s", ptr->err_mgr.msg);
+    }
 
-    } else if (EQ_STR(opt, "ISLOW")) {
-      dct_method = JDCT_ISLOW;
+    ret = rb_str_new((char*)ptr->buf.mem, ptr->buf.size);
 
-    } else if (EQ_STR(opt, "IFAST")) {
-      dct_method = JDCT_IFAST;
+  } else {
+    /*
+     * 出力先の文字列に直接書き出す(分割しない場合もリスタート区間は
+     * 同じなので、ストライプ分割時と同一の出力となる)
+     */
+    ret           = rb_str_buf_new(estimate_output_size(ptr));
+    ptr->dest.str = ret;
 
-    } else if (EQ_STR(opt, "FLOAT")) {
-      dct_method = JDCT_FLOAT;
+    err = rb_thread_call_without_gvl(encode_without_gvl, ptr, NULL, NULL);
 
-    } else {
-      ret = create_argument_error("unsupportd :dct_method option value");
+    ptr->dest.str = Qnil;
+
+    if (err != NULL) {
+      rb_raise(encerr_klass, "%s", ptr->err_mgr.msg);
     }
-    break;
 
-  default:
-    ret = create_type_error("unsupportd :dct_method option type");
-    break;
+    rb_str_resize(ret, ptr->dest.size);
   }
 
-  if (!RTEST(ret)) ptr->dct_method = dct_method;
+  RB_GC_GUARD(ret);
 
   return ret;
 }
 
+/**
+ * encode data
+ *
+ * @overload encode(raw)
+ *
+ *   @param raw [String]  raw image data to encode.
+ *
+ *   @return [String] encoded JPEG data.
+ */
 static VALUE
-eval_decoder_with_exif_tags_opt(jpeg_decode_t* ptr, VALUE opt)
+rb_encoder_encode(VALUE self, VALUE data)
 {
-  if (opt != Qundef && RTEST(opt)) {
-    SET_FLAG(ptr, F_PARSE_EXIF);
-  } else {
-    CLR_FLAG(ptr, F_PARSE_EXIF);
-  }
+  VALUE ret;
+  int state;
+  jpeg_encode_t* ptr;
 
-  return Qnil;
-}
+  /*
+   * initialize
+   */
+  ret   = Qnil;
+  state = 0;
 
-static VALUE
-eval_decoder_orientation_opt(jpeg_decode_t* ptr, VALUE opt)
-{
-  if (opt != Qundef && RTEST(opt)) {
-    SET_FLAG(ptr, F_APPLY_ORIENTATION);
-  } else {
-    CLR_FLAG(ptr, F_APPLY_ORIENTATION);
+  TypedData_Get_Struct(self, jpeg_encode_t, &jpeg_encoder_data_type, ptr);
+
+  /*
+   * argument check
+   */
+  Check_Type(data, T_STRING);
+
+  if (ptr->data != Qnil || TEST_FLAG(ptr, F_SESSION)) {
+    RUNTIME_ERROR("encoder is busy");
   }
 
-  return Qnil;
-}
+  if (RSTRING_LEN(data) < ptr->data_size) {
+    ARGUMENT_ERROR("image data is too short");
+  }
 
-static VALUE
-set_decoder_context( jpeg_decode_t* ptr, VALUE opt)
-{
-  VALUE ret;
-  VALUE opts[N(decoder_opts_ids)];
-  JSAMPARRAY ary;
+  if (RSTRING_LEN(data) > ptr->data_size) {
+    ARGUMENT_ERROR("image data is too large");
+  }
 
   /*
-   * initialize
+   * prepare
    */
-  ret = Qnil;
-  ary = NULL;
+  SET_DATA(ptr, rb_str_new_frozen(data));
 
   /*
-   * parse options
+   * do encode
    */
-  do {
-    rb_get_kwargs(opt, decoder_opts_ids, 0, N(decoder_opts_ids), opts);
+  ret = rb_protect(do_encode, (VALUE)ptr, &state);
 
-    /*
-     * set context
-     */
-    ret = eval_decoder_pixel_format_opt(ptr, opts[0]);
-    if (RTEST(ret)) break;
+  /*
+   * post process
+   */
+  CLR_DATA(ptr);
 
-    ret = eval_decoder_output_gamma_opt(ptr, opts[1]);
-    if (RTEST(ret)) break;
+  if (ptr->buf.mem != NULL) {
+    free(ptr->buf.mem);
 
-    ret = eval_decoder_do_fancy_upsampling_opt(ptr, opts[2]);
-    if (RTEST(ret)) break;
+    ptr->buf.mem  = NULL;
+    ptr->buf.size = 0;
+  }
 
-    ret = eval_decoder_do_smoothing_opt(ptr, opts[3]);
-    if (RTEST(ret)) break;
+  if (state != 0) rb_jump_tag(state);
 
-    ret = eval_decoder_dither_opt(ptr, opts[4]);
-    if (RTEST(ret)) break;
+  return ret;
+}
 
-#if 0
-    ret = eval_decoder_use_1pass_quantizer_opt(ptr, opts[5]);
-    if (RTEST(ret)) break;
+/*
+ * 行単位の逐次エンコード (start/write_rows/finish)
+ *
+ * jpeg_start_compress()からjpeg_finish_compress()までの間、圧縮の状態
+ * をレシーバに保持したままにする。出力はdest.strに直接書き出される。
+ * 入力は呼び出し毎に渡された行だけを参照するので、フレーム全体を保持
+ * する必要はない。
+ */
 
-    ret = eval_decoder_use_external_colormap_opt(ptr, opts[6]);
-    if (RTEST(ret)) break;
+static void*
+session_start_without_gvl(void* _ptr)
+{
+  jpeg_encode_t* volatile ptr;     // setjmp()を跨いで参照するのでvolatile
 
-    ret = eval_decoder_use_2pass_quantizer_opt(ptr, opts[7]);
-    if (RTEST(ret)) break;
-#endif
+  ptr = (jpeg_encode_t*)_ptr;
 
-    ret = eval_decoder_without_meta_opt(ptr, opts[5]);
-    if (RTEST(ret)) break;
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_compress(&ptr->cinfo);
+    return ptr;
+  }
 
-    ret = eval_decoder_expand_colormap_opt(ptr, opts[6]);
-    if (RTEST(ret)) break;
+  jpeg_str_dest(&ptr->cinfo, &ptr->dest);
+  jpeg_start_compress(&ptr->cinfo, TRUE);
 
-    ret = eval_decoder_scale_opt(ptr, opts[7]);
-    if (RTEST(ret)) break;
+  if (ptr->orientation != 0) {
+    put_exif_tags(ptr);
+  }
 
-    ret = eval_decoder_dct_method_opt(ptr, opts[8]);
-    if (RTEST(ret)) break;
+  return NULL;
+}
 
-    ret = eval_decoder_with_exif_tags_opt(ptr, opts[9]);
-    if (RTEST(ret)) break;
+static void*
+session_write_without_gvl(void* _ptr)
+{
+  jpeg_encode_t* volatile ptr;
 
-    ret = eval_decoder_orientation_opt(ptr, opts[10]);
-    if (RTEST(ret)) break;
-  } while (0);
+  ptr = (jpeg_encode_t*)_ptr;
 
-  /*
-   * alloc memory
-   */
-  if (!RTEST(ret)) {
-    ary = ALLOC_ARRAY();
-    if (ary == NULL) ret = create_memory_error();
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_compress(&ptr->cinfo);
+    return ptr;
   }
 
-  /*
-   * set the rest context parameter
-   */
-  if (!RTEST(ret)) {
-    ptr->err_mgr.jerr.output_message = output_message;
-    ptr->err_mgr.jerr.emit_message   = emit_message;
-    ptr->err_mgr.jerr.error_exit     = error_exit;
+  write_scanlines(ptr, ptr->src, RSTRING_LEN(ptr->data) / ptr->stride);
 
-    // 現時点でオプションでの対応をおこなっていないので
-    // ここで値を設定
-    ptr->enable_1pass_quant    = FALSE;
-    ptr->enable_external_quant = FALSE;
-    ptr->enable_2pass_quant    = FALSE;
-    ptr->buffered_image        = FALSE;
+  return NULL;
+}
 
-#if 0
-    if (ptr->enable_1pass_quant == TRUE ||
-        ptr->enable_external_quant == TRUE ||
-        ptr->enable_2pass_quant == TRUE) {
-      ptr->buffered_image = TRUE;
+static void*
+session_finish_without_gvl(void* _ptr)
+{
+  jpeg_encode_t* volatile ptr;
 
-    } else {
-      ptr->buffered_image = FALSE;
-    }
-#endif
+  ptr = (jpeg_encode_t*)_ptr;
 
-    ptr->array             = ary;
-    ptr->data              = Qnil;
-    ptr->orientation.value = 0;
-    ptr->orientation.buf   = Qnil;
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_compress(&ptr->cinfo);
+    return ptr;
   }
 
+  jpeg_finish_compress(&ptr->cinfo);
+
+  return NULL;
+}
+
+static void
+call_session_without_gvl(jpeg_encode_t* ptr, void* (*func)(void*))
+{
   /*
-   * setup libjpeg
+   * エラー時は圧縮処理は中断されているので、セッションも終了させる
    */
-  if (!RTEST(ret)) {
-    jpeg_create_decompress(&ptr->cinfo);
-    SET_FLAG(ptr, F_CREAT);
+  if (rb_thread_call_without_gvl(func, ptr, NULL, NULL) != NULL) {
+    CLR_FLAG(ptr, F_SESSION);
+    ptr->dest.str = Qnil;
 
-    ptr->cinfo.err = jpeg_std_error(&ptr->err_mgr.jerr);
+    rb_raise(encerr_klass, "%s", ptr->err_mgr.msg);
   }
-
-  return ret;
 }
 
 /**
- * initialize decoder object
- *
- * @overload initialize(opts)
- *
- *   @param opts [Hash] options to initialize object
- *
- *   @option opts [Symbol] :pixel_format
- *     specifies the format of the output image. possible values are:
- *     YUV422 YUYV RGB565 RGB RGB24 BGR BGR24 YUV444 YCbCr
- *     RGBX RGB32 BGRX BGR32 GRAYSCALE
- *
- *   @option opts [Float] :output_gamma
- *
- *   @option opts [Boolean] :fancy_upsampling
- *
- *   @option opts [Boolean] :do_smoothing
- *
- *   @option opts [Array] :dither
- *     specifies dithering parameters. A 3-elements array.
- *     specify the dither type as a string for the 1st element,
- *     whether to use 2-pass quantize for the 2nd element as a boolean,
- *     and the number of colors used for the 3rd element as an integer
- *     from 16 to 256.
- *
- *   @option opts [Boolean] :without_meta
- *     specifies whether or not to include meta information in the
- *     output data. If true, no meta-information is output.
- *
- *   @option opts [Boolean] :expand_colormap
- *     specifies whether to expand the color map. If dither is specified,
- *     the output will be a color number of 1 byte per pixel, but if this
- *     option is set to true, the output will be expanded to color information.
- *
- *   @option opts [Ratioanl] :scale
- *
- *   @option opts [Symbol] :dct_method
- *     specifies how decoding is handled. possible values are:
- *     FASTEST ISLOW IFAST FLOAT
+ * start incremental encoding
  *
- *   @option opts [Boolean] :with_exif_tags
- *     specifies whether to include Exif tag information in the output data.
- *     set this option to true to parse the Exif tag information and include
- *     it in the meta information output.
+ * @return [JPEG::Encoder]  self
  *
- *   @option opts [Boolean] :with_exif
- *     alias to :with_exif_tags option.
+ * @note after calling this method, give the image rows with
+ *   {#write_rows} from the top of the image, and get the encoded
+ *   data with {#finish}. {#encode} can't be used until the session
+ *   is finished or canceled.
  */
 static VALUE
-rb_decoder_initialize( int argc, VALUE *argv, VALUE self)
+rb_encoder_start(VALUE self)
 {
-  jpeg_decode_t* ptr;
-  VALUE exc;
-  VALUE opt;
+  jpeg_encode_t* ptr;
 
-  /*
-   * initialize
-   */
-  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
+  TypedData_Get_Struct(self, jpeg_encode_t, &jpeg_encoder_data_type, ptr);
 
   /*
-   * parse arguments
+   * argument check
    */
-  rb_scan_args( argc, argv, "0:", &opt);
+  if (IS_PLANAR(ptr)) {
+    NOT_IMPLEMENTED_ERROR("session is not supported with planar format");
+  }
 
-  /*
-   * set context
-   */ 
-  exc = set_decoder_context(ptr, opt);
+  if (ptr->data != Qnil || TEST_FLAG(ptr, F_SESSION)) {
+    RUNTIME_ERROR("encoder is busy");
+  }
 
   /*
-   * post process
+   * do start
    */
-  if (RTEST(exc)) rb_exc_raise(exc);
+  ptr->dest.str = rb_str_buf_new(estimate_output_size(ptr));
+  SET_FLAG(ptr, F_SESSION);
 
-  return Qtrue;
+  call_session_without_gvl(ptr, session_start_without_gvl);
+
+  return self;
 }
 
+/**
+ * write image rows to the encoding session
+ *
+ * @overload write_rows(raw)
+ *
+ *   @param raw [String]  raw image data of one or more rows. the size
+ *     must be a multiple of the stride.
+ *
+ *   @return [Integer]  number of rows to be written yet.
+ */
 static VALUE
-rb_decoder_set(VALUE self, VALUE opt)
+rb_encoder_write_rows(VALUE self, VALUE data)
 {
-  jpeg_decode_t* ptr;
-  VALUE exc;
+  jpeg_encode_t* ptr;
+  long nrow;
+  void* err;
+
+  TypedData_Get_Struct(self, jpeg_encode_t, &jpeg_encoder_data_type, ptr);
 
   /*
-   * initialize
+   * argument check
    */
-  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
+  Check_Type(data, T_STRING);
+
+  if (!TEST_FLAG(ptr, F_SESSION)) {
+    RUNTIME_ERROR("encoding session is not started");
+  }
+
+  if (ptr->data != Qnil) {
+    RUNTIME_ERROR("encoder is busy");
+  }
+
+  if (RSTRING_LEN(data) % ptr->stride != 0) {
+    ARGUMENT_ERROR("image data is not a multiple of the stride");
+  }
+
+  nrow = RSTRING_LEN(data) / ptr->stride;
+
+  if (nrow > (long)(ptr->cinfo.image_height - ptr->cinfo.next_scanline)) {
+    ARGUMENT_ERROR("image data is too large");
+  }
 
   /*
-   * check argument
+   * do write
    */
-  Check_Type(opt, T_HASH);
+  SET_DATA(ptr, rb_str_new_frozen(data));
+  ptr->src = (uint8_t*)RSTRING_PTR(ptr->data);
 
-  /*
-   * set context
-   */ 
-  exc = set_decoder_context(ptr, opt);
+  err = rb_thread_call_without_gvl(session_write_without_gvl, ptr, NULL, NULL);
 
   /*
    * post process
    */
-  if (RTEST(exc)) rb_exc_raise(exc);
+  CLR_DATA(ptr);
 
-  return Qtrue;
+  if (err != NULL) {
+    CLR_FLAG(ptr, F_SESSION);
+    ptr->dest.str = Qnil;
+
+    rb_raise(encerr_klass, "%s", ptr->err_mgr.msg);
+  }
+
+  return INT2FIX(ptr->cinfo.image_height - ptr->cinfo.next_scanline);
 }
 
+/**
+ * finish the encoding session
+ *
+ * @return [String]  encoded JPEG data.
+ */
 static VALUE
-get_colorspace_str( J_COLOR_SPACE cs)
+rb_encoder_finish(VALUE self)
 {
-  const char* cstr;
-
-  switch (cs) {
-  case JCS_GRAYSCALE:
-    cstr = "GRAYSCALE";
-    break;
+  VALUE ret;
+  jpeg_encode_t* ptr;
 
-  case JCS_RGB:
-    cstr = "RGB";
-    break;
+  TypedData_Get_Struct(self, jpeg_encode_t, &jpeg_encoder_data_type, ptr);
 
-  case JCS_YCbCr:
-    cstr = "YCbCr";
-    break;
+  /*
+   * argument check
+   */
+  if (!TEST_FLAG(ptr, F_SESSION)) {
+    RUNTIME_ERROR("encoding session is not started");
+  }
 
-  case JCS_CMYK:
-    cstr = "CMYK";
-    break;
+  if (ptr->data != Qnil) {
+    RUNTIME_ERROR("encoder is busy");
+  }
 
-  case JCS_YCCK:
-    cstr = "YCCK";
-    break;
-#if JPEG_LIB_VERSION < 90
-  case JCS_EXT_RGB:
-    cstr = "RGB";
-    break;
+  if (ptr->cinfo.next_scanline < ptr->cinfo.image_height) {
+    RUNTIME_ERROR("not all rows have been written");
+  }
 
-  case JCS_EXT_RGBX:
-    cstr = "RGBX";
-    break;
+  /*
+   * do finish
+   */
+  call_session_without_gvl(ptr, session_finish_without_gvl);
 
-  case JCS_EXT_BGR:
-    cstr = "BGR";
-    break;
+  /*
+   * post process
+   */
+  ret = ptr->dest.str;
 
-  case JCS_EXT_BGRX:
-    cstr = "BGRX";
-    break;
+  CLR_FLAG(ptr, F_SESSION);
+  ptr->dest.str = Qnil;
 
-  case JCS_EXT_XBGR:
-    cstr = "XBGR";
-    break;
+  rb_str_resize(ret, ptr->dest.size);
 
-  case JCS_EXT_XRGB:
-    cstr = "XRGB";
-    break;
+  return ret;
+}
 
-  case JCS_EXT_RGBA:
-    cstr = "RGBA";
-    break;
+/**
+ * cancel the encoding session
+ *
+ * @return [JPEG::Encoder]  self
+ */
+static VALUE
+rb_encoder_cancel(VALUE self)
+{
+  jpeg_encode_t* ptr;
 
-  case JCS_EXT_BGRA:
-    cstr = "BGRA";
-    break;
+  TypedData_Get_Struct(self, jpeg_encode_t, &jpeg_encoder_data_type, ptr);
 
-  case JCS_EXT_ABGR:
-    cstr = "ABGR";
-    break;
+  if (ptr->data != Qnil) {
+    RUNTIME_ERROR("encoder is busy");
+  }
 
-  case JCS_EXT_ARGB:
-    cstr = "ARGB";
-    break;
-#endif /* JPEG_LIB_VERSION < 90 */
+  if (TEST_FLAG(ptr, F_SESSION)) {
+    jpeg_abort_compress(&ptr->cinfo);
 
-  default:
-    cstr = "UNKNOWN";
-    break;
+    CLR_FLAG(ptr, F_SESSION);
+    ptr->dest.str = Qnil;
   }
 
-  return rb_str_freeze(rb_str_new_cstr(cstr));
+  return self;
 }
 
 typedef struct {
-  int be;
-  uint8_t* head;
-  uint8_t* cur;
-  size_t size;
+  uint8_t* data;
+  int status;
 
-  struct {
-    tag_entry_t* tbl;
-    size_t n;
-  } tags;
+  unsigned char* mem;
+  unsigned long size;
 
-  int next;
-} exif_t;
+  char msg[JMSG_LENGTH_MAX+10];
+} encode_item_t;
 
-static uint16_t
-get_u16(uint8_t* src, int be)
+typedef struct {
+  jpeg_encode_t* ptr;
+  encode_item_t* items;
+  int nworker;
+  int cur;
+  work_queue_t queue;
+} encode_batch_t;
+
+static void*
+encode_batch_worker(void* _batch)
 {
-  uint16_t ret;
+  encode_batch_t* batch;
+  encode_item_t* item;
+  jpeg_encode_t ctx;
+  int i;
 
-  if (be) {
-    ret = (((src[0] << 8) & 0xff00)|
-           ((src[1] << 0) & 0x00ff));
-  } else {
-    ret = (((src[1] << 8) & 0xff00)|
-           ((src[0] << 0) & 0x00ff));
+  /*
+   * ワーカ毎にレシーバの設定を複製したjpeg_compress_structを持つ
+   */
+  batch     = (encode_batch_t*)_batch;
+
+  memcpy(&ctx, batch->ptr, sizeof(ctx));
+
+  ctx.data     = Qnil;
+  ctx.dest.str = Qnil;
+  ctx.array    = ALLOC_ARRAY();
+  ctx.rows     = ALLOC_ROWS(ctx.width, ctx.components);
+
+  if (ctx.array == NULL || ctx.rows == NULL) goto out;
+
+  for (i = 0; i < UNIT_LINES; i++) {
+    ctx.array[i] = ctx.rows + (i * ctx.width * ctx.components);
   }
 
-  return ret;
-}
+  if (setjmp(ctx.err_mgr.jmpbuf)) {
+    /*
+     * when failed to create compress object
+     */
+    goto out;
+  }
 
-/*
-static int16_t
-get_s16(uint8_t* src, int be)
-{
-  int16_t ret;
+  create_compress(&ctx);
 
-  if (be) {
-    ret = (((src[0] << 8) & 0xff00)|
-           ((src[1] << 0) & 0x00ff));
-  } else {
-    ret = (((src[1] << 8) & 0xff00)|
-           ((src[0] << 0) & 0x00ff));
+  while ((i = work_queue_fetch(&batch->queue)) >= 0) {
+    item = batch->items + i;
+    if (item->status != ITEM_PENDING) continue;
+
+    ctx.src      = item->data;
+    ctx.buf.mem  = NULL;
+    ctx.buf.size = 0;
+
+    if (encode_without_gvl(&ctx) != NULL) {
+      if (ctx.buf.mem != NULL) free(ctx.buf.mem);
+
+      strcpy(item->msg, ctx.err_mgr.msg);
+      item->status = ITEM_ERROR;
+      continue;
+    }
+
+    item->mem    = ctx.buf.mem;
+    item->size   = ctx.buf.size;
+    item->status = ITEM_DONE;
   }
 
-  return ret;
+  jpeg_destroy_compress(&ctx.cinfo);
+
+ out:
+  if (ctx.array != NULL) free(ctx.array);
+  if (ctx.rows != NULL) free(ctx.rows);
+
+  return NULL;
 }
-*/
 
-static uint32_t
-get_u32(uint8_t* src, int be)
+static void*
+run_encode_batch(void* _batch)
 {
-  uint32_t ret;
+  encode_batch_t* batch;
 
-  if (be) {
-    ret = (((src[0] << 24) & 0xff000000)|
-           ((src[1] << 16) & 0x00ff0000)|
-           ((src[2] <<  8) & 0x0000ff00)|
-           ((src[3] <<  0) & 0x000000ff));
-  } else {
-    ret = (((src[3] << 24) & 0xff000000)|
-           ((src[2] << 16) & 0x00ff0000)|
-           ((src[1] <<  8) & 0x0000ff00)|
-           ((src[0] <<  0) & 0x000000ff));
-  }
+  batch = (encode_batch_t*)_batch;
+  run_workers(batch->nworker, encode_batch_worker, batch);
 
-  return ret;
+  return NULL;
 }
 
-static int32_t
-get_s32(uint8_t* src, int be)
+static VALUE
+build_encode_batch_result(VALUE _batch)
 {
-  int32_t ret;
+  VALUE ret;
+  encode_batch_t* batch;
+  encode_item_t* item;
 
-  if (be) {
-    ret = (((src[0] << 24) & 0xff000000)|
-           ((src[1] << 16) & 0x00ff0000)|
-           ((src[2] <<  8) & 0x0000ff00)|
-           ((src[3] <<  0) & 0x000000ff));
-  } else {
-    ret = (((src[3] << 24) & 0xff000000)|
-           ((src[2] << 16) & 0x00ff0000)|
-           ((src[1] <<  8) & 0x0000ff00)|
-           ((src[0] <<  0) & 0x000000ff));
+  batch = (encode_batch_t*)_batch;
+  item  = batch->items + batch->cur;
+
+  switch (item->status) {
+  case ITEM_DONE:
+    ret = rb_str_new((char*)item->mem, item->size);
+    break;
+
+  case ITEM_ERROR:
+    ret = rb_exc_new_cstr(encerr_klass, item->msg);
+    break;
+
+  case ITEM_INVALID:
+    ret = rb_exc_new_cstr(rb_eArgError, item->msg);
+    break;
+
+  default:
+    ret = rb_exc_new_cstr(encerr_klass, "not processed");
+    break;
   }
 
   return ret;
 }
 
-static void
-exif_increase(exif_t* ptr, size_t size)
+/**
+ * encode multiple raw images
+ *
+ * @overload encode_batch(list, threads: nil)
+ *
+ *   @param list [Array<String>]  raw image data to encode. each element
+ *     must have the same geometry as the receiver.
+ *
+ *   @param threads [Integer, Boolean]  number of native worker threads.
+ *     true or omitted uses the number of online CPUs, and false or nil
+ *     uses a single worker.
+ *
+ *   @return [Array<String, Exception>] encoded JPEG data in the same order
+ *     as the input. an item that could not be encoded is replaced by the
+ *     exception object describing the failure.
+ *
+ *   @note  the call can be interrupted (e.g. Thread#kill or Ctrl-C).
+ *     items not started yet are abandoned and the interrupt is handled
+ *     once the running items are finished.
+ */
+static VALUE
+rb_encoder_encode_batch(int argc, VALUE* argv, VALUE self)
 {
-  ptr->cur  += size;
-  ptr->size -= size;
-}
+  VALUE ret;
+  VALUE list;
+  VALUE opt;
+  VALUE srcs;
+  VALUE src;
+  VALUE val;
+  jpeg_encode_t* ptr;
+  encode_batch_t batch;
+  int state;
+  int n;
+  int i;
 
-static void
-exif_init(exif_t* ptr, uint8_t* src, size_t size)
-{
-  int be;
-  uint16_t ident;
-  uint32_t off;
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_encode_t, &jpeg_encoder_data_type, ptr);
 
   /*
-   * Check Exif identifier
+   * parse arguments
    */
-  if (memcmp(src, "Exif\0\0", 6)) {
-    rb_raise(decerr_klass, "invalid exif identifier");
-  }
+  rb_scan_args(argc, argv, "1:", &list, &opt);
 
   /*
-   * Check TIFF header and judge endian
+   * argument check
    */
-  do {
-    if (!memcmp(src + 6, "MM", 2)) {
-      be = !0;
-      break;
-    }
+  Check_Type(list, T_ARRAY);
 
-    if (!memcmp(src + 6, "II", 2)) {
-      be = 0;
-      break;
-    }
+  n = (int)RARRAY_LEN(list);
 
-    rb_raise(decerr_klass, "invalid tiff header");
-  } while (0);
+  for (i = 0; i < n; i++) {
+    Check_Type(RARRAY_AREF(list, i), T_STRING);
+  }
+
+  if (ptr->data != Qnil || TEST_FLAG(ptr, F_SESSION)) {
+    RUNTIME_ERROR("encoder is busy");
+  }
 
   /*
-   * Check TIFF identifier
+   * prepare
    */
-  ident = get_u16(src + 8, be);
-  if (ident != 0x002a) {
-    rb_raise(decerr_klass, "invalid tiff identifier");
+  batch.ptr     = ptr;
+  batch.nworker = eval_threads_opt(opt, n);
+  batch.items   = ALLOC_N(encode_item_t, n);
+  srcs          = rb_ary_new_capa(n);
+
+  memset(batch.items, 0, sizeof(encode_item_t) * n);
+
+  for (i = 0; i < n; i++) {
+    src = rb_str_new_frozen(RARRAY_AREF(list, i));
+    rb_ary_push(srcs, src);
+
+    batch.items[i].data = (uint8_t*)RSTRING_PTR(src);
+
+    if (RSTRING_LEN(src) < ptr->data_size) {
+      strcpy(batch.items[i].msg, "image data is too short");
+      batch.items[i].status = ITEM_INVALID;
+
+    } else if (RSTRING_LEN(src) > ptr->data_size) {
+      strcpy(batch.items[i].msg, "image data is too large");
+      batch.items[i].status = ITEM_INVALID;
+    }
   }
 
+  work_queue_init(&batch.queue, n);
+  SET_DATA(ptr, srcs);
+
   /*
-   * get offset for 0th IFD
+   * do encode
+   *
+   * 割り込み(Ctrl-CやThread#kill)はUBFでキューを打ち切らせ、後始末を
+   * 終えてから処理する
    */
-  off = get_u32(src + 10, be);
-  if (off < 8 || off >= size - 6) {
-    rb_raise(decerr_klass, "invalid offset dentifier");
-  }
+  rb_thread_call_without_gvl2(run_encode_batch, &batch,
+                              cancel_work_queue, &batch.queue);
 
   /*
-   * initialize Exif context
+   * build return data
    */
-  ptr->be       = be;
-  ptr->head     = src + 6;
-  ptr->cur      = ptr->head + off;
-  ptr->size     = size - (6 + off);
-  ptr->tags.tbl = tag_tiff;
-  ptr->tags.n   = N(tag_tiff);
-  ptr->next     = 0;
-}
+  ret   = rb_ary_new_capa(n);
+  state = 0;
 
-static void
-exif_fetch_tag_header(exif_t* ptr, uint16_t* tag, uint16_t* type)
-{
-  *tag  = get_u16(ptr->cur + 0, ptr->be);
-  *type = get_u16(ptr->cur + 2, ptr->be);
-}
+  for (i = 0; i < n; i++) {
+    batch.cur = i;
 
+    if (state == 0) {
+      val = rb_protect(build_encode_batch_result, (VALUE)&batch, &state);
+      if (state == 0) rb_ary_push(ret, val);
+    }
 
-static void
-exif_fetch_byte_data(exif_t* ptr, VALUE* dst)
-{
-  VALUE obj;
+    if (batch.items[i].mem != NULL) free(batch.items[i].mem);
+  }
 
-  int i;
-  uint32_t n;
-  uint8_t* p;
+  /*
+   * post process
+   */
+  CLR_DATA(ptr);
+  work_queue_destroy(&batch.queue);
+  xfree(batch.items);
 
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->cur + 8;
+  if (state != 0) rb_jump_tag(state);
 
-  switch (n) {
-  case 0:
-    obj = Qnil;
-    break;
+  rb_thread_check_ints();
 
-  case 1:
-    obj = INT2FIX(*p);
-    break;
+  RB_GC_GUARD(srcs);
 
-  default:
-    p = ptr->head + get_u32(p, ptr->be);
+  return ret;
+}
 
-  case 2:
-  case 3:
-  case 4:
-    obj = rb_ary_new_capa(n);
-    for (i = 0; i < (int)n; i++) {
-      rb_ary_push(obj, INT2FIX(p[i]));
-    }
+static void
+rb_decoder_mark(void* _ptr)
+{
+  jpeg_decode_t* ptr;
 
-    rb_ary_freeze(obj);
-    break;
+  ptr = (jpeg_decode_t*)_ptr; 
+
+  if (ptr->data != Qnil) {
+    mark_pinned(ptr->data);
   }
 
-  *dst = obj;
+  if (ptr->into != Qnil) {
+    rb_gc_mark(ptr->into);
+  }
 }
 
 static void
-exif_fetch_ascii_data(exif_t* ptr, VALUE* dst)
+rb_decoder_free(void* _ptr)
 {
-  VALUE obj;
-
-  uint32_t n;
-  uint8_t* p;
+  jpeg_decode_t* ptr;
 
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->cur + 8;
+  ptr = (jpeg_decode_t*)_ptr;
 
-  if (n > 4) {
-    p = ptr->head + get_u32(p, ptr->be);
+  if (ptr->array != NULL) {
+    free(ptr->array);
   }
 
-  obj = rb_utf8_str_new((char*)p, n);
-  rb_funcall(obj, rb_intern("strip!"), 0);
-  rb_str_freeze(obj);
+  ptr->data = Qnil;
+  ptr->into = Qnil;
 
-  *dst = obj;
+  if (TEST_FLAG(ptr, F_CREAT)) {
+    jpeg_destroy_decompress(&ptr->cinfo);
+  }
+
+  free(ptr);
 }
 
-static void
-exif_fetch_short_data(exif_t* ptr, VALUE* dst)
+static size_t
+rb_decoder_size(const void* ptr)
 {
-  VALUE obj;
+  size_t ret;
 
-  int i;
-  uint32_t n;
-  uint8_t* p;
+  ret  = sizeof(jpeg_decode_t);
 
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->cur + 8;
+  return ret;
+}
 
-  switch (n) {
-  case 0:
-    obj = Qnil;
+#if RUBY_API_VERSION_CODE > 20600
+static const rb_data_type_t jpeg_decoder_data_type = {
+  "libjpeg-ruby decoder object",     // wrap_struct_name
+  {                                 
+    rb_decoder_mark,                 // function.dmark
+    rb_decoder_free,                 // function.dfree
+    rb_decoder_size,                 // function.dsize
+    NULL,                            // function.dcompact
+    {NULL},                          // function.reserved
+  },                                
+  NULL,                              // parent
+  NULL,                              // data
+  (VALUE)RUBY_TYPED_FREE_IMMEDIATELY // flags
+};
+#else /* RUBY_API_VERSION_CODE > 20600 */
+static const rb_data_type_t jpeg_decoder_data_type = {
+  "libjpeg-ruby decoder object",     // wrap_struct_name
+  {                                 
+    rb_decoder_mark,                 // function.dmark
+    rb_decoder_free,                 // function.dfree
+    rb_decoder_size,                 // function.dsize
+    {NULL, NULL},                    // function.reserved
+  },                                
+  NULL,                              // parent
+  NULL,                              // data
+  (VALUE)RUBY_TYPED_FREE_IMMEDIATELY // flags
+};
+#endif /* RUBY_API_VERSION_CODE > 20600 */
+
+static VALUE
+rb_decoder_alloc(VALUE self)
+{
+  jpeg_decode_t* ptr;
+
+  ptr = ALLOC(jpeg_decode_t);
+  memset(ptr, 0, sizeof(*ptr));
+
+  ptr->flags = DEFAULT_DECODE_FLAGS;
+
+  return TypedData_Wrap_Struct(decoder_klass, &jpeg_decoder_data_type, ptr);
+}
+
+static VALUE
+eval_decoder_pixel_format_opt(jpeg_decode_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  int format;
+  int color_space;
+  int components;
+
+  ret = Qnil;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    format      = FMT_RGB;
+    color_space = JCS_RGB;
+    components  = 3;
     break;
 
-  case 1:
-    obj = INT2FIX(get_u16(p, ptr->be));
+  case T_STRING:
+  case T_SYMBOL:
+    if(EQ_STR(opt, "RGB") || EQ_STR(opt, "RGB24")) {
+      format      = FMT_RGB;
+      color_space = JCS_RGB;
+      components  = 3;
+
+    } else if (EQ_STR(opt, "YUV422") || EQ_STR(opt, "YUYV")) {
+      // YCbCrで復号し、出力時にYUYVに詰め直す
+      format      = FMT_YUV422;
+      color_space = JCS_YCbCr;
+      components  = 3;
+
+    } else if (EQ_STR(opt, "RGB565")) {
+      // RGBXで復号し、出力時にRGB565に詰め直す
+      format      = FMT_RGB565;
+      color_space = JCS_EXT_RGBX;
+      components  = 4;
+
+    } else if (EQ_STR(opt, "GRAYSCALE")) {
+      format      = FMT_GRAYSCALE;
+      color_space = JCS_GRAYSCALE;
+      components  = 1;
+
+    } else if (EQ_STR(opt, "YUV444") || EQ_STR(opt, "YCbCr")) {
+      format      = FMT_YUV;
+      color_space = JCS_YCbCr;
+      components  = 3;
+
+    } else if (EQ_STR(opt, "BGR") || EQ_STR(opt, "BGR24")) {
+      format      = FMT_BGR;
+      color_space = JCS_EXT_BGR;
+      components  = 3;
+
+    } else if (EQ_STR(opt, "YVU444") || EQ_STR(opt, "YCrCb")) {
+      format      = FMT_YVU;
+      color_space = JCS_YCbCr;
+      components  = 3;
+
+    } else if (EQ_STR(opt, "RGBX") || EQ_STR(opt, "RGB32")) {
+      format      = FMT_RGB32;
+      color_space = JCS_EXT_RGBX;
+      components  = 4;
+
+    } else if (EQ_STR(opt, "BGRX") || EQ_STR(opt, "BGR32")) {
+      format      = FMT_BGR32;
+      color_space = JCS_EXT_BGRX;
+      components  = 4;
+
+    } else if (EQ_STR(opt, "I420") || EQ_STR(opt, "YUV420P")) {
+      format      = FMT_I420;
+      color_space = JCS_YCbCr;
+      components  = 3;
+
+    } else if (EQ_STR(opt, "NV12")) {
+      format      = FMT_NV12;
+      color_space = JCS_YCbCr;
+      components  = 3;
+
+    } else if (EQ_STR(opt, "YUV422P")) {
+      format      = FMT_YUV422P;
+      color_space = JCS_YCbCr;
+      components  = 3;
+
+    } else {
+      ret = create_argument_error("unsupportd :pixel_format option value");
+    }
+    break;
+
+  default:
+    ret = create_type_error("unsupportd :pixel_format option type");
+    break;
+  }
+
+  if (!RTEST(ret)) {
+    ptr->format               = format;
+    ptr->out_color_space      = color_space;
+    ptr->out_color_components = components;
+  }
+
+  return ret;
+}
+
+static VALUE
+eval_decoder_output_gamma_opt(jpeg_decode_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  double gamma;
+
+  ret = Qnil;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    gamma = 0.0;
+    break;
+
+  case T_FIXNUM:
+  case T_FLOAT:
+    if (isnan(NUM2DBL(opt)) || isinf(NUM2DBL(opt))) {
+      ret = create_argument_error("unsupported :output_gamma value");
+    } else {
+      gamma = NUM2DBL(opt);
+    }
+    break;
+
+  default:
+    ret = create_type_error("unsupported :output_gamma type");
+    break;
+  }
+
+  if (!RTEST(ret)) ptr->output_gamma = gamma;
+
+  return ret;
+}
+
+static VALUE
+eval_decoder_do_fancy_upsampling_opt(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef && RTEST(opt)) {
+    ptr->do_fancy_upsampling = TRUE;
+  } else {
+    ptr->do_fancy_upsampling = FALSE;
+  }
+
+  return Qnil;
+}
+
+static VALUE
+eval_decoder_do_smoothing_opt(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef && RTEST(opt)) {
+    ptr->do_block_smoothing = TRUE;
+  } else {
+    ptr->do_block_smoothing = FALSE;
+  }
+
+  return Qnil;
+}
+
+static VALUE
+eval_decoder_dither_opt( jpeg_decode_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  VALUE tmp;
+  int mode;
+  int quant;
+  int pass2;
+  int ncol;
+
+  ret = Qnil;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    mode  = JDITHER_NONE;
+    quant = FALSE;
+    ncol  = 0;
+    pass2 = FALSE;
     break;
 
-  default:
-    p = ptr->head + get_u32(p, ptr->be);
+  case T_ARRAY:
+    if (RARRAY_LEN(opt) != 3) {
+      ret = create_argument_error(":dither invalid size");
+
+    } else do {
+      /*
+       * dither mode
+       */
+      tmp = rb_ary_entry(opt, 0);
+      if (TYPE(tmp) != T_STRING && TYPE(tmp) != T_SYMBOL) {
+        ret = create_type_error("unsupported dither mode type");
+        break;
+
+      } else if (EQ_STR(tmp, "NONE")) {
+        mode  = JDITHER_NONE;
+        quant = FALSE;
+
+      } else if(EQ_STR(tmp, "ORDERED")) {
+        mode  = JDITHER_ORDERED;
+        quant = TRUE;
+
+      } else if(EQ_STR(tmp, "FS")) {
+        mode  = JDITHER_FS;
+        quant = TRUE;
+
+      } else {
+        ret = create_argument_error("dither mode is illeagal value.");
+        break;
+      }
+
+      /*
+       * 2 pass flag
+       */
+      pass2 = (RTEST(rb_ary_entry(opt, 1)))? TRUE: FALSE;
+
+      /*
+       * number of color
+       */
+      tmp = rb_ary_entry(opt, 2);
+      if (TYPE(tmp) != T_FIXNUM) {
+        ret = create_type_error("unsupported number of colors type");
+        break;
+
+      } else if (FIX2LONG(tmp) < 8) {
+        ret = create_range_error("number of colors less than 0");
+        break;
+
+      } else if (FIX2LONG(tmp) > 256) {
+        ret = create_range_error("number of colors greater than 256");
+        break;
+
+      } else {
+        ncol = FIX2INT(tmp); 
+      }
+    } while (0);
+    break;
+
+  default:
+    ret = create_type_error("unsupported :dither type");
+    break;
+  }
+
+  if (!RTEST(ret)) {
+    ptr->dither_mode              = mode;
+    ptr->quantize_colors          = quant;
+    ptr->two_pass_quantize        = pass2;
+    ptr->desired_number_of_colors = ncol;
+
+    if (mode != JDITHER_NONE) SET_FLAG(ptr, F_DITHER);
+  }
+
+  return ret;
+}
+
+#if 0
+static void
+eval_decoder_use_1pass_quantizer_opt(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef && RTEST(opt)) {
+    ptr->enable_1pass_quant = TRUE;
+  } else {
+    ptr->enable_1pass_quant = FALSE;
+  }
+
+  return Qnil;
+}
+
+static VALUE
+eval_decoder_use_external_colormap_opt(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef && RTEST(opt)) {
+      ptr->enable_external_quant = TRUE;
+    } else {
+      ptr->enable_external_quant = FALSE;
+    }
+  }
+
+  return Qnil;
+}
+
+static VALUE
+eval_decoder_use_2pass_quantizer_opt(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef && RTEST(opt)) {
+      ptr->enable_2pass_quant = TRUE;
+    } else {
+      ptr->enable_2pass_quant = FALSE;
+    }
+  }
+
+  return Qnil;
+}
+#endif
+
+static VALUE
+eval_decoder_without_meta_opt(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef && RTEST(opt)) {
+    CLR_FLAG(ptr, F_NEED_META);
+  } else {
+    SET_FLAG(ptr, F_NEED_META);
+  }
+
+  return Qnil;
+}
+
+static VALUE
+eval_decoder_expand_colormap_opt(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef && RTEST(opt)) {
+    SET_FLAG(ptr, F_EXPAND_COLORMAP);
+  } else {
+    CLR_FLAG(ptr, F_EXPAND_COLORMAP);
+  }
+
+  return Qnil;
+}
+
+
+static VALUE
+eval_decoder_scale_opt(jpeg_decode_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  int scale_num;
+  int scale_denom;
+
+  ret = Qnil;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    scale_num   = 1;
+    scale_denom = 1;
+    break;
+
+  case T_FIXNUM:
+    if (FIX2LONG(opt) <= 0) {
+      ret = create_range_error(":scale less equal 0");
+
+    } else {
+      scale_num   = FIX2INT(opt) * 1000;
+      scale_denom = 1000;
+    }
+    break;
+
+  case T_FLOAT:
+    if (isnan(NUM2DBL(opt)) || isinf(NUM2DBL(opt))) {
+      ret = create_argument_error("unsupportd :quality option value");
+      
+    } else if (NUM2DBL(opt) <= 0.0) {
+      ret = create_range_error(":scale less equal 0");
+
+    } else {
+      scale_num   = (int)(NUM2DBL(opt) * 1000.0);
+      scale_denom = 1000;
+    }
+    break;
+
+  case T_RATIONAL:
+    scale_num   = (int)FIX2LONG(rb_rational_num(opt));
+    scale_denom = (int)FIX2LONG(rb_rational_den(opt));
+    break;
+
+  default:
+    ret = create_type_error("unsupportd :scale option type");
+    break;
+  }
+
+  if (!RTEST(ret)) {
+    ptr->scale_num   = scale_num;
+    ptr->scale_denom = scale_denom;
+  }
+
+  return ret;
+}
+
+static VALUE
+eval_decoder_dct_method_opt(jpeg_decode_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  int dct_method;
+
+  ret = Qnil;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    dct_method = JDCT_FASTEST;
+    break;
+
+  case T_STRING:
+  case T_SYMBOL:
+    if (EQ_STR(opt, "FASTEST")) {
+      dct_method = JDCT_FASTEST;
+
+    } else if (EQ_STR(opt, "ISLOW")) {
+      dct_method = JDCT_ISLOW;
+
+    } else if (EQ_STR(opt, "IFAST")) {
+      dct_method = JDCT_IFAST;
+
+    } else if (EQ_STR(opt, "FLOAT")) {
+      dct_method = JDCT_FLOAT;
+
+    } else {
+      ret = create_argument_error("unsupportd :dct_method option value");
+    }
+    break;
+
+  default:
+    ret = create_type_error("unsupportd :dct_method option type");
+    break;
+  }
+
+  if (!RTEST(ret)) ptr->dct_method = dct_method;
+
+  return ret;
+}
+
+static VALUE
+eval_decoder_with_exif_tags_opt(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef && RTEST(opt)) {
+    SET_FLAG(ptr, F_PARSE_EXIF);
+  } else {
+    CLR_FLAG(ptr, F_PARSE_EXIF);
+  }
+
+  return Qnil;
+}
+
+static VALUE
+eval_decoder_orientation_opt(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef && RTEST(opt)) {
+    SET_FLAG(ptr, F_APPLY_ORIENTATION);
+  } else {
+    CLR_FLAG(ptr, F_APPLY_ORIENTATION);
+  }
+
+  return Qnil;
+}
+
+static VALUE
+eval_decoder_threads_opt(jpeg_decode_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  int threads;
+
+  ret     = Qnil;
+  threads = 1;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+  case T_NIL:
+  case T_FALSE:
+    threads = 1;
+    break;
+
+  case T_TRUE:
+    threads = default_workers;
+    break;
+
+  case T_FIXNUM:
+    if (FIX2LONG(opt) < 1) {
+      ret = create_range_error(":threads less than 1");
+
+    } else {
+      threads = (FIX2LONG(opt) > 256)? 256: FIX2INT(opt);
+    }
+    break;
+
+  default:
+    ret = create_type_error("unsupportd :threads option type");
+    break;
+  }
+
+  if (!RTEST(ret)) ptr->threads = threads;
+
+  return ret;
+}
+
+static void
+create_decompress(jpeg_decode_t* ptr)
+{
+  // jpeg_std_error()はハンドラを上書きするので、その後に設定すること
+  ptr->cinfo.err                   = jpeg_std_error(&ptr->err_mgr.jerr);
+  ptr->err_mgr.jerr.output_message = output_message;
+  ptr->err_mgr.jerr.emit_message   = emit_message;
+  ptr->err_mgr.jerr.error_exit     = error_exit;
+
+  jpeg_create_decompress(&ptr->cinfo);
+}
+
+static VALUE
+set_decoder_context( jpeg_decode_t* ptr, VALUE opt)
+{
+  VALUE ret;
+  VALUE opts[N(decoder_opts_ids)];
+  JSAMPARRAY ary;
+
+  /*
+   * initialize
+   */
+  ret = Qnil;
+  ary = NULL;
+
+  /*
+   * parse options
+   */
+  do {
+    rb_get_kwargs(opt, decoder_opts_ids, 0, N(decoder_opts_ids), opts);
+
+    /*
+     * set context
+     */
+    ret = eval_decoder_pixel_format_opt(ptr, opts[0]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_output_gamma_opt(ptr, opts[1]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_do_fancy_upsampling_opt(ptr, opts[2]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_do_smoothing_opt(ptr, opts[3]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_dither_opt(ptr, opts[4]);
+    if (RTEST(ret)) break;
+
+#if 0
+    ret = eval_decoder_use_1pass_quantizer_opt(ptr, opts[5]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_use_external_colormap_opt(ptr, opts[6]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_use_2pass_quantizer_opt(ptr, opts[7]);
+    if (RTEST(ret)) break;
+#endif
+
+    ret = eval_decoder_without_meta_opt(ptr, opts[5]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_expand_colormap_opt(ptr, opts[6]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_scale_opt(ptr, opts[7]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_dct_method_opt(ptr, opts[8]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_with_exif_tags_opt(ptr, opts[9]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_orientation_opt(ptr, opts[10]);
+    if (RTEST(ret)) break;
+
+    ret = eval_decoder_threads_opt(ptr, opts[11]);
+    if (RTEST(ret)) break;
+  } while (0);
+
+  /*
+   * alloc memory
+   */
+  if (!RTEST(ret)) {
+    ary = ALLOC_ARRAY();
+    if (ary == NULL) ret = create_memory_error();
+  }
+
+  /*
+   * set the rest context parameter
+   */
+  if (!RTEST(ret)) {
+    // 現時点でオプションでの対応をおこなっていないので
+    // ここで値を設定
+    ptr->enable_1pass_quant    = FALSE;
+    ptr->enable_external_quant = FALSE;
+    ptr->enable_2pass_quant    = FALSE;
+    ptr->buffered_image        = FALSE;
+
+#if 0
+    if (ptr->enable_1pass_quant == TRUE ||
+        ptr->enable_external_quant == TRUE ||
+        ptr->enable_2pass_quant == TRUE) {
+      ptr->buffered_image = TRUE;
+
+    } else {
+      ptr->buffered_image = FALSE;
+    }
+#endif
+
+    ptr->array             = ary;
+    ptr->data              = Qnil;
+    ptr->into              = Qnil;
+  }
+
+  /*
+   * setup libjpeg
+   */
+  if (!RTEST(ret)) {
+    create_decompress(ptr);
+    SET_FLAG(ptr, F_CREAT);
+  }
+
+  return ret;
+}
+
+/**
+ * initialize decoder object
+ *
+ * @overload initialize(opts)
+ *
+ *   @param opts [Hash] options to initialize object
+ *
+ *   @option opts [Symbol] :pixel_format
+ *     specifies the format of the output image. possible values are:
+ *     YUV422 YUYV RGB565 RGB RGB24 BGR BGR24 YUV444 YCbCr
+ *     RGBX RGB32 BGRX BGR32 GRAYSCALE I420 YUV420P NV12 YUV422P.
+ *     I420, NV12 and YUV422P are planar formats; the layout of the planes
+ *     is reported by {JPEG::Meta#planes}.
+ *
+ *   @option opts [Float] :output_gamma
+ *
+ *   @option opts [Boolean] :fancy_upsampling
+ *
+ *   @option opts [Boolean] :do_smoothing
+ *
+ *   @option opts [Array] :dither
+ *     specifies dithering parameters. A 3-elements array.
+ *     specify the dither type as a string for the 1st element,
+ *     whether to use 2-pass quantize for the 2nd element as a boolean,
+ *     and the number of colors used for the 3rd element as an integer
+ *     from 16 to 256.
+ *
+ *   @option opts [Boolean] :without_meta
+ *     specifies whether or not to include meta information in the
+ *     output data. If true, no meta-information is output.
+ *
+ *   @option opts [Boolean] :expand_colormap
+ *     specifies whether to expand the color map. If dither is specified,
+ *     the output will be a color number of 1 byte per pixel, but if this
+ *     option is set to true, the output will be expanded to color information.
+ *
+ *   @option opts [Ratioanl] :scale
+ *
+ *   @option opts [Symbol] :dct_method
+ *     specifies how decoding is handled. possible values are:
+ *     FASTEST ISLOW IFAST FLOAT
+ *
+ *   @option opts [Boolean] :with_exif_tags
+ *     specifies whether to include Exif tag information in the output data.
+ *     set this option to true to parse the Exif tag information and include
+ *     it in the meta information output.
+ *
+ *   @option opts [Boolean] :with_exif
+ *     alias to :with_exif_tags option.
+ *
+ *   @option opts [Integer, Boolean] :threads
+ *     specifies the number of native threads used to decode one image.
+ *     if true, the number of online CPUs is used. only baseline JPEG
+ *     data containing restart markers is decoded in parallel; other data
+ *     is decoded serially.
+ */
+static VALUE
+rb_decoder_initialize( int argc, VALUE *argv, VALUE self)
+{
+  jpeg_decode_t* ptr;
+  VALUE exc;
+  VALUE opt;
+
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
+
+  /*
+   * parse arguments
+   */
+  rb_scan_args( argc, argv, "0:", &opt);
+
+  /*
+   * set context
+   */ 
+  exc = set_decoder_context(ptr, opt);
+
+  /*
+   * post process
+   */
+  if (RTEST(exc)) rb_exc_raise(exc);
+
+  return Qtrue;
+}
+
+static VALUE
+rb_decoder_set(VALUE self, VALUE opt)
+{
+  jpeg_decode_t* ptr;
+  VALUE exc;
+
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
+
+  /*
+   * check argument
+   */
+  Check_Type(opt, T_HASH);
+
+  // デコード中にjpeg_decompress_structを作り直させない
+  if (ptr->data != Qnil) {
+    RUNTIME_ERROR("decoder is busy");
+  }
+
+  /*
+   * set context
+   */ 
+  exc = set_decoder_context(ptr, opt);
+
+  /*
+   * post process
+   */
+  if (RTEST(exc)) rb_exc_raise(exc);
+
+  return Qtrue;
+}
+
+static VALUE
+get_colorspace_str( J_COLOR_SPACE cs)
+{
+  const char* cstr;
+
+  switch (cs) {
+  case JCS_GRAYSCALE:
+    cstr = "GRAYSCALE";
+    break;
+
+  case JCS_RGB:
+    cstr = "RGB";
+    break;
+
+  case JCS_YCbCr:
+    cstr = "YCbCr";
+    break;
+
+  case JCS_CMYK:
+    cstr = "CMYK";
+    break;
+
+  case JCS_YCCK:
+    cstr = "YCCK";
+    break;
+#if JPEG_LIB_VERSION < 90
+  case JCS_EXT_RGB:
+    cstr = "RGB";
+    break;
+
+  case JCS_EXT_RGBX:
+    cstr = "RGBX";
+    break;
+
+  case JCS_EXT_BGR:
+    cstr = "BGR";
+    break;
+
+  case JCS_EXT_BGRX:
+    cstr = "BGRX";
+    break;
+
+  case JCS_EXT_XBGR:
+    cstr = "XBGR";
+    break;
+
+  case JCS_EXT_XRGB:
+    cstr = "XRGB";
+    break;
+
+  case JCS_EXT_RGBA:
+    cstr = "RGBA";
+    break;
+
+  case JCS_EXT_BGRA:
+    cstr = "BGRA";
+    break;
+
+  case JCS_EXT_ABGR:
+    cstr = "ABGR";
+    break;
+
+  case JCS_EXT_ARGB:
+    cstr = "ARGB";
+    break;
+#endif /* JPEG_LIB_VERSION < 90 */
+
+  default:
+    cstr = "UNKNOWN";
+    break;
+  }
+
+  return rb_str_freeze(rb_str_new_cstr(cstr));
+}
+
+typedef struct {
+  int be;
+  uint8_t* head;
+  uint8_t* cur;
+  size_t size;
+
+  struct {
+    tag_entry_t* tbl;
+    size_t n;
+  } tags;
+
+  int next;
+} exif_t;
+
+static uint16_t
+get_u16(uint8_t* src, int be)
+{
+  uint16_t ret;
+
+  if (be) {
+    ret = (((src[0] << 8) & 0xff00)|
+           ((src[1] << 0) & 0x00ff));
+  } else {
+    ret = (((src[1] << 8) & 0xff00)|
+           ((src[0] << 0) & 0x00ff));
+  }
+
+  return ret;
+}
+
+/*
+static int16_t
+get_s16(uint8_t* src, int be)
+{
+  int16_t ret;
+
+  if (be) {
+    ret = (((src[0] << 8) & 0xff00)|
+           ((src[1] << 0) & 0x00ff));
+  } else {
+    ret = (((src[1] << 8) & 0xff00)|
+           ((src[0] << 0) & 0x00ff));
+  }
+
+  return ret;
+}
+*/
+
+static uint32_t
+get_u32(uint8_t* src, int be)
+{
+  uint32_t ret;
+
+  if (be) {
+    ret = (((src[0] << 24) & 0xff000000)|
+           ((src[1] << 16) & 0x00ff0000)|
+           ((src[2] <<  8) & 0x0000ff00)|
+           ((src[3] <<  0) & 0x000000ff));
+  } else {
+    ret = (((src[3] << 24) & 0xff000000)|
+           ((src[2] << 16) & 0x00ff0000)|
+           ((src[1] <<  8) & 0x0000ff00)|
+           ((src[0] <<  0) & 0x000000ff));
+  }
+
+  return ret;
+}
+
+static int32_t
+get_s32(uint8_t* src, int be)
+{
+  int32_t ret;
+
+  if (be) {
+    ret = (((src[0] << 24) & 0xff000000)|
+           ((src[1] << 16) & 0x00ff0000)|
+           ((src[2] <<  8) & 0x0000ff00)|
+           ((src[3] <<  0) & 0x000000ff));
+  } else {
+    ret = (((src[3] << 24) & 0xff000000)|
+           ((src[2] << 16) & 0x00ff0000)|
+           ((src[1] <<  8) & 0x0000ff00)|
+           ((src[0] <<  0) & 0x000000ff));
+  }
+
+  return ret;
+}
+
+static void
+exif_increase(exif_t* ptr, size_t size)
+{
+  ptr->cur  += size;
+  ptr->size -= size;
+}
+
+static void
+exif_init(exif_t* ptr, uint8_t* src, size_t size)
+{
+  int be;
+  uint16_t ident;
+  uint32_t off;
+
+  /*
+   * Check Exif identifier
+   */
+  if (memcmp(src, "Exif\0\0", 6)) {
+    rb_raise(decerr_klass, "invalid exif identifier");
+  }
+
+  /*
+   * Check TIFF header and judge endian
+   */
+  do {
+    if (!memcmp(src + 6, "MM", 2)) {
+      be = !0;
+      break;
+    }
+
+    if (!memcmp(src + 6, "II", 2)) {
+      be = 0;
+      break;
+    }
+
+    rb_raise(decerr_klass, "invalid tiff header");
+  } while (0);
+
+  /*
+   * Check TIFF identifier
+   */
+  ident = get_u16(src + 8, be);
+  if (ident != 0x002a) {
+    rb_raise(decerr_klass, "invalid tiff identifier");
+  }
+
+  /*
+   * get offset for 0th IFD
+   */
+  off = get_u32(src + 10, be);
+  if (off < 8 || off >= size - 6) {
+    rb_raise(decerr_klass, "invalid offset dentifier");
+  }
+
+  /*
+   * initialize Exif context
+   */
+  ptr->be       = be;
+  ptr->head     = src + 6;
+  ptr->cur      = ptr->head + off;
+  ptr->size     = size - (6 + off);
+  ptr->tags.tbl = tag_tiff;
+  ptr->tags.n   = N(tag_tiff);
+  ptr->next     = 0;
+}
+
+static void
+exif_fetch_tag_header(exif_t* ptr, uint16_t* tag, uint16_t* type)
+{
+  *tag  = get_u16(ptr->cur + 0, ptr->be);
+  *type = get_u16(ptr->cur + 2, ptr->be);
+}
+
+
+static void
+exif_fetch_byte_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+
+  int i;
+  uint32_t n;
+  uint8_t* p;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->cur + 8;
+
+  switch (n) {
+  case 0:
+    obj = Qnil;
+    break;
+
+  case 1:
+    obj = INT2FIX(*p);
+    break;
+
+  default:
+    p = ptr->head + get_u32(p, ptr->be);
+
+  case 2:
+  case 3:
+  case 4:
+    obj = rb_ary_new_capa(n);
+    for (i = 0; i < (int)n; i++) {
+      rb_ary_push(obj, INT2FIX(p[i]));
+    }
+
+    rb_ary_freeze(obj);
+    break;
+  }
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_ascii_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+
+  uint32_t n;
+  uint8_t* p;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->cur + 8;
+
+  if (n > 4) {
+    p = ptr->head + get_u32(p, ptr->be);
+  }
+
+  obj = rb_utf8_str_new((char*)p, n);
+  rb_funcall(obj, rb_intern("strip!"), 0);
+  rb_str_freeze(obj);
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_short_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+
+  int i;
+  uint32_t n;
+  uint8_t* p;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->cur + 8;
+
+  switch (n) {
+  case 0:
+    obj = Qnil;
+    break;
+
+  case 1:
+    obj = INT2FIX(get_u16(p, ptr->be));
+    break;
+
+  default:
+    p = ptr->head + get_u32(p, ptr->be);
+
+  case 2:
+    obj = rb_ary_new_capa(n);
+    for (i = 0; i < (int)n; i++) {
+      rb_ary_push(obj, INT2FIX(get_u16(p, ptr->be)));
+      p += 2;
+    }
+
+    rb_ary_freeze(obj);
+    break;
+  }
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_long_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+
+  int i;
+  uint32_t n;
+  uint8_t* p;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->cur + 8;
+
+  switch (n) {
+  case 0:
+    obj = Qnil;
+    break;
+
+  case 1:
+    obj = INT2FIX(get_u32(p, ptr->be));
+    break;
+
+  default:
+    p   = ptr->head + get_u32(p, ptr->be);
+    obj = rb_ary_new_capa(n);
+    for (i = 0; i < (int)n; i++) {
+      rb_ary_push(obj, INT2FIX(get_u32(p, ptr->be)));
+      p += 4;
+    }
+
+    rb_ary_freeze(obj);
+    break;
+  }
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_rational_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+  VALUE val;
+
+  int i;
+  uint32_t n;
+  uint8_t* p;
+  uint32_t deno;
+  uint32_t num;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->head + get_u32(ptr->cur + 8, ptr->be);
+
+  switch (n) {
+  case 0:
+    obj = Qnil;
+    break;
+
+  case 1:
+    num  = get_u32(p + 0, ptr->be);
+    deno = get_u32(p + 4, ptr->be);
+    if (num == 0 && deno == 0) {
+      deno = 1;
+    }
+    obj = rb_rational_new(INT2FIX(num), INT2FIX(deno));
+    rb_obj_freeze(obj);
+    break;
+
+  default:
+    obj = rb_ary_new_capa(n);
+    for (i = 0; i < (int)n; i++) {
+      num  = get_u32(p + 0, ptr->be);
+      deno = get_u32(p + 4, ptr->be);
+      if (num == 0 && deno == 0) {
+        deno = 1;
+      }
+
+      val = rb_rational_new(INT2FIX(num), INT2FIX(deno));
+      rb_obj_freeze(val);
+
+      rb_ary_push(obj, val);
+      p += 8;
+    }
+
+    rb_ary_freeze(obj);
+    break;
+  }
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_undefined_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+
+  uint32_t n;
+  uint8_t* p;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->cur + 8;
+
+  if (n > 4) {
+    p = ptr->head + get_u32(p, ptr->be);
+  }
+
+  obj = rb_enc_str_new((char*)p, n, rb_ascii8bit_encoding());
+  rb_str_freeze(obj);
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_slong_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+
+  int i;
+  uint32_t n;
+  uint8_t* p;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->cur + 8;
+
+  switch (n) {
+  case 0:
+    obj = Qnil;
+    break;
+
+  case 1:
+    obj = INT2FIX(get_s32(p, ptr->be));
+    break;
+
+  default:
+    p   = ptr->head + get_u32(p, ptr->be);
+    obj = rb_ary_new_capa(n);
+    for (i = 0; i < (int)n; i++) {
+      rb_ary_push(obj, INT2FIX(get_s32(p, ptr->be)));
+      p += 4;
+    }
+
+    rb_ary_freeze(obj);
+    break;
+  }
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_srational_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+  VALUE val;
+
+  int i;
+  uint32_t n;
+  uint8_t* p;
+  uint32_t deno;
+  uint32_t num;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->head + get_u32(ptr->cur + 8, ptr->be);
+
+  switch (n) {
+  case 0:
+    obj = Qnil;
+    break;
+
+  case 1:
+    num  = get_s32(p + 0, ptr->be);
+    deno = get_s32(p + 4, ptr->be);
+    if (num == 0 && deno == 0) {
+      deno = 1;
+    }
+    obj = rb_rational_new(INT2FIX(num), INT2FIX(deno));
+    break;
+
+  default:
+    obj = rb_ary_new_capa(n);
+    for (i = 0; i < (int)n; i++) {
+      num  = get_s32(p + 0, ptr->be);
+      deno = get_s32(p + 4, ptr->be);
+      if (num == 0 && deno == 0) {
+        deno = 1;
+      }
+
+      val = rb_rational_new(INT2FIX(num), INT2FIX(deno));
+      rb_obj_freeze(val);
+
+      rb_ary_push(obj, val);
+      p += 8;
+    }
+
+    rb_ary_freeze(obj);
+    break;
+  }
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_child_ifd(exif_t* ptr, tag_entry_t* tbl, size_t n, exif_t* dst)
+{
+  uint32_t off;
+
+  off = get_u32(ptr->cur + 8, ptr->be); 
+
+  dst->be       = ptr->be;
+  dst->head     = ptr->head;
+  dst->cur      = ptr->head + off;
+  dst->size     = ptr->size - off;
+  dst->tags.tbl = tbl;
+  dst->tags.n   = n;
+  dst->next     = 0;
+}
+
+static int
+exif_read(exif_t* ptr, VALUE dst)
+{
+  int ret;
+  int i;
+  uint16_t ntag;
+  uint16_t tag;
+  uint16_t type;
+  uint32_t off;
+
+  exif_t child;
+
+  VALUE key;
+  VALUE val;
+
+  ntag = get_u16(ptr->cur, ptr->be);
+  exif_increase(ptr, 2);
+
+  for (i = 0; i < ntag; i++) {
+    exif_fetch_tag_header(ptr, &tag, &type);
+
+    switch (tag) {
+    case 34665: // ExifIFDPointer
+      key = ID2SYM(rb_intern("exif"));
+      val = rb_hash_new();
+
+      exif_fetch_child_ifd(ptr, tag_exif, N(tag_exif), &child);
+      exif_read(&child, val);
+      break;
+
+    case 34853: // GPSInfoIFDPointer
+      key = ID2SYM(rb_intern("gps"));
+      val = rb_hash_new();
+
+      exif_fetch_child_ifd(ptr, tag_gps, N(tag_gps), &child);
+      exif_read(&child, val);
+      break;
+
+    case 40965: // InteroperabilityIFDPointer
+      key = ID2SYM(rb_intern("interoperability"));
+      val = rb_hash_new();
+
+      exif_fetch_child_ifd(ptr, tag_i14y, N(tag_i14y), &child);
+      exif_read(&child, val);
+      break;
+
+    default:
+      key = lookup_tag_symbol(ptr->tags.tbl, ptr->tags.n, tag);
+
+      switch (type) {
+      case 1:  // when BYTE
+        exif_fetch_byte_data(ptr, &val);
+        break;
+
+      case 2:  // when ASCII
+        exif_fetch_ascii_data(ptr, &val);
+        break;
+
+      case 3:  // when SHORT
+        exif_fetch_short_data(ptr, &val);
+        break;
+
+      case 4:  // when LONG
+        exif_fetch_long_data(ptr, &val);
+        break;
+
+      case 5:  // when RATIONAL
+        exif_fetch_rational_data(ptr, &val);
+        break;
+
+      case 7:  // when UNDEFINED
+        exif_fetch_undefined_data(ptr, &val);
+        break;
+
+      case 9:  // when SLONG
+        exif_fetch_slong_data(ptr, &val);
+        break;
+
+      case 10: // when SRATIONAL
+        exif_fetch_srational_data(ptr, &val);
+        break;
+
+      default:
+        rb_raise(decerr_klass, "invalid tag data type");
+      }
+    }
+
+    rb_hash_aset(dst, key, val);
+    exif_increase(ptr, 12);
+  }
+
+  off = get_u32(ptr->cur, ptr->be);
+  if (off != 0) {
+    ptr->cur  = ptr->head + off;
+    ptr->next = !0;
+  }
+
+  return ret;
+}
+
+#define THUMBNAIL_OFFSET    ID2SYM(rb_intern("jpeg_interchange_format"))
+#define THUMBNAIL_SIZE      ID2SYM(rb_intern("jpeg_interchange_format_length"))
+
+static VALUE
+create_exif_tags_hash(uint8_t* data, size_t size)
+{
+  VALUE ret;
+  exif_t exif;
+
+  ret = rb_hash_new();
+
+  if (data != NULL) {
+    /* 0th IFD */
+    exif_init(&exif, data, size);
+    exif_read(&exif, ret);
+
+    if (exif.next) {
+      /* when 1th IFD (tumbnail) exist */
+      VALUE info;
+      VALUE off;
+      VALUE size;
+      VALUE data;
+
+      info = rb_hash_new();
+
+      exif_read(&exif, info);
+
+      off  = rb_hash_lookup(info, THUMBNAIL_OFFSET);
+      size = rb_hash_lookup(info, THUMBNAIL_SIZE);
+
+      if (TYPE(off) == T_FIXNUM && TYPE(size) == T_FIXNUM) {
+        data = rb_enc_str_new((char*)exif.head + FIX2INT(off),
+                              FIX2INT(size),
+                              rb_ascii8bit_encoding());
+
+        rb_str_freeze(data);
+
+        rb_hash_lookup(info, THUMBNAIL_OFFSET);
+        rb_hash_lookup(info, THUMBNAIL_SIZE);
+        rb_hash_aset(info, ID2SYM(rb_intern("jpeg_interchange")), data);
+        rb_hash_aset(ret, ID2SYM(rb_intern("thumbnail")), info);
+      }
+    }
+  }
+
+  rb_hash_freeze(ret);
+
+  return ret;
+}
+
+/*
+ * quietを指定した場合は不正なタグを黙って無視する（probeの経路用）
+ */
+static int
+parse_exif_orientation(uint8_t* p, size_t size, int quiet)
+{
+  int o9n;
+  int be;
+  uint32_t off;
+  int i;
+  int n;
+
+  o9n = 0;
+
+  do {
+    if (p == NULL || size < 14) break;
+
+    /*
+     * check endian marker
+     */
+    if (!memcmp(p + 6, "MM", 2)) {
+      be = !0;
+
+    } else if (!memcmp(p + 6, "II", 2)) {
+      be = 0;
+
+    } else {
+      break;
+    }
+
+    /*
+     * check TIFF identifier
+     */
+    if (get_u16(p + 8, be) != 0x002a) break;
+
+    /*
+     * set 0th IFD address
+     */
+    off = get_u32(p + 10, be);
+    if (off < 8 || off > size - 8) break;
+
+    p += (6 + off);
+
+    /* ここまでくればAPP1がExifタグなので
+     * 0th IFDをなめてOrientationタグを探す */
+
+    n = get_u16(p, be);
+    p += 2;
+
+    // APP1の範囲に収まるエントリのみを見る
+    if ((size_t)n > (size - 8 - off) / 12) n = (size - 8 - off) / 12;
+
+    for (i = 0; i < n; i++) {
+      int tag;
+      int type;
+      int num;
+
+      tag  = get_u16(p + 0, be);
+      type = get_u16(p + 2, be);
+      num  = get_u32(p + 4, be);
+
+      if (tag == 0x0112) {
+        if (type == 3 && num == 1) {
+          o9n = get_u16(p + 8, be);
+          break;
+
+        } else if (!quiet) {
+          fprintf(stderr,
+                  "Illeagal orientation tag found [type:%d, num:%d]\n",
+                  type,
+                  num);
+        }
+      }
+
+      p += 12;
+    }
+  } while (0);
+
+  return (o9n >= 1 && o9n <= 8)? (o9n - 1): 0;
+}
+
+static uint8_t*
+find_exif_thumbnail(uint8_t* p, size_t size, size_t* len)
+{
+  uint8_t* ret;
+  uint8_t* tiff;
+  int be;
+  size_t off;
+  size_t pos;
+  size_t thumb;
+  size_t n;
+  size_t i;
+
+  ret   = NULL;
+  pos   = 0;
+  thumb = 0;
+
+  do {
+    if (p == NULL || size < 14) break;
+
+    /*
+     * check endian marker
+     */
+    if (!memcmp(p + 6, "MM", 2)) {
+      be = !0;
+
+    } else if (!memcmp(p + 6, "II", 2)) {
+      be = 0;
+
+    } else {
+      break;
+    }
+
+    tiff  = p + 6;
+    size -= 6;
+
+    if (get_u16(tiff + 2, be) != 0x002a) break;
+
+    /*
+     * 0th IFDを読み飛ばして1st IFDの位置を得る
+     * (オフセットは32bitの任意の値を取り得るので、加算で溢れないよう
+     * sizeの側から引いて比較する)
+     */
+    off = get_u32(tiff + 4, be);
+    if (off < 8 || off > size - 2) break;
+
+    n = get_u16(tiff + off, be);
+    if ((n * 12) + 4 > size - off - 2) break;
+
+    off = get_u32(tiff + off + 2 + (n * 12), be);
+    if (off < 8 || off > size - 2) break;
+
+    /*
+     * 1st IFDからJPEGInterchangeFormat(Length)を探す
+     */
+    n = get_u16(tiff + off, be);
+    if (n * 12 > size - off - 2) break;
+
+    for (i = 0; i < n; i++) {
+      uint8_t* ent;
+
+      ent = tiff + off + 2 + (i * 12);
+
+      switch (get_u16(ent, be)) {
+      case 0x0201:
+        pos   = get_u32(ent + 8, be);
+        break;
+
+      case 0x0202:
+        thumb = get_u32(ent + 8, be);
+        break;
+      }
+    }
+
+    if (pos == 0 || thumb == 0) break;
+    if (pos > size || thumb > size - pos) break;
+
+    ret  = tiff + pos;
+    *len = thumb;
+  } while (0);
+
+  return ret;
+}
+
+static void
+get_decode_info(jpeg_decode_t* ptr, decode_info_t* info)
+{
+  struct jpeg_decompress_struct* cinfo;
+  jpeg_saved_marker_ptr marker;
+  int i;
+
+  /*
+   * マーカーリストとカラーマップはjpeg_finish_decompress()で解放されて
+   * しまうので、メタ情報の生成に必要な値はここで取り出しておく。
+   * (但しExifデータはポインタを保持するだけなので注意)
+   */
+  cinfo = &ptr->cinfo;
+
+  info->width                = cinfo->output_width;
+  info->height               = cinfo->output_height;
+  info->components           = cinfo->output_components;
+  info->out_color_components = cinfo->out_color_components;
+  info->jpeg_color_space     = cinfo->jpeg_color_space;
+  info->out_color_space      = cinfo->out_color_space;
+  info->exif.data            = NULL;
+  info->exif.size            = 0;
+  info->orientation          = 0;
+  info->colormap.n           = 0;
+
+  if (TEST_FLAG(ptr, F_PARSE_EXIF | F_APPLY_ORIENTATION | F_THUMBNAIL)) {
+    for (marker = cinfo->marker_list;
+              marker != NULL; marker = marker->next) {
+
+      if (marker->data_length < 14) continue;
+      if (memcmp(marker->data, "Exif\0\0", 6)) continue;
+
+      info->exif.data = marker->data;
+      info->exif.size = marker->data_length;
+      break;
+    }
+  }
+
+  if (TEST_FLAG(ptr, F_APPLY_ORIENTATION)) {
+    info->orientation = parse_exif_orientation(info->exif.data,
+                                               info->exif.size, 0);
+  }
+
+  if (cinfo->colormap != NULL && cinfo->actual_number_of_colors > 0) {
+    info->colormap.n = cinfo->actual_number_of_colors;
+
+    for (i = 0; i < cinfo->out_color_components && i < 4; i++) {
+      memcpy(info->colormap.map[i], cinfo->colormap[i], info->colormap.n);
+    }
+  }
+}
+
+static VALUE
+create_colormap(decode_info_t* info)
+{
+  VALUE ret;
+  JSAMPLE (*map)[256];
+  int i;   // volatileを外すとaarch64のgcc6でクラッシュする場合がある
+  uint32_t c;
+
+  ret   = rb_ary_new_capa(info->colormap.n);
+  map   = info->colormap.map;
+
+  switch (info->out_color_components) {
+  case 1:
+    for (i = 0; i < info->colormap.n; i++) {
+      c = map[0][i];
+      rb_ary_push(ret, INT2FIX(c));
+    }
+    break;
+
+  case 2:
+    for (i = 0; i < info->colormap.n; i++) {
+      c = (map[0][i] << 8) | (map[1][i] << 0);
+      rb_ary_push(ret, INT2FIX(c));
+    }
+    break;
+
+  case 3:
+    for (i = 0; i < info->colormap.n; i++) {
+      c = (map[0][i] << 16) | (map[1][i] << 8) | (map[2][i] << 0);
+
+      rb_ary_push(ret, INT2FIX(c));
+    }
+    break;
+
+  default:
+    RUNTIME_ERROR("this number of components is not implemented yet");
+  }
+
+  rb_ary_freeze(ret);
+
+  return ret;
+}
+
+static VALUE
+rb_meta_exif_tags(VALUE self)
+{
+  return rb_ivar_get(self, id_exif_tags);
+}
+
+/*
+ * パック形式(YUYV, RGB565)の1行のバイト数を求める
+ */
+static int
+packed_stride(int format, int wd)
+{
+  return (format == FMT_YUV422)? ((wd + 1) / 2) * 4: wd * 2;
+}
+
+/*
+ * 向きを適用する前の大きさがwd x htの画像の出力に必要なバイト数
+ * (パック形式を書き出し時に詰める場合は詰めた後の大きさ)
+ */
+static size_t
+output_size(jpeg_decode_t* ptr, int wd, int ht, int nc, int orientation)
+{
+  if (PACK_ON_OUTPUT(ptr, orientation)) {
+    return (size_t)packed_stride(ptr->format, wd) * ht;
+  }
+
+  return (size_t)nc * wd * ht;
+}
+
+static VALUE
+create_meta(jpeg_decode_t* ptr, decode_info_t* info)
+{
+  VALUE ret;
+  int width;
+  int height;
+  int stride;
+
+  ret    = rb_obj_alloc(meta_klass);
+
+  if (TEST_FLAG(ptr, F_APPLY_ORIENTATION) && (info->orientation & 4)) {
+    width  = info->height;
+    height = info->width;
+  } else {
+    width  = info->width;
+    height = info->height;
+  }
+
+  stride = info->width * info->components;
+
+  if (IS_PLANAR(ptr)) {
+    plane_t planes[3];
+    VALUE ary;
+    VALUE ent;
+    int n;
+    int i;
+
+    get_plane_layout(ptr->format,
+                     info->width, info->height, info->width, planes);
+
+    n   = NUM_PLANES(ptr->format);
+    ary = rb_ary_new_capa(n);
+
+    for (i = 0; i < n; i++) {
+      ent = rb_hash_new();
+
+      rb_hash_aset(ent, ID2SYM(rb_intern("offset")), SIZET2NUM(planes[i].offset));
+      rb_hash_aset(ent, ID2SYM(rb_intern("stride")), INT2FIX(planes[i].stride));
+      rb_hash_aset(ent, ID2SYM(rb_intern("width")), INT2FIX(planes[i].width));
+      rb_hash_aset(ent, ID2SYM(rb_intern("height")), INT2FIX(planes[i].height));
+      rb_ary_push(ary, rb_hash_freeze(ent));
+    }
+
+    rb_ivar_set(ret, id_planes, rb_ary_freeze(ary));
+
+    stride = planes[0].stride;
+
+  } else if (IS_PACKED(ptr)) {
+    stride = packed_stride(ptr->format, width);
+  }
+
+  rb_ivar_set(ret, id_width, INT2FIX(width));
+  rb_ivar_set(ret, id_stride, INT2FIX(stride));
+  rb_ivar_set(ret, id_height, INT2FIX(height));
+
+  rb_ivar_set(ret, id_orig_cs, get_colorspace_str(info->jpeg_color_space));
+
+  if (ptr->format == FMT_YVU) {
+    rb_ivar_set(ret, id_out_cs, rb_str_freeze(rb_str_new_cstr("YCrCb")));
+  } else if (ptr->format == FMT_YUV422) {
+    rb_ivar_set(ret, id_out_cs, rb_str_freeze(rb_str_new_cstr("YUYV")));
+  } else if (ptr->format == FMT_RGB565) {
+    rb_ivar_set(ret, id_out_cs, rb_str_freeze(rb_str_new_cstr("RGB565")));
+  } else {
+    rb_ivar_set(ret, id_out_cs, get_colorspace_str(info->out_color_space));
+  }
+
+  if (IS_PACKED(ptr)) {
+    rb_ivar_set(ret, id_ncompo, INT2FIX(2));
+  } else if (TEST_FLAG_ALL(ptr, F_DITHER | F_EXPAND_COLORMAP)) {
+    rb_ivar_set(ret, id_ncompo, INT2FIX(info->out_color_components));
+  } else {
+    rb_ivar_set(ret, id_ncompo, INT2FIX(info->components));
+  }
+
+  if (TEST_FLAG(ptr, F_PARSE_EXIF)) {
+    rb_ivar_set(ret, id_exif_tags,
+                create_exif_tags_hash(info->exif.data, info->exif.size));
+    rb_define_singleton_method(ret, "exif_tags", rb_meta_exif_tags, 0);
+    rb_define_singleton_method(ret, "exif", rb_meta_exif_tags, 0);
+  } 
+
+  if (TEST_FLAG(ptr, F_DITHER)) {
+    rb_ivar_set(ret, id_colormap, create_colormap(info));
+  }
+
+  rb_obj_freeze(ret);
+  
+  return ret;
+}
+
+static VALUE
+do_read_header(VALUE _ptr)
+{
+  VALUE ret;
+  jpeg_decode_t* ptr;
+  uint8_t* data;
+  size_t size;
+  decode_info_t info;
+
+  /*
+   * initialize
+   */
+  ret  = Qnil;
+  ptr  = (jpeg_decode_t*)_ptr;
+  data = (uint8_t*)RSTRING_PTR(ptr->data);
+  size = RSTRING_LEN(ptr->data);
+
+  /*
+   * process body
+   */
+  ptr->cinfo.raw_data_out = FALSE;
+  ptr->cinfo.dct_method   = JDCT_FLOAT;
+
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    rb_raise(decerr_klass, "%s", ptr->err_mgr.msg);
+
+  } else {
+    /*
+     * normal path
+     */
+    jpeg_mem_src(&ptr->cinfo, data, size);
+
+    if (TEST_FLAG(ptr, F_PARSE_EXIF | F_APPLY_ORIENTATION)) {
+      jpeg_save_markers(&ptr->cinfo, JPEG_APP1, 0xFFFF);
+    }
+
+    jpeg_read_header(&ptr->cinfo, TRUE);
+    jpeg_calc_output_dimensions(&ptr->cinfo);
+
+    get_decode_info(ptr, &info);
+    ret = create_meta(ptr, &info);
+
+    // 次回のデコードで再度ヘッダが読まれるように状態を戻しておく
+    jpeg_abort_decompress(&ptr->cinfo);
+  }
+
+  return ret;
+}
+
+/**
+ * read meta data
+ *
+ * @overload read_header(jpeg)
+ *
+ *   @param jpeg [String] input data.
+ *
+ *   @return [JPEG::Meta] metadata.
+ */
+static VALUE
+rb_decoder_read_header(VALUE self, VALUE data)
+{
+  VALUE ret;
+  jpeg_decode_t* ptr;
+  int state;
+
+  /*
+   * initialize
+   */
+  ret   = Qnil;
+  state = 0;
+
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
+
+  /*
+   * argument check
+   */
+  Check_Type(data, T_STRING);
+
+  if (ptr->data != Qnil) {
+    RUNTIME_ERROR("decoder is busy");
+  }
+
+  /*
+   * prepare
+   */
+  SET_DATA(ptr, rb_str_new_frozen(data));
+
+  /*
+   * do encode
+   */
+  ret = rb_protect(do_read_header, (VALUE)ptr, &state);
+
+  /*
+   * post process
+   */
+  CLR_DATA(ptr);
+
+  if (state != 0) rb_jump_tag(state);
+
+  return ret;
+}
+
+static VALUE
+rb_decode_result_meta(VALUE self)
+{
+  return rb_ivar_get(self, id_meta);
+}
+
+static void
+add_meta(VALUE obj, jpeg_decode_t* ptr, decode_info_t* info)
+{
+  VALUE meta;
+
+  meta = create_meta(ptr, info);
+
+  rb_ivar_set(obj, id_meta, meta);
+  rb_define_singleton_method(obj, "meta", rb_decode_result_meta, 0);
+}
+
+static void
+expand_colormap(decode_info_t* info, VALUE img)
+{
+  /*
+   * 本関数はinfo->out_color_componentsが1または3であることを前提に
+   * 作成されています。
+   *
+   * 展開はバッファ上でその場で行う。後方から処理することで未読の
+   * カラー番号を上書きしないようにしている。
+   */
+
+  volatile int i;   // volatileを外すとaarch64のgcc6でクラッシュする場合がある
+  int n;
+  size_t size;
+  uint8_t* src;
+  uint8_t* dst;
+  JSAMPLE (*map)[256];
+
+  n    = info->width * info->height;
+  size = (size_t)n * info->out_color_components;
+  map  = info->colormap.map;
+
+  rb_str_set_len(img, n);
+
+  if (rb_str_capacity(img) < size) {
+    rb_str_modify_expand(img, size - n);
+  }
+
+  src = (uint8_t*)RSTRING_PTR(img);
+  dst = src;
+
+  switch (info->out_color_components) {
+  case 1:
+    for (i = 0; i < n; i++) {
+      dst[i] = map[0][src[i]];
+    }
+    break;
+
+  case 2:
+    for (i = n - 1; i >= 0; i--) {
+      dst[(i * 2) + 1] = map[1][src[i]];
+      dst[(i * 2) + 0] = map[0][src[i]];
+    }
+    break;
+
+  case 3:
+    for (i = n - 1; i >= 0; i--) {
+      dst[(i * 3) + 2] = map[2][src[i]];
+      dst[(i * 3) + 1] = map[1][src[i]];
+      dst[(i * 3) + 0] = map[0][src[i]];
+    }
+    break;
+
+  default:
+    RUNTIME_ERROR("this number of components is not implemented yet");
+  }
+
+  rb_str_set_len(img, size);
+}
+
+static void
+swap_cbcr(uint8_t* p, size_t size)
+{
+  int i;
+  uint8_t tmp;
+
+  for (i = 0; i < (int)size; i++) {
+    tmp  = p[1];
+    p[1] = p[2];
+    p[2] = tmp;
+  }
+}
+
+#if defined(__SSE2__)
+static inline void
+load_deinterleave3(uint8_t* src, __m128i* c0, __m128i* c1, __m128i* c2)
+{
+  __m128i t0;
+  __m128i t1;
+  __m128i t2;
+  __m128i u0;
+  __m128i u1;
+  __m128i u2;
+  int i;
+
+  /*
+   * SSE2にはバイトシャッフルが無いので、unpackを繰り返して
+   * 3チャネルのインタリーブを解く（16画素分）
+   */
+  t0 = _mm_loadu_si128((__m128i*)(src + 0));
+  t1 = _mm_loadu_si128((__m128i*)(src + 16));
+  t2 = _mm_loadu_si128((__m128i*)(src + 32));
+
+  for (i = 0; i < 4; i++) {
+    u0 = _mm_unpacklo_epi8(t0, _mm_unpackhi_epi64(t1, t1));
+    u1 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t0, t0), t2);
+    u2 = _mm_unpacklo_epi8(t1, _mm_unpackhi_epi64(t2, t2));
+
+    t0 = u0;
+    t1 = u1;
+    t2 = u2;
+  }
+
+  *c0 = t0;
+  *c1 = t1;
+  *c2 = t2;
+}
+#endif /* defined(__SSE2__) */
+
+/*
+ * YCbCr(3バイト/画素)の1行をYUYVに詰める。色差は隣接2画素の平均とし、
+ * 幅が奇数の場合の最後の画素は輝度を複製する。
+ * 同一バッファ上で前詰めで変換できるよう、書き込みは必ず読み出しの
+ * 後に行う（SIMD版も同様）。
+ */
+static void
+pack_yuv422_scalar(uint8_t* dst, uint8_t* src, int wd)
+{
+  int i;
+  int y0;
+  int y1;
+  int u;
+  int v;
+
+  for (i = 0; i + 1 < wd; i += 2) {
+    y0 = src[0];
+    y1 = src[3];
+    u  = (src[1] + src[4] + 1) >> 1;
+    v  = (src[2] + src[5] + 1) >> 1;
+
+    dst[0] = y0;
+    dst[1] = u;
+    dst[2] = y1;
+    dst[3] = v;
+
+    src += 6;
+    dst += 4;
+  }
+
+  if (i < wd) {
+    y0 = src[0];
+    u  = src[1];
+    v  = src[2];
+
+    dst[0] = y0;
+    dst[1] = u;
+    dst[2] = y0;
+    dst[3] = v;
+  }
+}
+
+/*
+ * RGBX(4バイト/画素)の1行をRGB565(リトルエンディアン)に詰める
+ */
+static void
+pack_rgb565_scalar(uint8_t* dst, uint8_t* src, int wd)
+{
+  int i;
+  int r;
+  int g;
+  int b;
+
+  for (i = 0; i < wd; i++) {
+    r = src[0];
+    g = src[1];
+    b = src[2];
+
+    dst[0] = ((g << 3) & 0xe0) | (b >> 3);
+    dst[1] = (r & 0xf8) | (g >> 5);
+
+    src += 4;
+    dst += 2;
+  }
+}
+
+#if defined(__SSE2__)
+static void
+pack_yuv422_sse2(uint8_t* dst, uint8_t* src, int wd)
+{
+  __m128i y;
+  __m128i cb;
+  __m128i cr;
+  __m128i uv;
+  __m128i mask;
+  int i;
+
+  mask = _mm_set1_epi16(0x00ff);
+
+  for (i = 0; i + 16 <= wd; i += 16) {
+    load_deinterleave3(src, &y, &cb, &cr);
+
+    cb = _mm_avg_epu16(_mm_and_si128(cb, mask), _mm_srli_epi16(cb, 8));
+    cr = _mm_avg_epu16(_mm_and_si128(cr, mask), _mm_srli_epi16(cr, 8));
+    uv = _mm_packus_epi16(cb, cr);
+    uv = _mm_unpacklo_epi8(uv, _mm_srli_si128(uv, 8));
+
+    _mm_storeu_si128((__m128i*)(dst + 0), _mm_unpacklo_epi8(y, uv));
+    _mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi8(y, uv));
+
+    src += 48;
+    dst += 32;
+  }
+
+  pack_yuv422_scalar(dst, src, wd - i);
+}
+
+static void
+pack_rgb565_sse2(uint8_t* dst, uint8_t* src, int wd)
+{
+  __m128i p0;
+  __m128i p1;
+  __m128i m_r;
+  __m128i m_g;
+  __m128i m_b;
+  int i;
+
+  m_r = _mm_set1_epi32(0x000000f8);
+  m_g = _mm_set1_epi32(0x000007e0);
+  m_b = _mm_set1_epi32(0x0000001f);
+
+#define TO_RGB565(x) \
+  _mm_srai_epi32(_mm_slli_epi32( \
+    _mm_or_si128(_mm_or_si128( \
+      _mm_slli_epi32(_mm_and_si128((x), m_r), 8), \
+      _mm_and_si128(_mm_srli_epi32((x), 5), m_g)), \
+      _mm_and_si128(_mm_srli_epi32((x), 19), m_b)), 16), 16)
+
+  for (i = 0; i + 8 <= wd; i += 8) {
+    p0 = _mm_loadu_si128((__m128i*)(src + 0));
+    p1 = _mm_loadu_si128((__m128i*)(src + 16));
+
+    // 符号拡張しておけば飽和なしでpackできる
+    _mm_storeu_si128((__m128i*)dst,
+                     _mm_packs_epi32(TO_RGB565(p0), TO_RGB565(p1)));
+
+    src += 32;
+    dst += 16;
+  }
+
+#undef TO_RGB565
+
+  pack_rgb565_scalar(dst, src, wd - i);
+}
+#endif /* defined(__SSE2__) */
+
+#if defined(__ARM_NEON)
+static void
+pack_yuv422_neon(uint8_t* dst, uint8_t* src, int wd)
+{
+  uint8x16x3_t in;
+  uint8x16x2_t out;
+  uint8x8x2_t uv;
+  int i;
+
+  for (i = 0; i + 16 <= wd; i += 16) {
+    in = vld3q_u8(src);
+
+    uv = vzip_u8(vrshrn_n_u16(vpaddlq_u8(in.val[1]), 1),
+                 vrshrn_n_u16(vpaddlq_u8(in.val[2]), 1));
+
+    out.val[0] = in.val[0];
+    out.val[1] = vcombine_u8(uv.val[0], uv.val[1]);
+
+    vst2q_u8(dst, out);
+
+    src += 48;
+    dst += 32;
+  }
+
+  pack_yuv422_scalar(dst, src, wd - i);
+}
+
+static void
+pack_rgb565_neon(uint8_t* dst, uint8_t* src, int wd)
+{
+  uint8x16x4_t in;
+  uint8x16x2_t out;
+  int i;
+
+  for (i = 0; i + 16 <= wd; i += 16) {
+    in = vld4q_u8(src);
+
+    out.val[0] = vorrq_u8(vandq_u8(vshlq_n_u8(in.val[1], 3),
+                                   vdupq_n_u8(0xe0)),
+                          vshrq_n_u8(in.val[2], 3));
+    out.val[1] = vorrq_u8(vandq_u8(in.val[0], vdupq_n_u8(0xf8)),
+                          vshrq_n_u8(in.val[1], 5));
+
+    vst2q_u8(dst, out);
+
+    src += 64;
+    dst += 32;
+  }
+
+  pack_rgb565_scalar(dst, src, wd - i);
+}
+#endif /* defined(__ARM_NEON) */
+
+/*
+ * 復号結果をパック形式に詰め直す（バッファ上で変換する）
+ */
+static void
+pack_output(jpeg_decode_t* ptr, VALUE img, int wd, int ht, int nc)
+{
+  uint8_t* p;
+  size_t src_st;
+  size_t dst_st;
+  int y;
+
+  src_st = (size_t)wd * nc;
+  dst_st = packed_stride(ptr->format, wd);
+
+  // 幅1のYUYVだけは変換後の方が大きくなる
+  if (dst_st * ht > (size_t)RSTRING_LEN(img)) {
+    rb_str_modify_expand(img, (dst_st * ht) - RSTRING_LEN(img));
+  }
+
+  p = (uint8_t*)RSTRING_PTR(img);
+
+  if (dst_st <= src_st) {
+    for (y = 0; y < ht; y++) {
+      if (ptr->format == FMT_YUV422) {
+        kernels.pack_yuv422(p + (dst_st * y), p + (src_st * y), wd);
+      } else {
+        kernels.pack_rgb565(p + (dst_st * y), p + (src_st * y), wd);
+      }
+    }
+
+  } else {
+    for (y = ht - 1; y >= 0; y--) {
+      kernels.pack_yuv422(p + (dst_st * y), p + (src_st * y), wd);
+    }
+  }
+
+  rb_str_set_len(img, dst_st * ht);
+}
+
+/*
+ * 転置は8x8画素のブロック単位で行う。ブロックの処理はSIMD版があれば
+ * レジスタ上で並べ替え、画像はさらにTRANSPOSE_TILE画素四方のタイル毎に
+ * 処理して書き込み先がキャッシュに乗っている間に埋まるようにする。
+ */
+static inline void
+transpose_rect(uint8_t* sp, ptrdiff_t ss, uint8_t* dp, ptrdiff_t ds,
+               int bw, int bh, int nc)
+{
+  int x;
+  int y;
+  int i;
+
+  for (y = 0; y < bh; y++) {
+    for (x = 0; x < bw; x++) {
+      for (i = 0; i < nc; i++) {
+        dp[(x * ds) + (y * nc) + i] = sp[(y * ss) + (x * nc) + i];
+      }
+    }
+  }
+}
+
+static void
+transpose8_scalar(uint8_t* sp, ptrdiff_t ss, uint8_t* dp, ptrdiff_t ds)
+{
+  transpose_rect(sp, ss, dp, ds, 8, 8, 1);
+}
+
+static void
+transpose16_scalar(uint8_t* sp, ptrdiff_t ss, uint8_t* dp, ptrdiff_t ds)
+{
+  transpose_rect(sp, ss, dp, ds, 8, 8, 2);
+}
+
+static void
+transpose24_scalar(uint8_t* sp, ptrdiff_t ss, uint8_t* dp, ptrdiff_t ds)
+{
+  transpose_rect(sp, ss, dp, ds, 8, 8, 3);
+}
+
+static void
+transpose32_scalar(uint8_t* sp, ptrdiff_t ss, uint8_t* dp, ptrdiff_t ds)
+{
+  transpose_rect(sp, ss, dp, ds, 8, 8, 4);
+}
+
+#if defined(__SSE2__)
+static void
+transpose8_sse2(uint8_t* sp, ptrdiff_t ss, uint8_t* dp, ptrdiff_t ds)
+{
+  __m128i a0;
+  __m128i a1;
+  __m128i a2;
+  __m128i a3;
+  __m128i b0;
+  __m128i b1;
+  __m128i b2;
+  __m128i b3;
+
+#define LOAD(y)   _mm_loadl_epi64((__m128i*)(sp + ((y) * ss)))
+#define STORE(x, v) \
+  _mm_storel_epi64((__m128i*)(dp + ((x) * ds)), (v)); \
+  _mm_storel_epi64((__m128i*)(dp + (((x) + 1) * ds)), _mm_srli_si128((v), 8))
+
+  a0 = _mm_unpacklo_epi8(LOAD(0), LOAD(1));
+  a1 = _mm_unpacklo_epi8(LOAD(2), LOAD(3));
+  a2 = _mm_unpacklo_epi8(LOAD(4), LOAD(5));
+  a3 = _mm_unpacklo_epi8(LOAD(6), LOAD(7));
+
+  b0 = _mm_unpacklo_epi16(a0, a1);
+  b1 = _mm_unpackhi_epi16(a0, a1);
+  b2 = _mm_unpacklo_epi16(a2, a3);
+  b3 = _mm_unpackhi_epi16(a2, a3);
+
+  STORE(0, _mm_unpacklo_epi32(b0, b2));
+  STORE(2, _mm_unpackhi_epi32(b0, b2));
+  STORE(4, _mm_unpacklo_epi32(b1, b3));
+  STORE(6, _mm_unpackhi_epi32(b1, b3));
+
+#undef LOAD
+#undef STORE
+}
+
+/*
+ * 4x4画素(32bit)の転置
+ */
+static inline void
+transpose4x4_epi32(__m128i* r0, __m128i* r1, __m128i* r2, __m128i* r3)
+{
+  __m128i t0;
+  __m128i t1;
+  __m128i t2;
+  __m128i t3;
+
+  t0 = _mm_unpacklo_epi32(*r0, *r1);
+  t1 = _mm_unpacklo_epi32(*r2, *r3);
+  t2 = _mm_unpackhi_epi32(*r0, *r1);
+  t3 = _mm_unpackhi_epi32(*r2, *r3);
+
+  *r0 = _mm_unpacklo_epi64(t0, t1);
+  *r1 = _mm_unpackhi_epi64(t0, t1);
+  *r2 = _mm_unpacklo_epi64(t2, t3);
+  *r3 = _mm_unpackhi_epi64(t2, t3);
+}
+
+static void
+transpose32_sse2(uint8_t* sp, ptrdiff_t ss, uint8_t* dp, ptrdiff_t ds)
+{
+  __m128i r[4];
+  int x;
+  int y;
+  int i;
+
+  for (y = 0; y < 8; y += 4) {
+    for (x = 0; x < 8; x += 4) {
+      for (i = 0; i < 4; i++) {
+        r[i] = _mm_loadu_si128((__m128i*)(sp + ((y + i) * ss) + (x * 4)));
+      }
+
+      transpose4x4_epi32(&r[0], &r[1], &r[2], &r[3]);
+
+      for (i = 0; i < 4; i++) {
+        _mm_storeu_si128((__m128i*)(dp + ((x + i) * ds) + (y * 4)), r[i]);
+      }
+    }
+  }
+}
+
+/*
+ * 12バイト(4画素)を読み出して1画素を32bitに広げる（範囲外は読まない）
+ */
+static inline __m128i
+load_pixel3(uint8_t* p)
+{
+  __m128i q;
+  int32_t tail;
+
+  memcpy(&tail, p + 8, sizeof(tail));
+
+  q = _mm_unpacklo_epi64(_mm_loadl_epi64((__m128i*)p), _mm_cvtsi32_si128(tail));
+  q = _mm_unpacklo_epi64(q, _mm_srli_si128(q, 6));
+
+  return _mm_or_si128(
+           _mm_and_si128(q, _mm_set1_epi64x(0x0000000000ffffffLL)),
+           _mm_and_si128(_mm_slli_epi64(q, 8),
+                         _mm_set1_epi64x(0x00ffffff00000000LL)));
+}
+
+static inline void
+store_pixel3(uint8_t* p, __m128i v)
+{
+  int32_t tail;
+
+  v    = compact_pixel3(v);
+  tail = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+
+  _mm_storel_epi64((__m128i*)p, v);
+  memcpy(p + 8, &tail, sizeof(tail));
+}
+
+static void
+transpose24_sse2(uint8_t* sp, ptrdiff_t ss, uint8_t* dp, ptrdiff_t ds)
+{
+  __m128i r[4];
+  int x;
+  int y;
+  int i;
+
+  for (y = 0; y < 8; y += 4) {
+    for (x = 0; x < 8; x += 4) {
+      for (i = 0; i < 4; i++) {
+        r[i] = load_pixel3(sp + ((y + i) * ss) + (x * 3));
+      }
+
+      transpose4x4_epi32(&r[0], &r[1], &r[2], &r[3]);
+
+      for (i = 0; i < 4; i++) {
+        store_pixel3(dp + ((x + i) * ds) + (y * 3), r[i]);
+      }
+    }
+  }
+}
+#endif /* defined(__SSE2__) */
+
+#if defined(__ARM_NEON)
+/*
+ * 8x8画素(8bit)の転置（vtrnを3段重ねる）
+ */
+static inline void
+transpose8x8_u8(uint8x8_t r[8])
+{
+  uint8x8x2_t t0;
+  uint8x8x2_t t1;
+  uint8x8x2_t t2;
+  uint8x8x2_t t3;
+  uint16x4x2_t u0;
+  uint16x4x2_t u1;
+  uint16x4x2_t u2;
+  uint16x4x2_t u3;
+  uint32x2x2_t v0;
+  uint32x2x2_t v1;
+  uint32x2x2_t v2;
+  uint32x2x2_t v3;
+
+  t0 = vtrn_u8(r[0], r[1]);
+  t1 = vtrn_u8(r[2], r[3]);
+  t2 = vtrn_u8(r[4], r[5]);
+  t3 = vtrn_u8(r[6], r[7]);
+
+  u0 = vtrn_u16(vreinterpret_u16_u8(t0.val[0]), vreinterpret_u16_u8(t1.val[0]));
+  u1 = vtrn_u16(vreinterpret_u16_u8(t0.val[1]), vreinterpret_u16_u8(t1.val[1]));
+  u2 = vtrn_u16(vreinterpret_u16_u8(t2.val[0]), vreinterpret_u16_u8(t3.val[0]));
+  u3 = vtrn_u16(vreinterpret_u16_u8(t2.val[1]), vreinterpret_u16_u8(t3.val[1]));
+
+  v0 = vtrn_u32(vreinterpret_u32_u16(u0.val[0]), vreinterpret_u32_u16(u2.val[0]));
+  v1 = vtrn_u32(vreinterpret_u32_u16(u1.val[0]), vreinterpret_u32_u16(u3.val[0]));
+  v2 = vtrn_u32(vreinterpret_u32_u16(u0.val[1]), vreinterpret_u32_u16(u2.val[1]));
+  v3 = vtrn_u32(vreinterpret_u32_u16(u1.val[1]), vreinterpret_u32_u16(u3.val[1]));
+
+  r[0] = vreinterpret_u8_u32(v0.val[0]);
+  r[1] = vreinterpret_u8_u32(v1.val[0]);
+  r[2] = vreinterpret_u8_u32(v2.val[0]);
+  r[3] = vreinterpret_u8_u32(v3.val[0]);
+  r[4] = vreinterpret_u8_u32(v0.val[1]);
+  r[5] = vreinterpret_u8_u32(v1.val[1]);
+  r[6] = vreinterpret_u8_u32(v2.val[1]);
+  r[7] = vreinterpret_u8_u32(v3.val[1]);
+}
+
+static void
+transpose8_neon(uint8_t* sp, ptrdiff_t ss, uint8_t* dp, ptrdiff_t ds)
+{
+  uint8x8_t r[8];
+  int i;
+
+  for (i = 0; i < 8; i++) r[i] = vld1_u8(sp + (i * ss));
+
+  transpose8x8_u8(r);
+
+  for (i = 0; i < 8; i++) vst1_u8(dp + (i * ds), r[i]);
+}
+
+static void
+transpose24_neon(uint8_t* sp, ptrdiff_t ss, uint8_t* dp, ptrdiff_t ds)
+{
+  uint8x8x3_t px[8];
+  uint8x8_t r[8];
+  int i;
+  int j;
+
+  // チャネル毎のプレーンに分けてから転置する
+  for (i = 0; i < 8; i++) px[i] = vld3_u8(sp + (i * ss));
+
+  for (j = 0; j < 3; j++) {
+    for (i = 0; i < 8; i++) r[i] = px[i].val[j];
+
+    transpose8x8_u8(r);
+
+    for (i = 0; i < 8; i++) px[i].val[j] = r[i];
+  }
+
+  for (i = 0; i < 8; i++) vst3_u8(dp + (i * ds), px[i]);
+}
+
+static void
+transpose32_neon(uint8_t* sp, ptrdiff_t ss, uint8_t* dp, ptrdiff_t ds)
+{
+  uint32x4_t r[4];
+  uint32x4x2_t t0;
+  uint32x4x2_t t1;
+  int x;
+  int y;
+  int i;
+
+  for (y = 0; y < 8; y += 4) {
+    for (x = 0; x < 8; x += 4) {
+      for (i = 0; i < 4; i++) {
+        r[i] = vreinterpretq_u32_u8(vld1q_u8(sp + ((y + i) * ss) + (x * 4)));
+      }
+
+      t0 = vtrnq_u32(r[0], r[1]);
+      t1 = vtrnq_u32(r[2], r[3]);
+
+      r[0] = vcombine_u32(vget_low_u32(t0.val[0]), vget_low_u32(t1.val[0]));
+      r[1] = vcombine_u32(vget_low_u32(t0.val[1]), vget_low_u32(t1.val[1]));
+      r[2] = vcombine_u32(vget_high_u32(t0.val[0]), vget_high_u32(t1.val[0]));
+      r[3] = vcombine_u32(vget_high_u32(t0.val[1]), vget_high_u32(t1.val[1]));
+
+      for (i = 0; i < 4; i++) {
+        vst1q_u8(dp + ((x + i) * ds) + (y * 4), vreinterpretq_u8_u32(r[i]));
+      }
+    }
+  }
+}
+#endif /* defined(__ARM_NEON) */
+
+/*
+ * wd x ht画素の画像を転置する。ストライドに負の値を与えると上下を反転
+ * しながら読み出し(書き込み)を行う。
+ */
+static void
+transpose_image(uint8_t* sp, ptrdiff_t ss, uint8_t* dp, ptrdiff_t ds,
+                int wd, int ht, int nc)
+{
+  block_conv_t conv;
+  uint8_t* s;
+  uint8_t* d;
+  int tx;
+  int ty;
+  int tw;
+  int th;
+  int x;
+  int y;
+
+  conv = kernels.transpose[nc - 1];
+
+  for (ty = 0; ty < ht; ty += TRANSPOSE_TILE) {
+    th = (ht - ty < TRANSPOSE_TILE)? ht - ty: TRANSPOSE_TILE;
+
+    for (tx = 0; tx < wd; tx += TRANSPOSE_TILE) {
+      tw = (wd - tx < TRANSPOSE_TILE)? wd - tx: TRANSPOSE_TILE;
+
+      for (y = ty; y < ty + th; y += 8) {
+        s = sp + (y * ss) + (tx * nc);
+        d = dp + (tx * ds) + (y * nc);
+
+        for (x = 0; x + 8 <= tw && y + 8 <= ht; x += 8) {
+          conv(s + (x * nc), ss, d + (x * ds), ds);
+        }
+
+        // 右端と下端の端数
+        if (x < tw) {
+          transpose_rect(s + (x * nc), ss, d + (x * ds), ds,
+                         tw - x, (ht - y < 8)? ht - y: 8, nc);
+        }
+      }
+    }
+  }
+}
+
+/*
+ * 1行分の画素を左右反転して複写する(srcとdstは重ならないこと)
+ */
+static inline void
+mirror_pixels(uint8_t* dst, uint8_t* src, int wd, int nc)
+{
+  int i;
+
+  src += (wd - 1) * nc;
+
+  for (i = 0; i < wd; i++) {
+    memcpy(dst, src, nc);
+
+    dst += nc;
+    src -= nc;
+  }
+}
+
+static void
+mirror8_scalar(uint8_t* dst, uint8_t* src, int wd)
+{
+  mirror_pixels(dst, src, wd, 1);
+}
+
+static void
+mirror16_scalar(uint8_t* dst, uint8_t* src, int wd)
+{
+  mirror_pixels(dst, src, wd, 2);
+}
+
+static void
+mirror24_scalar(uint8_t* dst, uint8_t* src, int wd)
+{
+  mirror_pixels(dst, src, wd, 3);
+}
+
+static void
+mirror32_scalar(uint8_t* dst, uint8_t* src, int wd)
+{
+  mirror_pixels(dst, src, wd, 4);
+}
+
+/*
+ * SIMD版は行の末尾から1レジスタ分ずつ読み出し、逆順に並べ替えて先頭から
+ * 書き込む。残った端数(srcの先頭側)はスカラ版で処理する。
+ */
+#if defined(__SSE2__)
+static inline __m128i
+reverse_epi16(__m128i v)
+{
+  v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+  v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+
+  return _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+static void
+mirror8_sse2(uint8_t* dst, uint8_t* src, int wd)
+{
+  __m128i v;
+  int x;
+
+  for (x = 0; x + 16 <= wd; x += 16) {
+    v = _mm_loadu_si128((__m128i*)(src + (wd - x - 16)));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+
+    _mm_storeu_si128((__m128i*)(dst + x), reverse_epi16(v));
+  }
+
+  mirror8_scalar(dst + x, src, wd - x);
+}
+
+static void
+mirror16_sse2(uint8_t* dst, uint8_t* src, int wd)
+{
+  __m128i v;
+  int x;
+
+  for (x = 0; x + 8 <= wd; x += 8) {
+    v = _mm_loadu_si128((__m128i*)(src + ((wd - x - 8) * 2)));
+
+    _mm_storeu_si128((__m128i*)(dst + (x * 2)), reverse_epi16(v));
+  }
+
+  mirror16_scalar(dst + (x * 2), src, wd - x);
+}
+
+static void
+mirror24_sse2(uint8_t* dst, uint8_t* src, int wd)
+{
+  __m128i v;
+  int x;
+
+  for (x = 0; x + 4 <= wd; x += 4) {
+    v = load_pixel3(src + ((wd - x - 4) * 3));
+
+    store_pixel3(dst + (x * 3), _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+  }
+
+  mirror24_scalar(dst + (x * 3), src, wd - x);
+}
+
+static void
+mirror32_sse2(uint8_t* dst, uint8_t* src, int wd)
+{
+  __m128i v;
+  int x;
+
+  for (x = 0; x + 4 <= wd; x += 4) {
+    v = _mm_loadu_si128((__m128i*)(src + ((wd - x - 4) * 4)));
+
+    _mm_storeu_si128((__m128i*)(dst + (x * 4)),
+                     _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+  }
+
+  mirror32_scalar(dst + (x * 4), src, wd - x);
+}
+#endif /* defined(__SSE2__) */
+
+#ifdef HAVE_AVX2_KERNEL
+/*
+ * AVX2版はレーン内をvpshufbで反転し、レーンを入れ替える
+ */
+__attribute__((target("avx2")))
+static inline void
+mirror_bytes_avx2(uint8_t* dst, uint8_t* src, int n, int wd, __m256i s)
+{
+  __m256i v;
+  int x;
+
+  for (x = 0; x + 32 <= wd; x += 32) {
+    v = _mm256_loadu_si256((__m256i*)(src + (wd - x - 32)));
+    v = _mm256_shuffle_epi8(v, s);
+
+    _mm256_storeu_si256((__m256i*)(dst + x), _mm256_permute4x64_epi64(v, 0x4e));
+  }
+
+  mirror_pixels(dst + x, src, (wd - x) / n, n);
+}
+
+__attribute__((target("avx2")))
+static void
+mirror8_avx2(uint8_t* dst, uint8_t* src, int wd)
+{
+  mirror_bytes_avx2(dst, src, 1, wd,
+                    _mm256_setr_epi8(
+                      15, 14, 13, 12, 11, 10,  9,  8,
+                       7,  6,  5,  4,  3,  2,  1,  0,
+                      15, 14, 13, 12, 11, 10,  9,  8,
+                       7,  6,  5,  4,  3,  2,  1,  0));
+}
+
+__attribute__((target("avx2")))
+static void
+mirror16_avx2(uint8_t* dst, uint8_t* src, int wd)
+{
+  mirror_bytes_avx2(dst, src, 2, wd * 2,
+                    _mm256_setr_epi8(
+                      14, 15, 12, 13, 10, 11,  8,  9,
+                       6,  7,  4,  5,  2,  3,  0,  1,
+                      14, 15, 12, 13, 10, 11,  8,  9,
+                       6,  7,  4,  5,  2,  3,  0,  1));
+}
+
+/*
+ * 24bitは16画素(48バイト)単位で、出力の各16バイトを2〜3本の入力から
+ * pshufbで集める
+ */
+__attribute__((target("avx2")))
+static void
+mirror24_avx2(uint8_t* dst, uint8_t* src, int wd)
+{
+  __m128i m02;
+  __m128i m01;
+  __m128i m11;
+  __m128i m10;
+  __m128i m12;
+  __m128i m20;
+  __m128i m21;
+  __m128i s0;
+  __m128i s1;
+  __m128i s2;
+  uint8_t* sp;
+  int x;
+
+  m02 = _mm_setr_epi8(13, 14, 15, 10, 11, 12,  7,  8,
+                       9,  4,  5,  6,  1,  2,  3, -1);
+  m01 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                      -1, -1, -1, -1, -1, -1, -1, 14);
+  m11 = _mm_setr_epi8(15, -1, 11, 12, 13,  8,  9, 10,
+                       5,  6,  7,  2,  3,  4, -1,  0);
+  m10 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                      -1, -1, -1, -1, -1, -1, 15, -1);
+  m12 = _mm_setr_epi8(-1,  0, -1, -1, -1, -1, -1, -1,
+                      -1, -1, -1, -1, -1, -1, -1, -1);
+  m20 = _mm_setr_epi8(-1, 12, 13, 14,  9, 10, 11,  6,
+                       7,  8,  3,  4,  5,  0,  1,  2);
+  m21 = _mm_setr_epi8( 1, -1, -1, -1, -1, -1, -1, -1,
+                      -1, -1, -1, -1, -1, -1, -1, -1);
+
+  for (x = 0; x + 16 <= wd; x += 16) {
+    sp = src + ((wd - x - 16) * 3);
+    s0 = _mm_loadu_si128((__m128i*)(sp + 0));
+    s1 = _mm_loadu_si128((__m128i*)(sp + 16));
+    s2 = _mm_loadu_si128((__m128i*)(sp + 32));
+
+    _mm_storeu_si128((__m128i*)(dst + (x * 3) + 0),
+                     _mm_or_si128(_mm_shuffle_epi8(s2, m02),
+                                  _mm_shuffle_epi8(s1, m01)));
+    _mm_storeu_si128((__m128i*)(dst + (x * 3) + 16),
+                     _mm_or_si128(_mm_shuffle_epi8(s1, m11),
+                                  _mm_or_si128(_mm_shuffle_epi8(s0, m10),
+                                               _mm_shuffle_epi8(s2, m12))));
+    _mm_storeu_si128((__m128i*)(dst + (x * 3) + 32),
+                     _mm_or_si128(_mm_shuffle_epi8(s0, m20),
+                                  _mm_shuffle_epi8(s1, m21)));
+  }
+
+  mirror24_scalar(dst + (x * 3), src, wd - x);
+}
+
+__attribute__((target("avx2")))
+static void
+mirror32_avx2(uint8_t* dst, uint8_t* src, int wd)
+{
+  __m256i s;
+  __m256i v;
+  int x;
+
+  s = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+  for (x = 0; x + 8 <= wd; x += 8) {
+    v = _mm256_loadu_si256((__m256i*)(src + ((wd - x - 8) * 4)));
+
+    _mm256_storeu_si256((__m256i*)(dst + (x * 4)),
+                        _mm256_permutevar8x32_epi32(v, s));
+  }
+
+  mirror32_scalar(dst + (x * 4), src, wd - x);
+}
+#endif /* defined(HAVE_AVX2_KERNEL) */
+
+#if defined(__ARM_NEON)
+static inline uint8x16_t
+reverse_u8(uint8x16_t v)
+{
+  v = vrev64q_u8(v);
+
+  return vcombine_u8(vget_high_u8(v), vget_low_u8(v));
+}
+
+static void
+mirror8_neon(uint8_t* dst, uint8_t* src, int wd)
+{
+  int x;
+
+  for (x = 0; x + 16 <= wd; x += 16) {
+    vst1q_u8(dst + x, reverse_u8(vld1q_u8(src + (wd - x - 16))));
+  }
+
+  mirror8_scalar(dst + x, src, wd - x);
+}
+
+static void
+mirror16_neon(uint8_t* dst, uint8_t* src, int wd)
+{
+  uint16x8_t v;
+  int x;
+
+  for (x = 0; x + 8 <= wd; x += 8) {
+    v = vrev64q_u16(vld1q_u16((uint16_t*)(src + ((wd - x - 8) * 2))));
+
+    vst1q_u16((uint16_t*)(dst + (x * 2)),
+              vcombine_u16(vget_high_u16(v), vget_low_u16(v)));
+  }
+
+  mirror16_scalar(dst + (x * 2), src, wd - x);
+}
+
+static void
+mirror24_neon(uint8_t* dst, uint8_t* src, int wd)
+{
+  uint8x16x3_t v;
+  int x;
+
+  for (x = 0; x + 16 <= wd; x += 16) {
+    v = vld3q_u8(src + ((wd - x - 16) * 3));
+
+    v.val[0] = reverse_u8(v.val[0]);
+    v.val[1] = reverse_u8(v.val[1]);
+    v.val[2] = reverse_u8(v.val[2]);
+
+    vst3q_u8(dst + (x * 3), v);
+  }
+
+  mirror24_scalar(dst + (x * 3), src, wd - x);
+}
+
+static void
+mirror32_neon(uint8_t* dst, uint8_t* src, int wd)
+{
+  uint32x4_t v;
+  int x;
+
+  for (x = 0; x + 4 <= wd; x += 4) {
+    v = vrev64q_u32(vld1q_u32((uint32_t*)(src + ((wd - x - 4) * 4))));
+
+    vst1q_u32((uint32_t*)(dst + (x * 4)),
+              vcombine_u32(vget_high_u32(v), vget_low_u32(v)));
+  }
+
+  mirror32_scalar(dst + (x * 4), src, wd - x);
+}
+#endif /* defined(__ARM_NEON) */
+
+/*
+ * 出力先の設定。orientationにはExifの向きから求めた値(0〜7)を指定する。
+ * bit2が転置、下位2bitが1:左右反転 2:180度回転 3:上下反転を表す。
+ *
+ * パック形式(YUYV, RGB565)はlibjpegの出力(YCbCr, RGBX)を帯バッファで
+ * 受け、書き出す際に詰める。但し転置する場合は出力の1行が全ての帯に
+ * 跨り、YUYVは横に隣接する2画素で色差を共有するので、帯単位では詰め
+ * られない。この場合は詰める前の形式で書き出し、復号後に詰め直す。
+ */
+static void
+set_output(jpeg_decode_t* ptr, uint8_t* buf, int wd, int ht, int orientation)
+{
+  ptr->dst.ptr         = buf;
+  ptr->dst.nc          = ptr->cinfo.output_components;
+  ptr->dst.stride      = (size_t)wd * ptr->dst.nc;
+  ptr->dst.width       = wd;
+  ptr->dst.height      = ht;
+  ptr->dst.orientation = orientation;
+  ptr->dst.pack        = (PACK_ON_OUTPUT(ptr, orientation))? ptr->format: 0;
+  ptr->dst.pstride     = (ptr->dst.pack)?
+                          (size_t)packed_stride(ptr->format, wd): 0;
+  ptr->dst.band        = NULL;
+  ptr->dst.top         = 0;
+  ptr->dst.fill        = 0;
+}
+
+#define FLIP_H(o)   (((o) & 3) == 1 || ((o) & 3) == 2)
+#define FLIP_V(o)   (((o) & 3) == 2 || ((o) & 3) == 3)
+
+// 転置、左右反転またはパック形式への詰め直しを伴う場合は帯バッファを経由する
+#define USE_BAND(ptr) \
+  (((ptr)->dst.orientation & 4) || FLIP_H((ptr)->dst.orientation) || \
+   (ptr)->dst.pack)
+
+/*
+ * 続けて書き込み先を要求できる行数
+ */
+static int
+output_capacity(jpeg_decode_t* ptr)
+{
+  return (USE_BAND(ptr))? ORIENT_BAND_ROWS - ptr->dst.fill: INT_MAX;
+}
+
+/*
+ * 元画像のy行目の書き込み先を返す(行は上から順に要求すること)
+ */
+static uint8_t*
+output_row(jpeg_decode_t* ptr, int y)
+{
+  j_common_ptr cinfo;
+
+  if (USE_BAND(ptr)) {
+    if (ptr->dst.band == NULL) {
+      // 左右反転してから詰める場合の作業用に1行余分に確保する
+      cinfo         = (j_common_ptr)&ptr->cinfo;
+      ptr->dst.band = (uint8_t*)(*cinfo->mem->alloc_large)(cinfo, JPOOL_IMAGE,
+                                     ptr->dst.stride * (ORIENT_BAND_ROWS + 1));
+    }
+
+    return ptr->dst.band + ((y - ptr->dst.top) * ptr->dst.stride);
+  }
+
+  if (FLIP_V(ptr->dst.orientation)) y = ptr->dst.height - 1 - y;
+
+  return ptr->dst.ptr + (y * ptr->dst.stride);
+}
+
+/*
+ * 左右反転のみの場合は、帯バッファの行を反転しながら最終的な行に複写する
+ */
+static void
+flush_mirrored(jpeg_decode_t* ptr, int n)
+{
+  row_conv_t conv;
+  uint8_t* sp;
+  int y;
+  int i;
+
+  conv = kernels.mirror[ptr->dst.nc - 1];
+  sp   = ptr->dst.band;
+
+  for (i = 0; i < n; i++) {
+    y = ptr->dst.top + i;
+    if (FLIP_V(ptr->dst.orientation)) y = ptr->dst.height - 1 - y;
+
+    conv(ptr->dst.ptr + (y * ptr->dst.stride), sp, ptr->dst.width);
+
+    sp += ptr->dst.stride;
+  }
+}
+
+/*
+ * 帯バッファの行を(必要なら左右反転してから)パック形式に詰めて最終的な
+ * 行に書き込む
+ */
+static void
+flush_packed(jpeg_decode_t* ptr, int n)
+{
+  row_conv_t pack;
+  row_conv_t mirror;
+  uint8_t* sp;
+  uint8_t* tmp;
+  int y;
+  int i;
+
+  pack   = (ptr->dst.pack == FMT_YUV422)?
+                     kernels.pack_yuv422: kernels.pack_rgb565;
+  mirror = kernels.mirror[ptr->dst.nc - 1];
+  sp     = ptr->dst.band;
+  tmp    = ptr->dst.band + (ORIENT_BAND_ROWS * ptr->dst.stride);
+
+  for (i = 0; i < n; i++) {
+    y = ptr->dst.top + i;
+    if (FLIP_V(ptr->dst.orientation)) y = ptr->dst.height - 1 - y;
+
+    if (FLIP_H(ptr->dst.orientation)) {
+      mirror(tmp, sp, ptr->dst.width);
+      pack(ptr->dst.ptr + (y * ptr->dst.pstride), tmp, ptr->dst.width);
+    } else {
+      pack(ptr->dst.ptr + (y * ptr->dst.pstride), sp, ptr->dst.width);
+    }
+
+    sp += ptr->dst.stride;
+  }
+}
+
+/*
+ * 帯バッファの行を転置して最終的な位置に書き込む
+ */
+static void
+flush_transposed(jpeg_decode_t* ptr, int n)
+{
+  uint8_t* sp;
+  uint8_t* dp;
+  ptrdiff_t ss;
+  ptrdiff_t ds;
+  int col;
+
+  /*
+   * 転置後の左右反転は帯の行を逆順に、上下反転は出力先の行を逆順に
+   * 辿ることで実現する
+   */
+  ss = ptr->dst.stride;
+  ds = (ptrdiff_t)ptr->dst.height * ptr->dst.nc;
+
+  if (FLIP_H(ptr->dst.orientation)) {
+    sp  = ptr->dst.band + ((n - 1) * ss);
+    ss  = -ss;
+    col = ptr->dst.height - ptr->dst.top - n;
+  } else {
+    sp  = ptr->dst.band;
+    col = ptr->dst.top;
+  }
+
+  dp = ptr->dst.ptr + (col * ptr->dst.nc);
+
+  if (FLIP_V(ptr->dst.orientation)) {
+    dp += (ptr->dst.width - 1) * ds;
+    ds  = -ds;
+  }
+
+  transpose_image(sp, ss, dp, ds, ptr->dst.width, n, ptr->dst.nc);
+}
+
+/*
+ * 帯バッファに溜まっている行を出力先に書き出す
+ */
+static void
+output_flush(jpeg_decode_t* ptr)
+{
+  int n;
+
+  n = ptr->dst.fill;
+
+  if (!USE_BAND(ptr) || n == 0) return;
+
+  if (ptr->dst.orientation & 4) {
+    flush_transposed(ptr, n);
+  } else if (ptr->dst.pack) {
+    flush_packed(ptr, n);
+  } else {
+    flush_mirrored(ptr, n);
+  }
+
+  ptr->dst.top += n;
+  ptr->dst.fill = 0;
+}
+
+/*
+ * output_row()で得た行のうち、n行の書き込みが済んだことを通知する
+ */
+static void
+output_done(jpeg_decode_t* ptr, int n)
+{
+  if (USE_BAND(ptr)) {
+    ptr->dst.fill += n;
+    if (ptr->dst.fill >= ORIENT_BAND_ROWS) output_flush(ptr);
+  }
+}
+
+static VALUE
+build_decode_result(jpeg_decode_t* ptr, decode_info_t* info, VALUE img)
+{
+  VALUE ret;
+  size_t raw_sz;
+
+  if (IS_PLANAR(ptr)) {
+    raw_sz = get_plane_layout(ptr->format,
+                              info->width, info->height, info->width, NULL);
+  } else {
+    raw_sz = output_size(ptr, info->width, info->height,
+                         info->components, info->orientation);
+  }
+
+  if (TEST_FLAG(ptr, F_EXPAND_COLORMAP) && IS_COLORMAPPED(info)) {
+    expand_colormap(info, img);
+  } else {
+    rb_str_set_len(img, raw_sz);
+  }
+
+  ret = img;
+
+  if (ptr->format == FMT_YVU) {
+    swap_cbcr((uint8_t*)RSTRING_PTR(ret), RSTRING_LEN(ret));
+  }
+
+  // 転置した場合は書き出し時に詰められないので、ここで詰め直す
+  if (IS_PACKED(ptr) && !PACK_ON_OUTPUT(ptr, info->orientation)) {
+    pack_output(ptr, ret, info->height, info->width, info->components);
+  }
+
+  if (TEST_FLAG(ptr, F_NEED_META)) add_meta(ret, ptr, info);
+
+  return ret;
+}
+
+static void*
+decode_header_without_gvl(void* _ptr)
+{
+  jpeg_decode_t* volatile ptr;     // setjmp()を跨いで参照するのでvolatile
+  struct jpeg_decompress_struct* cinfo;
+
+  ptr   = (jpeg_decode_t*)_ptr;
+  cinfo = &ptr->cinfo;
+
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_decompress(cinfo);
+    return ptr;
+  }
+
+  jpeg_mem_src(cinfo, ptr->src.ptr, ptr->src.size);
+
+  if (TEST_FLAG(ptr, F_PARSE_EXIF | F_APPLY_ORIENTATION | F_THUMBNAIL)) {
+    jpeg_save_markers(cinfo, JPEG_APP1, 0xFFFF);
+  }
+
+  jpeg_read_header(cinfo, TRUE);
+
+  /*
+   * configuration
+   */
+  cinfo->raw_data_out             = IS_PLANAR(ptr)? TRUE: FALSE;
+  cinfo->dct_method               = ptr->dct_method;
+
+  cinfo->out_color_space          = ptr->out_color_space;
+  cinfo->out_color_components     = ptr->out_color_components;
+  cinfo->scale_num                = ptr->scale_num;
+  cinfo->scale_denom              = ptr->scale_denom;
+  cinfo->output_gamma             = ptr->output_gamma;
+  cinfo->do_fancy_upsampling      = ptr->do_fancy_upsampling;
+  cinfo->do_block_smoothing       = ptr->do_block_smoothing;
+  cinfo->quantize_colors          = ptr->quantize_colors;
+  cinfo->dither_mode              = ptr->dither_mode;
+  cinfo->two_pass_quantize        = ptr->two_pass_quantize;
+  cinfo->desired_number_of_colors = ptr->desired_number_of_colors;
+  cinfo->enable_1pass_quant       = ptr->enable_1pass_quant;
+  cinfo->enable_external_quant    = ptr->enable_external_quant;
+  cinfo->enable_2pass_quant       = ptr->enable_2pass_quant;
+
+  // 平面形式・パック形式の出力では減色は行わない
+  if (IS_PLANAR(ptr) || IS_PACKED(ptr)) cinfo->quantize_colors = FALSE;
+
+  // 出力バッファの確保をGVL下で行うため、ここで出力サイズを確定させる
+  jpeg_calc_output_dimensions(cinfo);
+
+  return NULL;
+}
+
+/*
+ * 入力をn番目のスキャンの終わりまで読み進め(それより前にEOIに達した
+ * 場合はそこまで)、読み終えたスキャンの番号を返す
+ */
+static int
+consume_scans(j_decompress_ptr cinfo, int n)
+{
+  int ret;
+
+  while (!jpeg_input_complete(cinfo)) {
+    ret = jpeg_consume_input(cinfo);
+
+    if (ret == JPEG_SUSPENDED || ret == JPEG_REACHED_EOI) break;
+    if (ret == JPEG_SCAN_COMPLETED && cinfo->input_scan_number >= n) break;
+  }
+
+  return cinfo->input_scan_number;
+}
+
+/*
+ * 復号を開始する。:max_scansが指定された複数スキャンのJPEGでは、
+ * バッファードイメージモードで指定された数のスキャンまでを読み込み、
+ * その時点の画像を出力する(残りのスキャンは復号しない)。
+ */
+static void
+start_decompress(jpeg_decode_t* ptr)
+{
+  j_decompress_ptr cinfo;
+
+  cinfo = &ptr->cinfo;
+
+  if (ptr->max_scans > 0 && jpeg_has_multiple_scans(cinfo)) {
+    cinfo->buffered_image = TRUE;
+
+    jpeg_start_decompress(cinfo);
+    jpeg_start_output(cinfo, consume_scans(cinfo, ptr->max_scans));
+
+  } else {
+    jpeg_start_decompress(cinfo);
+  }
+}
+
+/*
+ * 出力パスの全ての行を読み出して出力先に書き込む
+ */
+static void
+read_output_rows(jpeg_decode_t* ptr)
+{
+  struct jpeg_decompress_struct* cinfo;
+  JSAMPARRAY array;
+  int y;
+  int i;
+  int n;
+
+  cinfo = &ptr->cinfo;
+  array = ptr->array;
+
+  while (cinfo->output_scanline < cinfo->output_height) {
+    y = cinfo->output_scanline;
+    n = cinfo->output_height - y;
+    if (n > UNIT_LINES) n = UNIT_LINES;
+    if (n > output_capacity(ptr)) n = output_capacity(ptr);
+
+    for (i = 0; i < n; i++) {
+      array[i] = output_row(ptr, y + i);
+    }
+
+    n = jpeg_read_scanlines(cinfo, array, n);
+    output_done(ptr, n);
+  }
+
+  output_flush(ptr);
+}
+
+static void*
+decode_scanlines_without_gvl(void* _ptr)
+{
+  jpeg_decode_t* volatile ptr;
+
+  ptr = (jpeg_decode_t*)_ptr;
+
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_decompress(&ptr->cinfo);
+    return ptr;
+  }
+
+  start_decompress(ptr);
+  read_output_rows(ptr);
+
+  return NULL;
+}
+
+static void
+plane_span(int i, int src, int dst, int* p0, int* p1)
+{
+  int f;
+
+  if (src > dst) {
+    // 縮小（平均を取る範囲を求める）
+    f   = (src + dst - 1) / dst;
+    *p0 = i * f;
+
+    if (*p0 >= src) *p0 = src - 1;
+
+    *p1 = (*p0 + f < src)? *p0 + f: src;
+
+  } else {
+    // 等倍もしくは拡大（複製）
+    *p0 = (int)(((int64_t)i * src) / dst);
+    *p1 = *p0 + 1;
+  }
+}
+
+static void
+convert_plane(uint8_t* dst, int dw, int dh, int dst_stride, int step,
+              uint8_t* src, int sw, int sh, int src_stride)
+{
+  int x;
+  int y;
+  int x0;
+  int x1;
+  int y0;
+  int y1;
+  int i;
+  int j;
+  int sum;
+  int n;
+
+  /*
+   * JPEGの色差のサンプリングと出力形式のサンプリングが異なる場合に、
+   * ボックス平均(縮小)または複製(拡大)で変換する
+   */
+  for (y = 0; y < dh; y++) {
+    plane_span(y, sh, dh, &y0, &y1);
+
+    for (x = 0; x < dw; x++) {
+      plane_span(x, sw, dw, &x0, &x1);
+
+      sum = 0;
+      n   = (x1 - x0) * (y1 - y0);
+
+      for (i = y0; i < y1; i++) {
+        for (j = x0; j < x1; j++) {
+          sum += src[i * src_stride + j];
+        }
+      }
+
+      dst[y * dst_stride + x * step] = (uint8_t)((sum + (n / 2)) / n);
+    }
+  }
+}
+
+static void
+fill_plane(uint8_t* dst, int dw, int dh, int dst_stride, int step, int val)
+{
+  int x;
+  int y;
+
+  for (y = 0; y < dh; y++) {
+    for (x = 0; x < dw; x++) {
+      dst[y * dst_stride + x * step] = (uint8_t)val;
+    }
+  }
+}
+
+static void*
+decode_planar_without_gvl(void* _ptr)
+{
+  jpeg_decode_t* volatile ptr;
+  struct jpeg_decompress_struct* cinfo;
+  jpeg_component_info* comp;
+  plane_t planes[3];
+  plane_t target[3];
+  JSAMPARRAY bufs[3];
+  JSAMPIMAGE image;
+  uint8_t* tmp[3];
+  uint8_t* dst;
+  int direct[3];
+  int lines;
+  int imcu;
+  int rows;
+  int y;
+  int n;
+  int i;
+  int j;
+
+  ptr   = (jpeg_decode_t*)_ptr;
+  cinfo = &ptr->cinfo;
+  image = (JSAMPIMAGE)bufs;
+
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_decompress(cinfo);
+    return ptr;
+  }
+
+  start_decompress(ptr);
+
+  /*
+   * 出力先のプレーン配置を求める（NV12のUVはU,Vの2面として扱い、
+   * 1バイトずらして2バイト毎に書き込む）
+   */
+  get_plane_layout(ptr->format, cinfo->output_width, cinfo->output_height,
+                   cinfo->output_width, planes);
+
+  target[0] = planes[0];
+  target[1] = planes[1];
+
+  if (ptr->format == FMT_NV12) {
+    target[2]         = planes[1];
+    target[2].offset += 1;
+  } else {
+    target[2]         = planes[2];
+  }
+
+  /*
+   * 各コンポーネントの読み出しバッファを用意する。JPEG側の間引き後の
+   * サイズが出力形式と一致する場合は出力先に直接コピーし、一致しない
+   * 場合は一旦作業領域に展開して後から変換する。
+   */
+  n = cinfo->num_components;
+
+  for (i = 0; i < n; i++) {
+    comp    = cinfo->comp_info + i;
+    bufs[i] = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo,
+                                          JPOOL_IMAGE,
+                                          comp->width_in_blocks *
+                                          comp->DCT_scaled_size,
+                                          comp->v_samp_factor *
+                                          comp->DCT_scaled_size);
+
+    direct[i] = (i == 0 || ptr->format != FMT_NV12) &&
+                ((int)comp->downsampled_width == target[i].width) &&
+                ((int)comp->downsampled_height == target[i].height);
+
+    if (direct[i]) {
+      tmp[i] = NULL;
+    } else {
+      tmp[i] = (*cinfo->mem->alloc_large)((j_common_ptr)cinfo,
+                                          JPOOL_IMAGE,
+                                          (size_t)comp->downsampled_width *
+                                          comp->downsampled_height);
+    }
+  }
+
+  /*
+   * 読み出し
+   */
+  lines = cinfo->max_v_samp_factor * cinfo->min_DCT_scaled_size;
+
+  while (cinfo->output_scanline < cinfo->output_height) {
+    imcu = cinfo->output_scanline / lines;
+
+    if (jpeg_read_raw_data(cinfo, image, lines) == 0) break;
+
+    for (i = 0; i < n; i++) {
+      comp = cinfo->comp_info + i;
+      rows = comp->v_samp_factor * comp->DCT_scaled_size;
+      y    = imcu * rows;
+
+      for (j = 0; j < rows && y + j < (int)comp->downsampled_height; j++) {
+        if (direct[i]) {
+          dst = ptr->dst.ptr + target[i].offset +
+                ((size_t)(y + j) * target[i].stride);
+        } else {
+          dst = tmp[i] + ((size_t)(y + j) * comp->downsampled_width);
+        }
+
+        memcpy(dst, bufs[i][j], comp->downsampled_width);
+      }
+    }
+  }
+
+  /*
+   * サンプリングの変換
+   */
+  for (i = 0; i < 3; i++) {
+    dst = ptr->dst.ptr + target[i].offset;
+
+    if (i >= n) {
+      // グレースケールのJPEGの場合は色差を中央値で埋める
+      fill_plane(dst, target[i].width, target[i].height,
+                 target[i].stride, (i > 0 && ptr->format == FMT_NV12)? 2: 1,
+                 128);
+
+    } else if (!direct[i]) {
+      comp = cinfo->comp_info + i;
+
+      convert_plane(dst, target[i].width, target[i].height,
+                    target[i].stride, (i > 0 && ptr->format == FMT_NV12)? 2: 1,
+                    tmp[i], comp->downsampled_width,
+                    comp->downsampled_height, comp->downsampled_width);
+    }
+  }
+
+  return NULL;
+}
+
+static JDIMENSION
+crop_columns(j_decompress_ptr cinfo, int x, int width)
+{
+  JDIMENSION ret;
+
+  /*
+   * jpeg_crop_scanline()で指定範囲を含むiMCU列だけを復号するよう設定し、
+   * 実際に復号される先頭の列を返す。jpeg_crop_scanline()が使用できない
+   * 場合は常に全体を復号する。
+   */
+  ret = 0;
+
+#ifdef HAVE_JPEG_CROP_SCANLINE
+  {
+    JDIMENSION wd;
+    JDIMENSION mcu_w;
+
+    /*
+     * 切り出した範囲の両端は画像の端として扱われるので、fancy
+     * upsamplingで端の列の値が変わらないよう左右に1 iMCU分余分に
+     * 復号させる
+     */
+    mcu_w = cinfo->max_h_samp_factor * cinfo->min_DCT_scaled_size;
+    ret   = (x > (int)mcu_w)? x - mcu_w: 0;
+    wd    = x + width + mcu_w - ret;
+
+    if (ret + wd > cinfo->output_width) wd = cinfo->output_width - ret;
+
+    jpeg_crop_scanline(cinfo, &ret, &wd);
+  }
+#endif /* defined(HAVE_JPEG_CROP_SCANLINE) */
+
+  return ret;
+}
+
+static void*
+decode_cropped_without_gvl(void* _ptr)
+{
+  jpeg_decode_t* volatile ptr;
+  struct jpeg_decompress_struct* cinfo;
+  JSAMPARRAY array;
+  JDIMENSION xoff;
+  JDIMENSION width;
+  JDIMENSION last;
+  size_t col;
+  size_t len;
+  int y;
+  int i;
+  int n;
+
+  ptr   = (jpeg_decode_t*)_ptr;
+  cinfo = &ptr->cinfo;
+
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_decompress(cinfo);
+    return ptr;
+  }
+
+  start_decompress(ptr);
+
+  /*
+   * 水平方向は対象領域を含むiMCU列だけを復号させ、開始位置の差分は行毎に
+   * 詰める。減色時はディザの結果が画素の位置に依存するので全体を復号する。
+   */
+  if (cinfo->quantize_colors) {
+    xoff = 0;
+  } else {
+    xoff = crop_columns(cinfo, ptr->crop.x, ptr->crop.width);
+  }
+
+  width = cinfo->output_width;
+
+  col   = (ptr->crop.x - xoff) * cinfo->output_components;
+  len   = ptr->crop.width * cinfo->output_components;
+  last  = ptr->crop.y + ptr->crop.height;
+  y     = 0;
+
+  // 作業用の行バッファはlibjpegのイメージプールから確保する(中断時に解放)
+  array = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE,
+                                      width * cinfo->output_components,
+                                      UNIT_LINES);
+
+  /*
+   * 垂直方向は対象領域より上の行を読み飛ばす
+   */
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+  if (ptr->crop.y > 0 && !cinfo->quantize_colors) {
+    jpeg_skip_scanlines(cinfo, ptr->crop.y);
+  }
+#endif /* defined(HAVE_JPEG_SKIP_SCANLINES) */
+
+  while (cinfo->output_scanline < (JDIMENSION)ptr->crop.y) {
+    n = ptr->crop.y - cinfo->output_scanline;
+    if (n > UNIT_LINES) n = UNIT_LINES;
+
+    jpeg_read_scanlines(cinfo, array, n);
+  }
+
+  while (cinfo->output_scanline < last) {
+    n = last - cinfo->output_scanline;
+    if (n > UNIT_LINES) n = UNIT_LINES;
+
+    n = jpeg_read_scanlines(cinfo, array, n);
+
+    for (i = 0; i < n; i++, y++) {
+      memcpy(output_row(ptr, y), array[i] + col, len);
+      output_done(ptr, 1);
+    }
+  }
+
+  output_flush(ptr);
+
+  return NULL;
+}
+
+/*
+ * 指定サイズへのリサイズ付きデコード
+ *
+ * DCTの縮尺(M/8)で目標の大きさ以上となる最小の大きさまで縮小して復号し、
+ * 残りの倍率は分離可能なフィルタによるリサンプラで処理する。リサンプラ
+ * はスキャンラインの読み出しループ内で動作し、水平方向に縮小した行を
+ * 垂直方向のフィルタのタップ数分だけリングバッファに保持する。このため
+ * 縮尺変更後の画像全体を保持するバッファは確保しない。
+ *
+ * 重みは固定小数点(COEF_BITS)で保持し、水平・垂直いずれのパスも中間値
+ * を8bitに丸める。垂直パスは行単位の積和なのでSIMDのカーネルで処理する
+ * (水平パスは出力画素毎に参照位置が変わるのでスカラ版のみ)。
+ */
+
+typedef struct {
+  int* start;       // 各出力画素が参照する入力の先頭位置
+  int* count;       // 各出力画素が参照する入力の数
+  int32_t* weight;  // 各出力画素の重み(max個単位)
+  int max;
+} resample_coef_t;
+
+static double
+filter_bilinear(double x)
+{
+  if (x < 0.0) x = -x;
+
+  return (x < 1.0)? 1.0 - x: 0.0;
+}
+
+static double
+sinc(double x)
+{
+  if (x == 0.0) return 1.0;
+
+  x *= M_PI;
+
+  return sin(x) / x;
+}
+
+static double
+filter_lanczos(double x)
+{
+  return (x > -3.0 && x < 3.0)? sinc(x) * sinc(x / 3.0): 0.0;
+}
+
+static void
+calc_resample_coef(j_decompress_ptr cinfo, resample_coef_t* coef,
+                   int in_size, int virt_size, int off, int n, int filter)
+{
+  double (*func)(double);
+  double support;
+  double scale;
+  double fscale;
+  double center;
+  double sum;
+  double* tmp;
+  int32_t* w;
+  int32_t total;
+  int first;
+  int last;
+  int i;
+  int j;
+
+  if (filter == FILTER_LANCZOS) {
+    func    = filter_lanczos;
+    support = 3.0;
+  } else {
+    func    = filter_bilinear;
+    support = 1.0;
+  }
+
+  /*
+   * 縮小時はフィルタの幅を倍率に合わせて広げる(アンチエイリアス)
+   */
+  scale   = (double)in_size / virt_size;
+  fscale  = (scale < 1.0)? 1.0: scale;
+  support = support * fscale;
+
+  coef->max    = ((int)ceil(support) * 2) + 1;
+  coef->start  = (int*)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo,
+                                  JPOOL_IMAGE, sizeof(int) * n);
+  coef->count  = (int*)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo,
+                                  JPOOL_IMAGE, sizeof(int) * n);
+  coef->weight = (int32_t*)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo,
+                                  JPOOL_IMAGE, sizeof(int32_t) * n * coef->max);
+  tmp          = (double*)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo,
+                                  JPOOL_IMAGE, sizeof(double) * coef->max);
+
+  for (i = 0; i < n; i++) {
+    center = (i + off + 0.5) * scale;
+    first  = (int)(center - support + 0.5);
+    last   = (int)(center + support + 0.5);
+
+    if (first < 0) first = 0;
+    if (last > in_size) last = in_size;
+    if (last - first > coef->max) last = first + coef->max;
+
+    sum = 0.0;
+    for (j = first; j < last; j++) {
+      tmp[j - first] = func((j - center + 0.5) / fscale);
+      sum += tmp[j - first];
+    }
+
+    // 重みが得られない場合は最近傍の画素を使用する
+    if (sum <= 0.0) {
+      first  = (int)center;
+      if (first >= in_size) first = in_size - 1;
+      last   = first + 1;
+      tmp[0] = 1.0;
+      sum    = 1.0;
+    }
+
+    w     = coef->weight + (i * coef->max);
+    total = 0;
+
+    for (j = 0; j < last - first; j++) {
+      w[j]   = (int32_t)floor((tmp[j] / sum) * (1 << COEF_BITS) + 0.5);
+      total += w[j];
+    }
+
+    // 丸め誤差は中央の重みで吸収させ、総和を1.0に揃える
+    w[(last - first) / 2] += (1 << COEF_BITS) - total;
+
+    coef->start[i] = first;
+    coef->count[i] = last - first;
+  }
+}
+
+static inline uint8_t
+clip_sample(int32_t v)
+{
+  v >>= COEF_BITS;
+
+  return (v < 0)? 0: (v > 255)? 255: (uint8_t)v;
+}
+
+static void
+resample_row(uint8_t* dst, uint8_t* src, int nc, resample_coef_t* coef, int n)
+{
+  uint8_t* p;
+  int32_t* w;
+  int32_t acc[4];
+  int i;
+  int j;
+  int k;
+
+  for (i = 0; i < n; i++) {
+    p = src + (coef->start[i] * nc);
+    w = coef->weight + (i * coef->max);
+
+    for (k = 0; k < nc; k++) {
+      acc[k] = 1 << (COEF_BITS - 1);
+    }
+
+    for (j = 0; j < coef->count[i]; j++) {
+      for (k = 0; k < nc; k++) {
+        acc[k] += p[k] * w[j];
+      }
+
+      p += nc;
+    }
+
+    for (k = 0; k < nc; k++) {
+      dst[k] = clip_sample(acc[k]);
+    }
+
+    dst += nc;
+  }
+}
+
+static void
+resample_column_scalar(uint8_t* dst, uint8_t** rows, int32_t* w, int nrow,
+                       int32_t* acc, size_t len)
+{
+  uint8_t* src;
+  int32_t c;
+  size_t i;
+  int j;
+
+  for (i = 0; i < len; i++) {
+    acc[i] = 1 << (COEF_BITS - 1);
+  }
+
+  for (j = 0; j < nrow; j++) {
+    src = rows[j];
+    c   = w[j];
+
+    for (i = 0; i < len; i++) {
+      acc[i] += src[i] * c;
+    }
+  }
+
+  for (i = 0; i < len; i++) {
+    dst[i] = clip_sample(acc[i]);
+  }
+}
+
+/*
+ * SSE2/AVX2版は2行ずつ画素を16bitに広げて交互に並べ、2行分の重みとの
+ * 積和を32bitで求める(pmaddwd)。NEON版は1行ずつsmlalで積和を求める。
+ * いずれも重みを16bitで扱うので、収まらない場合はスカラ版で処理する。
+ * 丸めと飽和はスカラ版と同じ(算術右シフトの後に0〜255に飽和させる)
+ * なので、結果はビット単位で一致する。列方向の端数はスカラ版と同じ
+ * 計算で処理する。
+ */
+static inline int
+fit_in_int16(int32_t* w, int nrow)
+{
+  int j;
+
+  for (j = 0; j < nrow; j++) {
+    if (w[j] < -32768 || w[j] > 32767) return 0;
+  }
+
+  return !0;
+}
+
+/*
+ * j行目とj+1行目の重みを下位・上位16bitに詰めた値(j+1行目が無い場合は0)
+ */
+static inline int32_t
+pair_weight(int32_t* w, int j, int nrow)
+{
+  uint32_t hi;
+
+  hi = (j + 1 < nrow)? (uint32_t)w[j + 1] << 16: 0;
+
+  return (int32_t)(((uint32_t)w[j] & 0xffff) | hi);
+}
+
+static inline void
+resample_column_tail(uint8_t* dst, uint8_t** rows, int32_t* w, int nrow,
+                     size_t i, size_t len)
+{
+  int32_t acc;
+  int j;
+
+  for (; i < len; i++) {
+    acc = 1 << (COEF_BITS - 1);
+
+    for (j = 0; j < nrow; j++) {
+      acc += rows[j][i] * w[j];
+    }
+
+    dst[i] = clip_sample(acc);
+  }
+}
+
+#if defined(__SSE2__)
+static void
+resample_column_sse2(uint8_t* dst, uint8_t** rows, int32_t* w, int nrow,
+                     int32_t* acc, size_t len)
+{
+  __m128i zero;
+  __m128i rnd;
+  __m128i a[4];
+  __m128i c;
+  __m128i v0;
+  __m128i v1;
+  __m128i p;
+  __m128i q;
+  uint8_t* r0;
+  uint8_t* r1;
+  size_t i;
+  int j;
+
+  if (!fit_in_int16(w, nrow)) {
+    resample_column_scalar(dst, rows, w, nrow, acc, len);
+    return;
+  }
+
+  zero = _mm_setzero_si128();
+  rnd  = _mm_set1_epi32(1 << (COEF_BITS - 1));
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    a[0] = a[1] = a[2] = a[3] = rnd;
+
+    for (j = 0; j < nrow; j += 2) {
+      // 奇数行の場合、最後の行は重み0の相手と組にする
+      r0 = rows[j] + i;
+      r1 = (j + 1 < nrow)? rows[j + 1] + i: r0;
+      c  = _mm_set1_epi32(pair_weight(w, j, nrow));
+      v0 = _mm_loadu_si128((__m128i*)r0);
+      v1 = _mm_loadu_si128((__m128i*)r1);
+
+      // r0, r1の同じ列の画素を交互に並べた16bit値と重みの積和
+      p    = _mm_unpacklo_epi8(v0, zero);
+      q    = _mm_unpacklo_epi8(v1, zero);
+      a[0] = _mm_add_epi32(a[0], _mm_madd_epi16(_mm_unpacklo_epi16(p, q), c));
+      a[1] = _mm_add_epi32(a[1], _mm_madd_epi16(_mm_unpackhi_epi16(p, q), c));
+
+      p    = _mm_unpackhi_epi8(v0, zero);
+      q    = _mm_unpackhi_epi8(v1, zero);
+      a[2] = _mm_add_epi32(a[2], _mm_madd_epi16(_mm_unpacklo_epi16(p, q), c));
+      a[3] = _mm_add_epi32(a[3], _mm_madd_epi16(_mm_unpackhi_epi16(p, q), c));
+    }
+
+    p = _mm_packs_epi32(_mm_srai_epi32(a[0], COEF_BITS),
+                        _mm_srai_epi32(a[1], COEF_BITS));
+    q = _mm_packs_epi32(_mm_srai_epi32(a[2], COEF_BITS),
+                        _mm_srai_epi32(a[3], COEF_BITS));
+
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(p, q));
+  }
+
+  resample_column_tail(dst, rows, w, nrow, i, len);
+}
+#endif /* defined(__SSE2__) */
+
+#ifdef HAVE_AVX2_KERNEL
+/*
+ * AVX2版は16画素を16bitに広げて1レジスタに載せる。vpunpck[lh]wdと
+ * vpackssdwはいずれもレーン内で動作するので、詰め直した時点で画素の
+ * 並びは元に戻る。
+ */
+__attribute__((target("avx2")))
+static void
+resample_column_avx2(uint8_t* dst, uint8_t** rows, int32_t* w, int nrow,
+                     int32_t* acc, size_t len)
+{
+  __m256i rnd;
+  __m256i lo;
+  __m256i hi;
+  __m256i c;
+  __m256i p;
+  __m256i q;
+  uint8_t* r0;
+  uint8_t* r1;
+  size_t i;
+  int j;
+
+  if (!fit_in_int16(w, nrow)) {
+    resample_column_scalar(dst, rows, w, nrow, acc, len);
+    return;
+  }
+
+  rnd = _mm256_set1_epi32(1 << (COEF_BITS - 1));
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    lo = hi = rnd;
+
+    for (j = 0; j < nrow; j += 2) {
+      r0 = rows[j] + i;
+      r1 = (j + 1 < nrow)? rows[j + 1] + i: r0;
+      c  = _mm256_set1_epi32(pair_weight(w, j, nrow));
+
+      p = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)r0));
+      q = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)r1));
+
+      lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(p, q), c));
+      hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(p, q), c));
+    }
+
+    p = _mm256_packs_epi32(_mm256_srai_epi32(lo, COEF_BITS),
+                           _mm256_srai_epi32(hi, COEF_BITS));
+    p = _mm256_permute4x64_epi64(_mm256_packus_epi16(p, p),
+                                 _MM_SHUFFLE(3, 1, 2, 0));
+
+    _mm_storeu_si128((__m128i*)(dst + i), _mm256_castsi256_si128(p));
+  }
+
+  resample_column_tail(dst, rows, w, nrow, i, len);
+}
+#endif /* defined(HAVE_AVX2_KERNEL) */
+
+#if defined(__ARM_NEON)
+static void
+resample_column_neon(uint8_t* dst, uint8_t** rows, int32_t* w, int nrow,
+                     int32_t* acc, size_t len)
+{
+  int32x4_t a[4];
+  int16x8_t lo;
+  int16x8_t hi;
+  uint8x16_t v;
+  int16_t c;
+  size_t i;
+  int j;
+
+  if (!fit_in_int16(w, nrow)) {
+    resample_column_scalar(dst, rows, w, nrow, acc, len);
+    return;
+  }
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    a[0] = a[1] = a[2] = a[3] = vdupq_n_s32(1 << (COEF_BITS - 1));
+
+    for (j = 0; j < nrow; j++) {
+      v  = vld1q_u8(rows[j] + i);
+      c  = (int16_t)w[j];
+      lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v)));
+      hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v)));
+
+      a[0] = vmlal_n_s16(a[0], vget_low_s16(lo), c);
+      a[1] = vmlal_n_s16(a[1], vget_high_s16(lo), c);
+      a[2] = vmlal_n_s16(a[2], vget_low_s16(hi), c);
+      a[3] = vmlal_n_s16(a[3], vget_high_s16(hi), c);
+    }
+
+    lo = vcombine_s16(vqmovn_s32(vshrq_n_s32(a[0], COEF_BITS)),
+                      vqmovn_s32(vshrq_n_s32(a[1], COEF_BITS)));
+    hi = vcombine_s16(vqmovn_s32(vshrq_n_s32(a[2], COEF_BITS)),
+                      vqmovn_s32(vshrq_n_s32(a[3], COEF_BITS)));
+
+    vst1q_u8(dst + i, vcombine_u8(vqmovun_s16(lo), vqmovun_s16(hi)));
+  }
+
+  resample_column_tail(dst, rows, w, nrow, i, len);
+}
+#endif /* defined(__ARM_NEON) */
+
+static void*
+decode_resized_without_gvl(void* _ptr)
+{
+  jpeg_decode_t* volatile ptr;
+  struct jpeg_decompress_struct* cinfo;
+  resample_coef_t hc;
+  resample_coef_t vc;
+  JSAMPARRAY array;
+  JSAMPARRAY ring;
+  uint8_t** rows;
+  int32_t* acc;
+  JDIMENSION xoff;
+  JDIMENSION top;
+  JDIMENSION bottom;
+  JDIMENSION y;
+  size_t len;
+  int nc;
+  int i;
+  int j;
+  int k;
+  int n;
+
+  ptr   = (jpeg_decode_t*)_ptr;
+  cinfo = &ptr->cinfo;
+
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_decompress(cinfo);
+    return ptr;
+  }
+
+  start_decompress(ptr);
+
+  nc  = cinfo->output_components;
+  len = (size_t)ptr->resize.out_width * nc;
+
+  calc_resample_coef(cinfo, &hc, cinfo->output_width,
+                     ptr->resize.virt_width, ptr->resize.off_x,
+                     ptr->resize.out_width, ptr->resize.filter);
+
+  calc_resample_coef(cinfo, &vc, cinfo->output_height,
+                     ptr->resize.virt_height, ptr->resize.off_y,
+                     ptr->resize.out_height, ptr->resize.filter);
+
+  /*
+   * 参照される範囲の列・行だけを復号させる
+   */
+  i    = ptr->resize.out_width - 1;
+  xoff = crop_columns(cinfo, hc.start[0], hc.start[i] + hc.count[i] - hc.start[0]);
+
+  for (i = 0; i < ptr->resize.out_width; i++) {
+    hc.start[i] -= xoff;
+  }
+
+  j      = ptr->resize.out_height - 1;
+  top    = vc.start[0];
+  bottom = vc.start[j] + vc.count[j];
+
+  array  = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE,
+                                       cinfo->output_width * nc, UNIT_LINES);
+  ring   = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE,
+                                       len, vc.max);
+  acc    = (int32_t*)(*cinfo->mem->alloc_large)((j_common_ptr)cinfo,
+                                       JPOOL_IMAGE, sizeof(int32_t) * len);
+  rows   = (uint8_t**)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo,
+                                       JPOOL_IMAGE, sizeof(uint8_t*) * vc.max);
+
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+  if (top > 0) jpeg_skip_scanlines(cinfo, top);
+#endif /* defined(HAVE_JPEG_SKIP_SCANLINES) */
+
+  /*
+   * 水平方向にリサンプルした行をリングバッファに溜め、出力行が参照する
+   * 最後の行が揃った時点で垂直方向のリサンプルを行う
+   */
+  j = 0;
+
+  while (cinfo->output_scanline < bottom) {
+    y = cinfo->output_scanline;
+    n = bottom - y;
+    if (n > UNIT_LINES) n = UNIT_LINES;
+
+    n = jpeg_read_scanlines(cinfo, array, n);
+
+    for (i = 0; i < n; i++, y++) {
+      if (y < top) continue;
+
+      resample_row(ring[y % vc.max], array[i], nc, &hc,
+                   ptr->resize.out_width);
+
+      while (j < ptr->resize.out_height &&
+             (JDIMENSION)(vc.start[j] + vc.count[j]) <= y + 1) {
+        for (k = 0; k < vc.count[j]; k++) {
+          rows[k] = ring[(vc.start[j] + k) % vc.max];
+        }
+
+        kernels.resample_col(output_row(ptr, j), rows,
+                             vc.weight + (j * vc.max), vc.count[j], acc, len);
+        output_done(ptr, 1);
+        j++;
+      }
+    }
+  }
+
+  output_flush(ptr);
+
+  return NULL;
+}
+
+static void
+plan_resize(jpeg_decode_t* ptr, int orientation)
+{
+  struct jpeg_decompress_struct* cinfo;
+  double rx;
+  double ry;
+  double r;
+  int wd;
+  int ht;
+  int tw;
+  int th;
+  int m;
+
+  cinfo = &ptr->cinfo;
+  wd    = cinfo->image_width;
+  ht    = cinfo->image_height;
+  tw    = ptr->resize.width;
+  th    = ptr->resize.height;
+
+  // 目標の大きさは向きの補正後の値なので、デコード時の向きに合わせる
+  if (TEST_FLAG(ptr, F_APPLY_ORIENTATION) && (orientation & 4)) {
+    SWAP(tw, th, int);
+  }
+
+  rx = (double)tw / wd;
+  ry = (double)th / ht;
+
+  switch (ptr->resize.fit) {
+  case FIT_CONTAIN:
+    r  = (rx < ry)? rx: ry;
+    tw = (int)floor((wd * r) + 0.5);
+    th = (int)floor((ht * r) + 0.5);
+
+    if (tw < 1) tw = 1;
+    if (th < 1) th = 1;
+
+    ptr->resize.virt_width  = tw;
+    ptr->resize.virt_height = th;
+    break;
+
+  case FIT_COVER:
+    r  = (rx > ry)? rx: ry;
+
+    ptr->resize.virt_width  = (int)floor((wd * r) + 0.5);
+    ptr->resize.virt_height = (int)floor((ht * r) + 0.5);
+
+    if (ptr->resize.virt_width < tw) ptr->resize.virt_width = tw;
+    if (ptr->resize.virt_height < th) ptr->resize.virt_height = th;
+    break;
+
+  default:
+    ptr->resize.virt_width  = tw;
+    ptr->resize.virt_height = th;
+    break;
+  }
+
+  ptr->resize.out_width  = tw;
+  ptr->resize.out_height = th;
+  ptr->resize.off_x      = (ptr->resize.virt_width - tw) / 2;
+  ptr->resize.off_y      = (ptr->resize.virt_height - th) / 2;
+
+  /*
+   * 目標の大きさ以上となる最小のDCT縮尺を選ぶ(拡大時は等倍)
+   */
+  for (m = 1; m <= 8; m++) {
+    cinfo->scale_num   = m;
+    cinfo->scale_denom = 8;
+
+    jpeg_calc_output_dimensions(cinfo);
+
+    if (cinfo->output_width >= (JDIMENSION)ptr->resize.virt_width &&
+        cinfo->output_height >= (JDIMENSION)ptr->resize.virt_height) {
+      break;
+    }
+  }
+}
+
+static void*
+decode_start_without_gvl(void* _ptr)
+{
+  jpeg_decode_t* volatile ptr;
+
+  ptr = (jpeg_decode_t*)_ptr;
+
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_decompress(&ptr->cinfo);
+    return ptr;
+  }
+
+  jpeg_start_decompress(&ptr->cinfo);
+
+  return NULL;
+}
+
+static void*
+decode_band_rows_without_gvl(void* _ptr)
+{
+  jpeg_decode_t* volatile ptr;
+  struct jpeg_decompress_struct* cinfo;
+  JSAMPARRAY array;
+  JDIMENSION top;
+  JDIMENSION lim;
+  int i;
+  int n;
+
+  ptr   = (jpeg_decode_t*)_ptr;
+  cinfo = &ptr->cinfo;
+  array = ptr->array;
+
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_decompress(cinfo);
+    return ptr;
+  }
+
+  /*
+   * 出力バッファの先頭を帯域の先頭行として、dst.rows行(最終帯域では
+   * 残りの行数)を読み込む
+   */
+  top = cinfo->output_scanline;
+  lim = top + ptr->dst.rows;
+
+  if (lim > cinfo->output_height) lim = cinfo->output_height;
+
+  while (cinfo->output_scanline < lim) {
+    n = lim - cinfo->output_scanline;
+    if (n > UNIT_LINES) n = UNIT_LINES;
+
+    for (i = 0; i < n; i++) {
+      array[i] = ptr->dst.ptr +
+                 ((cinfo->output_scanline - top + i) * ptr->dst.stride);
+    }
+
+    jpeg_read_scanlines(cinfo, array, n);
+  }
+
+  return NULL;
+}
+
+static void*
+decode_finish_without_gvl(void* _ptr)
+{
+  jpeg_decode_t* volatile ptr;
+
+  ptr = (jpeg_decode_t*)_ptr;
+
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_decompress(&ptr->cinfo);
+    return ptr;
+  }
+
+  jpeg_finish_decompress(&ptr->cinfo);
+
+  return NULL;
+}
+
+/*
+ * リスタートマーカーを利用した帯域分割デコード
+ *
+ * DRIを持つベースラインJPEGはRSTマーカーの位置でエントロピー符号化
+ * データを独立に復号できる。MCU行の境界とリスタート区間の境界が一致
+ * する位置で画像を水平の帯域に分割し、帯域毎にSOFの高さを書き換えた
+ * ヘッダと該当区間のデータを繋いだ単独のJPEGデータを生成してワーカ
+ * スレッドで並列に復号する。各帯域は出力バッファの互いに重ならない
+ * 領域に書き込まれる。
+ *
+ * fancy upsamplingは上下のMCU行を参照するので、その場合は帯域の上下
+ * に1区間分余分に復号し、その部分の出力は捨てる。これにより逐次処理
+ * と同一の出力が得られる。
+ */
+
+typedef struct {
+  jpeg_decode_t* ptr;
+  uint8_t* src;
+
+  uint8_t* hdr;
+  size_t hdr_size;
+  size_t sof_pos;
+
+  size_t* mark;
+  int nseg;
+
+  int mpr;
+  int mcu_rows;
+  int mcu_height;
+  int lines;
+  int band_rows;
+  int overlap;
+  int nband;
+  int nworker;
+
+  work_queue_t queue;
+} band_plan_t;
+
+static int
+gcd(int a, int b)
+{
+  int t;
+
+  while (b != 0) {
+    t = a % b;
+    a = b;
+    b = t;
+  }
+
+  return a;
+}
+
+static int
+scan_band_header(band_plan_t* plan, uint8_t* src, size_t size)
+{
+  uint8_t* tmp;
+  size_t pos;
+  size_t len;
+  int m;
+
+  /*
+   * SOIからSOSまでのマーカーをコピーする。APP0(JFIF)とAPP14(Adobe)
+   * は色空間の判定に使われるので残し、それ以外のAPPnとCOMは捨てる。
+   */
+  plan->hdr      = (uint8_t*)malloc(2);
+  plan->hdr_size = 2;
+  plan->sof_pos  = 0;
+
+  if (plan->hdr == NULL) return -1;
+
+  plan->hdr[0] = 0xff;
+  plan->hdr[1] = 0xd8;
+
+  pos = 2;
+
+  while (1) {
+    while (pos + 1 < size && src[pos] == 0xff && src[pos + 1] == 0xff) pos++;
+    if (pos + 4 > size || src[pos] != 0xff) return -1;
+
+    m   = src[pos + 1];
+    len = (src[pos + 2] << 8) | src[pos + 3];
+
+    if (len < 2 || pos + 2 + len > size) return -1;
+
+    switch (m) {
+    case 0xc0:  /* SOF0 */
+    case 0xc1:  /* SOF1 */
+      plan->sof_pos = plan->hdr_size + 5;
+      break;
+
+    case 0xc2: case 0xc3: case 0xc5: case 0xc6: case 0xc7:
+    case 0xc9: case 0xca: case 0xcb: case 0xcd: case 0xce: case 0xcf:
+      /* progressive, lossless, hierarchical and arithmetic */
+      return -1;
+    }
+
+    if (m == 0xe0 || m == 0xee || m < 0xe0) {
+      tmp = (uint8_t*)realloc(plan->hdr, plan->hdr_size + len + 2);
+      if (tmp == NULL) return -1;
+
+      plan->hdr = tmp;
+      memcpy(plan->hdr + plan->hdr_size, src + pos, len + 2);
+      plan->hdr_size += len + 2;
+    }
+
+    pos += len + 2;
+
+    if (m == 0xda) break;
+  }
+
+  if (plan->sof_pos == 0) return -1;
+
+  /* mark[0]はエントロピー符号化データの先頭の2バイト前を指す */
+  plan->mark[0] = pos - 2;
+
+  return 0;
+}
+
+static int
+scan_restart_markers(band_plan_t* plan, uint8_t* src, size_t size)
+{
+  size_t pos;
+  uint8_t* p;
+  int n;
+  int m;
+
+  pos = plan->mark[0] + 2;
+  n   = 0;
+
+  while (1) {
+    p = (uint8_t*)memchr(src + pos, 0xff, size - pos);
+    if (p == NULL) return -1;
+
+    pos = p - src;
+    if (pos + 1 >= size) return -1;
+
+    m = src[pos + 1];
+
+    if (m == 0x00) {
+      pos += 2;
+
+    } else if (m == 0xff) {
+      pos += 1;
+
+    } else if (m >= 0xd0 && m <= 0xd7) {
+      if ((m - 0xd0) != (n & 7) || n + 1 >= plan->nseg) return -1;
+
+      plan->mark[++n] = pos;
+      pos += 2;
+
+    } else if (m == 0xd9) {
+      break;
+
+    } else {
+      /* DNLや複数スキャンのデータは対象外 */
+      return -1;
+    }
+  }
+
+  if (n + 1 != plan->nseg) return -1;
+
+  plan->mark[plan->nseg] = pos;
+
+  return 0;
+}
+
+static void
+free_band_plan(band_plan_t* plan)
+{
+  if (plan->hdr != NULL) free(plan->hdr);
+  if (plan->mark != NULL) free(plan->mark);
+}
+
+static int
+plan_bands(jpeg_decode_t* ptr, band_plan_t* plan)
+{
+  struct jpeg_decompress_struct* cinfo;
+  jpeg_component_info* comp;
+  int interval;
+  int unit;
+  int scaled;
+  int i;
+
+  cinfo = &ptr->cinfo;
+
+  memset(plan, 0, sizeof(*plan));
+
+  plan->ptr = ptr;
+  plan->src = ptr->src.ptr;
+
+  /*
+   * 分割可能なデータかどうかの判定
+   */
+  if (cinfo->restart_interval == 0) return -1;
+  if (cinfo->progressive_mode || cinfo->arith_code) return -1;
+  if (cinfo->comps_in_scan != cinfo->num_components) return -1;
+  if (cinfo->quantize_colors || cinfo->buffered_image) return -1;
+
+  /*
+   * MCUの配置の算出
+   */
+  if (cinfo->comps_in_scan == 1) {
+    comp             = cinfo->cur_comp_info[0];
+    plan->mpr        = comp->width_in_blocks;
+    plan->mcu_rows   = comp->height_in_blocks;
+    plan->mcu_height = DCTSIZE * cinfo->max_v_samp_factor / comp->v_samp_factor;
+
+  } else {
+    plan->mpr        = (cinfo->image_width +
+                        (cinfo->max_h_samp_factor * DCTSIZE) - 1) /
+                       (cinfo->max_h_samp_factor * DCTSIZE);
+    plan->mcu_rows   = cinfo->total_iMCU_rows;
+    plan->mcu_height = cinfo->max_v_samp_factor * DCTSIZE;
+  }
+
+#if JPEG_LIB_VERSION >= 70
+  scaled = cinfo->min_DCT_v_scaled_size;
+#else /* JPEG_LIB_VERSION >= 70 */
+  scaled = cinfo->min_DCT_scaled_size;
+#endif /* JPEG_LIB_VERSION >= 70 */
+
+  if ((plan->mcu_height * scaled) % DCTSIZE != 0) return -1;
+
+  plan->lines = plan->mcu_height * scaled / DCTSIZE;
+
+  if ((size_t)plan->lines * plan->mcu_rows < cinfo->output_height ||
+      (size_t)plan->lines * (plan->mcu_rows - 1) >= cinfo->output_height) {
+    return -1;
+  }
+
+  /*
+   * リスタート区間の境界とMCU行の境界が一致するのはunit行毎
+   */
+  interval = cinfo->restart_interval;
+  unit     = interval / gcd(interval, plan->mpr);
+
+  plan->nseg = (int)(((size_t)plan->mpr * plan->mcu_rows + interval - 1) /
+                     interval);
+
+  plan->band_rows = (plan->mcu_rows + ptr->threads - 1) / ptr->threads;
+  plan->band_rows = ((plan->band_rows + unit - 1) / unit) * unit;
+  plan->nband     = (plan->mcu_rows + plan->band_rows - 1) / plan->band_rows;
+
+  if (plan->nband < 2) return -1;
+
+  plan->overlap = 0;
+
+  if (cinfo->do_fancy_upsampling) {
+    for (i = 0; i < cinfo->num_components; i++) {
+      if (cinfo->comp_info[i].v_samp_factor != cinfo->max_v_samp_factor) {
+        plan->overlap = unit;
+        break;
+      }
+    }
+  }
+
+  plan->nworker = (ptr->threads < plan->nband)? ptr->threads: plan->nband;
+
+  /*
+   * マーカー位置の走査
+   */
+  plan->mark = (size_t*)malloc(sizeof(size_t) * (plan->nseg + 1));
+  if (plan->mark == NULL) return -1;
+
+  if (scan_band_header(plan, ptr->src.ptr, ptr->src.size)) return -1;
+  if (scan_restart_markers(plan, ptr->src.ptr, ptr->src.size)) return -1;
+
+  return 0;
+}
+
+static size_t
+build_band_data(band_plan_t* plan, uint8_t* buf, int top, int bottom)
+{
+  struct jpeg_decompress_struct* cinfo;
+  size_t interval;
+  size_t s0;
+  size_t s1;
+  size_t base;
+  size_t len;
+  size_t j;
+  int height;
+
+  cinfo    = &plan->ptr->cinfo;
+  interval = cinfo->restart_interval;
+
+  s0   = (size_t)top * plan->mpr / interval;
+  s1   = (bottom == plan->mcu_rows)?
+               (size_t)plan->nseg: (size_t)bottom * plan->mpr / interval;
+  base = plan->mark[s0] + 2;
+  len  = plan->mark[s1] - base;
+
+  if (buf == NULL) return plan->hdr_size + len + 2;
+
+  if (bottom == plan->mcu_rows) {
+    height = cinfo->image_height - (top * plan->mcu_height);
+  } else {
+    height = (bottom - top) * plan->mcu_height;
+  }
+
+  memcpy(buf, plan->hdr, plan->hdr_size);
+  buf[plan->sof_pos + 0] = (height >> 8) & 0xff;
+  buf[plan->sof_pos + 1] = height & 0xff;
+
+  memcpy(buf + plan->hdr_size, plan->src + base, len);
+
+  // RSTマーカーの番号は帯域の先頭から振り直す
+  for (j = s0 + 1; j < s1; j++) {
+    buf[plan->hdr_size + (plan->mark[j] - base) + 1] = 0xd0 + ((j - s0 - 1) & 7);
+  }
+
+  buf[plan->hdr_size + len + 0] = 0xff;
+  buf[plan->hdr_size + len + 1] = 0xd9;
+
+  return plan->hdr_size + len + 2;
+}
+
+static void*
+decode_band_scanlines(jpeg_decode_t* _ctx,
+                      size_t skip, size_t keep, int first, uint8_t* trash)
+{
+  jpeg_decode_t* volatile ctx;
+  struct jpeg_decompress_struct* cinfo;
+  JSAMPARRAY array;
+  size_t j;
+  int i;
+  int n;
+
+  ctx   = _ctx;
+  cinfo = &ctx->cinfo;
+  array = ctx->array;
+
+  if (setjmp(ctx->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_decompress(cinfo);
+    return ctx;
+  }
+
+  jpeg_start_decompress(cinfo);
+
+  /*
+   * 重なり部分の行は読み捨て、担当する行だけを出力先に書き込む
+   */
+  while (cinfo->output_scanline < skip + keep) {
+    j = cinfo->output_scanline;
+
+    if (j < skip) {
+      n = (skip - j < UNIT_LINES)? skip - j: UNIT_LINES;
+      for (i = 0; i < n; i++) array[i] = trash;
+
+      jpeg_read_scanlines(cinfo, array, n);
+
+    } else {
+      n = (skip + keep - j < UNIT_LINES)? skip + keep - j: UNIT_LINES;
+      if (n > output_capacity(ctx)) n = output_capacity(ctx);
+
+      for (i = 0; i < n; i++) {
+        array[i] = output_row(ctx, first + (j - skip) + i);
+      }
+
+      n = jpeg_read_scanlines(cinfo, array, n);
+      output_done(ctx, n);
+    }
+  }
+
+  output_flush(ctx);
+
+  jpeg_abort_decompress(cinfo);
+
+  return NULL;
+}
+
+static int
+decode_band(jpeg_decode_t* ctx, band_plan_t* plan, int band,
+            uint8_t** buf, size_t* capa, uint8_t* trash)
+{
+  struct jpeg_decompress_struct* cinfo;
+  uint8_t* tmp;
+  size_t size;
+  size_t first;
+  size_t last;
+  int top;
+  int bottom;
+
+  cinfo = &plan->ptr->cinfo;
+
+  /*
+   * 出力する範囲と実際に復号する範囲(MCU行単位)
+   */
+  top    = band * plan->band_rows;
+  bottom = top + plan->band_rows;
+  if (bottom > plan->mcu_rows) bottom = plan->mcu_rows;
+
+  first  = (size_t)top * plan->lines;
+  last   = (size_t)bottom * plan->lines;
+  if (last > cinfo->output_height) last = cinfo->output_height;
+
+  top    -= plan->overlap;
+  bottom += plan->overlap;
+  if (top < 0) top = 0;
+  if (bottom > plan->mcu_rows) bottom = plan->mcu_rows;
+
+  /*
+   * 帯域データの生成
+   */
+  size = build_band_data(plan, NULL, top, bottom);
+
+  if (size > *capa) {
+    tmp = (uint8_t*)realloc(*buf, size);
+    if (tmp == NULL) {
+      strcpy(ctx->err_mgr.msg, "no memory");
+      return -1;
+    }
+
+    *buf  = tmp;
+    *capa = size;
+  }
+
+  ctx->src.ptr  = *buf;
+  ctx->src.size = build_band_data(plan, *buf, top, bottom);
+
+  /*
+   * 復号
+   */
+  if (decode_header_without_gvl(ctx) != NULL) return -1;
+
+  if (ctx->cinfo.output_width != cinfo->output_width ||
+      ctx->cinfo.output_components != cinfo->output_components ||
+      ctx->cinfo.output_height < (first - (size_t)top * plan->lines) +
+                                 (last - first)) {
+    jpeg_abort_decompress(&ctx->cinfo);
+    strcpy(ctx->err_mgr.msg, "band geometry mismatch");
+    return -1;
+  }
+
+  // 帯バッファは帯域毎のイメージプールから確保し直す
+  ctx->dst.band = NULL;
+  ctx->dst.top  = (int)first;
+  ctx->dst.fill = 0;
+
+  if (decode_band_scanlines(ctx,
+                            first - ((size_t)top * plan->lines),
+                            last - first, (int)first, trash) != NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * ワーカ用のjpeg_decompress_structを生成する(失敗した場合は非0を返す)
+ */
+static int
+create_worker_decompress(jpeg_decode_t* ctx)
+{
+  if (setjmp(ctx->err_mgr.jmpbuf)) {
+    /*
+     * when failed to create decompress object
+     */
+    return !0;
+  }
+
+  create_decompress(ctx);
+
+  return 0;
+}
+
+static void*
+decode_band_worker(void* _plan)
+{
+  band_plan_t* plan;
+  jpeg_decode_t ctx;
+  JSAMPROW rows[UNIT_LINES];
+  uint8_t* buf;
+  size_t capa;
+  uint8_t* trash;
+  int i;
+
+  /*
+   * ワーカ毎にレシーバの設定を複製したjpeg_decompress_structを持つ
+   */
+  plan  = (band_plan_t*)_plan;
+  buf   = NULL;
+  capa  = 0;
+  trash = (uint8_t*)malloc(plan->ptr->dst.stride);
+
+  memcpy(&ctx, plan->ptr, sizeof(ctx));
+
+  ctx.array = rows;
+  ctx.data  = Qnil;
+  ctx.into  = Qnil;
+
+  CLR_FLAG(&ctx, F_PARSE_EXIF | F_APPLY_ORIENTATION);
+
+  if (trash == NULL) {
+    strcpy(ctx.err_mgr.msg, "no memory");
+
+  } else if (create_worker_decompress(&ctx)) {
+    free(trash);
+    trash = NULL;
+  }
+
+  // 処理を始められない場合も失敗を記録し、残りの帯域を打ち切らせる
+  if (trash == NULL) {
+    if (work_queue_fail(&plan->queue)) {
+      strcpy(plan->ptr->err_mgr.msg, ctx.err_mgr.msg);
+    }
+
+    return NULL;
+  }
+
+  while ((i = work_queue_fetch(&plan->queue)) >= 0) {
+    if (decode_band(&ctx, plan, i, &buf, &capa, trash)) {
+      if (work_queue_fail(&plan->queue)) {
+        strcpy(plan->ptr->err_mgr.msg, ctx.err_mgr.msg);
+      }
+
+    } else {
+      work_queue_done(&plan->queue);
+    }
+  }
+
+  jpeg_destroy_decompress(&ctx.cinfo);
+
+  if (buf != NULL) free(buf);
+  free(trash);
+
+  return NULL;
+}
+
+static void*
+decode_bands_without_gvl(void* _ptr)
+{
+  jpeg_decode_t* ptr;
+  band_plan_t plan;
+  void* ret;
+
+  ptr = (jpeg_decode_t*)_ptr;
+
+  if (plan_bands(ptr, &plan)) {
+    // 帯域分割できないデータは従来通り逐次処理で復号する
+    free_band_plan(&plan);
+    return decode_scanlines_without_gvl(ptr);
+  }
+
+  SET_FLAG(ptr, F_BANDED);
+
+  work_queue_init(&plan.queue, plan.nband);
+  run_workers(plan.nworker, decode_band_worker, &plan);
+
+  if (plan.queue.failed) {
+    ret = ptr;
+
+  } else if (plan.queue.done != plan.nband) {
+    strcpy(ptr->err_mgr.msg, "band decode worker failed");
+    ret = ptr;
+
+  } else {
+    ret = NULL;
+  }
+
+  work_queue_destroy(&plan.queue);
+  free_band_plan(&plan);
+
+  return ret;
+}
+
+static void
+call_decoder_without_gvl(jpeg_decode_t* ptr, void* (*func)(void*))
+{
+  /*
+   * libjpegのエラーはlongjmpで通知されるため、GVL解放中に
+   * rb_raise()を呼ぶことはできない。エラーメッセージは
+   * err_mgr.msgに保存されているので、GVLを再取得した後に
+   * 例外に変換する。
+   */
+  if (rb_thread_call_without_gvl(func, ptr, NULL, NULL) != NULL) {
+    rb_raise(decerr_klass, "%s", ptr->err_mgr.msg);
+  }
+}
+
+/*
+ * 出力先のStringをロックした状態で復号処理を呼び出す。例外を発生させる
+ * 前にロックを解除しないと、:intoで渡されたStringがロックされたまま
+ * 残ってしまう。
+ */
+static void
+call_decoder_with_lock(jpeg_decode_t* ptr, void* (*func)(void*), VALUE str)
+{
+  void* err;
+
+  rb_str_locktmp(str);
+  err = rb_thread_call_without_gvl(func, ptr, NULL, NULL);
+  rb_str_unlocktmp(str);
+
+  if (err != NULL) {
+    rb_raise(decerr_klass, "%s", ptr->err_mgr.msg);
+  }
+}
+
+static VALUE
+prepare_output_buffer(VALUE buf, size_t size)
+{
+  /*
+   * 容量が足りている場合はそのまま使用し、足りない場合のみ拡張する
+   */
+  rb_str_modify(buf);
+
+  if (rb_str_capacity(buf) < size) {
+    rb_str_modify_expand(buf, size - RSTRING_LEN(buf));
+  }
+
+  rb_enc_associate(buf, rb_ascii8bit_encoding());
+
+  return buf;
+}
+
+static VALUE
+do_decode(VALUE _ptr)
+{
+  VALUE ret;
+
+  jpeg_decode_t* ptr;
+  struct jpeg_decompress_struct* cinfo;
+
+  size_t raw_sz;
+  size_t capa;
+  uint8_t* raw;
+  int wd;
+  int ht;
+  decode_info_t info;
+
+  /*
+   * initialize
+   */
+  ret       = Qnil; // warning対策
+  ptr       = (jpeg_decode_t*)_ptr;
+  cinfo     = &ptr->cinfo;
+
+  ptr->src.ptr  = (uint8_t*)RSTRING_PTR(ptr->data);
+  ptr->src.size = RSTRING_LEN(ptr->data);
+
+  /*
+   * read header
+   */
+  call_decoder_without_gvl(ptr, decode_header_without_gvl);
+
+  if (IS_PLANAR(ptr)) {
+    if (!(cinfo->jpeg_color_space == JCS_YCbCr &&
+          cinfo->num_components == 3) &&
+        !(cinfo->jpeg_color_space == JCS_GRAYSCALE &&
+          cinfo->num_components == 1)) {
+      NOT_IMPLEMENTED_ERROR("planar output supports only YCbCr or "
+                            "grayscale JPEG");
+    }
+  }
+
+  // 向きは出力時に適用するので、ここで求めておく
+  get_decode_info(ptr, &info);
+
+  if (IS_PLANAR(ptr)) info.orientation = 0;
+
+  if (IS_RESIZED(ptr)) {
+    plan_resize(ptr, info.orientation);
+  }
+
+  if (IS_CROPPED(ptr)) {
+    if ((JDIMENSION)(ptr->crop.x + ptr->crop.width) > cinfo->output_width ||
+        (JDIMENSION)(ptr->crop.y + ptr->crop.height) > cinfo->output_height) {
+      RANGE_ERROR("crop area is out of the image");
+    }
+  }
+
+  /*
+   * alloc output buffer
+   */
+  if (IS_CROPPED(ptr)) {
+    wd = ptr->crop.width;
+    ht = ptr->crop.height;
+  } else if (IS_RESIZED(ptr)) {
+    wd = ptr->resize.out_width;
+    ht = ptr->resize.out_height;
+  } else {
+    wd = cinfo->output_width;
+    ht = cinfo->output_height;
+  }
+
+  if (IS_PLANAR(ptr)) {
+    raw_sz = get_plane_layout(ptr->format, wd, ht, wd, NULL);
+  } else {
+    raw_sz = output_size(ptr, wd, ht,
+                         cinfo->output_components, info.orientation);
+  }
+
+  capa   = raw_sz;
+
+  // カラーマップの展開はバッファ上で行うので、その分も確保しておく
+  if (TEST_FLAG(ptr, F_EXPAND_COLORMAP) && cinfo->quantize_colors) {
+    capa *= cinfo->out_color_components;
+  }
+
+  if (ptr->into != Qnil) {
+    ret = prepare_output_buffer(ptr->into, capa);
+  } else {
+    ret = rb_str_buf_new(capa);
+  }
+
+  raw    = (uint8_t*)RSTRING_PTR(ret);
+
+  set_output(ptr, raw, wd, ht, info.orientation);
+
+  /*
+   * decode process
+   */
+  CLR_FLAG(ptr, F_BANDED);
+
+  if (IS_PLANAR(ptr)) {
+    call_decoder_with_lock(ptr, decode_planar_without_gvl, ret);
+  } else if (IS_CROPPED(ptr)) {
+    call_decoder_with_lock(ptr, decode_cropped_without_gvl, ret);
+  } else if (IS_RESIZED(ptr)) {
+    call_decoder_with_lock(ptr, decode_resized_without_gvl, ret);
+  } else if (ptr->threads > 1) {
+    call_decoder_with_lock(ptr, decode_bands_without_gvl, ret);
+  } else {
+    call_decoder_with_lock(ptr, decode_scanlines_without_gvl, ret);
+  }
+
+  /*
+   * build return data
+   */
+  get_decode_info(ptr, &info);
+
+  if (IS_CROPPED(ptr)) {
+    info.width  = ptr->crop.width;
+    info.height = ptr->crop.height;
+
+  } else if (IS_RESIZED(ptr)) {
+    info.width  = ptr->resize.out_width;
+    info.height = ptr->resize.out_height;
+
+  } else if (IS_PLANAR(ptr)) {
+    // 平面形式の場合は回転・反転は適用しない
+    info.orientation = 0;
+  }
+
+  ret = build_decode_result(ptr, &info, ret);
+
+  if (TEST_FLAG(ptr, F_BANDED) || IS_CROPPED(ptr) || IS_RESIZED(ptr) ||
+      cinfo->buffered_image) {
+    /*
+     * 帯域分割時のコンテキストはヘッダを読んだ状態のままになっている。
+     * 切り出し・リサイズ時は残りの行を読み出していないので、ここで
+     * 中断する。:max_scans指定時は残りのスキャンを読まずに中断する。
+     */
+    jpeg_abort_decompress(cinfo);
+  } else {
+    call_decoder_without_gvl(ptr, decode_finish_without_gvl);
+  }
+
+  RB_GC_GUARD(ret);
+
+  return ret;
+}
+
+static void
+eval_decode_crop_arg(VALUE arg, int rect[4])
+{
+  int i;
+
+  Check_Type(arg, T_ARRAY);
+
+  if (RARRAY_LEN(arg) != 4) {
+    ARGUMENT_ERROR(":crop should be [x, y, width, height]");
+  }
+
+  for (i = 0; i < 4; i++) {
+    rect[i] = NUM2INT(RARRAY_AREF(arg, i));
+  }
+
+  if (rect[0] < 0 || rect[1] < 0) {
+    RANGE_ERROR(":crop position is negative");
+  }
+
+  if (rect[2] <= 0 || rect[3] <= 0) {
+    RANGE_ERROR(":crop size less equal zero");
+  }
+}
+
+static void
+eval_decode_size_arg(VALUE arg, int size[2])
+{
+  int i;
+
+  Check_Type(arg, T_ARRAY);
+
+  if (RARRAY_LEN(arg) != 2) {
+    ARGUMENT_ERROR(":size should be [width, height]");
+  }
+
+  for (i = 0; i < 2; i++) {
+    size[i] = NUM2INT(RARRAY_AREF(arg, i));
+  }
+
+  if (size[0] <= 0 || size[1] <= 0 || size[0] > 65500 || size[1] > 65500) {
+    RANGE_ERROR(":size is out of range");
+  }
+}
+
+static int
+eval_decode_fit_arg(VALUE arg)
+{
+  int ret;
+
+  if (arg == Qundef || arg == Qnil) {
+    ret = FIT_CONTAIN;
 
-  case 2:
-    obj = rb_ary_new_capa(n);
-    for (i = 0; i < (int)n; i++) {
-      rb_ary_push(obj, INT2FIX(get_u16(p, ptr->be)));
-      p += 2;
+  } else {
+    if (TYPE(arg) != T_STRING && TYPE(arg) != T_SYMBOL) {
+      TYPE_ERROR("unsupported :fit type");
     }
 
-    rb_ary_freeze(obj);
-    break;
+    if (EQ_STR(arg, "contain")) {
+      ret = FIT_CONTAIN;
+
+    } else if (EQ_STR(arg, "cover")) {
+      ret = FIT_COVER;
+
+    } else if (EQ_STR(arg, "fill")) {
+      ret = FIT_FILL;
+
+    } else {
+      ARGUMENT_ERROR("unsupported :fit value");
+    }
   }
 
-  *dst = obj;
+  return ret;
 }
 
-static void
-exif_fetch_long_data(exif_t* ptr, VALUE* dst)
+static int
+eval_decode_filter_arg(VALUE arg)
 {
-  VALUE obj;
+  int ret;
 
-  int i;
-  uint32_t n;
-  uint8_t* p;
+  if (arg == Qundef || arg == Qnil) {
+    ret = FILTER_BILINEAR;
 
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->cur + 8;
+  } else {
+    if (TYPE(arg) != T_STRING && TYPE(arg) != T_SYMBOL) {
+      TYPE_ERROR("unsupported :filter type");
+    }
 
-  switch (n) {
-  case 0:
-    obj = Qnil;
-    break;
+    if (EQ_STR(arg, "bilinear")) {
+      ret = FILTER_BILINEAR;
 
-  case 1:
-    obj = INT2FIX(get_u32(p, ptr->be));
-    break;
+    } else if (EQ_STR(arg, "lanczos")) {
+      ret = FILTER_LANCZOS;
 
-  default:
-    p   = ptr->head + get_u32(p, ptr->be);
-    obj = rb_ary_new_capa(n);
-    for (i = 0; i < (int)n; i++) {
-      rb_ary_push(obj, INT2FIX(get_u32(p, ptr->be)));
-      p += 4;
+    } else {
+      ARGUMENT_ERROR("unsupported :filter value");
     }
-
-    rb_ary_freeze(obj);
-    break;
   }
 
-  *dst = obj;
+  return ret;
 }
 
-static void
-exif_fetch_rational_data(exif_t* ptr, VALUE* dst)
+/**
+ * decode JPEG data
+ *
+ * @overload decode(jpeg, into: nil, crop: nil, size: nil, fit: :contain, filter: :bilinear, max_scans: nil)
+ *
+ *   @param jpeg [String]  JPEG data to decode.
+ *
+ *   @param into [String]  buffer to store the decoded image. the buffer
+ *     is reused as is when its capacity is large enough, and expanded
+ *     otherwise. its content and encoding are overwritten.
+ *
+ *   @param crop [Array<Integer>]  area to decode as [x, y, width, height]
+ *     in the output image (after scaling, before orientation is applied).
+ *     only the area is decoded, and the meta information reports the
+ *     size of the area.
+ *
+ *   @param size [Array<Integer>]  target size as [width, height] of the
+ *     output image (after orientation is applied). the image is reduced
+ *     by the DCT scaling first and then resampled to the size. the
+ *     :scale option is ignored when this is given.
+ *
+ *   @param fit [Symbol]  how to fit the image into :size.
+ *     :contain keeps the aspect ratio within the size, :cover keeps the
+ *     aspect ratio and crops the center to the size, and :fill stretches
+ *     the image to the size.
+ *
+ *   @param filter [Symbol]  resampling filter (:bilinear or :lanczos).
+ *
+ *   @param max_scans [Integer]  number of scans to decode from a
+ *     progressive (multi-scan) JPEG. the image refined by the first
+ *     max_scans scans is returned and the rest of the data is not
+ *     decoded. ignored for single scan JPEG.
+ *
+ *   @return [String] decoded raw image data. if :into is given, the
+ *     given buffer is returned.
+ */
+static VALUE
+rb_decoder_decode(int argc, VALUE* argv, VALUE self)
 {
-  VALUE obj;
-  VALUE val;
-
+  VALUE ret;
+  VALUE data;
+  VALUE opt;
+  VALUE args[N(decode_args_ids)];
+  VALUE into;
+  int crop[4];
+  int size[2];
+  int fit;
+  int filter;
+  int scans;
   int i;
-  uint32_t n;
-  uint8_t* p;
-  uint32_t deno;
-  uint32_t num;
+  jpeg_decode_t* ptr;
+  int state;
 
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->head + get_u32(ptr->cur + 8, ptr->be);
+  /*
+   * initialize
+   */
+  ret     = Qnil;
+  state   = 0;
+  crop[2] = 0;
+  size[0] = 0;
+  scans   = 0;
+
+  for (i = 0; i < (int)N(args); i++) {
+    args[i] = Qundef;
+  }
 
-  switch (n) {
-  case 0:
-    obj = Qnil;
-    break;
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
 
-  case 1:
-    num  = get_u32(p + 0, ptr->be);
-    deno = get_u32(p + 4, ptr->be);
-    if (num == 0 && deno == 0) {
-      deno = 1;
+  /*
+   * parse arguments
+   */
+  rb_scan_args(argc, argv, "1:", &data, &opt);
+
+  if (opt != Qnil) {
+    rb_get_kwargs(opt, decode_args_ids, 0, N(decode_args_ids), args);
+  }
+
+  /*
+   * argument check
+   */
+  Check_Type(data, T_STRING);
+
+  into = (args[0] == Qundef)? Qnil: args[0];
+
+  if (into != Qnil) {
+    Check_Type(into, T_STRING);
+    rb_check_frozen(into);
+  }
+
+  if (args[1] != Qundef && args[1] != Qnil) {
+    eval_decode_crop_arg(args[1], crop);
+  }
+
+  if (args[2] != Qundef && args[2] != Qnil) {
+    eval_decode_size_arg(args[2], size);
+
+    if (crop[2] > 0) {
+      ARGUMENT_ERROR(":crop and :size can't be specified together");
     }
-    obj = rb_rational_new(INT2FIX(num), INT2FIX(deno));
-    rb_obj_freeze(obj);
-    break;
 
-  default:
-    obj = rb_ary_new_capa(n);
-    for (i = 0; i < (int)n; i++) {
-      num  = get_u32(p + 0, ptr->be);
-      deno = get_u32(p + 4, ptr->be);
-      if (num == 0 && deno == 0) {
-        deno = 1;
-      }
+    if (TEST_FLAG(ptr, F_DITHER)) {
+      ARGUMENT_ERROR(":size can't be used with :dither");
+    }
 
-      val = rb_rational_new(INT2FIX(num), INT2FIX(deno));
-      rb_obj_freeze(val);
+  } else if (args[3] != Qundef || args[4] != Qundef) {
+    ARGUMENT_ERROR(":fit and :filter require :size");
+  }
 
-      rb_ary_push(obj, val);
-      p += 8;
+  fit    = eval_decode_fit_arg(args[3]);
+  filter = eval_decode_filter_arg(args[4]);
+
+  if (args[5] != Qundef && args[5] != Qnil) {
+    Check_Type(args[5], T_FIXNUM);
+
+    if (FIX2LONG(args[5]) < 1 || FIX2LONG(args[5]) > 65535) {
+      RANGE_ERROR(":max_scans is out of range");
     }
 
-    rb_ary_freeze(obj);
-    break;
+    scans = FIX2INT(args[5]);
   }
 
-  *dst = obj;
+  if (IS_PLANAR(ptr) && (crop[2] > 0 || size[0] > 0)) {
+    NOT_IMPLEMENTED_ERROR(":crop and :size are not supported "
+                          "with planar format");
+  }
+
+  if (ptr->data != Qnil) {
+    RUNTIME_ERROR("decoder is busy");
+  }
+
+  /*
+   * prepare
+   */
+  SET_DATA(ptr, rb_str_new_frozen(data));
+  ptr->into      = into;
+  ptr->max_scans = scans;
+
+  if (crop[2] > 0) {
+    ptr->crop.x      = crop[0];
+    ptr->crop.y      = crop[1];
+    ptr->crop.width  = crop[2];
+    ptr->crop.height = crop[3];
+  }
+
+  if (size[0] > 0) {
+    ptr->resize.width  = size[0];
+    ptr->resize.height = size[1];
+    ptr->resize.fit    = fit;
+    ptr->resize.filter = filter;
+  }
+
+  /*
+   * do decode
+   */
+  ret = rb_protect(do_decode, (VALUE)ptr, &state);
+
+  /*
+   * post process
+   */
+  CLR_DATA(ptr);
+  ptr->into         = Qnil;
+  ptr->crop.width   = 0;
+  ptr->resize.width = 0;
+  ptr->max_scans    = 0;
+
+  if (state != 0) {
+    jpeg_abort_decompress(&ptr->cinfo);
+    rb_jump_tag(state);
+  }
+
+  return ret;
 }
 
-static void
-exif_fetch_undefined_data(exif_t* ptr, VALUE* dst)
+static int
+scale_for_thumbnail(j_decompress_ptr cinfo, int max)
 {
-  VALUE obj;
+  JDIMENSION side;
+  int m;
 
-  uint32_t n;
-  uint8_t* p;
+  /*
+   * 長辺がmax以上となる最小のDCT縮尺(M/8)を選ぶ。M=1はDC成分のみの
+   * 復号となる。
+   */
+  for (m = 1; m <= 8; m++) {
+    cinfo->scale_num   = m;
+    cinfo->scale_denom = 8;
 
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->cur + 8;
+    jpeg_calc_output_dimensions(cinfo);
 
-  if (n > 4) {
-    p = ptr->head + get_u32(p, ptr->be);
-  }
+    side = (cinfo->output_width > cinfo->output_height)?
+                cinfo->output_width: cinfo->output_height;
 
-  obj = rb_enc_str_new((char*)p, n, rb_ascii8bit_encoding());
-  rb_str_freeze(obj);
+    if (side >= (JDIMENSION)max) break;
+  }
 
-  *dst = obj;
+  return (m <= 8);
 }
 
-static void
-exif_fetch_slong_data(exif_t* ptr, VALUE* dst)
+static VALUE
+do_thumbnail(VALUE _ptr)
 {
-  VALUE obj;
-
-  int i;
-  uint32_t n;
+  VALUE ret;
+  VALUE exif;
+  VALUE thumb;
+  jpeg_decode_t* ptr;
+  struct jpeg_decompress_struct* cinfo;
+  size_t capa;
+  size_t size;
   uint8_t* p;
+  int orientation;
+  decode_info_t info;
 
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->cur + 8;
+  /*
+   * initialize
+   */
+  ptr   = (jpeg_decode_t*)_ptr;
+  cinfo = &ptr->cinfo;
+  exif  = Qnil;
+  thumb = Qnil;
 
-  switch (n) {
-  case 0:
-    obj = Qnil;
-    break;
+  ptr->src.ptr  = (uint8_t*)RSTRING_PTR(ptr->data);
+  ptr->src.size = RSTRING_LEN(ptr->data);
 
-  case 1:
-    obj = INT2FIX(get_s32(p, ptr->be));
-    break;
+  /*
+   * read header
+   */
+  call_decoder_without_gvl(ptr, decode_header_without_gvl);
 
-  default:
-    p   = ptr->head + get_u32(p, ptr->be);
-    obj = rb_ary_new_capa(n);
-    for (i = 0; i < (int)n; i++) {
-      rb_ary_push(obj, INT2FIX(get_s32(p, ptr->be)));
-      p += 4;
+  get_decode_info(ptr, &info);
+  orientation = info.orientation;
+
+  /*
+   * Exifに埋め込まれたサムネイルが十分な大きさであればそちらを使用する
+   * (マーカーは中断時に解放されるので、必要なデータは複製しておく)
+   */
+  p = find_exif_thumbnail(info.exif.data, info.exif.size, &size);
+
+  if (p != NULL) {
+    if (TEST_FLAG(ptr, F_PARSE_EXIF)) {
+      exif = rb_str_new((char*)info.exif.data, info.exif.size);
     }
 
-    rb_ary_freeze(obj);
-    break;
+    thumb = rb_str_new((char*)p, size);
+
+    jpeg_abort_decompress(cinfo);
+
+    ptr->src.ptr  = (uint8_t*)RSTRING_PTR(thumb);
+    ptr->src.size = RSTRING_LEN(thumb);
+
+    if (rb_thread_call_without_gvl(decode_header_without_gvl,
+                                   ptr, NULL, NULL) != NULL ||
+        !scale_for_thumbnail(cinfo, ptr->thumbnail_max)) {
+      /*
+       * 小さすぎるか壊れている場合は本体を使用する
+       */
+      jpeg_abort_decompress(cinfo);
+
+      exif          = Qnil;
+      thumb         = Qnil;
+      ptr->src.ptr  = (uint8_t*)RSTRING_PTR(ptr->data);
+      ptr->src.size = RSTRING_LEN(ptr->data);
+
+      call_decoder_without_gvl(ptr, decode_header_without_gvl);
+    }
   }
 
-  *dst = obj;
-}
+  if (thumb == Qnil) {
+    // 本体より大きな値が指定された場合は等倍で復号される
+    scale_for_thumbnail(cinfo, ptr->thumbnail_max);
+  }
 
-static void
-exif_fetch_srational_data(exif_t* ptr, VALUE* dst)
-{
-  VALUE obj;
-  VALUE val;
+  /*
+   * alloc output buffer
+   */
+  capa = output_size(ptr, cinfo->output_width, cinfo->output_height,
+                     cinfo->output_components, orientation);
 
-  int i;
-  uint32_t n;
-  uint8_t* p;
-  uint32_t deno;
-  uint32_t num;
+  if (TEST_FLAG(ptr, F_EXPAND_COLORMAP) && cinfo->quantize_colors) {
+    capa *= cinfo->out_color_components;
+  }
 
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->head + get_u32(ptr->cur + 8, ptr->be);
+  ret = rb_str_buf_new(capa);
 
-  switch (n) {
-  case 0:
-    obj = Qnil;
-    break;
+  set_output(ptr, (uint8_t*)RSTRING_PTR(ret),
+             cinfo->output_width, cinfo->output_height, orientation);
 
-  case 1:
-    num  = get_s32(p + 0, ptr->be);
-    deno = get_s32(p + 4, ptr->be);
-    if (num == 0 && deno == 0) {
-      deno = 1;
-    }
-    obj = rb_rational_new(INT2FIX(num), INT2FIX(deno));
-    break;
+  /*
+   * do decode
+   */
+  call_decoder_with_lock(ptr, decode_scanlines_without_gvl, ret);
 
-  default:
-    obj = rb_ary_new_capa(n);
-    for (i = 0; i < (int)n; i++) {
-      num  = get_s32(p + 0, ptr->be);
-      deno = get_s32(p + 4, ptr->be);
-      if (num == 0 && deno == 0) {
-        deno = 1;
-      }
+  /*
+   * build return data
+   */
+  get_decode_info(ptr, &info);
 
-      val = rb_rational_new(INT2FIX(num), INT2FIX(deno));
-      rb_obj_freeze(val);
+  if (thumb != Qnil) {
+    // 向きとExifタグは本体のものを使用する
+    info.orientation = orientation;
 
-      rb_ary_push(obj, val);
-      p += 8;
+    if (exif != Qnil) {
+      info.exif.data = (uint8_t*)RSTRING_PTR(exif);
+      info.exif.size = RSTRING_LEN(exif);
     }
-
-    rb_ary_freeze(obj);
-    break;
   }
 
-  *dst = obj;
-}
+  ret = build_decode_result(ptr, &info, ret);
 
-static void
-exif_fetch_child_ifd(exif_t* ptr, tag_entry_t* tbl, size_t n, exif_t* dst)
-{
-  uint32_t off;
+  call_decoder_without_gvl(ptr, decode_finish_without_gvl);
 
-  off = get_u32(ptr->cur + 8, ptr->be); 
+  RB_GC_GUARD(exif);
+  RB_GC_GUARD(thumb);
 
-  dst->be       = ptr->be;
-  dst->head     = ptr->head;
-  dst->cur      = ptr->head + off;
-  dst->size     = ptr->size - off;
-  dst->tags.tbl = tbl;
-  dst->tags.n   = n;
-  dst->next     = 0;
+  return ret;
 }
 
-static int
-exif_read(exif_t* ptr, VALUE dst)
+/**
+ * decode a thumbnail of JPEG data
+ *
+ * @overload thumbnail(jpeg, max: 256)
+ *
+ *   @param jpeg [String]  JPEG data to decode.
+ *
+ *   @param max [Integer]  required length of the longer side.
+ *
+ *   @return [String]  decoded raw image data whose longer side is equal
+ *     to or just above max (or the whole image if it is smaller).
+ *
+ *   @note the thumbnail embedded in Exif is used if it is large enough.
+ *     otherwise the image is decoded with the smallest DCT scaling that
+ *     satisfies max (1/8 scaling decodes only the DC coefficients). the
+ *     :scale and :threads options are ignored.
+ */
+static VALUE
+rb_decoder_thumbnail(int argc, VALUE* argv, VALUE self)
 {
-  int ret;
-  int i;
-  uint16_t ntag;
-  uint16_t tag;
-  uint16_t type;
-  uint32_t off;
+  VALUE ret;
+  VALUE data;
+  VALUE opt;
+  VALUE max;
+  jpeg_decode_t* ptr;
+  int state;
+  ID id;
 
-  exif_t child;
+  /*
+   * initialize
+   */
+  ret   = Qnil;
+  state = 0;
+  max   = Qundef;
+  id    = rb_intern("max");
 
-  VALUE key;
-  VALUE val;
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
 
-  ntag = get_u16(ptr->cur, ptr->be);
-  exif_increase(ptr, 2);
+  /*
+   * parse arguments
+   */
+  rb_scan_args(argc, argv, "1:", &data, &opt);
 
-  for (i = 0; i < ntag; i++) {
-    exif_fetch_tag_header(ptr, &tag, &type);
+  if (opt != Qnil) {
+    rb_get_kwargs(opt, &id, 0, 1, &max);
+  }
 
-    switch (tag) {
-    case 34665: // ExifIFDPointer
-      key = ID2SYM(rb_intern("exif"));
-      val = rb_hash_new();
+  /*
+   * argument check
+   */
+  Check_Type(data, T_STRING);
 
-      exif_fetch_child_ifd(ptr, tag_exif, N(tag_exif), &child);
-      exif_read(&child, val);
-      break;
+  if (max == Qundef) {
+    max = INT2FIX(DEFAULT_THUMBNAIL_SIZE);
+  } else {
+    Check_Type(max, T_FIXNUM);
+  }
 
-    case 34853: // GPSInfoIFDPointer
-      key = ID2SYM(rb_intern("gps"));
-      val = rb_hash_new();
+  if (FIX2LONG(max) <= 0 || FIX2LONG(max) > 65500) {
+    RANGE_ERROR(":max is out of range");
+  }
 
-      exif_fetch_child_ifd(ptr, tag_gps, N(tag_gps), &child);
-      exif_read(&child, val);
-      break;
+  if (IS_PLANAR(ptr)) {
+    NOT_IMPLEMENTED_ERROR("thumbnail is not supported with planar format");
+  }
 
-    case 40965: // InteroperabilityIFDPointer
-      key = ID2SYM(rb_intern("interoperability"));
-      val = rb_hash_new();
+  if (ptr->data != Qnil) {
+    RUNTIME_ERROR("decoder is busy");
+  }
 
-      exif_fetch_child_ifd(ptr, tag_i14y, N(tag_i14y), &child);
-      exif_read(&child, val);
-      break;
+  /*
+   * prepare
+   */
+  SET_DATA(ptr, rb_str_new_frozen(data));
+  SET_FLAG(ptr, F_THUMBNAIL);
+  ptr->thumbnail_max = FIX2INT(max);
 
-    default:
-      key = lookup_tag_symbol(ptr->tags.tbl, ptr->tags.n, tag);
+  /*
+   * do decode
+   */
+  ret = rb_protect(do_thumbnail, (VALUE)ptr, &state);
 
-      switch (type) {
-      case 1:  // when BYTE
-        exif_fetch_byte_data(ptr, &val);
-        break;
+  /*
+   * post process
+   */
+  CLR_DATA(ptr);
+  CLR_FLAG(ptr, F_THUMBNAIL);
 
-      case 2:  // when ASCII
-        exif_fetch_ascii_data(ptr, &val);
-        break;
+  if (state != 0) {
+    jpeg_abort_decompress(&ptr->cinfo);
+    rb_jump_tag(state);
+  }
 
-      case 3:  // when SHORT
-        exif_fetch_short_data(ptr, &val);
-        break;
+  return ret;
+}
 
-      case 4:  // when LONG
-        exif_fetch_long_data(ptr, &val);
-        break;
+static void*
+read_coefficients_without_gvl(void* _ptr)
+{
+  jpeg_decode_t* volatile ptr;
 
-      case 5:  // when RATIONAL
-        exif_fetch_rational_data(ptr, &val);
-        break;
+  ptr = (jpeg_decode_t*)_ptr;
 
-      case 7:  // when UNDEFINED
-        exif_fetch_undefined_data(ptr, &val);
-        break;
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_decompress(&ptr->cinfo);
+    return ptr;
+  }
 
-      case 9:  // when SLONG
-        exif_fetch_slong_data(ptr, &val);
-        break;
+  // エントロピー復号のみを行い、全係数を仮想配列に読み込む
+  ptr->coef = jpeg_read_coefficients(&ptr->cinfo);
 
-      case 10: // when SRATIONAL
-        exif_fetch_srational_data(ptr, &val);
-        break;
+  return NULL;
+}
 
-      default:
-        rb_raise(decerr_klass, "invalid tag data type");
-      }
-    }
+static VALUE
+create_component_hash(jpeg_decode_t* ptr, int ci)
+{
+  VALUE ret;
+  VALUE qtbl;
+  VALUE coef;
+  struct jpeg_decompress_struct* cinfo;
+  jpeg_component_info* comp;
+  JBLOCKARRAY rows;
+  size_t size;
+  uint8_t* dst;
+  JDIMENSION y;
+  int i;
 
-    rb_hash_aset(dst, key, val);
-    exif_increase(ptr, 12);
+  cinfo = &ptr->cinfo;
+  comp  = cinfo->comp_info + ci;
+  size  = (size_t)comp->width_in_blocks * sizeof(JBLOCK);
+  coef  = rb_str_buf_new(size * comp->height_in_blocks);
+  qtbl  = rb_ary_new_capa(DCTSIZE2);
+  dst   = (uint8_t*)RSTRING_PTR(coef);
+
+  /*
+   * ブロックは左上から行順に並べ、各ブロック内の係数は自然順(ジグザグ
+   * 順ではない8x8の行順)のまま格納する
+   */
+  for (y = 0; y < comp->height_in_blocks; y++) {
+    rows = (*cinfo->mem->access_virt_barray)((j_common_ptr)cinfo,
+                                             ptr->coef[ci], y, 1, FALSE);
+    memcpy(dst, rows[0], size);
+    dst += size;
   }
 
-  off = get_u32(ptr->cur, ptr->be);
-  if (off != 0) {
-    ptr->cur  = ptr->head + off;
-    ptr->next = !0;
+  rb_str_set_len(coef, size * comp->height_in_blocks);
+
+  for (i = 0; i < DCTSIZE2; i++) {
+    rb_ary_push(qtbl, INT2FIX(comp->quant_table->quantval[i]));
   }
 
-  return ret;
-}
+  ret = rb_hash_new();
 
-#define THUMBNAIL_OFFSET    ID2SYM(rb_intern("jpeg_interchange_format"))
-#define THUMBNAIL_SIZE      ID2SYM(rb_intern("jpeg_interchange_format_length"))
+  rb_hash_aset(ret, ID2SYM(rb_intern("id")), INT2FIX(comp->component_id));
+  rb_hash_aset(ret, ID2SYM(rb_intern("h_samp_factor")),
+               INT2FIX(comp->h_samp_factor));
+  rb_hash_aset(ret, ID2SYM(rb_intern("v_samp_factor")),
+               INT2FIX(comp->v_samp_factor));
+  rb_hash_aset(ret, ID2SYM(rb_intern("width_in_blocks")),
+               INT2FIX(comp->width_in_blocks));
+  rb_hash_aset(ret, ID2SYM(rb_intern("height_in_blocks")),
+               INT2FIX(comp->height_in_blocks));
+  rb_hash_aset(ret, ID2SYM(rb_intern("quant_table")), rb_ary_freeze(qtbl));
+  rb_hash_aset(ret, ID2SYM(rb_intern("coefficients")), coef);
+
+  return rb_hash_freeze(ret);
+}
 
 static VALUE
-create_exif_tags_hash(jpeg_decode_t* ptr)
+do_read_coefficients(VALUE _ptr)
 {
   VALUE ret;
-  jpeg_saved_marker_ptr marker;
-  exif_t exif;
+  VALUE ary;
+  jpeg_decode_t* ptr;
+  struct jpeg_decompress_struct* cinfo;
+  int i;
 
-  ret = rb_hash_new();
+  /*
+   * initialize
+   */
+  ret   = Qnil;
+  ptr   = (jpeg_decode_t*)_ptr;
+  cinfo = &ptr->cinfo;
+
+  ptr->src.ptr  = (uint8_t*)RSTRING_PTR(ptr->data);
+  ptr->src.size = RSTRING_LEN(ptr->data);
 
-  for (marker = ptr->cinfo.marker_list;
-            marker != NULL; marker = marker->next) {
+  /*
+   * read coefficients (IDCT, アップサンプリング, 色変換は行わない)
+   */
+  call_decoder_without_gvl(ptr, decode_header_without_gvl);
+  call_decoder_without_gvl(ptr, read_coefficients_without_gvl);
 
-    if (marker->data_length < 14) continue;
-    if (memcmp(marker->data, "Exif\0\0", 6)) continue;
+  /*
+   * build return data
+   */
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_decompress(cinfo);
+    rb_raise(decerr_klass, "%s", ptr->err_mgr.msg);
 
-    /* 0th IFD */
-    exif_init(&exif, marker->data, marker->data_length);
-    exif_read(&exif, ret);
+  } else {
+    ary = rb_ary_new_capa(cinfo->num_components);
 
-    if (exif.next) {
-      /* when 1th IFD (tumbnail) exist */
-      VALUE info;
-      VALUE off;
-      VALUE size;
-      VALUE data;
+    for (i = 0; i < cinfo->num_components; i++) {
+      rb_ary_push(ary, create_component_hash(ptr, i));
+    }
 
-      info = rb_hash_new();
+    ret = rb_hash_new();
 
-      exif_read(&exif, info);
+    rb_hash_aset(ret, ID2SYM(rb_intern("width")),
+                 INT2FIX(cinfo->image_width));
+    rb_hash_aset(ret, ID2SYM(rb_intern("height")),
+                 INT2FIX(cinfo->image_height));
+    rb_hash_aset(ret, ID2SYM(rb_intern("colorspace")),
+                 get_colorspace_str(cinfo->jpeg_color_space));
+    rb_hash_aset(ret, ID2SYM(rb_intern("components")), rb_ary_freeze(ary));
+  }
 
-      off  = rb_hash_lookup(info, THUMBNAIL_OFFSET);
-      size = rb_hash_lookup(info, THUMBNAIL_SIZE);
+  call_decoder_without_gvl(ptr, decode_finish_without_gvl);
 
-      if (TYPE(off) == T_FIXNUM && TYPE(size) == T_FIXNUM) {
-        data = rb_enc_str_new((char*)exif.head + FIX2INT(off),
-                              FIX2INT(size),
-                              rb_ascii8bit_encoding());
+  return rb_hash_freeze(ret);
+}
+
+/**
+ * read the quantized DCT coefficients of JPEG data
+ *
+ * @overload read_coefficients(jpeg)
+ *
+ *   @param jpeg [String]  JPEG data to read.
+ *
+ *   @return [Hash]  :width, :height, :colorspace (of the JPEG data) and
+ *     :components, an Array of Hashes for each component with the keys
+ *     :id, :h_samp_factor, :v_samp_factor, :width_in_blocks,
+ *     :height_in_blocks, :quant_table and :coefficients.
+ *
+ *   @note only the entropy decoding is done (no IDCT, upsampling nor
+ *     color conversion). :coefficients is a String of native endian
+ *     int16 values, 64 per 8x8 block in natural (row major, not zigzag)
+ *     order, with the blocks stored left to right and top to bottom
+ *     (unpack it by "s*"). :quant_table holds the 64 quantizer values in
+ *     the same order. the decode options are ignored.
+ */
+static VALUE
+rb_decoder_read_coefficients(VALUE self, VALUE data)
+{
+  VALUE ret;
+  jpeg_decode_t* ptr;
+  int state;
+
+  /*
+   * initialize
+   */
+  ret   = Qnil;
+  state = 0;
+
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
+
+  /*
+   * argument check
+   */
+  Check_Type(data, T_STRING);
+
+  if (ptr->data != Qnil) {
+    RUNTIME_ERROR("decoder is busy");
+  }
+
+  /*
+   * prepare
+   */
+  SET_DATA(ptr, rb_str_new_frozen(data));
+
+  /*
+   * do read
+   */
+  ret = rb_protect(do_read_coefficients, (VALUE)ptr, &state);
 
-        rb_str_freeze(data);
+  /*
+   * post process
+   */
+  CLR_DATA(ptr);
+  ptr->coef = NULL;
 
-        rb_hash_lookup(info, THUMBNAIL_OFFSET);
-        rb_hash_lookup(info, THUMBNAIL_SIZE);
-        rb_hash_aset(info, ID2SYM(rb_intern("jpeg_interchange")), data);
-        rb_hash_aset(ret, ID2SYM(rb_intern("thumbnail")), info);
-      }
-    }
-    break;
+  if (state != 0) {
+    jpeg_abort_decompress(&ptr->cinfo);
+    rb_jump_tag(state);
   }
 
-  rb_hash_freeze(ret);
-
   return ret;
 }
 
-static void
-pick_exif_orientation(jpeg_decode_t* ptr)
+static VALUE
+do_each_band(VALUE _ptr)
 {
-  jpeg_saved_marker_ptr marker;
-  int o9n;
-  uint8_t* p;
-  int be;
-  uint32_t off;
-  int i;
-  int n;
+  jpeg_decode_t* ptr;
+  struct jpeg_decompress_struct* cinfo;
+  VALUE band;
+  size_t stride;
+  size_t capa;
+  int rows;
+  int top;
+  decode_info_t info;
 
-  o9n = 0;
+  /*
+   * initialize
+   */
+  ptr   = (jpeg_decode_t*)_ptr;
+  cinfo = &ptr->cinfo;
 
-  for (marker = ptr->cinfo.marker_list;
-            marker != NULL; marker = marker->next) {
+  ptr->src.ptr  = (uint8_t*)RSTRING_PTR(ptr->data);
+  ptr->src.size = RSTRING_LEN(ptr->data);
 
-    if (marker->data_length < 14) continue;
+  /*
+   * read header
+   */
+  call_decoder_without_gvl(ptr, decode_header_without_gvl);
 
-    p = marker->data;
+  /*
+   * alloc band buffer
+   */
+  rows   = ptr->dst.rows;
+  stride = cinfo->output_components * cinfo->output_width;
 
-    /*
-     * check Exif identifier
-     */
-    if (memcmp(p, "Exif\0\0", 6)) continue;
+  if ((JDIMENSION)rows > cinfo->output_height) {
+    rows = cinfo->output_height;
+  }
 
-    /*
-     * check endian marker
-     */
-    if (!memcmp(p + 6, "MM", 2)) {
-      be = !0;
+  capa   = stride * rows;
 
-    } else if (!memcmp(p + 6, "II", 2)) {
-      be = 0;
+  if (TEST_FLAG(ptr, F_EXPAND_COLORMAP) && cinfo->quantize_colors) {
+    capa *= cinfo->out_color_components;
+  }
 
-    } else {
-      continue;
-    }
+  band = rb_str_buf_new(capa);
 
-    /*
-     * check TIFF identifier
-     */
-    if (get_u16(p + 8, be) != 0x002a) continue;
+  /*
+   * start decompress
+   */
+  call_decoder_without_gvl(ptr, decode_start_without_gvl);
 
-    /*
-     * set 0th IFD address
-     */
-    off = get_u32(p + 10, be);
-    if (off < 8 || off >= marker->data_length - 6) continue;
+  // カラーマップはjpeg_start_decompress()の後でないと確定しない
+  get_decode_info(ptr, &info);
 
-    p += (6 + off);
+  // 帯域単位では向きの補正はできないので、メタ情報も補正前のものとする
+  info.orientation = 0;
 
-    /* ここまでくればAPP1がExifタグなので
-     * 0th IFDをなめてOrientationタグを探す */
+  if (TEST_FLAG(ptr, F_NEED_META)) add_meta(band, ptr, &info);
 
-    n = get_u16(p, be);
-    p += 2;
+  /*
+   * do decode
+   */
+  while (cinfo->output_scanline < cinfo->output_height) {
+    top = cinfo->output_scanline;
 
-    for (i = 0; i < n; i++) {
-      int tag;
-      int type;
-      int num;
+    // ブロック内で帯域バッファが変更されている可能性があるので毎回確認する
+    prepare_output_buffer(band, capa);
 
-      tag  = get_u16(p + 0, be);
-      type = get_u16(p + 2, be);
-      num  = get_u32(p + 4, be);
+    ptr->dst.ptr    = (uint8_t*)RSTRING_PTR(band);
+    ptr->dst.stride = stride;
+    ptr->dst.rows   = rows;
 
-      if (tag == 0x0112) {
-        if (type == 3 && num == 1) {
-          o9n = get_u16(p + 8, be);
-          goto loop_out;
+    call_decoder_with_lock(ptr, decode_band_rows_without_gvl, band);
 
-        } else {
-          fprintf(stderr,
-                  "Illeagal orientation tag found [type:%d, num:%d]\n",
-                  type,
-                  num);
-        }
-      }
+    info.height = cinfo->output_scanline - top;
 
-      p += 12;
+    if (TEST_FLAG(ptr, F_EXPAND_COLORMAP) && IS_COLORMAPPED(&info)) {
+      expand_colormap(&info, band);
+    } else {
+      rb_str_set_len(band, stride * info.height);
+    }
+
+    if (ptr->format == FMT_YVU) {
+      swap_cbcr((uint8_t*)RSTRING_PTR(band), RSTRING_LEN(band));
+    }
+
+    if (IS_PACKED(ptr)) {
+      pack_output(ptr, band, info.width, info.height, info.components);
     }
+
+    rb_yield_values(2, band, INT2FIX(top));
   }
-  loop_out:
 
-  ptr->orientation.value = (o9n >= 1 && o9n <= 8)? (o9n - 1): 0;
+  /*
+   * post process
+   */
+  call_decoder_without_gvl(ptr, decode_finish_without_gvl);
+
+  RB_GC_GUARD(band);
+
+  return Qnil;
 }
 
+/**
+ * decode JPEG data band by band
+ *
+ * @overload each_band(jpeg, rows = 16)
+ *
+ *   @param jpeg [String]  JPEG data to decode.
+ *
+ *   @param rows [Integer]  number of rows in one band.
+ *
+ *   @yield [band, y]  called for each band from the top of the image.
+ *   @yieldparam band [String]  decoded raw image data of the band. the
+ *     same buffer is reused for every band, so its content is valid only
+ *     within the block. the last band may contain fewer rows.
+ *   @yieldparam y [Integer]  row number of the first row in the band.
+ *
+ *   @return [JPEG::Decoder]  self
+ *
+ *   @note orientation and :threads options are not applied. the meta
+ *     information of the band describes the whole image.
+ */
 static VALUE
-create_colormap(jpeg_decode_t* ptr)
+rb_decoder_each_band(int argc, VALUE* argv, VALUE self)
 {
-  VALUE ret;
-  struct jpeg_decompress_struct* cinfo;
-  JSAMPARRAY map;
-  int i;   // volatileを外すとaarch64のgcc6でクラッシュする場合がある
-  uint32_t c;
+  VALUE data;
+  VALUE rows;
+  jpeg_decode_t* ptr;
+  int state;
 
-  cinfo = &ptr->cinfo;
-  ret   = rb_ary_new_capa(cinfo->actual_number_of_colors);
-  map   = cinfo->colormap;
+  RETURN_ENUMERATOR(self, argc, argv);
 
-  switch (cinfo->out_color_components) {
-  case 1:
-    for (i = 0; i < cinfo->actual_number_of_colors; i++) {
-      c = map[0][i];
-      rb_ary_push(ret, INT2FIX(c));
-    }
-    break;
+  /*
+   * initialize
+   */
+  state = 0;
 
-  case 2:
-    for (i = 0; i < cinfo->actual_number_of_colors; i++) {
-      c = (map[0][i] << 8) | (map[1][i] << 0);
-      rb_ary_push(ret, INT2FIX(c));
-    }
-    break;
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
 
-  case 3:
-    for (i = 0; i < cinfo->actual_number_of_colors; i++) {
-      c = (map[0][i] << 16) | (map[1][i] << 8) | (map[2][i] << 0);
+  /*
+   * parse arguments
+   */
+  rb_scan_args(argc, argv, "11", &data, &rows);
 
-      rb_ary_push(ret, INT2FIX(c));
-    }
-    break;
+  /*
+   * argument check
+   */
+  Check_Type(data, T_STRING);
 
-  default:
-    RUNTIME_ERROR("this number of components is not implemented yet");
+  if (rows == Qnil) {
+    rows = INT2FIX(DEFAULT_BAND_ROWS);
+  } else {
+    Check_Type(rows, T_FIXNUM);
   }
 
-  rb_ary_freeze(ret);
+  if (FIX2LONG(rows) <= 0 || FIX2LONG(rows) > 65535) {
+    RANGE_ERROR("rows is out of range");
+  }
 
-  return ret;
-}
+  if (IS_PLANAR(ptr)) {
+    NOT_IMPLEMENTED_ERROR("each_band is not supported with planar format");
+  }
 
-static VALUE
-rb_meta_exif_tags(VALUE self)
-{
-  return rb_ivar_get(self, id_exif_tags);
+  if (ptr->data != Qnil) {
+    RUNTIME_ERROR("decoder is busy");
+  }
+
+  /*
+   * prepare
+   */
+  SET_DATA(ptr, rb_str_new_frozen(data));
+  ptr->dst.rows = FIX2INT(rows);
+
+  /*
+   * do decode
+   */
+  rb_protect(do_each_band, (VALUE)ptr, &state);
+
+  /*
+   * post process
+   */
+  CLR_DATA(ptr);
+
+  if (state != 0) {
+    jpeg_abort_decompress(&ptr->cinfo);
+    rb_jump_tag(state);
+  }
+
+  return self;
 }
 
-static VALUE
-create_meta(jpeg_decode_t* ptr)
+static void*
+decode_buffered_start_without_gvl(void* _ptr)
 {
-  VALUE ret;
-  struct jpeg_decompress_struct* cinfo;
-  int width;
-  int height;
-  int stride;
+  jpeg_decode_t* volatile ptr;
 
-  ret    = rb_obj_alloc(meta_klass);
-  cinfo  = &ptr->cinfo;
+  ptr = (jpeg_decode_t*)_ptr;
 
-  if (TEST_FLAG(ptr, F_APPLY_ORIENTATION) && (ptr->orientation.value & 4)) {
-    width  = cinfo->output_height;
-    height = cinfo->output_width;
-  } else {
-    width  = cinfo->output_width;
-    height = cinfo->output_height;
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_decompress(&ptr->cinfo);
+    return ptr;
   }
 
-  stride = cinfo->output_width * cinfo->output_components;
+  ptr->cinfo.buffered_image     = TRUE;
+  ptr->cinfo.output_scan_number = 0;
 
-  rb_ivar_set(ret, id_width, INT2FIX(width));
-  rb_ivar_set(ret, id_stride, INT2FIX(stride));
-  rb_ivar_set(ret, id_height, INT2FIX(height));
+  jpeg_start_decompress(&ptr->cinfo);
 
-  rb_ivar_set(ret, id_orig_cs, get_colorspace_str(cinfo->jpeg_color_space));
+  return NULL;
+}
 
-  if (ptr->format == FMT_YVU) {
-    rb_ivar_set(ret, id_out_cs, rb_str_freeze(rb_str_new_cstr("YCrCb")));
-  } else {
-    rb_ivar_set(ret, id_out_cs, get_colorspace_str(cinfo->out_color_space));
-  }
+/*
+ * 次のスキャンまでを読み込み、その時点の画像を出力する(新しいスキャンが
+ * 無い場合はoutput_scan_numberを更新せずに戻る)
+ */
+static void*
+decode_next_scan_without_gvl(void* _ptr)
+{
+  jpeg_decode_t* volatile ptr;
+  j_decompress_ptr cinfo;
+  int n;
 
-  if (TEST_FLAG_ALL(ptr, F_DITHER | F_EXPAND_COLORMAP)) {
-    rb_ivar_set(ret, id_ncompo, INT2FIX(cinfo->out_color_components));
-  } else {
-    rb_ivar_set(ret, id_ncompo, INT2FIX(cinfo->output_components));
+  ptr   = (jpeg_decode_t*)_ptr;
+  cinfo = &ptr->cinfo;
+
+  if (setjmp(ptr->err_mgr.jmpbuf)) {
+    /*
+     * when error occurred
+     */
+    jpeg_abort_decompress(cinfo);
+    return ptr;
   }
 
-  if (TEST_FLAG(ptr, F_PARSE_EXIF)) {
-    rb_ivar_set(ret, id_exif_tags, create_exif_tags_hash(ptr));
-    rb_define_singleton_method(ret, "exif_tags", rb_meta_exif_tags, 0);
-    rb_define_singleton_method(ret, "exif", rb_meta_exif_tags, 0);
-  } 
+  n = cinfo->output_scan_number + 1;
 
-  if (TEST_FLAG(ptr, F_DITHER)) {
-    rb_ivar_set(ret, id_colormap, create_colormap(ptr));
+  if (consume_scans(cinfo, n) >= n) {
+    jpeg_start_output(cinfo, cinfo->input_scan_number);
+    read_output_rows(ptr);
+    jpeg_finish_output(cinfo);
   }
 
-  rb_obj_freeze(ret);
-  
-  return ret;
+  return NULL;
 }
 
 static VALUE
-do_read_header(VALUE _ptr)
+do_each_scan(VALUE _ptr)
 {
-  VALUE ret;
+  VALUE img;
   jpeg_decode_t* ptr;
-  uint8_t* data;
-  size_t size;
+  struct jpeg_decompress_struct* cinfo;
+  size_t capa;
+  int scan;
+  decode_info_t info;
 
   /*
    * initialize
    */
-  ret  = Qnil;
-  ptr  = (jpeg_decode_t*)_ptr;
-  data = (uint8_t*)RSTRING_PTR(ptr->data);
-  size = RSTRING_LEN(ptr->data);
+  ptr   = (jpeg_decode_t*)_ptr;
+  cinfo = &ptr->cinfo;
+
+  ptr->src.ptr  = (uint8_t*)RSTRING_PTR(ptr->data);
+  ptr->src.size = RSTRING_LEN(ptr->data);
 
   /*
-   * process body
+   * read header
    */
-  ptr->cinfo.raw_data_out = FALSE;
-  ptr->cinfo.dct_method   = JDCT_FLOAT;
+  call_decoder_without_gvl(ptr, decode_header_without_gvl);
+  get_decode_info(ptr, &info);
 
-  if (setjmp(ptr->err_mgr.jmpbuf)) {
-    /*
-     * when error occurred
-     */
-    rb_raise(decerr_klass, "%s", ptr->err_mgr.msg);
+  capa = output_size(ptr, cinfo->output_width, cinfo->output_height,
+                     cinfo->output_components, info.orientation);
 
-  } else {
-    /*
-     * normal path
-     */
-    jpeg_mem_src(&ptr->cinfo, data, size);
+  if (TEST_FLAG(ptr, F_EXPAND_COLORMAP) && cinfo->quantize_colors) {
+    capa *= cinfo->out_color_components;
+  }
 
-    if (TEST_FLAG(ptr, F_PARSE_EXIF | F_APPLY_ORIENTATION)) {
-      jpeg_save_markers(&ptr->cinfo, JPEG_APP1, 0xFFFF);
-    }
+  /*
+   * start decompress (buffered image mode)
+   */
+  call_decoder_without_gvl(ptr, decode_buffered_start_without_gvl);
 
-    jpeg_read_header(&ptr->cinfo, TRUE);
-    jpeg_calc_output_dimensions(&ptr->cinfo);
+  /*
+   * do decode
+   */
+  while (1) {
+    get_decode_info(ptr, &info);
 
-    if (TEST_FLAG(ptr, F_APPLY_ORIENTATION)) {
-      pick_exif_orientation(ptr);
-    }
+    scan = cinfo->output_scan_number;
+    img  = rb_str_buf_new(capa);
 
-    ret = create_meta(ptr);
+    set_output(ptr, (uint8_t*)RSTRING_PTR(img),
+               cinfo->output_width, cinfo->output_height, info.orientation);
+
+    call_decoder_with_lock(ptr, decode_next_scan_without_gvl, img);
+
+    // 出力するスキャンが残っていない
+    if (cinfo->output_scan_number == scan) break;
+
+    rb_yield_values(2, build_decode_result(ptr, &info, img),
+                    INT2FIX(cinfo->output_scan_number));
   }
 
-  return ret;
+  /*
+   * post process
+   */
+  call_decoder_without_gvl(ptr, decode_finish_without_gvl);
+
+  return Qnil;
 }
 
 /**
- * read meta data
+ * decode JPEG data scan by scan
  *
- * @overload read_header(jpeg)
+ * @overload each_scan(jpeg)
  *
- *   @param jpeg [String] input data.
+ *   @param jpeg [String]  JPEG data to decode.
  *
- *   @return [JPEG::Meta] metadata.
+ *   @yield [image, scan]  called each time a scan of the data has been
+ *     read. a progressive JPEG gives a coarse image first (the DC scan)
+ *     and finer ones after each refinement scan, and a single scan JPEG
+ *     gives one image.
+ *   @yieldparam image [String]  decoded raw image data at that point.
+ *   @yieldparam scan [Integer]  number of scans read so far.
+ *
+ *   @return [JPEG::Decoder]  self
+ *
+ *   @note leaving the block (e.g. by break) stops decoding, so the rest
+ *     of the scans are not decoded. :threads option is not applied.
  */
 static VALUE
-rb_decoder_read_header(VALUE self, VALUE data)
+rb_decoder_each_scan(VALUE self, VALUE data)
 {
-  VALUE ret;
   jpeg_decode_t* ptr;
   int state;
 
+  RETURN_ENUMERATOR(self, 1, &data);
+
   /*
    * initialize
    */
-  ret   = Qnil;
   state = 0;
 
   TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
@@ -3037,671 +9437,1040 @@ rb_decoder_read_header(VALUE self, VALUE data)
    */
   Check_Type(data, T_STRING);
 
+  if (IS_PLANAR(ptr)) {
+    NOT_IMPLEMENTED_ERROR("each_scan is not supported with planar format");
+  }
+
+  if (ptr->data != Qnil) {
+    RUNTIME_ERROR("decoder is busy");
+  }
+
   /*
    * prepare
    */
-  SET_DATA(ptr, data);
+  SET_DATA(ptr, rb_str_new_frozen(data));
 
   /*
-   * do encode
+   * do decode
    */
-  ret = rb_protect(do_read_header, (VALUE)ptr, &state);
+  rb_protect(do_each_scan, (VALUE)ptr, &state);
 
   /*
    * post process
    */
   CLR_DATA(ptr);
 
-  if (state != 0) rb_jump_tag(state);
+  if (state != 0) {
+    jpeg_abort_decompress(&ptr->cinfo);
+    rb_jump_tag(state);
+  }
 
-  return ret;
+  return self;
 }
 
-static VALUE
-rb_decode_result_meta(VALUE self)
-{
-  return rb_ivar_get(self, id_meta);
-}
+typedef struct {
+  uint8_t* data;
+  size_t size;
+  int status;
+
+  uint8_t* raw;
+  decode_info_t info;
+
+  char msg[JMSG_LENGTH_MAX+10];
+} decode_item_t;
+
+typedef struct {
+  jpeg_decode_t* ptr;
+  decode_item_t* items;
+  int nworker;
+  int cur;
+  work_queue_t queue;
+} decode_batch_t;
 
 static void
-add_meta(VALUE obj, jpeg_decode_t* ptr)
+decode_batch_item(jpeg_decode_t* ctx, decode_item_t* item)
 {
-  VALUE meta;
+  size_t raw_sz;
+  uint8_t* exif;
 
-  meta = create_meta(ptr);
+  ctx->src.ptr  = item->data;
+  ctx->src.size = item->size;
 
-  rb_ivar_set(obj, id_meta, meta);
-  rb_define_singleton_method(obj, "meta", rb_decode_result_meta, 0);
-}
+  if (decode_header_without_gvl(ctx) != NULL) {
+    strcpy(item->msg, ctx->err_mgr.msg);
+    item->status = ITEM_ERROR;
+    return;
+  }
+
+  // 向きは出力時に適用する
+  get_decode_info(ctx, &item->info);
 
-static VALUE
-expand_colormap(struct jpeg_decompress_struct* cinfo, uint8_t* src)
-{
   /*
-   * 本関数はcinfo->out_color_componentsが1または3であることを前提に
-   * 作成されています。
+   * Rubyのオブジェクトはワーカスレッドから生成できないので、出力は
+   * 一旦mallocしたバッファに書き出す
    */
+  raw_sz    = output_size(ctx, ctx->cinfo.output_width,
+                          ctx->cinfo.output_height,
+                          ctx->cinfo.output_components, item->info.orientation);
+  item->raw = (uint8_t*)malloc(raw_sz);
+
+  if (item->raw == NULL) {
+    jpeg_abort_decompress(&ctx->cinfo);
+    strcpy(item->msg, "no memory");
+    item->status = ITEM_ERROR;
+    return;
+  }
 
-  VALUE ret;
-  volatile int i;   // volatileを外すとaarch64のgcc6でクラッシュする場合がある
-  int n;
-  uint8_t* dst;
-  JSAMPARRAY map;
-
-  n   = cinfo->output_width * cinfo->output_height;
-  ret = rb_str_buf_new(n * cinfo->out_color_components);
-  dst = (uint8_t*)RSTRING_PTR(ret);
-  map = cinfo->colormap;
-
-  switch (cinfo->out_color_components) {
-  case 1:
-    for (i = 0; i < n; i++) {
-      dst[i] = map[0][src[i]];
-    }
-    break;
+  set_output(ctx, item->raw, ctx->cinfo.output_width,
+             ctx->cinfo.output_height, item->info.orientation);
 
-  case 2:
-    for (i = 0; i < n; i++) {
-      dst[0] = map[0][src[i]];
-      dst[1] = map[1][src[i]];
+  if (decode_scanlines_without_gvl(ctx) != NULL) {
+    strcpy(item->msg, ctx->err_mgr.msg);
+    item->status = ITEM_ERROR;
+    return;
+  }
 
-      dst += 2;
-    }
-    break;
+  /*
+   * Exifデータはjpeg_finish_decompress()で解放されるので複製しておく
+   */
+  get_decode_info(ctx, &item->info);
 
-  case 3:
-    for (i = 0; i < n; i++) {
-      dst[0] = map[0][src[i]];
-      dst[1] = map[1][src[i]];
-      dst[2] = map[2][src[i]];
+  if (item->info.exif.data != NULL) {
+    exif = (uint8_t*)malloc(item->info.exif.size);
 
-      dst += 3;
+    if (exif != NULL) {
+      memcpy(exif, item->info.exif.data, item->info.exif.size);
     }
-    break;
 
-  default:
-    RUNTIME_ERROR("this number of components is not implemented yet");
+    item->info.exif.data = exif;
   }
 
-  rb_str_set_len(ret, n * cinfo->out_color_components);
+  if (decode_finish_without_gvl(ctx) != NULL) {
+    strcpy(item->msg, ctx->err_mgr.msg);
+    item->status = ITEM_ERROR;
+    return;
+  }
 
-  return ret;
+  item->status = ITEM_DONE;
 }
 
-static void
-swap_cbcr(uint8_t* p, size_t size)
+static void*
+decode_batch_worker(void* _batch)
 {
+  decode_batch_t* batch;
+  jpeg_decode_t ctx;
+  JSAMPROW rows[UNIT_LINES];
   int i;
-  uint8_t tmp;
 
-  for (i = 0; i < (int)size; i++) {
-    tmp  = p[1];
-    p[1] = p[2];
-    p[2] = tmp;
+  /*
+   * ワーカ毎にレシーバの設定を複製したjpeg_decompress_structを持つ
+   */
+  batch = (decode_batch_t*)_batch;
+
+  memcpy(&ctx, batch->ptr, sizeof(ctx));
+
+  ctx.array = rows;
+  ctx.data  = Qnil;
+  ctx.into  = Qnil;
+
+  if (setjmp(ctx.err_mgr.jmpbuf)) {
+    /*
+     * when failed to create decompress object
+     */
+    return NULL;
+  }
+
+  create_decompress(&ctx);
+
+  while ((i = work_queue_fetch(&batch->queue)) >= 0) {
+    decode_batch_item(&ctx, batch->items + i);
   }
+
+  jpeg_destroy_decompress(&ctx.cinfo);
+
+  return NULL;
 }
 
-static void
-do_transpose8(uint8_t* img, int wd, int ht, void* dst)
+static void*
+run_decode_batch(void* _batch)
 {
-  int x;
-  int y;
+  decode_batch_t* batch;
 
-  uint8_t* sp;
-  uint8_t* dp;
+  batch = (decode_batch_t*)_batch;
+  run_workers(batch->nworker, decode_batch_worker, batch);
 
-  sp = (uint8_t*)img;
+  return NULL;
+}
 
-  for (y = 0; y < ht; y++) {
-    dp = (uint8_t*)dst + y;
+static VALUE
+build_decode_batch_result(VALUE _batch)
+{
+  VALUE ret;
+  decode_batch_t* batch;
+  decode_item_t* item;
+  decode_info_t* info;
+
+  batch = (decode_batch_t*)_batch;
+  item  = batch->items + batch->cur;
+  info  = &item->info;
+
+  switch (item->status) {
+  case ITEM_DONE:
+    ret = rb_str_new((char*)item->raw,
+                     output_size(batch->ptr, info->width, info->height,
+                                 info->components, info->orientation));
+    ret = build_decode_result(batch->ptr, info, ret);
+    break;
 
-    for (x = 0; x < wd; x++) {
-      *dp = *sp;
+  case ITEM_ERROR:
+    ret = rb_exc_new_cstr(decerr_klass, item->msg);
+    break;
 
-      sp++;
-      dp += ht;
-    }
+  default:
+    ret = rb_exc_new_cstr(decerr_klass, "not processed");
+    break;
   }
+
+  return ret;
 }
 
-static void
-do_transpose16(void* img, int wd, int ht, void* dst)
+/**
+ * decode multiple JPEG data
+ *
+ * @overload decode_batch(list, threads: nil)
+ *
+ *   @param list [Array<String>]  JPEG data to decode.
+ *
+ *   @param threads [Integer, Boolean]  number of native worker threads.
+ *     true or omitted uses the number of online CPUs, and false or nil
+ *     uses a single worker.
+ *
+ *   @return [Array<String, Exception>] decoded raw image data in the same
+ *     order as the input. an item that could not be decoded is replaced
+ *     by the exception object describing the failure.
+ *
+ *   @note  the call can be interrupted (e.g. Thread#kill or Ctrl-C).
+ *     items not started yet are abandoned and the interrupt is handled
+ *     once the running items are finished.
+ */
+static VALUE
+rb_decoder_decode_batch(int argc, VALUE* argv, VALUE self)
 {
-  int x;
-  int y;
+  VALUE ret;
+  VALUE list;
+  VALUE opt;
+  VALUE srcs;
+  VALUE src;
+  VALUE val;
+  jpeg_decode_t* ptr;
+  decode_batch_t batch;
+  int state;
+  int n;
+  int i;
 
-  uint16_t* sp;
-  uint16_t* dp;
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
 
-  sp = (uint16_t*)img;
+  /*
+   * parse arguments
+   */
+  rb_scan_args(argc, argv, "1:", &list, &opt);
 
-  for (y = 0; y < ht; y++) {
-    dp = (uint16_t*)dst + y;
+  /*
+   * argument check
+   */
+  Check_Type(list, T_ARRAY);
 
-    for (x = 0; x < wd; x++) {
-      *dp = *sp;
+  n = (int)RARRAY_LEN(list);
 
-      sp++;
-      dp += ht;
-    }
+  for (i = 0; i < n; i++) {
+    Check_Type(RARRAY_AREF(list, i), T_STRING);
   }
-}
 
-static void
-do_transpose24(void* img, int wd, int ht, void* dst)
-{
-  int x;
-  int y;
-  int st;
+  if (IS_PLANAR(ptr)) {
+    NOT_IMPLEMENTED_ERROR("decode_batch is not supported with planar format");
+  }
 
-  uint8_t* sp;
-  uint8_t* dp;
+  if (ptr->data != Qnil) {
+    RUNTIME_ERROR("decoder is busy");
+  }
 
-  sp = (uint8_t*)img;
-  st = ht * 3;
+  /*
+   * prepare
+   */
+  batch.ptr     = ptr;
+  batch.nworker = eval_threads_opt(opt, n);
+  batch.items   = ALLOC_N(decode_item_t, n);
+  srcs          = rb_ary_new_capa(n);
 
-  for (y = 0; y < ht; y++) {
-    dp = (uint8_t*)dst + (y * 3);
+  memset(batch.items, 0, sizeof(decode_item_t) * n);
 
-    for (x = 0; x < wd; x++) {
-      dp[0] = sp[0];
-      dp[1] = sp[1];
-      dp[2] = sp[2];
+  for (i = 0; i < n; i++) {
+    src = rb_str_new_frozen(RARRAY_AREF(list, i));
+    rb_ary_push(srcs, src);
 
-      sp += 3;
-      dp += st;
-    }
+    batch.items[i].data = (uint8_t*)RSTRING_PTR(src);
+    batch.items[i].size = RSTRING_LEN(src);
   }
-}
 
-static void
-do_transpose32(void* img, int wd, int ht, void* dst)
-{
-  int x;
-  int y;
+  work_queue_init(&batch.queue, n);
+  SET_DATA(ptr, srcs);
+
+  /*
+   * do decode
+   *
+   * 割り込み(Ctrl-CやThread#kill)はUBFでキューを打ち切らせ、後始末を
+   * 終えてから処理する
+   */
+  rb_thread_call_without_gvl2(run_decode_batch, &batch,
+                              cancel_work_queue, &batch.queue);
+
+  /*
+   * build return data
+   */
+  ret   = rb_ary_new_capa(n);
+  state = 0;
 
-  uint32_t* sp;
-  uint32_t* dp;
+  for (i = 0; i < n; i++) {
+    batch.cur = i;
 
-  sp = (uint32_t*)img;
+    if (state == 0) {
+      val = rb_protect(build_decode_batch_result, (VALUE)&batch, &state);
 
-  for (y = 0; y < ht; y++) {
-    dp = (uint32_t*)dst + y;
+      if (state != 0 && rb_obj_is_kind_of(rb_errinfo(), rb_eStandardError)) {
+        /* 個々のデータの変換エラーはバッチ全体を中断させない */
+        val   = rb_errinfo();
+        state = 0;
+        rb_set_errinfo(Qnil);
+      }
 
-    for (x = 0; x < wd; x++) {
-      *dp = *sp;
+      if (state == 0) rb_ary_push(ret, val);
+    }
 
-      sp++;
-      dp += ht;
+    if (batch.items[i].raw != NULL) free(batch.items[i].raw);
+    if (batch.items[i].info.exif.data != NULL) {
+      free(batch.items[i].info.exif.data);
     }
   }
-}
 
-static void
-do_transpose(void* img, int wd, int ht, int nc, void* dst)
-{
-  switch (nc) {
-  case 1:
-    do_transpose8(img, wd, ht, dst);
-    break;
+  /*
+   * post process
+   */
+  CLR_DATA(ptr);
+  work_queue_destroy(&batch.queue);
+  xfree(batch.items);
 
-  case 2:
-    do_transpose16(img, wd, ht, dst);
-    break;
+  if (state != 0) rb_jump_tag(state);
 
-  case 3:
-    do_transpose24(img, wd, ht, dst);
-    break;
+  rb_thread_check_ints();
 
-  case 4:
-    do_transpose32(img, wd, ht, dst);
-    break;
-  }
+  RB_GC_GUARD(srcs);
+
+  return ret;
 }
 
-static void
-do_upside_down8(void* img, int wd, int ht)
-{
-  uint8_t* sp;
-  uint8_t* dp;
+/*
+ * DC成分による縮小画像
+ *
+ * 1/8の縮尺で復号するとlibjpegはDC成分のみを用いる(IDCTを行わない)ので、
+ * 各ブロックの平均値を画素とする縮小画像がエントロピー復号とほぼ同じ
+ * コストで得られる。指紋・平均色・プレースホルダはこの画像から求める。
+ */
+typedef struct {
+  jpeg_decode_t ctx;
+  JSAMPROW rows[UNIT_LINES];
+
+  uint8_t* img;
+  int width;
+  int height;
+  int nc;
+} dc_image_t;
 
-  sp = (uint8_t*)img;
-  dp = (uint8_t*)img + ((wd * ht) - 1);
+static void*
+decode_dc_image_without_gvl(void* _dc)
+{
+  dc_image_t* dc;
+  jpeg_decode_t* ctx;
 
-  while (sp < dp) {
-    SWAP(*sp, *dp, uint8_t);
+  dc  = (dc_image_t*)_dc;
+  ctx = &dc->ctx;
 
-    sp++;
-    dp--;
+  if (setjmp(ctx->err_mgr.jmpbuf)) {
+    /*
+     * when failed to create decompress object
+     */
+    return dc;
   }
-}
 
-static void
-do_upside_down16(void* img, int wd, int ht)
-{
-  uint16_t* sp;
-  uint16_t* dp;
+  create_decompress(ctx);
 
-  sp = (uint16_t*)img;
-  dp = (uint16_t*)img + ((wd * ht) - 1);
+  if (decode_header_without_gvl(ctx) != NULL) goto err;
 
-  while (sp < dp) {
-    SWAP(*sp, *dp, uint8_t);
+  dc->width  = ctx->cinfo.output_width;
+  dc->height = ctx->cinfo.output_height;
+  dc->nc     = ctx->cinfo.output_components;
+  dc->img    = (uint8_t*)malloc((size_t)dc->width * dc->height * dc->nc);
 
-    sp++;
-    dp--;
+  if (dc->img == NULL) {
+    jpeg_abort_decompress(&ctx->cinfo);
+    strcpy(ctx->err_mgr.msg, "no memory for DC image");
+    goto err;
   }
-}
 
-static void
-do_upside_down24(void* img, int wd, int ht)
-{
-  uint8_t* sp;
-  uint8_t* dp;
+  set_output(ctx, dc->img, dc->width, dc->height, 0);
 
-  sp = (uint8_t*)img;
-  dp = (uint8_t*)img + ((wd * ht * 3) - 3);
+  if (decode_scanlines_without_gvl(ctx) != NULL) goto err;
+  if (decode_finish_without_gvl(ctx) != NULL) goto err;
 
-  while (sp < dp) {
-    SWAP(sp[0], dp[0], uint8_t);
-    SWAP(sp[1], dp[1], uint8_t);
-    SWAP(sp[2], dp[2], uint8_t);
+  jpeg_destroy_decompress(&ctx->cinfo);
 
-    sp += 3;
-    dp -= 3;
-  }
+  return NULL;
+
+ err:
+  jpeg_destroy_decompress(&ctx->cinfo);
+
+  return dc;
 }
 
+/*
+ * DC画像を復号する(失敗した場合は例外を発生させる)
+ */
 static void
-do_upside_down32(void* img, int wd, int ht)
+read_dc_image(dc_image_t* dc, VALUE data, int format)
 {
-  uint32_t* sp;
-  uint32_t* dp;
-
-  sp = (uint32_t*)img;
-  dp = (uint32_t*)img + ((wd * ht) - 1);
+  jpeg_decode_t* ctx;
 
-  ht /= 2;
-
-  while (sp < dp) {
-    SWAP(*sp, *dp, uint32_t);
+  Check_Type(data, T_STRING);
 
-    sp++;
-    dp--;
+  // 復号中に書き換えられないよう複製(共有)しておく
+  data = rb_str_new_frozen(data);
+
+  memset(dc, 0, sizeof(*dc));
+
+  ctx = &dc->ctx;
+
+  ctx->format               = format;
+  ctx->out_color_space      = (format == FMT_GRAYSCALE)? JCS_GRAYSCALE: JCS_RGB;
+  ctx->out_color_components = (format == FMT_GRAYSCALE)? 1: 3;
+  ctx->scale_num            = 1;
+  ctx->scale_denom          = 8;
+  ctx->dct_method           = JDCT_IFAST;
+  ctx->output_gamma         = 1.0;
+  ctx->do_fancy_upsampling  = FALSE;
+  ctx->do_block_smoothing   = FALSE;
+  ctx->array                = dc->rows;
+  ctx->data                 = Qnil;
+  ctx->into                 = Qnil;
+  ctx->src.ptr              = (uint8_t*)RSTRING_PTR(data);
+  ctx->src.size             = RSTRING_LEN(data);
+
+  if (rb_thread_call_without_gvl(decode_dc_image_without_gvl,
+                                 dc, NULL, NULL) != NULL) {
+    if (dc->img != NULL) free(dc->img);
+    rb_raise(decerr_klass, "%s", ctx->err_mgr.msg);
   }
+
+  RB_GC_GUARD(data);
 }
 
+/*
+ * 出力のi番目の画素に対応する入力の範囲(任意の倍率に対応する)
+ */
 static void
-do_upside_down(void* img, int wd, int ht, int nc)
+box_span(int i, int src, int dst, int* p0, int* p1)
 {
-  switch (nc) {
-  case 1:
-    do_upside_down8(img, wd, ht);
-    break;
-
-  case 2:
-    do_upside_down16(img, wd, ht);
-    break;
-
-  case 3:
-    do_upside_down24(img, wd, ht);
-    break;
+  *p0 = (int)(((int64_t)i * src) / dst);
+  *p1 = (int)(((int64_t)(i + 1) * src) / dst);
 
-  case 4:
-    do_upside_down32(img, wd, ht);
-    break;
-  }
+  if (*p1 <= *p0) *p1 = *p0 + 1;
 }
 
+/*
+ * 画素の並んだ画像をボックス平均(縮小)または複製(拡大)で変倍する
+ */
 static void
-do_flip_horizon8(void* img, int wd, int ht)
+box_resize(uint8_t* dst, int dw, int dh,
+           uint8_t* src, int sw, int sh, int nc)
 {
+  int x;
   int y;
-  int st;
+  int x0;
+  int x1;
+  int y0;
+  int y1;
+  int i;
+  int j;
+  int c;
+  uint64_t sum;     // 1画素が数百万画素分を集計する場合もあるので64bit
+  uint64_t n;
 
-  uint8_t* sp;
-  uint8_t* dp;
+  for (y = 0; y < dh; y++) {
+    box_span(y, sh, dh, &y0, &y1);
 
-  st  = wd;
-  wd /= 2;
+    for (x = 0; x < dw; x++) {
+      box_span(x, sw, dw, &x0, &x1);
 
-  sp = (uint8_t*)img;
-  dp = (uint8_t*)img + (st - 1);
+      n = (uint64_t)(x1 - x0) * (y1 - y0);
 
-  for (y = 0; y < ht; y++) {
-    while (sp < dp) {
-      SWAP(*sp, *dp, uint8_t);
+      for (c = 0; c < nc; c++) {
+        sum = 0;
 
-      sp++;
-      dp--;
-    }
+        for (i = y0; i < y1; i++) {
+          for (j = x0; j < x1; j++) {
+            sum += src[(((i * sw) + j) * nc) + c];
+          }
+        }
 
-    sp = sp - wd + st;
-    dp = sp + (st - 1);
+        *dst++ = (uint8_t)((sum + (n / 2)) / n);
+      }
+    }
   }
 }
 
-static void
-do_flip_horizon16(void* img, int wd, int ht)
+static int
+cmp_double(const void* a, const void* b)
 {
-  int y;
-  int st;
+  double d;
+
+  d = *(const double*)a - *(const double*)b;
+
+  return (d < 0)? -1: (d > 0)? 1: 0;
+}
 
-  uint16_t* sp;
-  uint16_t* dp;
+/*
+ * 32x32に縮小した輝度のDCTの低周波8x8成分を、その中央値と比較する
+ */
+static uint64_t
+calc_phash(uint8_t* img, int wd, int ht)
+{
+  uint8_t pix[32 * 32];
+  double cs[8][32];
+  double tmp[32][8];
+  double low[64];
+  double srt[64];
+  double med;
+  uint64_t ret;
+  int u;
+  int v;
+  int i;
 
-  st  = wd;
-  wd /= 2;
+  box_resize(pix, 32, 32, img, wd, ht, 1);
 
-  sp = (uint16_t*)img;
-  dp = (uint16_t*)img + (st - 1);
+  for (u = 0; u < 8; u++) {
+    for (i = 0; i < 32; i++) {
+      cs[u][i] = cos(M_PI * ((2 * i) + 1) * u / 64.0);
+    }
+  }
 
-  for (y = 0; y < ht; y++) {
-    while (sp < dp) {
-      SWAP(*sp, *dp, uint16_t);
+  // 行方向→列方向の順に、必要な低周波成分のみを求める
+  for (i = 0; i < 32; i++) {
+    for (v = 0; v < 8; v++) {
+      tmp[i][v] = 0.0;
+      for (u = 0; u < 32; u++) tmp[i][v] += pix[(i * 32) + u] * cs[v][u];
+    }
+  }
 
-      sp++;
-      dp--;
+  for (u = 0; u < 8; u++) {
+    for (v = 0; v < 8; v++) {
+      low[(u * 8) + v] = 0.0;
+      for (i = 0; i < 32; i++) low[(u * 8) + v] += cs[u][i] * tmp[i][v];
     }
+  }
 
-    sp = sp - wd + st;
-    dp = sp + (st - 1);
+  memcpy(srt, low, sizeof(low));
+  qsort(srt, 64, sizeof(double), cmp_double);
+  med = (srt[31] + srt[32]) / 2.0;
+
+  ret = 0;
+  for (i = 0; i < 64; i++) {
+    ret = (ret << 1) | ((low[i] > med)? 1: 0);
   }
+
+  return ret;
 }
 
-static void
-do_flip_horizon24(void* img, int wd, int ht)
+/*
+ * 9x8に縮小した輝度の、横に隣り合う画素の大小関係
+ */
+static uint64_t
+calc_dhash(uint8_t* img, int wd, int ht)
 {
+  uint8_t pix[9 * 8];
+  uint64_t ret;
+  int x;
   int y;
-  int st;
-
-  uint8_t* sp;
-  uint8_t* dp;
 
-  st  = wd * 3;
-  wd /= 2;
+  box_resize(pix, 9, 8, img, wd, ht, 1);
 
-  sp = (uint8_t*)img;
-  dp = (uint8_t*)img + (st - 3);
-
-  for (y = 0; y < ht; y++) {
-    while (sp < dp) {
-      SWAP(sp[0], dp[0], uint8_t);
-      SWAP(sp[1], dp[1], uint8_t);
-      SWAP(sp[2], dp[2], uint8_t);
-
-      sp += 3;
-      dp -= 3;
+  ret = 0;
+  for (y = 0; y < 8; y++) {
+    for (x = 0; x < 8; x++) {
+      ret = (ret << 1) | ((pix[(y * 9) + x + 1] > pix[(y * 9) + x])? 1: 0);
     }
-
-    sp = (sp - (wd * 3)) + st;
-    dp = sp + (st - 3);
   }
+
+  return ret;
 }
 
-static void
-do_flip_horizon32(void* img, int wd, int ht)
+/**
+ * compute a perceptual hash of JPEG data
+ *
+ * @overload fingerprint(jpeg, method: :phash)
+ *
+ *   @param jpeg [String]  JPEG data.
+ *
+ *   @param method [Symbol]  :phash (DCT of the 32x32 luminance) or
+ *     :dhash (horizontal gradient of the 9x8 luminance).
+ *
+ *   @return [Integer]  64 bit hash. similar images give hashes with a
+ *     small hamming distance.
+ *
+ *   @note the hash is computed from the 1/8 scale image given by the DC
+ *     coefficients, so no IDCT is done. the Exif orientation is not
+ *     applied.
+ */
+static VALUE
+rb_fingerprint(int argc, VALUE* argv, VALUE self)
 {
-  int y;
-  int st;
+  VALUE data;
+  VALUE opt;
+  VALUE method;
+  dc_image_t dc;
+  uint64_t ret;
+  ID id;
+  int dhash;
 
-  uint32_t* sp;
-  uint32_t* dp;
+  /*
+   * parse arguments
+   */
+  method = Qundef;
+  id     = rb_intern("method");
 
-  st  = wd;
-  wd /= 2;
+  rb_scan_args(argc, argv, "1:", &data, &opt);
 
-  sp = (uint32_t*)img;
-  dp = (uint32_t*)img + (st - 1);
+  if (opt != Qnil) {
+    rb_get_kwargs(opt, &id, 0, 1, &method);
+  }
 
-  for (y = 0; y < ht; y++) {
-    while (sp < dp) {
-      SWAP(*sp, *dp, uint32_t);
+  if (method == Qundef || method == ID2SYM(rb_intern("phash"))) {
+    dhash = 0;
+  } else if (method == ID2SYM(rb_intern("dhash"))) {
+    dhash = 1;
+  } else {
+    ARGUMENT_ERROR("unsupported :method option value");
+  }
 
-      sp++;
-      dp--;
-    }
+  /*
+   * do compute
+   */
+  read_dc_image(&dc, data, FMT_GRAYSCALE);
 
-    sp = sp - wd + st;
-    dp = sp + (st - 1);
+  if (dhash) {
+    ret = calc_dhash(dc.img, dc.width, dc.height);
+  } else {
+    ret = calc_phash(dc.img, dc.width, dc.height);
   }
+
+  free(dc.img);
+
+  return ULL2NUM(ret);
 }
 
-static void
-do_flip_horizon(void* img, int wd, int ht, int nc)
+/**
+ * compute the average color of JPEG data
+ *
+ * @overload average_color(jpeg)
+ *
+ *   @param jpeg [String]  JPEG data.
+ *
+ *   @return [Array<Integer>]  [R, G, B] averaged over the DC
+ *     coefficients (the 8x8 block averages) of the image.
+ */
+static VALUE
+rb_average_color(VALUE self, VALUE data)
 {
-  switch (nc) {
-  case 1:
-    do_flip_horizon8(img, wd, ht);
-    break;
-
-  case 2:
-    do_flip_horizon16(img, wd, ht);
-    break;
+  dc_image_t dc;
+  uint64_t sum[3];
+  size_t n;
+  size_t i;
+
+  read_dc_image(&dc, data, FMT_RGB);
+
+  n      = (size_t)dc.width * dc.height;
+  sum[0] = 0;
+  sum[1] = 0;
+  sum[2] = 0;
+
+  for (i = 0; i < n; i++) {
+    sum[0] += dc.img[(i * 3) + 0];
+    sum[1] += dc.img[(i * 3) + 1];
+    sum[2] += dc.img[(i * 3) + 2];
+  }
 
-  case 3:
-    do_flip_horizon24(img, wd, ht);
-    break;
+  free(dc.img);
 
-  case 4:
-    do_flip_horizon32(img, wd, ht);
-    break;
-  }
+  return rb_ary_new_from_args(3,
+                              INT2FIX((sum[0] + (n / 2)) / n),
+                              INT2FIX((sum[1] + (n / 2)) / n),
+                              INT2FIX((sum[2] + (n / 2)) / n));
 }
 
+/**
+ * make a low resolution placeholder of JPEG data
+ *
+ * @overload placeholder(jpeg, width, height)
+ *
+ *   @param jpeg [String]  JPEG data.
+ *
+ *   @param width [Integer]  width of the placeholder (1-1024).
+ *
+ *   @param height [Integer]  height of the placeholder (1-1024).
+ *
+ *   @return [String]  RGB raw image data of width x height, box averaged
+ *     from the 1/8 scale image given by the DC coefficients. the Exif
+ *     orientation is not applied.
+ */
 static VALUE
-shift_orientation_buffer(jpeg_decode_t* ptr, VALUE img)
+rb_placeholder(VALUE self, VALUE data, VALUE width, VALUE height)
 {
   VALUE ret;
-  int len;
+  dc_image_t dc;
+  int wd;
+  int ht;
 
-  ret = ptr->orientation.buf;
-  len = RSTRING_LEN(img);
+  /*
+   * argument check
+   */
+  wd = NUM2INT(width);
+  ht = NUM2INT(height);
 
-  if (ret == Qnil || RSTRING_LEN(ret) != len) {
-    ret = rb_str_buf_new(len);
-    rb_str_set_len(ret, len);
+  if (wd < 1 || wd > 1024 || ht < 1 || ht > 1024) {
+    RANGE_ERROR("placeholder size is out of range");
   }
 
-  ptr->orientation.buf = img;
+  /*
+   * do compute
+   */
+  ret = rb_str_buf_new((long)wd * ht * 3);
+
+  read_dc_image(&dc, data, FMT_RGB);
+
+  box_resize((uint8_t*)RSTRING_PTR(ret), wd, ht,
+             dc.img, dc.width, dc.height, 3);
+  rb_str_set_len(ret, (long)wd * ht * 3);
+
+  free(dc.img);
 
   return ret;
 }
 
-static VALUE
-apply_orientation(jpeg_decode_t* ptr, VALUE img)
+/*
+ * libjpegを使用しないヘッダの走査
+ */
+
+#define PROBE_DONE            0
+#define PROBE_NEED_MORE       1
+#define PROBE_ERROR           2
+
+#define PROBE_MAX_COMPONENTS  10    // libjpegのMAX_COMPONENTSと同じ
+
+typedef struct {
+  int width;
+  int height;
+  int ncompo;
+  int progressive;
+  int orientation;                  // Exifの値(1～8)
+  uint8_t samp[PROBE_MAX_COMPONENTS];
+                                    // 上位4bitが水平、下位4bitが垂直の
+                                    // サンプリングファクタ
+  size_t need;                      // PROBE_NEED_MORE時に必要な総バイト数
+  const char* err;                  // PROBE_ERROR時のメッセージ
+} probe_info_t;
+
+static inline int
+is_sof_marker(int marker)
 {
-  struct jpeg_decompress_struct* cinfo;
-  int wd;
-  int ht;
-  int nc;
-  VALUE tmp;
+  /* SOF0～SOF15の内、DHT(0xc4)、JPG(0xc8)、DAC(0xcc)以外 */
+  return ((marker & 0xf0) == 0xc0 &&
+          marker != 0xc4 && marker != 0xc8 && marker != 0xcc);
+}
 
-  cinfo = &ptr->cinfo;
-  wd    = cinfo->output_width;
-  ht    = cinfo->output_height;
-  nc    = cinfo->output_components;
+static int
+parse_sof(uint8_t* p, size_t len, int marker, probe_info_t* info)
+{
+  int n;
+  int i;
 
-  if (ptr->orientation.value & 4) {
-    /* 転置は交換アルゴリズムでは実装できないので新規バッファを
-       用意する */
-    tmp = img;
-    img = shift_orientation_buffer(ptr, tmp);
-    SWAP(wd, ht, int);
+  if (len < 8) return !0;
 
-    do_transpose(RSTRING_PTR(tmp), ht, wd, nc, RSTRING_PTR(img)); 
+  n = p[7];
+  if (n < 1 || n > PROBE_MAX_COMPONENTS || len != (size_t)(8 + (n * 3))) {
+    return !0;
   }
 
-  if (ptr->orientation.value & 2) {
-    do_upside_down(RSTRING_PTR(img), wd, ht, nc); 
-  }
+  info->height      = (p[3] << 8) | p[4];
+  info->width       = (p[5] << 8) | p[6];
+  info->ncompo      = n;
+  info->progressive = ((marker & 3) == 2);    // SOF2, SOF6, SOF10, SOF14
+
+  // 高さ0(DNLで指定する形式)はlibjpegと同様に扱わない
+  if (info->width == 0 || info->height == 0) return !0;
 
-  if (ptr->orientation.value & 1) {
-    do_flip_horizon(RSTRING_PTR(img), wd, ht, nc); 
+  for (i = 0; i < n; i++) {
+    info->samp[i] = p[8 + (i * 3) + 1];
+
+    if ((info->samp[i] >> 4) < 1 || (info->samp[i] >> 4) > 4 ||
+        (info->samp[i] & 15) < 1 || (info->samp[i] & 15) > 4) return !0;
   }
 
-  return img;
+  return 0;
 }
 
-static VALUE
-do_decode(VALUE _ptr)
+/*
+ * 位置posまでのデータにSOSまでに最低限必要なバイト数(SOSマーカーと、
+ * SOFが未だ無い場合は最小のSOFセグメント)を加えた総バイト数
+ */
+static inline size_t
+probe_need(probe_info_t* info, size_t pos)
 {
-  VALUE ret;
+  return pos + ((info->ncompo == 0)? (2 + 11): 0) + 2;
+}
 
-  jpeg_decode_t* ptr;
-  uint8_t* data;
-  size_t size;
+/*
+ * SOIからSOSまでのマーカーを走査し、SOFとExifのOrientationを読み取る。
+ * データが途中で切れている場合はPROBE_NEED_MOREを返し、SOSまで到達する
+ * のに最低限必要な総バイト数をinfo->needに設定する(必要な長さの下限で
+ * あり、その長さで走査が完了するとは限らない)。
+ *
+ * do_read_header()はlibjpegのjpeg_read_header()に依存しており、途中で
+ * 切れたデータに対して必要な長さを返せないので、JPEG.probe_prefixは
+ * こちらを使う。
+ */
+static int
+probe_markers(uint8_t* p, size_t size, probe_info_t* info)
+{
+  size_t pos;
+  size_t len;
+  int marker;
+  int exif;
 
-  struct jpeg_decompress_struct* cinfo;
-  JSAMPARRAY array;
+  memset(info, 0, sizeof(*info));
 
-  size_t stride;
-  size_t raw_sz;
-  uint8_t* raw;
-  int i;
-  int j;
+  info->orientation = 1;
+  exif              = 0;
 
-  /*
-   * initialize
-   */
-  ret   = Qnil; // warning対策
-  ptr   = (jpeg_decode_t*)_ptr;
-  data  = (uint8_t*)RSTRING_PTR(ptr->data);
-  size  = RSTRING_LEN(ptr->data);
-  cinfo = &ptr->cinfo;
-  array = ptr->array;
+  if (size < 2 && (size == 0 || p[0] == 0xff)) {
+    info->need = probe_need(info, 2);
+    return PROBE_NEED_MORE;
+  }
 
-  /*
-   * do decode
-   */
-  if (setjmp(ptr->err_mgr.jmpbuf)) {
-    /*
-     * when error occurred
-     */
-    jpeg_abort_decompress(&ptr->cinfo);
-    rb_raise(decerr_klass, "%s", ptr->err_mgr.msg);
+  if (p[0] != 0xff || p[1] != 0xd8) {
+    info->err = "SOI marker not found";
+    return PROBE_ERROR;
+  }
 
-  } else {
+  pos = 2;
+
+  while (1) {
     /*
-     * initialize
+     * read marker (0xffの詰め物は読み飛ばす)
      */
-    jpeg_mem_src(cinfo, data, size);
+    if (pos >= size) {
+      info->need = probe_need(info, pos);
+      return PROBE_NEED_MORE;
+    }
 
-    if (TEST_FLAG(ptr, F_PARSE_EXIF | F_APPLY_ORIENTATION)) {
-      jpeg_save_markers(&ptr->cinfo, JPEG_APP1, 0xFFFF);
+    if (p[pos] != 0xff) {
+      info->err = "marker not found";
+      return PROBE_ERROR;
     }
 
-    jpeg_read_header(cinfo, TRUE);
-    jpeg_calc_output_dimensions(cinfo);
+    while (pos < size && p[pos] == 0xff) pos++;
 
-    /*
-     * configuration
-     */
-    cinfo->raw_data_out             = FALSE;
-    cinfo->dct_method               = ptr->dct_method;
-           
-    cinfo->out_color_space          = ptr->out_color_space;
-    cinfo->out_color_components     = ptr->out_color_components;
-    cinfo->scale_num                = ptr->scale_num;
-    cinfo->scale_denom              = ptr->scale_denom;
-    cinfo->output_gamma             = ptr->output_gamma;
-    cinfo->do_fancy_upsampling      = ptr->do_fancy_upsampling;
-    cinfo->do_block_smoothing       = ptr->do_block_smoothing;
-    cinfo->quantize_colors          = ptr->quantize_colors;
-    cinfo->dither_mode              = ptr->dither_mode;
-    cinfo->two_pass_quantize        = ptr->two_pass_quantize;
-    cinfo->desired_number_of_colors = ptr->desired_number_of_colors;
-    cinfo->enable_1pass_quant       = ptr->enable_1pass_quant;
-    cinfo->enable_external_quant    = ptr->enable_external_quant;
-    cinfo->enable_2pass_quant       = ptr->enable_2pass_quant;
+    if (pos >= size) {
+      info->need = probe_need(info, pos - 1);
+      return PROBE_NEED_MORE;
+    }
 
-    /*
-     * decode process
-     */
-    jpeg_start_decompress(cinfo);
+    marker = p[pos++];
 
-    stride = cinfo->output_components * cinfo->output_width;
-    raw_sz = stride * cinfo->output_height;
-    ret    = rb_str_buf_new(raw_sz);
-    raw    = (uint8_t*)RSTRING_PTR(ret);
+    // 長さを持たないマーカー(TEM, RSTn)
+    if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) continue;
 
-    while (cinfo->output_scanline < cinfo->output_height) {
-      for (i = 0, j = cinfo->output_scanline; i < UNIT_LINES; i++, j++) {
-        array[i] = raw + (j * stride);
+    if (marker == 0xda) {
+      if (info->ncompo == 0) {
+        info->err = "SOS marker found before SOF";
+        return PROBE_ERROR;
       }
 
-      jpeg_read_scanlines(cinfo, array, UNIT_LINES);
+      return PROBE_DONE;
     }
 
-    jpeg_finish_decompress(&ptr->cinfo);
+    if (marker == 0x00 || marker == 0xd8 || marker == 0xd9) {
+      info->err = "unexpected marker found before SOS";
+      return PROBE_ERROR;
+    }
 
     /*
-     * build return data
+     * read segment
      */
-    if (TEST_FLAG(ptr, F_EXPAND_COLORMAP) && IS_COLORMAPPED(cinfo)) {
-      ret = expand_colormap(cinfo, raw);
-    } else {
-      rb_str_set_len(ret, raw_sz);
+    if (pos + 2 > size) {
+      if (is_sof_marker(marker) && info->ncompo == 0) {
+        info->need = pos + 11 + 2;
+      } else {
+        info->need = probe_need(info, pos + 2);
+      }
+
+      return PROBE_NEED_MORE;
+    }
+
+    len = (p[pos] << 8) | p[pos + 1];
+
+    if (len < 2) {
+      info->err = "invalid marker length";
+      return PROBE_ERROR;
+    }
+
+    if (pos + len > size) {
+      if (is_sof_marker(marker) && info->ncompo == 0) {
+        info->need = pos + len + 2;
+      } else {
+        info->need = probe_need(info, pos + len);
+      }
+
+      return PROBE_NEED_MORE;
     }
 
-    if (ptr->format == FMT_YVU) swap_cbcr(raw, raw_sz);
+    if (is_sof_marker(marker)) {
+      if (info->ncompo > 0 || parse_sof(p + pos, len, marker, info)) {
+        info->err = "invalid SOF marker";
+        return PROBE_ERROR;
+      }
 
-    if (TEST_FLAG(ptr, F_APPLY_ORIENTATION)) {
-      pick_exif_orientation(ptr);
-      ret = apply_orientation(ptr, ret);
+    } else if (marker == 0xe1 && !exif && len >= 16 &&
+               !memcmp(p + pos + 2, "Exif\0\0", 6)) {
+      info->orientation = parse_exif_orientation(p + pos + 2, len - 2, !0) + 1;
+      exif              = !0;
     }
 
-    if (TEST_FLAG(ptr, F_NEED_META)) add_meta(ret, ptr);
+    pos += len;
   }
+}
 
-  return ret;
+static VALUE
+create_probe_info(probe_info_t* info)
+{
+  VALUE ret;
+  VALUE samp;
+  int i;
+
+  ret  = rb_obj_alloc(probe_klass);
+  samp = rb_ary_new_capa(info->ncompo);
+
+  for (i = 0; i < info->ncompo; i++) {
+    rb_ary_push(samp, RARRAY_AREF(samp_pairs,
+                                  (((info->samp[i] >> 4) - 1) * 4) +
+                                  ((info->samp[i] & 15) - 1)));
+  }
+
+  rb_ivar_set(ret, id_width, INT2FIX(info->width));
+  rb_ivar_set(ret, id_height, INT2FIX(info->height));
+  rb_ivar_set(ret, id_ncompo, INT2FIX(info->ncompo));
+  rb_ivar_set(ret, id_samp, rb_ary_freeze(samp));
+  rb_ivar_set(ret, id_prog, (info->progressive)? Qtrue: Qfalse);
+  rb_ivar_set(ret, id_o9n, INT2FIX(info->orientation));
+
+  return rb_obj_freeze(ret);
 }
 
 /**
- * decode JPEG data
+ * read the frame header without libjpeg.
  *
- * @overload decode(jpeg)
+ * the markers are walked from SOI up to SOS with bounds checks, and only
+ * the SOF segment and the Exif orientation tag are looked at. no
+ * decompress object is created, so this is much cheaper than
+ * Decoder#read_header and suitable for indexing a large number of files.
  *
- *   @param jpeg [String]  JPEG data to decode.
+ * @param jpeg [String]  JPEG data (the entropy coded data is not needed)
  *
- *   @return [String] decoded raw image data.
+ * @return [JPEG::ProbeInfo]  frozen object with width, height (of the
+ *   frame, the Exif orientation is not applied), num_components,
+ *   sampling_factors ([[h, v], ...] for each component), progressive and
+ *   orientation (Exif value 1-8, 1 if the tag is not present).
+ *
+ * @raise [JPEG::DecodeError]  if the data is broken or ends before SOS
+ *   (use JPEG.probe_prefix for a prefix of the data).
  */
 static VALUE
-rb_decoder_decode(VALUE self, VALUE data)
+rb_probe(VALUE self, VALUE data)
 {
-  VALUE ret;
-  jpeg_decode_t* ptr;
-  int state;
+  probe_info_t info;
 
-  /*
-   * initialize
-   */
-  ret   = Qnil;
-  state = 0;
+  Check_Type(data, T_STRING);
 
-  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
+  switch (probe_markers((uint8_t*)RSTRING_PTR(data),
+                        RSTRING_LEN(data), &info)) {
+  case PROBE_NEED_MORE:
+    rb_raise(decerr_klass, "data is truncated before SOS marker");
+    break;
 
-  /*
-   * argument check
-   */
-  Check_Type(data, T_STRING);
+  case PROBE_ERROR:
+    rb_raise(decerr_klass, "%s", info.err);
+    break;
+  }
 
-  /*
-   * prepare
-   */
-  SET_DATA(ptr, data);
+  return create_probe_info(&info);
+}
 
-  /*
-   * do decode
-   */
-  ret = rb_protect(do_decode, (VALUE)ptr, &state);
+/**
+ * read the frame header from a prefix of JPEG data.
+ *
+ * works as JPEG.probe, but when the data ends before SOS, reports how
+ * long the prefix has to be instead of raising. this is meant for
+ * fetching only the header of a stored image by range requests.
+ *
+ * @param prefix [String]  leading bytes of JPEG data
+ *
+ * @return [JPEG::ProbeInfo, Array]  JPEG::ProbeInfo if the prefix
+ *   reaches SOS, otherwise [:need_more, min_total_bytes]. the length is
+ *   a lower bound of the prefix needed to reach SOS (the size of the
+ *   rest of the markers is unknown), so the prefix up to that length may
+ *   still be short if more markers follow.
+ *
+ * @raise [JPEG::DecodeError]  if the prefix is not a JPEG data.
+ *
+ * @example
+ *   len = 1024
+ *   loop {
+ *     ret = JPEG.probe_prefix(fetch_range(0, len))
+ *     break ret if ret.is_a?(JPEG::ProbeInfo)
+ *     len = [ret[1], len * 2].max
+ *   }
+ */
+static VALUE
+rb_probe_prefix(VALUE self, VALUE prefix)
+{
+  VALUE ret;
+  probe_info_t info;
 
-  /*
-   * post process
-   */
-  CLR_DATA(ptr);
+  Check_Type(prefix, T_STRING);
 
-  if (state != 0) rb_jump_tag(state);
+  switch (probe_markers((uint8_t*)RSTRING_PTR(prefix),
+                        RSTRING_LEN(prefix), &info)) {
+  case PROBE_NEED_MORE:
+    ret = rb_assoc_new(ID2SYM(rb_intern("need_more")), SIZET2NUM(info.need));
+    break;
+
+  case PROBE_ERROR:
+    rb_raise(decerr_klass, "%s", info.err);
+    break;
+
+  default:
+    ret = create_probe_info(&info);
+    break;
+  }
 
   return ret;
 }
@@ -3730,6 +10499,99 @@ rb_test_image(VALUE self, VALUE data)
   return ret;
 }
 
+/**
+ * report the SIMD kernels selected for the pixel format conversion, the
+ * transposition and mirroring of the Exif orientation, and the vertical
+ * pass of the resampler.
+ *
+ * @return [Symbol]
+ *   one of :avx2, :sse2, :neon or :none. the kernels are chosen once at
+ *   load time by CPU feature detection, and the environment variable
+ *   LIBJPEG_RUBY_SIMD ("none" or "sse2") restricts the choice.
+ */
+static VALUE
+rb_simd(VALUE self)
+{
+  return ID2SYM(rb_intern(kernels.name));
+}
+
+static void
+init_kernels(void)
+{
+  const char* lim;
+
+  lim = getenv("LIBJPEG_RUBY_SIMD");
+  if (lim == NULL) lim = "";
+
+  /*
+   * 全てのSIMD版は末尾の端数をスカラ版で処理し、結果はスカラ版と
+   * ビット単位で一致する
+   */
+  kernels.name          = "none";
+  kernels.expand_yuv422 = expand_yuv422_scalar;
+  kernels.expand_rgb565 = expand_rgb565_scalar;
+  kernels.pack_yuv422   = pack_yuv422_scalar;
+  kernels.pack_rgb565   = pack_rgb565_scalar;
+  kernels.transpose[0]  = transpose8_scalar;
+  kernels.transpose[1]  = transpose16_scalar;
+  kernels.transpose[2]  = transpose24_scalar;
+  kernels.transpose[3]  = transpose32_scalar;
+  kernels.mirror[0]     = mirror8_scalar;
+  kernels.mirror[1]     = mirror16_scalar;
+  kernels.mirror[2]     = mirror24_scalar;
+  kernels.mirror[3]     = mirror32_scalar;
+  kernels.resample_col  = resample_column_scalar;
+
+  if (strcmp(lim, "none") == 0) return;
+
+#if defined(__SSE2__)
+  kernels.name          = "sse2";
+  kernels.expand_yuv422 = expand_yuv422_sse2;
+  kernels.expand_rgb565 = expand_rgb565_sse2;
+  kernels.pack_yuv422   = pack_yuv422_sse2;
+  kernels.pack_rgb565   = pack_rgb565_sse2;
+  kernels.transpose[0]  = transpose8_sse2;
+  kernels.transpose[2]  = transpose24_sse2;
+  kernels.transpose[3]  = transpose32_sse2;
+  kernels.mirror[0]     = mirror8_sse2;
+  kernels.mirror[1]     = mirror16_sse2;
+  kernels.mirror[2]     = mirror24_sse2;
+  kernels.mirror[3]     = mirror32_sse2;
+  kernels.resample_col  = resample_column_sse2;
+#elif defined(__ARM_NEON)
+  kernels.name          = "neon";
+  kernels.expand_yuv422 = expand_yuv422_neon;
+  kernels.expand_rgb565 = expand_rgb565_neon;
+  kernels.pack_yuv422   = pack_yuv422_neon;
+  kernels.pack_rgb565   = pack_rgb565_neon;
+  kernels.transpose[0]  = transpose8_neon;
+  kernels.transpose[2]  = transpose24_neon;
+  kernels.transpose[3]  = transpose32_neon;
+  kernels.mirror[0]     = mirror8_neon;
+  kernels.mirror[1]     = mirror16_neon;
+  kernels.mirror[2]     = mirror24_neon;
+  kernels.mirror[3]     = mirror32_neon;
+  kernels.resample_col  = resample_column_neon;
+#endif
+
+#ifdef HAVE_AVX2_KERNEL
+  if (strcmp(lim, "sse2") == 0) return;
+
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    kernels.name          = "avx2";
+    kernels.expand_yuv422 = expand_yuv422_avx2;
+    kernels.expand_rgb565 = expand_rgb565_avx2;
+    kernels.mirror[0]     = mirror8_avx2;
+    kernels.mirror[1]     = mirror16_avx2;
+    kernels.mirror[2]     = mirror24_avx2;
+    kernels.mirror[3]     = mirror32_avx2;
+    kernels.resample_col  = resample_column_avx2;
+  }
+#endif /* defined(HAVE_AVX2_KERNEL) */
+}
+
 void
 Init_jpeg()
 {
@@ -3741,11 +10603,22 @@ Init_jpeg()
 
   module = rb_define_module("JPEG");
   rb_define_singleton_method(module, "broken?", rb_test_image, 1);
+  rb_define_singleton_method(module, "simd", rb_simd, 0);
+  rb_define_singleton_method(module, "fingerprint", rb_fingerprint, -1);
+  rb_define_singleton_method(module, "average_color", rb_average_color, 1);
+  rb_define_singleton_method(module, "placeholder", rb_placeholder, 3);
+  rb_define_singleton_method(module, "probe", rb_probe, 1);
+  rb_define_singleton_method(module, "probe_prefix", rb_probe_prefix, 1);
 
   encoder_klass = rb_define_class_under(module, "Encoder", rb_cObject);
   rb_define_alloc_func(encoder_klass, rb_encoder_alloc);
   rb_define_method(encoder_klass, "initialize", rb_encoder_initialize, -1);
   rb_define_method(encoder_klass, "encode", rb_encoder_encode, 1);
+  rb_define_method(encoder_klass, "encode_batch", rb_encoder_encode_batch, -1);
+  rb_define_method(encoder_klass, "start", rb_encoder_start, 0);
+  rb_define_method(encoder_klass, "write_rows", rb_encoder_write_rows, 1);
+  rb_define_method(encoder_klass, "finish", rb_encoder_finish, 0);
+  rb_define_method(encoder_klass, "cancel", rb_encoder_cancel, 0);
   rb_define_alias(encoder_klass, "compress", "encode");
   rb_define_alias(encoder_klass, "<<", "encode");
 
@@ -3757,7 +10630,13 @@ Init_jpeg()
   rb_define_method(decoder_klass, "initialize", rb_decoder_initialize, -1);
   rb_define_method(decoder_klass, "set", rb_decoder_set, 1);
   rb_define_method(decoder_klass, "read_header", rb_decoder_read_header, 1);
-  rb_define_method(decoder_klass, "decode", rb_decoder_decode, 1);
+  rb_define_method(decoder_klass, "decode", rb_decoder_decode, -1);
+  rb_define_method(decoder_klass, "each_band", rb_decoder_each_band, -1);
+  rb_define_method(decoder_klass, "each_scan", rb_decoder_each_scan, 1);
+  rb_define_method(decoder_klass, "thumbnail", rb_decoder_thumbnail, -1);
+  rb_define_method(decoder_klass, "read_coefficients",
+                   rb_decoder_read_coefficients, 1);
+  rb_define_method(decoder_klass, "decode_batch", rb_decoder_decode_batch, -1);
   rb_define_alias(decoder_klass, "decompress", "decode");
   rb_define_alias(decoder_klass, "<<", "decode");
 
@@ -3769,6 +10648,16 @@ Init_jpeg()
   rb_define_attr(meta_klass, "output_colorspace", 1, 0);
   rb_define_attr(meta_klass, "num_components", 1, 0);
   rb_define_attr(meta_klass, "colormap", 1, 0);
+  rb_define_attr(meta_klass, "planes", 1, 0);
+
+  probe_klass   = rb_define_class_under(module, "ProbeInfo", rb_cObject);
+  rb_define_attr(probe_klass, "width", 1, 0);
+  rb_define_attr(probe_klass, "height", 1, 0);
+  rb_define_attr(probe_klass, "num_components", 1, 0);
+  rb_define_attr(probe_klass, "sampling_factors", 1, 0);
+  rb_define_attr(probe_klass, "progressive", 1, 0);
+  rb_define_attr(probe_klass, "orientation", 1, 0);
+  rb_define_alias(probe_klass, "progressive?", "progressive");
 
   decerr_klass  = rb_define_class_under(module,
                                         "DecodeError", rb_eRuntimeError);
@@ -3786,6 +10675,10 @@ Init_jpeg()
       decoder_opts_ids[i] = rb_intern_const(decoder_opts_keys[i]);
   }
 
+  for (i = 0; i < (int)N(decode_args_keys); i++) {
+      decode_args_ids[i] = rb_intern_const(decode_args_keys[i]);
+  }
+
   id_meta      = rb_intern_const("@meta");
   id_width     = rb_intern_const("@width");
   id_stride    = rb_intern_const("@stride");
@@ -3795,4 +10688,27 @@ Init_jpeg()
   id_ncompo    = rb_intern_const("@num_components");
   id_exif_tags = rb_intern_const("@exif_tags");
   id_colormap  = rb_intern_const("@colormap");
+  id_planes    = rb_intern_const("@planes");
+  id_threads   = rb_intern_const("threads");
+  id_samp      = rb_intern_const("@sampling_factors");
+  id_prog      = rb_intern_const("@progressive");
+  id_o9n       = rb_intern_const("@orientation");
+
+  samp_pairs = rb_ary_new_capa(16);
+  rb_global_variable(&samp_pairs);
+
+  for (i = 0; i < 16; i++) {
+    rb_ary_push(samp_pairs, rb_ary_freeze(rb_assoc_new(INT2FIX((i / 4) + 1),
+                                                       INT2FIX((i % 4) + 1))));
+  }
+
+  rb_ary_freeze(samp_pairs);
+
+#ifdef _SC_NPROCESSORS_ONLN
+  default_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif /* defined(_SC_NPROCESSORS_ONLN) */
+
+  if (default_workers < 1) default_workers = 1;
+
+  init_kernels();
 }
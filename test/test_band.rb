@@ -0,0 +1,124 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestEachBand < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  data("1 row"    => 1,
+       "16 rows"  => 16,
+       "7 rows"   => 7,
+       "300 rows" => 300,
+       "999 rows" => 999)
+
+  test "each band" do |rows|
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    ref = dec << dat
+    img = "".b
+    pos = []
+
+    ret = dec.each_band(dat, rows) { |band, y|
+      assert_equal(200, band.meta.width)
+      assert_equal(300, band.meta.height)
+      assert_true(band.bytesize <= 200 * 3 * rows)
+
+      pos << y
+      img << band
+    }
+
+    assert_same(dec, ret)
+    assert_equal(ref, img)
+    assert_equal((0...300).step(rows).to_a, pos)
+  end
+
+  test "each band (default rows)" do
+    dec = JPEG::Decoder.new(:pixel_format => :GRAYSCALE)
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    ref = dec << dat
+    img = "".b
+
+    dec.each_band(dat) { |band, y|
+      assert_equal(y * 200, img.bytesize)
+      img << band
+    }
+
+    assert_equal(ref, img)
+  end
+
+  test "each band (colormap)" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB,
+                            :dither => [:FS, true, 64],
+                            :expand_colormap => true)
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    ref = dec << dat
+    img = "".b
+
+    dec.each_band(dat, 32) { |band, y| img << band}
+
+    assert_equal(ref, img)
+  end
+
+  test "enumerator" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    enu = dec.each_band(dat, 100)
+
+    assert_kind_of(Enumerator, enu)
+    assert_equal([0, 100, 200], enu.map {|band, y| y})
+  end
+
+  test "break and reuse" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+
+    dec.each_band(dat) { |band, y| break }
+    assert_raise(RuntimeError) {
+      dec.each_band(dat) { |band, y| raise "abort" }
+    }
+
+    img = assert_nothing_raised {dec << dat}
+    assert_equal(200 * 300 * 3, img.bytesize)
+  end
+
+  test "read_header and set while decoding" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    img = "".b
+
+    # デコード中の状態を書き換える呼び出しは拒否する
+    dec.each_band(dat, 64) { |band, y|
+      assert_raise_message(/busy/) {dec.read_header(dat)}
+      assert_raise_message(/busy/) {dec.set(:pixel_format => :GRAYSCALE)}
+      img << band
+    }
+
+    assert_equal(dec << dat, img)
+    assert_equal(300, dec.read_header(dat).height)
+  end
+
+  test "broken data" do
+    dec = JPEG::Decoder.new
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+
+    assert_raise(JPEG::DecodeError) {
+      dec.each_band(dat.byteslice(0, 2000)) { |band, y| }
+    }
+  end
+
+  data(
+    "zero"    => {:val => 0,    :exc => RangeError},
+    "minus"   => {:val => -1,   :exc => RangeError},
+    "Float"   => {:val => 1.0,  :exc => TypeError},
+    "String"  => {:val => "16", :exc => TypeError},
+  )
+
+  test "bad rows" do |info|
+    dec = JPEG::Decoder.new
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+
+    assert_raise_kind_of(info[:exc]) {
+      dec.each_band(dat, info[:val]) { |band, y| }
+    }
+  end
+end
@@ -0,0 +1,94 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestReadCoefficients < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  def read_data
+    return (DATA_DIR + "DSC_0215_small.JPG").binread
+  end
+
+  test "components" do
+    ret = JPEG::Decoder.new.read_coefficients(read_data)
+
+    assert_equal(200, ret[:width])
+    assert_equal(300, ret[:height])
+    assert_equal("YCbCr", ret[:colorspace])
+    assert_equal(3, ret[:components].size)
+    assert_true(ret.frozen?)
+
+    ret[:components].each { |comp|
+      blks = comp[:width_in_blocks] * comp[:height_in_blocks]
+
+      assert_equal(blks * 64 * 2, comp[:coefficients].bytesize)
+      assert_equal(64, comp[:quant_table].size)
+      assert_true(comp[:quant_table].all? { |q| q.between?(1, 255)})
+    }
+
+    y = ret[:components][0]
+    assert_equal(25, y[:width_in_blocks])
+    assert_equal(38, y[:height_in_blocks])
+  end
+
+  data("0"   => 0,
+       "255" => 255,
+       "77"  => 77)
+
+  test "flat image" do |val|
+    raw = val.chr * (16 * 16)
+    jpg = JPEG::Encoder.new(16, 16, :pixel_format => :GRAYSCALE,
+                            :quality => 100) << raw
+    ret = JPEG::Decoder.new.read_coefficients(jpg)
+    cmp = ret[:components][0]
+
+    assert_equal(1, ret[:components].size)
+    assert_equal([1] * 64, cmp[:quant_table])
+
+    # 平坦なブロックはDC成分のみを持つ
+    cmp[:coefficients].unpack("s*").each_slice(64) { |blk|
+      assert_equal([(val - 128) * 8] + [0] * 63, blk)
+    }
+  end
+
+  test "DC matches the block average" do
+    dat = read_data
+    ret = JPEG::Decoder.new.read_coefficients(dat)
+    img = JPEG::Decoder.new(:pixel_format => :GRAYSCALE) << dat
+    cmp = ret[:components][0]
+    q0  = cmp[:quant_table][0]
+    wd  = cmp[:width_in_blocks]
+
+    cmp[:coefficients].unpack("s*").each_slice(64).with_index { |blk, i|
+      bx, by = (i % wd) * 8, (i / wd) * 8
+      next if bx + 8 > 200 || by + 8 > 300
+
+      avg = (0...8).sum { |y|
+        img.byteslice(((by + y) * 200) + bx, 8).bytes.sum
+      } / 64.0
+
+      assert_in_delta(avg, ((blk[0] * q0) / 8.0) + 128, 2.0)
+    }
+  end
+
+  test "decoder can be reused" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    dat = read_data
+    ref = dec << dat
+
+    dec.read_coefficients(dat)
+    assert_equal(ref, dec << dat)
+  end
+
+  test "bad input" do
+    dec = JPEG::Decoder.new
+
+    assert_raise(TypeError) {dec.read_coefficients(nil)}
+    assert_raise(JPEG::DecodeError) {dec.read_coefficients("\xff\xd8abc")}
+    assert_raise(JPEG::DecodeError) {
+      dec.read_coefficients(read_data.byteslice(0, 300))
+    }
+
+    assert_nothing_raised {dec.read_coefficients(read_data)}
+  end
+end
@@ -0,0 +1,83 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestDecodeCrop < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  def window(img, x, y, w, h)
+    nc = img.bytesize / (img.meta.width * img.meta.height)
+    st = img.meta.width * nc
+
+    return (y...(y + h)).map {|j| img.byteslice((j * st) + (x * nc), w * nc)}.join
+  end
+
+  data(
+    "top left"     => [0, 0, 16, 16],
+    "inner"        => [37, 41, 100, 120],
+    "MCU aligned"  => [96, 80, 14, 138],
+    "bottom right" => [150, 250, 50, 50],
+    "one pixel"    => [199, 299, 1, 1],
+    "whole"        => [0, 0, 200, 300],
+  )
+
+  test "crop" do |area|
+    [
+      {:pixel_format => :RGB},
+      {:pixel_format => :RGB, :do_fancy_upsampling => true},
+      {:pixel_format => :GRAYSCALE},
+      {:pixel_format => :RGB, :dither => [:FS, false, 64], :expand_colormap => true},
+    ].each { |opt|
+      dec = JPEG::Decoder.new(**opt)
+      dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+      ref = dec << dat
+
+      img = assert_nothing_raised {dec.decode(dat, :crop => area)}
+      met = img.meta
+
+      assert_equal(area[2], met.width)
+      assert_equal(area[3], met.height)
+      assert_equal(ref.meta.stride / ref.meta.width * area[2], met.stride)
+      assert_equal(window(ref, *area), img)
+    }
+  end
+
+  test "crop with scale" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB, :scale => 0.5)
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    ref = dec << dat
+    img = dec.decode(dat, :crop => [10, 20, 30, 40])
+
+    assert_equal(window(ref, 10, 20, 30, 40), img)
+  end
+
+  test "crop with into" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    buf = String.new
+    ret = dec.decode(dat, :into => buf, :crop => [10, 20, 30, 40])
+
+    assert_same(buf, ret)
+    assert_equal(30 * 40 * 3, ret.bytesize)
+  end
+
+  data(
+    "not array"    => {:val => 1,                  :exc => TypeError},
+    "short"        => {:val => [0, 0, 10],         :exc => ArgumentError},
+    "not integer"  => {:val => [0, 0, "a", 10],    :exc => TypeError},
+    "negative"     => {:val => [-1, 0, 10, 10],    :exc => RangeError},
+    "zero size"    => {:val => [0, 0, 0, 10],      :exc => RangeError},
+    "out of image" => {:val => [150, 0, 51, 10],   :exc => RangeError},
+  )
+
+  test "bad crop" do |info|
+    dec = JPEG::Decoder.new
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+
+    assert_raise_kind_of(info[:exc]) {
+      dec.decode(dat, :crop => info[:val])
+    }
+
+    assert_nothing_raised {dec << dat}
+  end
+end
@@ -361,6 +361,27 @@ class TestDecodeOptions < Test::Unit::TestCase
         :n_comp => 1,
         :times  => 1
       },
+
+      "YUV422"    => {
+        :in     => :YUV422,
+        :out    => "YUYV",
+        :n_comp => 2,
+        :times  => 2
+      },
+
+      "YUYV"      => {
+        :in     => :YUYV,
+        :out    => "YUYV",
+        :n_comp => 2,
+        :times  => 2
+      },
+
+      "RGB565"    => {
+        :in     => :RGB565,
+        :out    => "RGB565",
+        :n_comp => 2,
+        :times  => 2
+      },
     }
   }
 
@@ -400,23 +421,6 @@ class TestDecodeOptions < Test::Unit::TestCase
     assert_equal(info[:out], met.output_colorspace);
   end
 
-  #
-  # pixel_format (not implemented value)
-  #
-  data {
-    {
-      "YUV422"    => :YUV422,
-      "YUYV"      => :YUYV,
-      "RGB565"    => :RGB565,
-    }
-  }
-
-  test "pixel_format (not implemented value)" do |val|
-    assert_raise_kind_of(NotImplementedError ) {
-      JPEG::Decoder.new(:pixel_format => val)
-    }
-  end
-
   #
   # pixel_format (invalid value)
   #
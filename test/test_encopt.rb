@@ -311,4 +311,33 @@ class TestEncodeOptions < Test::Unit::TestCase
       Pathname("DSC_0215_small.#{lab}.jpg").binwrite(jpg)
     end
   end
+
+  #
+  # output larger than the initial estimate
+  #
+  test "large output" do
+    raw = Random.new(0).bytes(320 * 240 * 3)
+    enc = JPEG::Encoder.new(320, 240, :pixel_format => :RGB, :quality => 100)
+    jpg = assert_nothing_raised {enc << raw}
+
+    assert_equal("\xff\xd8".b, jpg.byteslice(0, 2))
+    assert_equal("\xff\xd9".b, jpg.byteslice(-2, 2))
+
+    img = JPEG::Decoder.new(:pixel_format => :RGB) << jpg
+    assert_equal(320, img.meta.width)
+    assert_equal(240, img.meta.height)
+  end
+
+  #
+  # odd width with a format that needs conversion
+  #
+  test "odd width YUV422" do
+    raw = Random.new(0).bytes(203 * 3 * 57)
+    enc = JPEG::Encoder.new(203, 57, :pixel_format => :YUV422)
+    jpg = assert_nothing_raised {enc << raw}
+
+    img = JPEG::Decoder.new(:pixel_format => :RGB) << jpg
+    assert_equal(203, img.meta.width)
+    assert_equal(57, img.meta.height)
+  end
 end
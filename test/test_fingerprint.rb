@@ -0,0 +1,102 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestFingerprint < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  def read_data
+    return (DATA_DIR + "DSC_0215_small.JPG").binread
+  end
+
+  def hamming(a, b)
+    return (a ^ b).to_s(2).count("1")
+  end
+
+  #
+  # 同じ画像を縮小・再圧縮したもの
+  #
+  def make_variants(dat)
+    rgb  = JPEG::Decoder.new(:pixel_format => :RGB) << dat
+    half = JPEG::Decoder.new(:pixel_format => :RGB, :scale => 0.5) << dat
+
+    return [
+      JPEG::Encoder.new(200, 300, :pixel_format => :RGB, :quality => 30) << rgb,
+      JPEG::Encoder.new(100, 150, :pixel_format => :RGB) << half
+    ]
+  end
+
+  data("phash" => :phash,
+       "dhash" => :dhash)
+
+  test "fingerprint" do |method|
+    dat = read_data
+    ref = JPEG.fingerprint(dat, :method => method)
+    rnd = JPEG::Encoder.new(200, 300, :pixel_format => :RGB) <<
+          Random.new(0).bytes(200 * 300 * 3)
+
+    assert_kind_of(Integer, ref)
+    assert_true(ref.between?(0, 2 ** 64 - 1))
+    assert_equal(ref, JPEG.fingerprint(dat, :method => method))
+
+    make_variants(dat).each { |jpg|
+      assert_true(hamming(ref, JPEG.fingerprint(jpg, :method => method)) < 12)
+    }
+
+    assert_true(hamming(ref, JPEG.fingerprint(rnd, :method => method)) > 20)
+  end
+
+  test "default method is phash" do
+    dat = read_data
+    assert_equal(JPEG.fingerprint(dat, :method => :phash),
+                 JPEG.fingerprint(dat))
+  end
+
+  test "average color" do
+    dat = read_data
+    img = JPEG::Decoder.new(:pixel_format => :RGB) << dat
+    ref = img.unpack("C*").each_slice(3).to_a.transpose.map { |c|
+      c.sum.fdiv(c.size)
+    }
+
+    JPEG.average_color(dat).zip(ref) { |a, b| assert_in_delta(b, a, 2.0)}
+  end
+
+  data("gray"  => [:GRAYSCALE, [90]],
+       "color" => [:RGB, [200, 40, 120]])
+
+  test "flat image" do |(fmt, val)|
+    raw = val.pack("C*") * (64 * 48)
+    jpg = JPEG::Encoder.new(64, 48, :pixel_format => fmt, :quality => 100) << raw
+    rgb = (val.size == 1)? val * 3: val
+
+    JPEG.average_color(jpg).zip(rgb) { |a, b| assert_in_delta(b, a, 2)}
+
+    JPEG.placeholder(jpg, 4, 3).unpack("C*").zip(rgb * 12) { |a, b|
+      assert_in_delta(b, a, 2)
+    }
+  end
+
+  data("4x6"   => [4, 6],
+       "32x32" => [32, 32],
+       "1x1"   => [1, 1],
+       "64x96" => [64, 96])
+
+  test "placeholder" do |(wd, ht)|
+    img = JPEG.placeholder(read_data, wd, ht)
+
+    assert_equal(wd * ht * 3, img.bytesize)
+    assert_equal(Encoding::ASCII_8BIT, img.encoding)
+  end
+
+  test "bad input" do
+    dat = read_data
+
+    assert_raise(TypeError) {JPEG.fingerprint(nil)}
+    assert_raise(ArgumentError) {JPEG.fingerprint(dat, :method => :ahash)}
+    assert_raise(JPEG::DecodeError) {JPEG.average_color("\xff\xd8abc")}
+    assert_raise(JPEG::DecodeError) {JPEG.placeholder("abc", 4, 4)}
+    assert_raise(RangeError) {JPEG.placeholder(dat, 0, 4)}
+    assert_raise(RangeError) {JPEG.placeholder(dat, 4, 1025)}
+  end
+end
@@ -0,0 +1,130 @@
+require 'test/unit'
+require 'pathname'
+require 'objspace'
+require 'jpeg'
+
+class TestDecodeInto < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  test "decode into buffer" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    buf = String.new
+    ref = dec << dat
+
+    ret = assert_nothing_raised {dec.decode(dat, :into => buf)}
+
+    assert_same(buf, ret)
+    assert_equal(ref, ret)
+    assert_equal(Encoding::ASCII_8BIT, ret.encoding)
+    assert_equal(ref.meta.width, ret.meta.width)
+    assert_equal(ref.meta.height, ret.meta.height)
+  end
+
+  test "reuse buffer" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    buf = String.new(capacity: 200 * 300 * 3)
+
+    dec.decode(dat, :into => buf)
+    siz = ObjectSpace.memsize_of(buf)
+
+    ret = dec.decode(dat, :into => buf)
+
+    assert_same(buf, ret)
+    assert_equal(200 * 300 * 3, ret.bytesize)
+    assert_equal(siz, ObjectSpace.memsize_of(ret))
+  end
+
+  test "shrink and grow" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    buf = "x" * 10
+
+    dec = JPEG::Decoder.new(:pixel_format => :GRAYSCALE, :scale => 0.5)
+    ret = dec.decode(dat, :into => buf)
+    assert_equal(100 * 150, ret.bytesize)
+
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    ret = dec.decode(dat, :into => buf)
+    assert_equal(200 * 300 * 3, ret.bytesize)
+
+    dec = JPEG::Decoder.new(:pixel_format => :GRAYSCALE, :scale => 0.5)
+    ret = dec.decode(dat, :into => buf)
+    assert_equal(100 * 150, ret.bytesize)
+  end
+
+  data("1" => 1, "5" => 5, "6" => 6, "8" => 8)
+
+  test "with orientation" do |o|
+    dec = JPEG::Decoder.new(:pixel_format => :RGB, :orientation => true)
+    dat = (DATA_DIR + "orientation-#{o}.jpg").binread
+    ref = dec << dat
+    buf = String.new
+
+    2.times {
+      ret = dec.decode(dat, :into => buf)
+
+      assert_same(buf, ret)
+      assert_equal(ref, ret)
+      assert_equal(ref.meta.width, ret.meta.width)
+      assert_equal(ref.meta.height, ret.meta.height)
+    }
+  end
+
+  data("raw"      => false,
+       "expanded" => true)
+
+  test "with colormap" do |exp|
+    dec = JPEG::Decoder.new(:pixel_format => :RGB,
+                            :dither => [:FS, false, 64],
+                            :expand_colormap => exp)
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    ref = dec << dat
+    buf = String.new
+
+    ret = dec.decode(dat, :into => buf)
+
+    assert_same(buf, ret)
+    assert_equal(200 * 300 * (exp ? 3 : 1), ret.bytesize)
+    assert_equal(ref, ret)
+  end
+
+  data(
+    "Integer" => {:val => 1,        :exc => TypeError},
+    "Array"   => {:val => [],       :exc => TypeError},
+    "Symbol"  => {:val => :buf,     :exc => TypeError},
+    "Frozen"  => {:val => "".freeze, :exc => FrozenError},
+  )
+
+  test "bad buffer" do |info|
+    dec = JPEG::Decoder.new
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+
+    assert_raise_kind_of(info[:exc]) {
+      dec.decode(dat, :into => info[:val])
+    }
+  end
+
+  test "reuse buffer after decode error" do
+    gry = JPEG::Encoder.new(16, 16, :pixel_format => :GRAYSCALE) << "\x80" * 256
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new(:pixel_format => :YCbCr)
+    buf = String.new
+
+    # グレースケールからYCbCrへの変換はlibjpegのエラーになる
+    assert_raise(JPEG::DecodeError) {dec.decode(gry, :into => buf)}
+
+    # エラー後もバッファはロックされていない
+    assert_equal(dec << dat, dec.decode(dat, :into => buf))
+    assert_nothing_raised {buf << "x"}
+  end
+
+  test "unknown keyword" do
+    dec = JPEG::Decoder.new
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+
+    assert_raise_kind_of(ArgumentError) {
+      dec.decode(dat, :foo => 1)
+    }
+  end
+end
@@ -159,4 +159,67 @@ class TestOrientation < Test::Unit::TestCase
     assert_equal(YELLOW, pix[BR])
     assert_equal(BLUE,   pix[TR])
   end
+
+  #
+  # 向きを適用しない復号結果から、Exifの向き(5〜8)に従った画像を作る
+  # （転置の後に上下反転・左右反転を行う）
+  #
+  def apply_orientation(raw, wd, nc, o9n)
+    rows = raw.bytes.each_slice(nc).each_slice(wd).to_a.transpose
+
+    rows = rows.reverse if o9n == 7 || o9n == 8
+    rows = rows.map(&:reverse) if o9n == 6 || o9n == 7
+
+    return rows.flatten.pack("C*")
+  end
+
+  data(
+    [:GRAYSCALE, :RGB, :RGBX].product([5, 6, 7, 8],
+                                      [[203, 57], [64, 128], [9, 300]])
+      .to_h { |fmt, o9n, (wd, ht)|
+        ["#{fmt} #{o9n} #{wd}x#{ht}", [fmt, o9n, wd, ht]]
+      }
+  )
+
+  test "transposed orientation" do |(fmt, o9n, wd, ht)|
+    raw = Random.new(wd + ht).bytes(wd * ht * 3)
+    jpg = JPEG::Encoder.new(wd, ht, :pixel_format => :RGB,
+                            :orientation => o9n) << raw
+
+    dec = JPEG::Decoder.new(:pixel_format => fmt)
+    ref = dec << jpg
+    nc  = ref.meta.num_components
+
+    dec = JPEG::Decoder.new(:pixel_format => fmt, :orientation => true)
+    img = dec << jpg
+
+    assert_equal(ht, img.meta.width)
+    assert_equal(wd, img.meta.height)
+    assert_equal(apply_orientation(ref, wd, nc, o9n), img)
+  end
+
+  data("5" => 5,
+       "6" => 6,
+       "7" => 7,
+       "8" => 8)
+
+  test "transposed orientation with threads, crop and batch" do |o9n|
+    raw = Random.new(o9n).bytes(333 * 211 * 3)
+    jpg = JPEG::Encoder.new(333, 211, :pixel_format => :RGB,
+                            :orientation => o9n, :threads => 3) << raw
+
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    ref = dec << jpg
+    crp = dec.decode(jpg, :crop => [5, 7, 300, 190])
+
+    dec = JPEG::Decoder.new(:pixel_format => :RGB, :orientation => true)
+    thr = JPEG::Decoder.new(:pixel_format => :RGB, :orientation => true,
+                            :threads => 4)
+
+    assert_equal(apply_orientation(ref, 333, 3, o9n), thr << jpg)
+    assert_equal(apply_orientation(ref, 333, 3, o9n),
+                 dec.decode_batch([jpg])[0])
+    assert_equal(apply_orientation(crp, 300, 3, o9n),
+                 dec.decode(jpg, :crop => [5, 7, 300, 190]))
+  end
 end
@@ -0,0 +1,150 @@
+require 'test/unit'
+require 'pathname'
+require 'objspace'
+require 'jpeg'
+
+class TestPackedFormat < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  #
+  # YCbCrの復号結果から期待されるYUYVを作る（色差は2画素の平均）
+  #
+  def make_yuyv(ycc, wd, ht)
+    ret = "".b
+
+    ht.times { |y|
+      row = ycc.byteslice(y * wd * 3, wd * 3).bytes
+
+      (0...wd).step(2) { |x|
+        y0, u0, v0, y1, u1, v1 = row[x * 3, 6]
+
+        if y1
+          ret << [y0, (u0 + u1 + 1) >> 1, y1, (v0 + v1 + 1) >> 1].pack("C*")
+        else
+          ret << [y0, u0, y0, v0].pack("C*")
+        end
+      }
+    }
+
+    return ret
+  end
+
+  def make_rgb565(rgb)
+    return rgb.unpack("C*").each_slice(3).map { |r, g, b|
+      ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3)
+    }.pack("v*")
+  end
+
+  def make_jpeg(wd, ht)
+    raw = Random.new(wd * ht).bytes(wd * ht * 3)
+    return JPEG::Encoder.new(wd, ht, :pixel_format => :RGB) << raw
+  end
+
+  data("200x300" => [200, 300],
+       "203x57"  => [203, 57],
+       "17x33"   => [17, 33],
+       "31x2"    => [31, 2],
+       "1x5"     => [1, 5])
+
+  test "YUYV" do |(wd, ht)|
+    jpg = (wd == 200)? (DATA_DIR + "DSC_0215_small.JPG").binread:
+                       make_jpeg(wd, ht)
+    ycc = JPEG::Decoder.new(:pixel_format => :YCbCr) << jpg
+    img = JPEG::Decoder.new(:pixel_format => :YUYV) << jpg
+
+    assert_equal(((wd + 1) / 2) * 4, img.meta.stride)
+    assert_equal(make_yuyv(ycc, wd, ht), img)
+  end
+
+  data("200x300" => [200, 300],
+       "203x57"  => [203, 57],
+       "17x33"   => [17, 33],
+       "31x2"    => [31, 2],
+       "1x5"     => [1, 5])
+
+  test "RGB565" do |(wd, ht)|
+    jpg = (wd == 200)? (DATA_DIR + "DSC_0215_small.JPG").binread:
+                       make_jpeg(wd, ht)
+    rgb = JPEG::Decoder.new(:pixel_format => :RGB) << jpg
+    img = JPEG::Decoder.new(:pixel_format => :RGB565) << jpg
+
+    assert_equal(wd * 2, img.meta.stride)
+    assert_equal(make_rgb565(rgb), img)
+  end
+
+  data("YUYV"   => :YUYV,
+       "RGB565" => :RGB565)
+
+  test "round trip" do |fmt|
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    img = JPEG::Decoder.new(:pixel_format => fmt) << dat
+
+    # エンコーダ側のパック形式の行は幅×3バイト単位で詰める
+    raw = img.scan(/.{400}/mn).map { |row| row + "\0" * 200}.join
+    jpg = JPEG::Encoder.new(200, 300, :pixel_format => fmt) << raw
+    ref = JPEG::Decoder.new(:pixel_format => :RGB) << dat
+    ret = JPEG::Decoder.new(:pixel_format => :RGB) << jpg
+
+    # 再圧縮と量子化による誤差の範囲で一致すること
+    diff = ref.bytes.zip(ret.bytes).sum { |a, b| (a - b).abs}
+    assert_true(diff.fdiv(ref.bytesize) < 8)
+  end
+
+  data("YUYV 2"   => [:YUYV, 2],
+       "YUYV 3"   => [:YUYV, 3],
+       "YUYV 4"   => [:YUYV, 4],
+       "YUYV 6"   => [:YUYV, 6],
+       "RGB565 2" => [:RGB565, 2],
+       "RGB565 4" => [:RGB565, 4],
+       "RGB565 6" => [:RGB565, 6],
+       "RGB565 7" => [:RGB565, 7])
+
+  test "with orientation" do |(fmt, o9n)|
+    dat = (DATA_DIR + "orientation-#{o9n}.jpg").binread
+    dec = JPEG::Decoder.new(:pixel_format => fmt, :orientation => true)
+    img = dec << dat
+
+    if fmt == :RGB565
+      ref = JPEG::Decoder.new(:pixel_format => :RGB, :orientation => true) << dat
+      assert_equal(make_rgb565(ref), img)
+    else
+      ref = JPEG::Decoder.new(:pixel_format => :YCbCr, :orientation => true) << dat
+      assert_equal(make_yuyv(ref, ref.meta.width, ref.meta.height), img)
+    end
+
+    assert_equal(ref.meta.width, img.meta.width)
+    assert_equal(ref.meta.height, img.meta.height)
+  end
+
+  data("YUYV"   => :YUYV,
+       "RGB565" => :RGB565)
+
+  test "output buffer has the packed size" do |fmt|
+    dec = JPEG::Decoder.new(:pixel_format => fmt)
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    buf = String.new
+
+    # 帯単位で詰めるので、詰める前の形式の画像全体を置く領域は確保しない
+    dec.decode(dat, :into => buf)
+
+    assert_equal(200 * 300 * 2, buf.bytesize)
+    assert_true(ObjectSpace.memsize_of(buf) < 200 * 300 * 3)
+  end
+
+  data("YUYV"   => :YUYV,
+       "RGB565" => :RGB565)
+
+  test "each band and into" do |fmt|
+    dec = JPEG::Decoder.new(:pixel_format => fmt)
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    ref = dec << dat
+    img = "".b
+    buf = String.new
+
+    dec.each_band(dat, 7) { |band, y| img << band}
+
+    assert_equal(ref, img)
+    assert_equal(ref, dec.decode(dat, :into => buf))
+    assert_equal(ref, dec.decode_batch([dat])[0])
+  end
+end
@@ -0,0 +1,142 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestPlanar < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  def plane(img, i)
+    pl = img.meta.planes[i]
+    return img.byteslice(pl[:offset], pl[:stride] * pl[:height])
+  end
+
+  data(
+    "I420"    => {:fmt => :I420,    :size => 90000,
+                  :planes => [[0, 200, 200, 300],
+                              [60000, 100, 100, 150],
+                              [75000, 100, 100, 150]]},
+    "YUV420P" => {:fmt => :YUV420P, :size => 90000,
+                  :planes => [[0, 200, 200, 300],
+                              [60000, 100, 100, 150],
+                              [75000, 100, 100, 150]]},
+    "NV12"    => {:fmt => :NV12,    :size => 90000,
+                  :planes => [[0, 200, 200, 300],
+                              [60000, 200, 100, 150]]},
+    "YUV422P" => {:fmt => :YUV422P, :size => 120000,
+                  :planes => [[0, 200, 200, 300],
+                              [60000, 100, 100, 300],
+                              [90000, 100, 100, 300]]},
+  )
+
+  test "plane layout" do |info|
+    dec = JPEG::Decoder.new(:pixel_format => info[:fmt])
+    img = dec << (DATA_DIR + "DSC_0215_small.JPG").binread
+
+    assert_equal(info[:size], img.bytesize)
+    assert_equal(200, img.meta.width)
+    assert_equal(300, img.meta.height)
+    assert_equal(200, img.meta.stride)
+    assert_true(img.meta.planes.frozen?)
+
+    planes = img.meta.planes.map { |pl|
+      [pl[:offset], pl[:stride], pl[:width], pl[:height]]
+    }
+
+    assert_equal(info[:planes], planes)
+  end
+
+  test "luma plane" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    ref = JPEG::Decoder.new(:pixel_format => :GRAYSCALE) << dat
+    img = JPEG::Decoder.new(:pixel_format => :I420) << dat
+
+    assert_equal(ref, plane(img, 0))
+  end
+
+  test "chroma plane" do
+    # 4:2:0のJPEGなので、補間なしで復号した色差を間引いたものと一致する
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    ref = JPEG::Decoder.new(:pixel_format => :YCbCr,
+                            :do_fancy_upsampling => false) << dat
+    img = JPEG::Decoder.new(:pixel_format => :I420) << dat
+
+    u = (0...150).flat_map { |y|
+      (0...100).map { |x| ref.getbyte(((y * 2 * 200) + (x * 2)) * 3 + 1)}
+    }
+
+    v = (0...150).flat_map { |y|
+      (0...100).map { |x| ref.getbyte(((y * 2 * 200) + (x * 2)) * 3 + 2)}
+    }
+
+    assert_equal(u, plane(img, 1).bytes)
+    assert_equal(v, plane(img, 2).bytes)
+  end
+
+  test "NV12 and YUV422P" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    ref = JPEG::Decoder.new(:pixel_format => :I420) << dat
+    nv  = JPEG::Decoder.new(:pixel_format => :NV12) << dat
+    yuv = JPEG::Decoder.new(:pixel_format => :YUV422P) << dat
+
+    u   = plane(ref, 1)
+    v   = plane(ref, 2)
+
+    assert_equal(plane(ref, 0), plane(nv, 0))
+    assert_equal(u.bytes.zip(v.bytes).flatten, plane(nv, 1).bytes)
+
+    assert_equal(plane(ref, 0), plane(yuv, 0))
+    assert_equal(u.scan(/.{100}/mn).flat_map { |l| [l, l]}.join,
+                 plane(yuv, 1))
+    assert_equal(v.scan(/.{100}/mn).flat_map { |l| [l, l]}.join,
+                 plane(yuv, 2))
+  end
+
+  data("203x57" => [203, 57],
+       "17x33"  => [17, 33],
+       "1x1"    => [1, 1])
+
+  test "odd size" do |(wd, ht)|
+    raw = Random.new(0).bytes(wd * ht * 3)
+    jpg = JPEG::Encoder.new(wd, ht, :pixel_format => :RGB) << raw
+    img = JPEG::Decoder.new(:pixel_format => :I420) << jpg
+    cw  = (wd + 1) / 2
+    ch  = (ht + 1) / 2
+
+    assert_equal(wd * ht + cw * ch * 2, img.bytesize)
+    assert_equal([cw, ch], img.meta.planes[1].values_at(:width, :height))
+    assert_equal(JPEG::Decoder.new(:pixel_format => :GRAYSCALE) << jpg,
+                 plane(img, 0))
+  end
+
+  test "grayscale JPEG" do
+    raw = Random.new(0).bytes(64 * 48)
+    jpg = JPEG::Encoder.new(64, 48, :pixel_format => :GRAYSCALE) << raw
+    img = JPEG::Decoder.new(:pixel_format => :NV12) << jpg
+
+    assert_equal(JPEG::Decoder.new(:pixel_format => :GRAYSCALE) << jpg,
+                 plane(img, 0))
+    assert_equal([128], plane(img, 1).bytes.uniq)
+  end
+
+  test "with scale" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    ref = JPEG::Decoder.new(:pixel_format => :GRAYSCALE, :scale => 0.125) << dat
+    img = JPEG::Decoder.new(:pixel_format => :I420, :scale => 0.125) << dat
+
+    assert_equal(25 * 38 + 13 * 19 * 2, img.bytesize)
+    assert_equal(ref, plane(img, 0))
+  end
+
+  test "not supported" do
+    dec = JPEG::Decoder.new(:pixel_format => :I420)
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+
+    assert_raise(NotImplementedError) {dec.decode(dat, :crop => [0, 0, 8, 8])}
+    assert_raise(NotImplementedError) {dec.decode(dat, :size => [8, 8])}
+    assert_raise(NotImplementedError) {dec.each_band(dat) { |band, y| }}
+    assert_raise(NotImplementedError) {dec.decode_batch([dat])}
+    assert_raise(NotImplementedError) {dec.thumbnail(dat)}
+
+    assert_equal(90000, (dec << dat).bytesize)
+  end
+end
@@ -0,0 +1,105 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestPlanarEncode < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  def read_planar(fmt)
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    return JPEG::Decoder.new(:pixel_format => fmt) << dat
+  end
+
+  def diff(a, b)
+    return a.bytes.zip(b.bytes).sum { |x, y| (x - y).abs}.fdiv(a.bytesize)
+  end
+
+  data("I420"    => :I420,
+       "YUV420P" => :YUV420P,
+       "NV12"    => :NV12,
+       "YUV422P" => :YUV422P)
+
+  test "encode" do |fmt|
+    raw = read_planar(fmt)
+    enc = JPEG::Encoder.new(200, 300, :pixel_format => fmt)
+    jpg = assert_nothing_raised {enc << raw}
+    img = JPEG::Decoder.new(:pixel_format => fmt) << jpg
+
+    assert_equal(200, img.meta.width)
+    assert_equal(300, img.meta.height)
+    assert_equal(raw.bytesize, img.bytesize)
+    assert_true(diff(raw, img) < 2)
+  end
+
+  data("I420"    => :I420,
+       "NV12"    => :NV12)
+
+  test "same result for I420 and NV12" do |fmt|
+    ref = JPEG::Encoder.new(200, 300, :pixel_format => :I420) <<
+          read_planar(:I420)
+    jpg = JPEG::Encoder.new(200, 300, :pixel_format => fmt) <<
+          read_planar(fmt)
+
+    assert_equal(ref, jpg)
+  end
+
+  data("203x57" => [203, 57],
+       "17x33"  => [17, 33],
+       "1x1"    => [1, 1])
+
+  test "odd size" do |(wd, ht)|
+    raw = Random.new(0).bytes(wd * ht * 3)
+    src = JPEG::Encoder.new(wd, ht, :pixel_format => :RGB) << raw
+    pln = JPEG::Decoder.new(:pixel_format => :I420) << src
+    jpg = JPEG::Encoder.new(wd, ht, :pixel_format => :I420) << pln
+    img = JPEG::Decoder.new(:pixel_format => :I420) << jpg
+
+    assert_equal(wd, img.meta.width)
+    assert_equal(ht, img.meta.height)
+    assert_equal(pln.bytesize, img.bytesize)
+  end
+
+  test "stride" do
+    raw = read_planar(:I420)
+    buf = raw.meta.planes.each_with_index.map { |pl, i|
+      st = (i == 0)? 256: 128
+
+      (0...pl[:height]).map { |y|
+        raw.byteslice(pl[:offset] + (y * pl[:stride]), pl[:width]).ljust(st, "\0")
+      }.join
+    }.join
+
+    ref = JPEG::Encoder.new(200, 300, :pixel_format => :I420) << raw
+    enc = JPEG::Encoder.new(200, 300, :pixel_format => :I420, :stride => 256)
+
+    assert_equal(ref, enc << buf)
+  end
+
+  test "threads and batch" do
+    raw = read_planar(:YUV422P)
+    ref = JPEG::Encoder.new(200, 300,
+                            :pixel_format => :YUV422P, :threads => 1) << raw
+    enc = JPEG::Encoder.new(200, 300,
+                            :pixel_format => :YUV422P, :threads => 4)
+
+    assert_equal(ref, enc << raw)
+
+    enc = JPEG::Encoder.new(200, 300, :pixel_format => :YUV422P)
+    ref = enc << raw
+
+    assert_equal([ref, ref], enc.encode_batch([raw, raw]))
+  end
+
+  test "bad input" do
+    enc = JPEG::Encoder.new(200, 300, :pixel_format => :I420)
+    raw = read_planar(:I420)
+
+    assert_raise(ArgumentError) {enc << raw.byteslice(0, 60000)}
+    assert_raise(ArgumentError) {enc << raw + "\0"}
+    assert_raise(NotImplementedError) {enc.start}
+
+    assert_raise(RangeError) {
+      JPEG::Encoder.new(200, 300, :pixel_format => :I420, :stride => 199)
+    }
+  end
+end
@@ -0,0 +1,172 @@
+require 'test/unit'
+require 'pathname'
+require 'tempfile'
+require 'jpeg'
+
+class TestProbe < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  data("baseline"    => ["DSC_0215_small.JPG", false],
+       "restart"     => ["DSC_0215_small_rst.jpg", false],
+       "progressive" => ["DSC_0215_small_prog.jpg", true],
+       "orientation" => ["orientation.jpg", false])
+
+  test "same as read_header" do |(file, prog)|
+    dat = (DATA_DIR + file).binread
+    ret = JPEG.probe(dat)
+    ref = JPEG::Decoder.new.read_header(dat)
+
+    assert_equal(ref.width, ret.width)
+    assert_equal(ref.height, ret.height)
+    assert_equal(ref.num_components, ret.num_components)
+    assert_equal([[2, 2], [1, 1], [1, 1]], ret.sampling_factors)
+    assert_equal(prog, ret.progressive)
+    assert_true(ret.frozen?)
+    assert_true(ret.sampling_factors.frozen?)
+  end
+
+  data("1" => 1,
+       "2" => 2,
+       "5" => 5,
+       "6" => 6,
+       "8" => 8)
+
+  test "orientation" do |o9n|
+    dat = (DATA_DIR + "orientation-#{o9n}.jpg").binread
+    assert_equal(o9n, JPEG.probe(dat).orientation)
+
+    jpg = JPEG::Encoder.new(24, 16, :orientation => o9n) << "\x80" * (24 * 16 * 3)
+    assert_equal(o9n, JPEG.probe(jpg).orientation)
+    assert_equal([24, 16], [JPEG.probe(jpg).width, JPEG.probe(jpg).height])
+  end
+
+  test "grayscale" do
+    jpg = JPEG::Encoder.new(33, 7, :pixel_format => :GRAYSCALE) << "\x80" * 231
+    ret = JPEG.probe(jpg)
+
+    assert_equal([33, 7, 1], [ret.width, ret.height, ret.num_components])
+    assert_equal([[1, 1]], ret.sampling_factors)
+    assert_equal(1, ret.orientation)
+  end
+
+  test "IFD entries beyond APP1" do
+    jpg = JPEG::Encoder.new(16, 16, :orientation => 6) << "\x80" * (16 * 16 * 3)
+    pos = jpg.index("Exif\0\0MM".b) + 14
+
+    # エントリ数が過大でもAPP1の範囲外は参照しない
+    jpg[pos, 2] = "\xff\xff".b
+    assert_equal(6, JPEG.probe(jpg).orientation)
+
+    jpg[pos + 2, 2] = "\x01\x13".b
+    assert_equal(1, JPEG.probe(jpg).orientation)
+  end
+
+  test "illegal orientation tag" do
+    jpg = JPEG::Encoder.new(16, 16, :orientation => 6) << "\x80" * (16 * 16 * 3)
+    pos = jpg.index("\x01\x12\x00\x03".b)
+
+    # 型がSHORTでないOrientationタグは無視し、stderrにも何も出さない
+    jpg[pos + 2, 2] = "\x00\x04".b
+
+    err = Tempfile.create("stderr") { |tmp|
+      org = STDERR.dup
+
+      begin
+        STDERR.reopen(tmp)
+        assert_equal(1, JPEG.probe(jpg).orientation)
+      ensure
+        STDERR.reopen(org)
+        org.close
+      end
+
+      tmp.rewind
+      tmp.read
+    }
+
+    assert_equal("", err)
+  end
+
+  test "broken data" do
+    dat = (DATA_DIR + "orientation.jpg").binread
+    rnd = Random.new(0)
+
+    # APP1(Exif)以降のヘッダ部分を壊したデータで例外以外の異常が起きない
+    # こと
+    1000.times {
+      tmp = dat.dup
+      3.times { tmp.setbyte(rnd.rand(56...660), rnd.rand(256))}
+
+      begin
+        ret = JPEG.probe(tmp)
+        assert_true(ret.width > 0 && ret.height > 0)
+      rescue JPEG::DecodeError
+      end
+    }
+  end
+
+  #
+  # SOSマーカーの直後までの長さ
+  #
+  def sos_end(dat)
+    pos = 2
+
+    until dat.getbyte(pos + 1) == 0xda
+      pos += 2 + dat.byteslice(pos + 2, 2).unpack1("n")
+    end
+
+    return pos + 2
+  end
+
+  data("small" => "orientation.jpg",
+       "progressive" => "DSC_0215_small_prog.jpg")
+
+  test "prefix" do |file|
+    dat = (DATA_DIR + file).binread
+    lim = sos_end(dat)
+
+    (0...lim).each { |n|
+      ret = JPEG.probe_prefix(dat.byteslice(0, n))
+
+      # 必要な長さは常に下限を示す
+      assert_equal(:need_more, ret[0])
+      assert_true(ret[1] > n && ret[1] <= lim)
+    }
+
+    ret = JPEG.probe_prefix(dat.byteslice(0, lim))
+    ref = JPEG.probe(dat)
+
+    assert_kind_of(JPEG::ProbeInfo, ret)
+    assert_equal([ref.width, ref.height, ref.orientation],
+                 [ret.width, ret.height, ret.orientation])
+  end
+
+  test "prefix with large APP1" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    lim = sos_end(dat)
+    len = 1024
+
+    while (ret = JPEG.probe_prefix(dat.byteslice(0, len))).is_a?(Array)
+      assert_true(ret[1] > len && ret[1] <= lim)
+      len = [ret[1], len * 2].max
+    end
+
+    assert_equal(JPEG.probe(dat).width, ret.width)
+  end
+
+  test "bad input" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+
+    assert_raise(TypeError) {JPEG.probe(nil)}
+    assert_raise(JPEG::DecodeError) {JPEG.probe("")}
+    assert_raise(JPEG::DecodeError) {JPEG.probe("abc")}
+    assert_raise(JPEG::DecodeError) {JPEG.probe("\xff\xd8\xff\xda".b)}
+    assert_raise(JPEG::DecodeError) {JPEG.probe("\xff\xd8\x00\x00".b)}
+    assert_raise(JPEG::DecodeError) {JPEG.probe(dat.byteslice(0, 1000))}
+
+    assert_raise(TypeError) {JPEG.probe_prefix(nil)}
+    assert_raise(JPEG::DecodeError) {JPEG.probe_prefix("abc")}
+    assert_raise(JPEG::DecodeError) {JPEG.probe_prefix("\x00".b)}
+    assert_equal([:need_more, 17], JPEG.probe_prefix(""))
+    assert_equal([:need_more, 17], JPEG.probe_prefix("\xff".b))
+  end
+end
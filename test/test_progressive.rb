@@ -0,0 +1,120 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestProgressive < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  #
+  # DSC_0215_small.JPGを無劣化でプログレッシブ(10スキャン)に変換したもの
+  #
+  def read_data
+    return (DATA_DIR + "DSC_0215_small_prog.jpg").binread
+  end
+
+  def mean_diff(a, b)
+    return a.bytes.zip(b.bytes).sum { |x, y| (x - y).abs}.fdiv(a.bytesize)
+  end
+
+  test "same result as baseline" do
+    ref = JPEG::Decoder.new << (DATA_DIR + "DSC_0215_small.JPG").binread
+    assert_equal(ref, JPEG::Decoder.new << read_data)
+  end
+
+  data("1"  => 1,
+       "2"  => 2,
+       "5"  => 5,
+       "9"  => 9)
+
+  test "max_scans" do |n|
+    dec = JPEG::Decoder.new
+    dat = read_data
+    ref = dec << dat
+    img = dec.decode(dat, :max_scans => n)
+
+    assert_equal(ref.bytesize, img.bytesize)
+    assert_equal(200, img.meta.width)
+    assert_equal(300, img.meta.height)
+    assert_not_equal(ref, img)
+    assert_true(mean_diff(ref, img) < 20)
+
+    # 全てのスキャン数以上を指定した場合は通常の復号と同じ
+    assert_equal(ref, dec.decode(dat, :max_scans => 10))
+    assert_equal(ref, dec.decode(dat, :max_scans => 100))
+
+    # デコーダは再利用可能
+    assert_equal(ref, dec << dat)
+  end
+
+  test "max_scans with crop and size" do
+    dec = JPEG::Decoder.new
+    dat = read_data
+
+    img = dec.decode(dat, :max_scans => 1, :crop => [40, 60, 100, 80])
+    assert_equal([100, 80], [img.meta.width, img.meta.height])
+
+    img = dec.decode(dat, :max_scans => 1, :size => [50, 75])
+    assert_equal([50, 75], [img.meta.width, img.meta.height])
+  end
+
+  test "max_scans on baseline JPEG" do
+    dec = JPEG::Decoder.new
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+
+    assert_equal(dec << dat, dec.decode(dat, :max_scans => 1))
+  end
+
+  test "each_scan" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    sub = JPEG::Decoder.new(:pixel_format => :RGB)
+    dat = read_data
+    ref = dec << dat
+    lst = []
+    dif = []
+
+    dec.each_scan(dat) { |img, n|
+      assert_equal(sub.decode(dat, :max_scans => n), img)
+      lst << n
+      dif << mean_diff(ref, img)
+    }
+
+    assert_equal((1..10).to_a, lst)
+    assert_equal(0.0, dif.last)
+    assert_equal(dif.sort.reverse, dif)
+  end
+
+  test "each_scan on baseline JPEG" do
+    dec = JPEG::Decoder.new
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    ret = dec.enum_for(:each_scan, dat).to_a
+
+    assert_equal(1, ret.size)
+    assert_equal([dec << dat, 1], ret[0])
+  end
+
+  test "break in each_scan" do
+    dec = JPEG::Decoder.new
+    dat = read_data
+    ref = dec << dat
+
+    dec.each_scan(dat) { |img, n| break}
+    assert_equal(ref, dec << dat)
+    assert_equal(2, dec.each_scan(dat).first(2).size)
+  end
+
+  test "bad input" do
+    dec = JPEG::Decoder.new
+    dat = read_data
+
+    assert_raise(TypeError) {dec.decode(dat, :max_scans => "1")}
+    assert_raise(RangeError) {dec.decode(dat, :max_scans => 0)}
+    assert_raise(RangeError) {dec.decode(dat, :max_scans => 65536)}
+    assert_raise(TypeError) {dec.each_scan(nil) {}}
+    assert_raise(JPEG::DecodeError) {dec.each_scan("\xff\xd8abc") {}}
+    assert_raise(NotImplementedError) {
+      JPEG::Decoder.new(:pixel_format => :I420).each_scan(dat) {}
+    }
+
+    assert_equal(dec << dat, dec.decode(dat))
+  end
+end
@@ -0,0 +1,117 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestDecodeResize < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  def setup
+    @dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+  end
+
+  data(
+    "contain (wide box)"  => {:size => [100, 100], :fit => :contain, :exp => [67, 100]},
+    "contain (tall box)"  => {:size => [50, 400],  :fit => :contain, :exp => [50, 75]},
+    "cover"               => {:size => [100, 100], :fit => :cover,   :exp => [100, 100]},
+    "fill"                => {:size => [37, 53],   :fit => :fill,    :exp => [37, 53]},
+    "enlarge"             => {:size => [400, 600], :fit => :fill,    :exp => [400, 600]},
+    "very small"          => {:size => [3, 3],     :fit => :fill,    :exp => [3, 3]},
+  )
+
+  test "size" do |info|
+    [:bilinear, :lanczos].each { |filter|
+      dec = JPEG::Decoder.new(:pixel_format => :RGB)
+      img = assert_nothing_raised {
+        dec.decode(@dat, :size => info[:size], :fit => info[:fit],
+                   :filter => filter)
+      }
+
+      assert_equal(info[:exp][0], img.meta.width)
+      assert_equal(info[:exp][1], img.meta.height)
+      assert_equal(info[:exp][0] * 3, img.meta.stride)
+      assert_equal(info[:exp][0] * info[:exp][1] * 3, img.bytesize)
+    }
+  end
+
+  test "same as DCT scaling" do
+    [false, true].each { |fancy|
+      ref = JPEG::Decoder.new(:pixel_format => :RGB,
+                              :scale => 0.5,
+                              :do_fancy_upsampling => fancy) << @dat
+      dec = JPEG::Decoder.new(:pixel_format => :RGB,
+                              :do_fancy_upsampling => fancy)
+
+      # 等倍のリサンプルは入力をそのまま出力する
+      img = dec.decode(@dat, :size => [100, 150])
+      assert_equal(ref, img)
+
+      # :coverでは中央部分が切り出される
+      img = dec.decode(@dat, :size => [100, 100], :fit => :cover)
+      assert_equal(ref.byteslice(25 * 300, 100 * 300), img)
+    }
+  end
+
+  test "approximation" do
+    dec = JPEG::Decoder.new(:pixel_format => :GRAYSCALE)
+    ful = (dec << @dat).bytes
+    img = dec.decode(@dat, :size => [50, 75]).bytes
+
+    # 4x4画素の平均値とおおよそ一致すること
+    err = 0
+    75.times { |y|
+      50.times { |x|
+        sum = 0
+        16.times { |i| sum += ful[((y * 4 + i / 4) * 200) + (x * 4) + (i % 4)]}
+        err += (img[(y * 50) + x] - (sum / 16)).abs
+      }
+    }
+
+    assert_true(err / (50 * 75) < 8)
+  end
+
+  test "with orientation" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB, :orientation => true)
+    dat = (DATA_DIR + "orientation-6.jpg").binread
+    img = dec.decode(dat, :size => [80, 40], :fit => :fill)
+
+    assert_equal(80, img.meta.width)
+    assert_equal(40, img.meta.height)
+  end
+
+  test "with into" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    buf = String.new
+    ret = dec.decode(@dat, :into => buf, :size => [20, 30])
+
+    assert_same(buf, ret)
+    assert_equal(20 * 30 * 3, ret.bytesize)
+  end
+
+  data(
+    "size not array"  => {:arg => {:size => 100},                 :exc => TypeError},
+    "size short"      => {:arg => {:size => [100]},               :exc => ArgumentError},
+    "size zero"       => {:arg => {:size => [0, 100]},            :exc => RangeError},
+    "fit bad value"   => {:arg => {:size => [9, 9], :fit => :XX}, :exc => ArgumentError},
+    "fit bad type"    => {:arg => {:size => [9, 9], :fit => 1},   :exc => TypeError},
+    "filter bad"      => {:arg => {:size => [9, 9], :filter => :XX}, :exc => ArgumentError},
+    "fit only"        => {:arg => {:fit => :cover},               :exc => ArgumentError},
+    "with crop"       => {:arg => {:size => [9, 9], :crop => [0, 0, 9, 9]},
+                          :exc => ArgumentError},
+  )
+
+  test "bad argument" do |info|
+    dec = JPEG::Decoder.new
+
+    assert_raise_kind_of(info[:exc]) {
+      dec.decode(@dat, **info[:arg])
+    }
+  end
+
+  test "with dither" do
+    dec = JPEG::Decoder.new(:dither => [:FS, false, 64])
+
+    assert_raise_kind_of(ArgumentError) {
+      dec.decode(@dat, :size => [10, 10])
+    }
+  end
+end
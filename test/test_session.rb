@@ -0,0 +1,103 @@
+require 'test/unit'
+require 'pathname'
+require 'zlib'
+require 'jpeg'
+
+class TestEncodeSession < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  def read_raw(file)
+    return Zlib::Inflate.inflate((DATA_DIR + file).binread)
+  end
+
+  data(
+    "RGB"       => {:fmt => :RGB,       :ext => ".rgb",    :st => 600},
+    "BGR32"     => {:fmt => :BGR32,     :ext => ".bgr32",  :st => 800},
+    "YCbCr"     => {:fmt => :YCbCr,     :ext => ".ycbcr",  :st => 600},
+    "GRAYSCALE" => {:fmt => :GRAYSCALE, :ext => ".y",      :st => 200},
+  )
+
+  test "write rows" do |info|
+    enc = JPEG::Encoder.new(200, 300, :pixel_format => info[:fmt])
+    raw = read_raw("DSC_0215_small" + info[:ext] + ".zlib")
+    ref = enc << raw
+    rnd = Random.new(0)
+
+    assert_same(enc, enc.start)
+
+    pos = 0
+    while pos < 300
+      n    = [rnd.rand(1..40), 300 - pos].min
+      rest = enc.write_rows(raw.byteslice(pos * info[:st], n * info[:st]))
+      pos += n
+
+      assert_equal(300 - pos, rest)
+    end
+
+    jpg = enc.finish
+
+    assert_equal(ref, jpg)
+    assert_equal(ref, enc << raw)
+  end
+
+  test "write rows (conversion)" do
+    enc = JPEG::Encoder.new(64, 48, :pixel_format => :YUV422)
+    raw = Random.new(0).bytes(64 * 3 * 48)
+    ref = enc << raw
+
+    enc.start
+    48.times { |i| enc.write_rows(raw.byteslice(i * 192, 192)) }
+
+    assert_equal(ref, enc.finish)
+  end
+
+  test "with orientation" do
+    enc = JPEG::Encoder.new(200, 300, :pixel_format => :RGB, :orientation => 6)
+    raw = read_raw("DSC_0215_small.rgb.zlib")
+    ref = enc << raw
+
+    enc.start
+    enc.write_rows(raw)
+
+    assert_equal(ref, enc.finish)
+  end
+
+  test "state error" do
+    enc = JPEG::Encoder.new(200, 300, :pixel_format => :RGB)
+    raw = read_raw("DSC_0215_small.rgb.zlib")
+
+    assert_raise(RuntimeError) {enc.write_rows(raw)}
+    assert_raise(RuntimeError) {enc.finish}
+
+    enc.start
+
+    assert_raise(RuntimeError) {enc.start}
+    assert_raise(RuntimeError) {enc << raw}
+    assert_raise(RuntimeError) {enc.encode_batch([raw])}
+    assert_raise(RuntimeError) {enc.finish}
+
+    enc.write_rows(raw.byteslice(0, 600 * 10))
+
+    assert_same(enc, enc.cancel)
+    assert_raise(RuntimeError) {enc.finish}
+
+    jpg = assert_nothing_raised {enc << raw}
+    assert_equal("\xff\xd8".b, jpg.byteslice(0, 2))
+  end
+
+  test "bad rows" do
+    enc = JPEG::Encoder.new(200, 300, :pixel_format => :RGB)
+    raw = read_raw("DSC_0215_small.rgb.zlib")
+
+    enc.start
+
+    assert_raise(TypeError) {enc.write_rows(nil)}
+    assert_raise(ArgumentError) {enc.write_rows(raw.byteslice(0, 601))}
+    assert_raise(ArgumentError) {enc.write_rows(raw + raw.byteslice(0, 600))}
+
+    enc.write_rows(raw)
+    assert_raise(ArgumentError) {enc.write_rows(raw.byteslice(0, 600))}
+
+    assert_nothing_raised {enc.finish}
+  end
+end
@@ -0,0 +1,118 @@
+require 'test/unit'
+require 'pathname'
+require 'rbconfig'
+require 'jpeg'
+
+class TestSimdKernel < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  #
+  # スカラ版と同じ規則でYUYVをYCbCrに展開する
+  #
+  def expand_yuyv(raw, wd, ht, st)
+    return (0...ht).map { |y|
+      row = raw.byteslice(y * st, ((wd + 1) / 2) * 4).bytes
+
+      (0...wd).map { |x|
+        y0, u, y1, v = row[(x / 2) * 4, 4]
+        [x.even? ? y0 : y1, u, v]
+      }.flatten.pack("C*")
+    }.join
+  end
+
+  def expand_rgb565(raw, wd, ht, st)
+    return (0...ht).map { |y|
+      raw.byteslice(y * st, wd * 2).unpack("v*").map { |p|
+        [(p >> 8) & 0xf8, (p >> 3) & 0xfc, (p << 3) & 0xf8]
+      }.flatten.pack("C*")
+    }.join
+  end
+
+  #
+  # 指定したカーネルで変換した結果を子プロセスから受け取る
+  #
+  def run_with(simd)
+    script = <<~EOS
+      require 'jpeg'
+      dat = File.binread(#{(DATA_DIR + "DSC_0215_small.JPG").to_s.dump})
+      raw = Random.new(1).bytes(203 * 3 * 31)
+      ret = []
+      ret << (JPEG::Encoder.new(203, 31, :pixel_format => :YUYV) << raw)
+      ret << (JPEG::Encoder.new(203, 31, :pixel_format => :RGB565) << raw)
+      ret << (JPEG::Decoder.new(:pixel_format => :YUYV) << dat)
+      ret << (JPEG::Decoder.new(:pixel_format => :RGB565) << dat)
+      [2, 6].each { |o9n|
+        jpg = JPEG::Encoder.new(203, 31, :pixel_format => :RGB,
+                                :orientation => o9n) << raw
+        [:GRAYSCALE, :RGB, :RGBX].each { |fmt|
+          dec = JPEG::Decoder.new(:pixel_format => fmt, :orientation => true)
+          ret << (dec << jpg)
+        }
+      }
+      [:bilinear, :lanczos].each { |filter|
+        [:GRAYSCALE, :RGB, :RGBX].each { |fmt|
+          dec = JPEG::Decoder.new(:pixel_format => fmt)
+          ret << dec.decode(dat, :size => [101, 67], :filter => filter)
+        }
+      }
+      ret = [JPEG.simd] + ret.map { |s| String.new(s)}
+      $stdout.binmode.write(Marshal.dump(ret))
+    EOS
+
+    args = $LOAD_PATH.flat_map { |dir| ["-I", dir]}
+    env  = {"LIBJPEG_RUBY_SIMD" => simd}
+
+    return IO.popen(env, [RbConfig.ruby, *args, "-e", script], "rb") { |io|
+      Marshal.load(io.read)
+    }
+  end
+
+  test "selected kernel" do
+    assert_include([:avx2, :sse2, :neon, :none], JPEG.simd)
+  end
+
+  data("3x7"    => [3, 7],
+       "15x3"   => [15, 3],
+       "16x4"   => [16, 4],
+       "33x5"   => [33, 5],
+       "64x2"   => [64, 2],
+       "203x57" => [203, 57])
+
+  test "YUYV input" do |(wd, ht)|
+    st  = wd * 3
+    raw = Random.new(wd).bytes(st * ht)
+    ref = JPEG::Encoder.new(wd, ht, :pixel_format => :YCbCr) <<
+          expand_yuyv(raw, wd, ht, st)
+    jpg = JPEG::Encoder.new(wd, ht, :pixel_format => :YUYV) << raw
+
+    assert_equal(ref, jpg)
+  end
+
+  data("3x7"    => [3, 7],
+       "15x3"   => [15, 3],
+       "16x4"   => [16, 4],
+       "33x5"   => [33, 5],
+       "64x2"   => [64, 2],
+       "203x57" => [203, 57])
+
+  test "RGB565 input" do |(wd, ht)|
+    st  = wd * 3
+    raw = Random.new(wd).bytes(st * ht)
+    ref = JPEG::Encoder.new(wd, ht, :pixel_format => :RGB) <<
+          expand_rgb565(raw, wd, ht, st)
+    jpg = JPEG::Encoder.new(wd, ht, :pixel_format => :RGB565) << raw
+
+    assert_equal(ref, jpg)
+  end
+
+  data("none" => "none",
+       "sse2" => "sse2")
+
+  test "same result as restricted kernels" do |simd|
+    ret = run_with(simd)
+    ref = run_with(nil)
+
+    assert_equal(:none, ret[0]) if simd == "none"
+    assert_equal(ref[1..], ret[1..])
+  end
+end
@@ -0,0 +1,242 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestThread < Test::Unit::TestCase
+  DATA_DIR = Pathname($0).expand_path.dirname + "data"
+
+  #
+  # decode on multiple threads
+  #
+
+  test "decode on multiple threads" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    exp = JPEG::Decoder.new(:without_meta => true) << dat
+
+    thr = 4.times.map {
+      Thread.new {
+        dec = JPEG::Decoder.new(:without_meta => true)
+        8.times.map {dec << dat}
+      }
+    }
+
+    thr.each {|t|
+      t.value.each {|img| assert_equal(exp, img)}
+    }
+  end
+
+  #
+  # decode error on thread
+  #
+
+  test "decode error on thread" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new
+
+    assert_raise_kind_of(JPEG::DecodeError) {
+      Thread.new {dec << dat.byteslice(0, 100)}.value
+    }
+
+    # the decoder should be reusable after an error
+    img = assert_nothing_raised {dec << dat}
+    assert_equal(img.meta.stride * img.meta.height, img.bytesize)
+  end
+
+  #
+  # encode on multiple threads
+  #
+
+  test "encode on multiple threads" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    img = JPEG::Decoder.new(:pixel_format => :RGB) << dat
+    met = img.meta
+    exp = JPEG::Encoder.new(met.width, met.height, :pixel_format => :RGB) << img
+
+    thr = 4.times.map {
+      Thread.new {
+        enc = JPEG::Encoder.new(met.width, met.height, :pixel_format => :RGB)
+        8.times.map {enc << img}
+      }
+    }
+
+    thr.each {|t|
+      t.value.each {|jpg| assert_equal(exp, jpg)}
+    }
+  end
+
+  #
+  # batch decode
+  #
+
+  test "decode batch" do
+    lst = [
+      (DATA_DIR + "DSC_0215_small.JPG").binread,
+      (DATA_DIR + "orientation-6.jpg").binread,
+      (DATA_DIR + "DSC_0215_small.JPG").binread,
+    ]
+
+    dec = JPEG::Decoder.new(:pixel_format => :RGB, :orientation => true,
+                            :with_exif_tags => true)
+    exp = lst.map {|dat| dec << dat}
+    ret = assert_nothing_raised {dec.decode_batch(lst, :threads => 2)}
+
+    assert_equal(exp.size, ret.size)
+
+    exp.zip(ret) {|a, b|
+      assert_equal(a, b)
+      assert_equal(a.meta.width, b.meta.width)
+      assert_equal(a.meta.height, b.meta.height)
+      assert_equal(a.meta.exif, b.meta.exif)
+    }
+  end
+
+  test "decode batch with broken data" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new(:without_meta => true)
+    ret = dec.decode_batch([dat, dat.byteslice(0, 100), dat])
+
+    assert_equal(dec << dat, ret[0])
+    assert_kind_of(JPEG::DecodeError, ret[1])
+    assert_equal(dec << dat, ret[2])
+  end
+
+  test "decode batch argument check" do
+    dec = JPEG::Decoder.new
+
+    assert_equal([], dec.decode_batch([]))
+    assert_raise(TypeError) {dec.decode_batch([1])}
+    assert_raise(TypeError) {dec.decode_batch([], :threads => "2")}
+    assert_raise(RangeError) {dec.decode_batch([], :threads => 0)}
+  end
+
+  test "batch threads option accepts Boolean and nil" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    img = dec << dat
+    met = img.meta
+    enc = JPEG::Encoder.new(met.width, met.height, :pixel_format => :RGB)
+    jpg = enc << img
+
+    [true, false, nil].each { |val|
+      assert_equal([img, img], dec.decode_batch([dat, dat], :threads => val))
+      assert_equal([jpg, jpg], enc.encode_batch([img, img], :threads => val))
+    }
+  end
+
+  test "decode batch interrupted by Thread#kill" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new(:without_meta => true)
+    thr = Thread.new {dec.decode_batch([dat] * 10000, :threads => 1)}
+
+    sleep 0.1
+    thr.kill
+
+    # 未着手の項目を打ち切って速やかに終了し、デコーダは再利用できる
+    assert_not_nil(thr.join(1))
+    assert_equal([dec << dat], dec.decode_batch([dat]))
+  end
+
+  #
+  # batch encode
+  #
+
+  test "encode batch" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    img = JPEG::Decoder.new(:pixel_format => :RGB) << dat
+    met = img.meta
+    enc = JPEG::Encoder.new(met.width, met.height, :pixel_format => :RGB)
+    exp = enc << img
+    ret = enc.encode_batch([img, img.byteslice(0, 10), img, img], :threads => 3)
+
+    assert_equal(4, ret.size)
+    assert_equal(exp, ret[0])
+    assert_kind_of(ArgumentError, ret[1])
+    assert_equal(exp, ret[2])
+    assert_equal(exp, ret[3])
+  end
+
+  test "encode batch interrupted by Thread#kill" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    img = JPEG::Decoder.new(:pixel_format => :RGB) << dat
+    met = img.meta
+    enc = JPEG::Encoder.new(met.width, met.height, :pixel_format => :RGB)
+    thr = Thread.new {enc.encode_batch([img] * 10000, :threads => 1)}
+
+    sleep 0.1
+    thr.kill
+
+    # 未着手の項目を打ち切って速やかに終了し、エンコーダは再利用できる
+    assert_not_nil(thr.join(1))
+    assert_equal([enc << img], enc.encode_batch([img]))
+  end
+
+  #
+  # parallel decode using restart markers
+  #
+
+  test "decode with restart markers on multiple threads" do
+    dat = (DATA_DIR + "DSC_0215_small_rst.jpg").binread
+
+    [
+      {:pixel_format => :RGB},
+      {:pixel_format => :RGB, :do_fancy_upsampling => true},
+      {:pixel_format => :YCbCr, :scale => 0.5},
+      {:pixel_format => :GRAYSCALE},
+    ].each {|opt|
+      exp = JPEG::Decoder.new(**opt) << dat
+
+      [2, 3, 4, 16].each {|n|
+        dec = JPEG::Decoder.new(**opt, :threads => n)
+        assert_equal(exp, dec << dat)
+        assert_equal(exp.meta.height, (dec << dat).meta.height)
+      }
+    }
+  end
+
+  test "threads option without restart markers" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    exp = JPEG::Decoder.new << dat
+
+    assert_equal(exp, JPEG::Decoder.new(:threads => 4) << dat)
+    assert_equal(exp, JPEG::Decoder.new(:threads => true) << dat)
+  end
+
+  test "threads option check" do
+    assert_nothing_raised {JPEG::Decoder.new(:threads => nil)}
+    assert_nothing_raised {JPEG::Decoder.new(:threads => false)}
+    assert_raise(RangeError) {JPEG::Decoder.new(:threads => 0)}
+    assert_raise(TypeError) {JPEG::Decoder.new(:threads => "4")}
+  end
+
+  #
+  # striped encode
+  #
+
+  test "striped encode on multiple threads" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    img = JPEG::Decoder.new(:pixel_format => :RGB) << dat
+    met = img.meta
+    exp = JPEG::Decoder.new(:pixel_format => :RGB) <<
+          (JPEG::Encoder.new(met.width, met.height, :pixel_format => :RGB) << img)
+
+    ret = [1, 2, 3, 8, true].map {|n|
+      enc = JPEG::Encoder.new(met.width, met.height,
+                              :pixel_format => :RGB, :threads => n)
+      enc << img
+    }
+
+    # output does not depend on the number of threads
+    assert_equal(1, ret.uniq.size)
+
+    # restart markers do not change the decoded image
+    assert_equal(exp, JPEG::Decoder.new(:pixel_format => :RGB) << ret[0])
+    assert_equal(exp, JPEG::Decoder.new(:pixel_format => :RGB,
+                                        :threads => 4) << ret[0])
+  end
+
+  test "encoder threads option check" do
+    assert_nothing_raised {JPEG::Encoder.new(16, 16, :threads => nil)}
+    assert_raise(RangeError) {JPEG::Encoder.new(16, 16, :threads => 0)}
+    assert_raise(TypeError) {JPEG::Encoder.new(16, 16, :threads => "4")}
+  end
+end
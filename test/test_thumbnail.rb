@@ -0,0 +1,109 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestThumbnail < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  def setup
+    @dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    @exf = JPEG::Decoder.new(:with_exif_tags => true).read_header(@dat).exif
+  end
+
+  test "exif thumbnail" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    tmb = @exf[:thumbnail][:jpeg_interchange]
+
+    # 埋め込みのサムネイルは80x120
+    img = assert_nothing_raised {dec.thumbnail(@dat, :max => 100)}
+    ref = JPEG::Decoder.new(:pixel_format => :RGB, :scale => Rational(7, 8)) << tmb
+
+    assert_equal(70, img.meta.width)
+    assert_equal(105, img.meta.height)
+    assert_equal(ref, img)
+
+    img = dec.thumbnail(@dat, :max => 120)
+    ref = JPEG::Decoder.new(:pixel_format => :RGB) << tmb
+
+    assert_equal(ref, img)
+  end
+
+  test "DCT scaling" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+
+    # サムネイルより大きい場合は本体を縮小して復号する
+    img = dec.thumbnail(@dat, :max => 160)
+    ref = JPEG::Decoder.new(:pixel_format => :RGB, :scale => Rational(5, 8)) << @dat
+
+    assert_equal(125, img.meta.width)
+    assert_equal(188, img.meta.height)
+    assert_equal(ref, img)
+
+    # 本体より大きい場合は等倍
+    img = dec.thumbnail(@dat, :max => 1000)
+    assert_equal(dec << @dat, img)
+  end
+
+  test "without exif" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    dat = (DATA_DIR + "orientation-1.jpg").binread
+
+    img = dec.thumbnail(dat, :max => 20)
+    assert_equal(20, img.meta.width)
+    assert_equal(20, img.meta.height)
+
+    img = dec.thumbnail(dat)
+    assert_equal(160, img.meta.width)
+  end
+
+  test "meta from the main image" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB, :with_exif_tags => true)
+    img = dec.thumbnail(@dat, :max => 64)
+
+    assert_equal(@exf, img.meta.exif)
+  end
+
+  test "orientation" do
+    dec = JPEG::Decoder.new(:pixel_format => :RGB, :orientation => true)
+    dat = (DATA_DIR + "orientation-6.jpg").binread
+    ref = JPEG::Decoder.new(:pixel_format => :RGB,
+                            :orientation => true,
+                            :scale => Rational(2, 8)) << dat
+
+    assert_equal(ref, dec.thumbnail(dat, :max => 40))
+  end
+
+  data("IFD0 0xffffffff" => [0, 0xffffffff],
+       "IFD0 0xfffffffe" => [0, 0xfffffffe],
+       "IFD1 0xffffffff" => [18, 0xffffffff],
+       "IFD1 0xfffffffe" => [18, 0xfffffffe])
+
+  test "hostile IFD offset" do |(pos, off)|
+    raw = "\x80" * (64 * 48 * 3)
+    jpg = JPEG::Encoder.new(64, 48, :orientation => 1) << raw
+    tif = jpg.index("Exif\0\0MM".b) + 6
+    dec = JPEG::Decoder.new(:pixel_format => :RGB)
+    ref = dec.thumbnail(jpg, :max => 16)
+
+    # 0th IFDの位置(TIFFヘッダ+4)か、1st IFDの位置(0th IFDの末尾)を壊す
+    jpg[tif + 4 + pos, 4] = [off].pack("N")
+
+    # サムネイル無しとして本体を縮小して復号する
+    img = assert_nothing_raised {dec.thumbnail(jpg, :max => 16)}
+    assert_equal(ref, img)
+  end
+
+  data(
+    "zero"   => {:val => 0,     :exc => RangeError},
+    "float"  => {:val => 1.5,   :exc => TypeError},
+    "string" => {:val => "256", :exc => TypeError},
+  )
+
+  test "bad max" do |info|
+    dec = JPEG::Decoder.new
+
+    assert_raise_kind_of(info[:exc]) {
+      dec.thumbnail(@dat, :max => info[:val])
+    }
+  end
+end